@@ -0,0 +1,133 @@
+/*
+ * Boot timeline: when the guest first reaches each milestone
+ *
+ * A milestone is recorded once with its time since boot_timeline_init()
+ * and the number of MMIO requests, DMA transfers and DMA bytes seen so
+ * far, so that a slower boot can be traced to the phase that regressed
+ * and to whether it did more I/O or just took longer.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+
+#include "cutils.h"
+#include "boottime.h"
+
+#define MAX_MILESTONES 64
+#define MILESTONE_NAME_SIZE 48
+
+typedef struct {
+    char name[MILESTONE_NAME_SIZE];
+    uint64_t time_ns;
+    uint64_t mmio_count;
+    uint64_t dma_count;
+    uint64_t dma_bytes;
+} Milestone;
+
+uint64_t boot_mmio_count;
+uint64_t boot_dma_count;
+uint64_t boot_dma_bytes;
+
+static pthread_mutex_t boot_lock = PTHREAD_MUTEX_INITIALIZER;
+static uint64_t boot_start_ns;
+static Milestone milestones[MAX_MILESTONES];
+static int milestone_count;
+static volatile sig_atomic_t boot_report_requested;
+
+static uint64_t boot_get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void boot_timeline_init(void)
+{
+    pthread_mutex_lock(&boot_lock);
+    boot_start_ns = boot_get_time_ns();
+    milestone_count = 0;
+    pthread_mutex_unlock(&boot_lock);
+}
+
+void boot_milestone(const char *fmt, ...)
+{
+    char name[MILESTONE_NAME_SIZE];
+    uint64_t now = boot_get_time_ns();
+    Milestone *m;
+    va_list ap;
+    int i;
+
+    va_start(ap, fmt);
+    vsnprintf(name, sizeof(name), fmt, ap);
+    va_end(ap);
+
+    pthread_mutex_lock(&boot_lock);
+    for(i = 0; i < milestone_count; i++) {
+        if (!strcmp(milestones[i].name, name))
+            goto done;
+    }
+    if (milestone_count >= MAX_MILESTONES)
+        goto done;
+    m = &milestones[milestone_count++];
+    pstrcpy(m->name, sizeof(m->name), name);
+    m->time_ns = boot_start_ns ? now - boot_start_ns : 0;
+    m->mmio_count = __atomic_load_n(&boot_mmio_count, __ATOMIC_RELAXED);
+    m->dma_count = __atomic_load_n(&boot_dma_count, __ATOMIC_RELAXED);
+    m->dma_bytes = __atomic_load_n(&boot_dma_bytes, __ATOMIC_RELAXED);
+ done:
+    pthread_mutex_unlock(&boot_lock);
+}
+
+void boot_timeline_report(void)
+{
+    uint64_t prev_ns = 0;
+    Milestone *m;
+    int i;
+
+    pthread_mutex_lock(&boot_lock);
+    fprintf(stderr, "Boot timeline:\r\n");
+    fprintf(stderr, "  %10s %10s %9s %8s %12s  %s\r\n",
+            "time (s)", "delta (s)", "mmio", "dma", "dma bytes", "milestone");
+    for(i = 0; i < milestone_count; i++) {
+        m = &milestones[i];
+        fprintf(stderr, "  %10.6f %10.6f %9" PRIu64 " %8" PRIu64 " %12" PRIu64 "  %s\r\n",
+                m->time_ns / 1e9, (m->time_ns - prev_ns) / 1e9,
+                m->mmio_count, m->dma_count, m->dma_bytes, m->name);
+        prev_ns = m->time_ns;
+    }
+    fprintf(stderr, "  %10.6f %10s %9" PRIu64 " %8" PRIu64 " %12" PRIu64 "  (now)\r\n",
+            (boot_get_time_ns() - boot_start_ns) / 1e9, "",
+            __atomic_load_n(&boot_mmio_count, __ATOMIC_RELAXED),
+            __atomic_load_n(&boot_dma_count, __ATOMIC_RELAXED),
+            __atomic_load_n(&boot_dma_bytes, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&boot_lock);
+}
+
+static void boot_timeline_signal(int sig)
+{
+    boot_report_requested = 1;
+}
+
+void boot_timeline_report_on_signal(int sig)
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = boot_timeline_signal;
+    sa.sa_flags = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    sigaction(sig, &sa, NULL);
+}
+
+void boot_timeline_poll(void)
+{
+    if (unlikely(boot_report_requested)) {
+        boot_report_requested = 0;
+        boot_timeline_report();
+    }
+}
@@ -0,0 +1,54 @@
+/*
+ * Boot timeline: when the guest first reaches each milestone
+ */
+#ifndef BOOTTIME_H
+#define BOOTTIME_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* cumulative counts reported with each milestone, updated with relaxed
+   atomic adds */
+extern uint64_t boot_mmio_count;
+extern uint64_t boot_dma_count;
+extern uint64_t boot_dma_bytes;
+
+static inline void boot_count_mmio(void)
+{
+    __atomic_fetch_add(&boot_mmio_count, 1, __ATOMIC_RELAXED);
+}
+
+static inline void boot_count_dma(uint64_t len)
+{
+    __atomic_fetch_add(&boot_dma_count, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&boot_dma_bytes, len, __ATOMIC_RELAXED);
+}
+
+/* Start the clock; the timeline is relative to this call. */
+void boot_timeline_init(void);
+/* Record the milestone the first time it is reached; later calls with
+   the same name are ignored. */
+void boot_milestone(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+/* Evaluate 'flag' first so that the hot path costs a single test */
+#define BOOT_MILESTONE_ONCE(flag, ...)          \
+    do {                                        \
+        if (__builtin_expect(!(flag), 0)) {     \
+            (flag) = 1;                         \
+            boot_milestone(__VA_ARGS__);        \
+        }                                       \
+    } while (0)
+
+void boot_timeline_report(void);
+/* Print the report when 'sig' is received. The signal only sets a flag;
+   the report is printed by the next boot_timeline_poll(). */
+void boot_timeline_report_on_signal(int sig);
+void boot_timeline_poll(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* BOOTTIME_H */
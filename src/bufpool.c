@@ -0,0 +1,318 @@
+/*
+ * Size-classed request buffer pool
+ *
+ * Buffers are carved out of 2 MB slabs aligned on their size so that the
+ * slab header, and with it the size class, is found by masking the
+ * buffer address. Every size class is a power of two from one cache line
+ * up to BUFFER_POOL_MAX_CLASS_SIZE; bigger requests get a slab of their
+ * own which is unmapped when freed.
+ *
+ * Freed buffers first go to a small per-thread cache so that the common
+ * "allocate, copy, free" sequence of a request never takes the pool lock.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#include "cutils.h"
+#include "bufpool.h"
+#include "topology.h"
+
+#define CACHE_LINE_SIZE 64
+#define SLAB_SIZE (2 * 1024 * 1024)
+#define SLAB_MAGIC 0x42554650 /* "BUFP" */
+#define BUFFER_POOL_MIN_CLASS_SHIFT 6 /* one cache line */
+#define BUFFER_POOL_MAX_CLASS_SHIFT 19
+#define BUFFER_POOL_MAX_CLASS_SIZE (1 << BUFFER_POOL_MAX_CLASS_SHIFT)
+#define BUFFER_POOL_NB_CLASSES \
+    (BUFFER_POOL_MAX_CLASS_SHIFT - BUFFER_POOL_MIN_CLASS_SHIFT + 1)
+#define SLAB_CLASS_LARGE -1
+/* upper bound of the bytes a thread keeps per size class */
+#define THREAD_CACHE_BYTES (256 * 1024)
+#define THREAD_CACHE_MIN_COUNT 2
+
+typedef struct FreeBuffer {
+    struct FreeBuffer *next;
+} FreeBuffer;
+
+/* Occupies the first size class slot of the slab, so the buffers behind
+   it keep their natural alignment */
+typedef struct {
+    uint32_t magic;
+    int size_class; /* or SLAB_CLASS_LARGE */
+    BufferPool *pool;
+    size_t map_size;
+} SlabHeader;
+
+typedef struct {
+    FreeBuffer *head[BUFFER_POOL_NB_CLASSES];
+    int count[BUFFER_POOL_NB_CLASSES];
+} ThreadCache;
+
+struct BufferPool {
+    char name[32];
+    int flags;
+    pthread_key_t cache_key;
+    pthread_mutex_t lock;
+    FreeBuffer *free_list[BUFFER_POOL_NB_CLASSES];
+    /* statistics, updated with atomic operations */
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t cache_hits;
+    uint64_t large_allocs;
+    uint64_t bytes_in_use;
+    uint64_t slab_bytes;
+};
+
+static inline size_t class_size(int size_class)
+{
+    return (size_t)1 << (size_class + BUFFER_POOL_MIN_CLASS_SHIFT);
+}
+
+static inline int thread_cache_max(int size_class)
+{
+    return max_int(THREAD_CACHE_BYTES / class_size(size_class),
+                   THREAD_CACHE_MIN_COUNT);
+}
+
+static int size_to_class(size_t size)
+{
+    int size_class = 0;
+
+    while (class_size(size_class) < size)
+        size_class++;
+    return size_class;
+}
+
+static inline SlabHeader *buffer_to_slab(void *ptr)
+{
+    return (SlabHeader *)((uintptr_t)ptr & ~((uintptr_t)SLAB_SIZE - 1));
+}
+
+/* Map 'size' bytes (a multiple of SLAB_SIZE) aligned on SLAB_SIZE */
+static void *slab_map(BufferPool *p, size_t size)
+{
+    uint8_t *ptr, *aligned;
+    size_t head;
+
+    if (p->flags & BUFFER_POOL_HUGEPAGES) {
+        ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                   MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (ptr != MAP_FAILED) {
+            thread_topology_bind(ptr, size);
+            return ptr;
+        }
+    }
+    ptr = mmap(NULL, size + SLAB_SIZE, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "Error: buffer pool %s cannot map %zu bytes: %s\r\n",
+                p->name, size, strerror(errno));
+        abort();
+    }
+    aligned = (uint8_t *)(((uintptr_t)ptr + SLAB_SIZE - 1) &
+                          ~((uintptr_t)SLAB_SIZE - 1));
+    head = aligned - ptr;
+    if (head)
+        munmap(ptr, head);
+    munmap(aligned + size, SLAB_SIZE - head);
+#ifdef MADV_HUGEPAGE
+    if (p->flags & BUFFER_POOL_HUGEPAGES)
+        madvise(aligned, size, MADV_HUGEPAGE);
+#endif
+    thread_topology_bind(aligned, size);
+    return aligned;
+}
+
+/* Refill the free list of 'size_class' with a new slab. Called with the
+   pool lock held. */
+static void slab_new(BufferPool *p, int size_class)
+{
+    SlabHeader *slab;
+    size_t size = class_size(size_class);
+    FreeBuffer *fb;
+    int i, n;
+
+    slab = slab_map(p, SLAB_SIZE);
+    slab->magic = SLAB_MAGIC;
+    slab->size_class = size_class;
+    slab->pool = p;
+    slab->map_size = SLAB_SIZE;
+    n = SLAB_SIZE / size;
+    /* slot 0 holds the header */
+    for(i = n - 1; i >= 1; i--) {
+        fb = (FreeBuffer *)((uint8_t *)slab + i * size);
+        fb->next = p->free_list[size_class];
+        p->free_list[size_class] = fb;
+    }
+    __atomic_fetch_add(&p->slab_bytes, SLAB_SIZE, __ATOMIC_RELAXED);
+}
+
+static void thread_cache_destroy(void *opaque)
+{
+    ThreadCache *tc = opaque;
+    BufferPool *p;
+    FreeBuffer *fb;
+    int i;
+
+    for(i = 0; i < BUFFER_POOL_NB_CLASSES; i++) {
+        while ((fb = tc->head[i]) != NULL) {
+            tc->head[i] = fb->next;
+            p = buffer_to_slab(fb)->pool;
+            pthread_mutex_lock(&p->lock);
+            fb->next = p->free_list[i];
+            p->free_list[i] = fb;
+            pthread_mutex_unlock(&p->lock);
+        }
+    }
+    free(tc);
+}
+
+static ThreadCache *get_thread_cache(BufferPool *p)
+{
+    ThreadCache *tc;
+
+    tc = pthread_getspecific(p->cache_key);
+    if (!tc) {
+        tc = mallocz(sizeof(*tc));
+        pthread_setspecific(p->cache_key, tc);
+    }
+    return tc;
+}
+
+BufferPool *buffer_pool_new(const char *name, int flags)
+{
+    BufferPool *p;
+
+    p = mallocz(sizeof(*p));
+    pstrcpy(p->name, sizeof(p->name), name);
+    p->flags = flags;
+    pthread_mutex_init(&p->lock, NULL);
+    if (pthread_key_create(&p->cache_key, thread_cache_destroy) != 0) {
+        fprintf(stderr, "Error: buffer pool %s: no thread key left\r\n",
+                name);
+        abort();
+    }
+    return p;
+}
+
+static void *buffer_pool_alloc_large(BufferPool *p, size_t size)
+{
+    SlabHeader *slab;
+    size_t map_size;
+
+    /* the header takes one cache line in front of the buffer */
+    map_size = (size + CACHE_LINE_SIZE + SLAB_SIZE - 1) &
+        ~((size_t)SLAB_SIZE - 1);
+    slab = slab_map(p, map_size);
+    slab->magic = SLAB_MAGIC;
+    slab->size_class = SLAB_CLASS_LARGE;
+    slab->pool = p;
+    slab->map_size = map_size;
+    __atomic_fetch_add(&p->large_allocs, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&p->bytes_in_use, map_size, __ATOMIC_RELAXED);
+    return (uint8_t *)slab + CACHE_LINE_SIZE;
+}
+
+void *buffer_pool_alloc(BufferPool *p, size_t size)
+{
+    ThreadCache *tc;
+    FreeBuffer *fb;
+    int size_class;
+
+    __atomic_fetch_add(&p->allocs, 1, __ATOMIC_RELAXED);
+    if (size > BUFFER_POOL_MAX_CLASS_SIZE)
+        return buffer_pool_alloc_large(p, size);
+    size_class = size_to_class(size);
+    __atomic_fetch_add(&p->bytes_in_use, class_size(size_class),
+                       __ATOMIC_RELAXED);
+
+    tc = get_thread_cache(p);
+    fb = tc->head[size_class];
+    if (fb) {
+        tc->head[size_class] = fb->next;
+        tc->count[size_class]--;
+        __atomic_fetch_add(&p->cache_hits, 1, __ATOMIC_RELAXED);
+        return fb;
+    }
+
+    pthread_mutex_lock(&p->lock);
+    if (!p->free_list[size_class])
+        slab_new(p, size_class);
+    fb = p->free_list[size_class];
+    p->free_list[size_class] = fb->next;
+    pthread_mutex_unlock(&p->lock);
+    return fb;
+}
+
+void buffer_pool_free(BufferPool *p, void *ptr)
+{
+    SlabHeader *slab;
+    ThreadCache *tc;
+    FreeBuffer *fb = ptr;
+    int size_class, i;
+
+    if (!ptr)
+        return;
+    slab = buffer_to_slab(ptr);
+    assert(slab->magic == SLAB_MAGIC && slab->pool == p);
+    __atomic_fetch_add(&p->frees, 1, __ATOMIC_RELAXED);
+    size_class = slab->size_class;
+    if (size_class == SLAB_CLASS_LARGE) {
+        __atomic_fetch_sub(&p->bytes_in_use, slab->map_size,
+                           __ATOMIC_RELAXED);
+        munmap(slab, slab->map_size);
+        return;
+    }
+    __atomic_fetch_sub(&p->bytes_in_use, class_size(size_class),
+                       __ATOMIC_RELAXED);
+
+    tc = get_thread_cache(p);
+    fb->next = tc->head[size_class];
+    tc->head[size_class] = fb;
+    if (++tc->count[size_class] <= thread_cache_max(size_class))
+        return;
+
+    /* cache full: hand half of it back to the pool */
+    pthread_mutex_lock(&p->lock);
+    for(i = thread_cache_max(size_class) / 2; i > 0; i--) {
+        fb = tc->head[size_class];
+        tc->head[size_class] = fb->next;
+        tc->count[size_class]--;
+        fb->next = p->free_list[size_class];
+        p->free_list[size_class] = fb;
+    }
+    pthread_mutex_unlock(&p->lock);
+}
+
+void buffer_pool_get_stats(BufferPool *p, BufferPoolStats *st)
+{
+    st->allocs = __atomic_load_n(&p->allocs, __ATOMIC_RELAXED);
+    st->frees = __atomic_load_n(&p->frees, __ATOMIC_RELAXED);
+    st->cache_hits = __atomic_load_n(&p->cache_hits, __ATOMIC_RELAXED);
+    st->large_allocs = __atomic_load_n(&p->large_allocs, __ATOMIC_RELAXED);
+    st->bytes_in_use = __atomic_load_n(&p->bytes_in_use, __ATOMIC_RELAXED);
+    st->slab_bytes = __atomic_load_n(&p->slab_bytes, __ATOMIC_RELAXED);
+}
+
+const char *buffer_pool_get_name(BufferPool *p)
+{
+    return p->name;
+}
+
+void buffer_pool_dump_stats(BufferPool *p)
+{
+    BufferPoolStats st;
+
+    buffer_pool_get_stats(p, &st);
+    fprintf(stderr, "buffer pool %s: %" PRIu64 " allocs, %" PRIu64
+            " frees, %" PRIu64 " thread cache hits, %" PRIu64
+            " large, %" PRIu64 " bytes in use, %" PRIu64 " bytes of slabs\r\n",
+            p->name, st.allocs, st.frees, st.cache_hits, st.large_allocs,
+            st.bytes_in_use, st.slab_bytes);
+}
@@ -0,0 +1,30 @@
+/*
+ * Size-classed request buffer pool
+ */
+#ifndef BUFPOOL_H
+#define BUFPOOL_H
+
+/* back the slabs with huge pages when the host has them */
+#define BUFFER_POOL_HUGEPAGES (1 << 0)
+
+typedef struct BufferPool BufferPool;
+
+typedef struct {
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t cache_hits;    /* served from the calling thread's cache */
+    uint64_t large_allocs;  /* too big for a size class */
+    uint64_t bytes_in_use;  /* rounded up to the size class */
+    uint64_t slab_bytes;    /* memory reserved for the size classes */
+} BufferPoolStats;
+
+BufferPool *buffer_pool_new(const char *name, int flags);
+/* Return a cache line aligned buffer of at least 'size' bytes. The
+   contents are undefined. */
+void *buffer_pool_alloc(BufferPool *p, size_t size);
+void buffer_pool_free(BufferPool *p, void *ptr);
+void buffer_pool_get_stats(BufferPool *p, BufferPoolStats *st);
+const char *buffer_pool_get_name(BufferPool *p);
+void buffer_pool_dump_stats(BufferPool *p);
+
+#endif /* BUFPOOL_H */
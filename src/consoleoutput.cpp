@@ -0,0 +1,293 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <algorithm>
+#include <chrono>
+#include <string>
+
+extern "C" {
+#include "boottime.h"
+#include "topology.h"
+}
+
+#include "consoleoutput.h"
+
+ConsoleRing::ConsoleRing(size_t size)
+    : head(0), tail(0)
+{
+    // Round up to a power of two so indices can be masked.
+    size_t n = 1;
+    while (n < size)
+        n <<= 1;
+    buf = new uint8_t[n];
+    mask = n - 1;
+}
+
+ConsoleRing::~ConsoleRing()
+{
+    delete[] buf;
+}
+
+size_t ConsoleRing::push(const uint8_t *data, size_t len)
+{
+    size_t h = head.load(std::memory_order_relaxed);
+    size_t t = tail.load(std::memory_order_acquire);
+    size_t space = (mask + 1) - (h - t);
+    if (len > space)
+        len = space;
+    size_t offset = h & mask;
+    size_t first = std::min(len, (mask + 1) - offset);
+    memcpy(buf + offset, data, first);
+    memcpy(buf, data + first, len - first);
+    head.store(h + len, std::memory_order_release);
+    return len;
+}
+
+size_t ConsoleRing::peek(const uint8_t **p1, size_t *l1, const uint8_t **p2, size_t *l2)
+{
+    size_t t = tail.load(std::memory_order_relaxed);
+    size_t h = head.load(std::memory_order_acquire);
+    size_t len = h - t;
+    size_t offset = t & mask;
+    *p1 = buf + offset;
+    *l1 = std::min(len, (mask + 1) - offset);
+    *p2 = buf;
+    *l2 = len - *l1;
+    return len;
+}
+
+void ConsoleRing::consume(size_t len)
+{
+    tail.store(tail.load(std::memory_order_relaxed) + len, std::memory_order_release);
+}
+
+bool ConsoleRing::empty()
+{
+    return head.load(std::memory_order_acquire) == tail.load(std::memory_order_relaxed);
+}
+
+ConsoleOutput::ConsoleOutput(int out_fd, size_t ring_size)
+    : out_fd(out_fd), log_fd(-1), log_at_line_start(true),
+      writer_idle(false), space_waiters(0), stopping(false), running(false)
+{
+    clock_gettime(CLOCK_MONOTONIC, &start_time);
+    for (int i = 0; i < CONSOLE_OUTPUT_NUM_CHANNELS; i++)
+        rings[i] = new ConsoleRing(ring_size);
+}
+
+ConsoleOutput::~ConsoleOutput()
+{
+    stop();
+    for (int i = 0; i < CONSOLE_OUTPUT_NUM_CHANNELS; i++)
+        delete rings[i];
+    if (log_fd >= 0)
+        close(log_fd);
+}
+
+int ConsoleOutput::set_log_file(const char *filename)
+{
+    int fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        fprintf(stderr, "Error: failed to open console log %s: %s\r\n", filename, strerror(errno));
+        return -errno;
+    }
+    if (log_fd >= 0)
+        close(log_fd);
+    log_fd = fd;
+    return 0;
+}
+
+void ConsoleOutput::wake_writer()
+{
+    // Pairs with the fence in process_output(): either we see the writer
+    // idle, or the writer sees our data before it goes to sleep.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (writer_idle.load()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        data_cond.notify_one();
+    }
+}
+
+void ConsoleOutput::write(int channel, const uint8_t *data, size_t len)
+{
+    static bool boot_output_seen[CONSOLE_OUTPUT_NUM_CHANNELS];
+
+    BOOT_MILESTONE_ONCE(boot_output_seen[channel], "first %s console output",
+                        channel == CONSOLE_OUTPUT_HTIF ? "htif" : "virtio");
+    if (!running) {
+        // No writer thread yet (or any more): write through.
+        while (len > 0) {
+            ssize_t ret = ::write(out_fd, data, len);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                return;
+            }
+            data += ret;
+            len -= ret;
+        }
+        return;
+    }
+
+    ConsoleRing *ring = rings[channel];
+    for (;;) {
+        size_t n = ring->push(data, len);
+        data += n;
+        len -= n;
+        wake_writer();
+        if (len == 0)
+            return;
+        // Ring full: hold the producer until the writer frees some space.
+        std::unique_lock<std::mutex> lock(mutex);
+        space_waiters++;
+        space_cond.wait_for(lock, std::chrono::milliseconds(10));
+        space_waiters--;
+    }
+}
+
+bool ConsoleOutput::all_empty()
+{
+    for (int i = 0; i < CONSOLE_OUTPUT_NUM_CHANNELS; i++) {
+        if (!rings[i]->empty())
+            return false;
+    }
+    return true;
+}
+
+void ConsoleOutput::write_log(const uint8_t *data, size_t len)
+{
+    std::string line;
+    for (size_t i = 0; i < len; i++) {
+        if (log_at_line_start) {
+            struct timespec now;
+            char stamp[32];
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            double t = (now.tv_sec - start_time.tv_sec) + (now.tv_nsec - start_time.tv_nsec) / 1e9;
+            snprintf(stamp, sizeof(stamp), "[%12.6f] ", t);
+            line += stamp;
+            log_at_line_start = false;
+        }
+        if (data[i] == '\r')
+            continue;
+        line += (char)data[i];
+        if (data[i] == '\n')
+            log_at_line_start = true;
+    }
+    if (::write(log_fd, line.data(), line.size()) < 0) {
+        fprintf(stderr, "Error: console log write failed: %s\r\n", strerror(errno));
+        close(log_fd);
+        log_fd = -1;
+    }
+}
+
+// Coalesce everything currently buffered into a single writev().
+size_t ConsoleOutput::drain()
+{
+    struct iovec iov[2 * CONSOLE_OUTPUT_NUM_CHANNELS];
+    size_t lens[CONSOLE_OUTPUT_NUM_CHANNELS];
+    size_t total = 0;
+    int iovcnt = 0;
+
+    for (int i = 0; i < CONSOLE_OUTPUT_NUM_CHANNELS; i++) {
+        const uint8_t *p1, *p2;
+        size_t l1, l2;
+        lens[i] = rings[i]->peek(&p1, &l1, &p2, &l2);
+        if (l1) {
+            iov[iovcnt].iov_base = (void *)p1;
+            iov[iovcnt++].iov_len = l1;
+        }
+        if (l2) {
+            iov[iovcnt].iov_base = (void *)p2;
+            iov[iovcnt++].iov_len = l2;
+        }
+        total += lens[i];
+    }
+    if (total == 0)
+        return 0;
+
+    if (log_fd >= 0) {
+        for (int i = 0; i < iovcnt; i++)
+            write_log((const uint8_t *)iov[i].iov_base, iov[i].iov_len);
+    }
+
+    int first = 0;
+    while (first < iovcnt) {
+        ssize_t ret = writev(out_fd, iov + first, iovcnt - first);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            break; // Drop output rather than wedge the guest.
+        }
+        while (first < iovcnt && (size_t)ret >= iov[first].iov_len) {
+            ret -= iov[first].iov_len;
+            first++;
+        }
+        if (first < iovcnt) {
+            iov[first].iov_base = (uint8_t *)iov[first].iov_base + ret;
+            iov[first].iov_len -= ret;
+        }
+    }
+
+    for (int i = 0; i < CONSOLE_OUTPUT_NUM_CHANNELS; i++)
+        rings[i]->consume(lens[i]);
+    if (space_waiters.load()) {
+        std::lock_guard<std::mutex> lock(mutex);
+        space_cond.notify_all();
+    }
+    return total;
+}
+
+void ConsoleOutput::process_output()
+{
+    for (;;) {
+        while (drain() > 0)
+            ;
+        std::unique_lock<std::mutex> lock(mutex);
+        writer_idle.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        // Re-check after publishing idle so a concurrent push is not missed.
+        if (all_empty()) {
+            if (stopping.load()) {
+                writer_idle.store(false);
+                return;
+            }
+            data_cond.wait_for(lock, std::chrono::milliseconds(100));
+        }
+        writer_idle.store(false);
+    }
+}
+
+void *ConsoleOutput::process_output_thread(void *opaque)
+{
+    ((ConsoleOutput *)opaque)->process_output();
+    return NULL;
+}
+
+void ConsoleOutput::start()
+{
+    if (running)
+        return;
+    stopping = false;
+    running = true;
+    pthread_create(&writer_thread, NULL, &process_output_thread, this);
+    pthread_setname_np(writer_thread, "Console output");
+    thread_topology_apply(THREAD_ROLE_CONSOLE_OUTPUT, writer_thread);
+}
+
+// Flush all buffered output and stop the writer thread.
+void ConsoleOutput::stop()
+{
+    if (!running)
+        return;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        data_cond.notify_one();
+    }
+    pthread_join(writer_thread, NULL);
+    running = false;
+}
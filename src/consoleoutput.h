@@ -0,0 +1,76 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+
+// Each console producer (the MMIO thread for HTIF/UART output, the virtio
+// queue thread for the virtio console) owns one channel, so every ring has
+// exactly one producer and the writer thread is the only consumer.
+enum {
+    CONSOLE_OUTPUT_HTIF,
+    CONSOLE_OUTPUT_VIRTIO,
+    CONSOLE_OUTPUT_NUM_CHANNELS
+};
+
+#define CONSOLE_OUTPUT_DEFAULT_RING_SIZE (64 * 1024)
+
+// Lock-free single-producer single-consumer byte ring.
+class ConsoleRing {
+    uint8_t *buf;
+    size_t mask;
+    alignas(64) std::atomic<size_t> head; // advanced by the producer
+    alignas(64) std::atomic<size_t> tail; // advanced by the consumer
+
+public:
+    ConsoleRing(size_t size);
+    ~ConsoleRing();
+
+    size_t push(const uint8_t *data, size_t len);
+    // Return the readable data as up to two contiguous chunks.
+    size_t peek(const uint8_t **p1, size_t *l1, const uint8_t **p2, size_t *l2);
+    void consume(size_t len);
+    bool empty();
+};
+
+// Buffered console output. Producers copy into their channel's ring and
+// return immediately; a dedicated writer thread drains all rings with one
+// writev() per wakeup and optionally mirrors the output, timestamped per
+// line, into a log file. A full ring blocks its producer until the writer
+// catches up, which pushes back on the guest device.
+class ConsoleOutput {
+    int out_fd;
+    int log_fd;
+    bool log_at_line_start;
+    struct timespec start_time;
+    ConsoleRing *rings[CONSOLE_OUTPUT_NUM_CHANNELS];
+
+    std::mutex mutex;
+    std::condition_variable data_cond;
+    std::condition_variable space_cond;
+    std::atomic<bool> writer_idle;
+    std::atomic<int> space_waiters;
+    std::atomic<bool> stopping;
+    std::atomic<bool> running;
+    pthread_t writer_thread;
+
+    void wake_writer();
+    bool all_empty();
+    size_t drain();
+    void write_log(const uint8_t *data, size_t len);
+    void process_output();
+    static void *process_output_thread(void *opaque);
+
+public:
+    ConsoleOutput(int out_fd, size_t ring_size = CONSOLE_OUTPUT_DEFAULT_RING_SIZE);
+    ~ConsoleOutput();
+
+    int set_log_file(const char *filename);
+    void write(int channel, const uint8_t *data, size_t len);
+    void putchar(int channel, uint8_t ch) { write(channel, &ch, 1); }
+    void start();
+    void stop();
+};
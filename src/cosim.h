@@ -0,0 +1,94 @@
+#pragma once
+
+// Shared-memory cosimulation protocol between fmem_virtio_host and an RTL
+// simulator (Verilator, Bluesim). Both sides map the same POSIX
+// shared-memory object: a CosimShared header holding one ring per
+// direction, followed by the guest DRAM window, which both sides access
+// directly. Only MMIO, IRQ levels and DMA outside the window travel as
+// messages.
+//
+// This header is plain C so the simulator side can include it as is.
+
+#include <stdint.h>
+
+#define COSIM_MAGIC   0x4d534f43 // "COSM"
+#define COSIM_VERSION 1
+
+#define COSIM_DEFAULT_SHM_NAME  "/fmem_virtio_cosim"
+#define COSIM_DEFAULT_DRAM_BASE 0xc0000000ul
+#define COSIM_DEFAULT_DRAM_SIZE 0x40000000ul
+
+#define COSIM_RING_SIZE 1024 // messages, power of two
+
+enum {
+    COSIM_MSG_MMIO_READ = 1, // sim -> host: id, addr
+    COSIM_MSG_MMIO_WRITE,    // sim -> host: id, addr, data, strb
+    COSIM_MSG_MMIO_RESP,     // host -> sim: id, data (reads only)
+    COSIM_MSG_IRQ_SET,       // host -> sim: data = levels to raise
+    COSIM_MSG_IRQ_CLEAR,     // host -> sim: data = levels to lower
+    COSIM_MSG_DMA_READ,      // host -> sim: id, addr, size
+    COSIM_MSG_DMA_WRITE,     // host -> sim: addr, data, size
+    COSIM_MSG_DMA_RESP,      // sim -> host: id, data
+};
+
+typedef struct {
+    uint16_t type;
+    uint16_t id;
+    uint8_t size; // bytes, for DMA
+    uint8_t strb; // byte enables, for MMIO writes
+    uint16_t reserved;
+    uint64_t addr;
+    uint64_t data;
+    uint64_t timestamp; // simulator cycle, informational
+} CosimMessage;
+
+// Single-producer single-consumer ring. Producers fill slots and publish
+// them in batches with one release store of head.
+typedef struct {
+    uint32_t head;
+    uint8_t pad0[60];
+    uint32_t tail;
+    uint8_t pad1[60];
+    CosimMessage msgs[COSIM_RING_SIZE];
+} CosimRing;
+
+typedef struct {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t dram_base;   // guest physical address of the window
+    uint64_t dram_size;
+    uint64_t dram_offset; // offset of the window in the shm object
+    uint32_t host_ready;
+    uint32_t sim_ready;
+    uint8_t pad[24];
+    CosimRing to_host;
+    CosimRing to_sim;
+} CosimShared;
+
+// Write m at the producer's private head; returns 0, or -1 if full.
+static inline int cosim_ring_put(CosimRing *r, uint32_t *head, const CosimMessage *m)
+{
+    uint32_t tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (*head - tail == COSIM_RING_SIZE)
+        return -1;
+    r->msgs[*head & (COSIM_RING_SIZE - 1)] = *m;
+    (*head)++;
+    return 0;
+}
+
+// Make every message put so far visible to the consumer.
+static inline void cosim_ring_publish(CosimRing *r, uint32_t head)
+{
+    __atomic_store_n(&r->head, head, __ATOMIC_RELEASE);
+}
+
+// Returns 1 and fills m if a message was available.
+static inline int cosim_ring_get(CosimRing *r, CosimMessage *m)
+{
+    uint32_t tail = r->tail;
+    if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) == tail)
+        return 0;
+    *m = r->msgs[tail & (COSIM_RING_SIZE - 1)];
+    __atomic_store_n(&r->tail, tail + 1, __ATOMIC_RELEASE);
+    return 1;
+}
@@ -0,0 +1,211 @@
+/*
+ * Pre-filled entropy pool for the virtio entropy device
+ *
+ * Random bytes come from a ChaCha20 keystream generator seeded (and
+ * periodically reseeded) from getrandom(). Each generator call ends by
+ * replacing the key with fresh keystream ("fast key erasure"), so earlier
+ * output cannot be recovered from the state. A background thread keeps
+ * the pool topped up so that guest requests are served with a memcpy.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/types.h>
+
+#if __has_include(<sys/random.h>)
+#include <sys/random.h>
+#else
+#include <sys/syscall.h>
+
+static inline ssize_t getrandom(void *buf, size_t buflen, unsigned int flags) {
+    return syscall(SYS_getrandom, buf, buflen, flags);
+}
+#endif
+
+#include "cutils.h"
+#include "entropy.h"
+#include "topology.h"
+
+#define CHACHA_BLOCK_SIZE 64
+#define CHACHA_KEY_SIZE 32
+/* reseed the key from the kernel after this much output */
+#define ENTROPY_RESEED_INTERVAL (16 * 1024 * 1024)
+#define ENTROPY_REFILL_CHUNK (16 * 1024)
+
+typedef struct {
+    uint32_t key[8];
+    uint32_t nonce[3];
+    uint64_t output_count;
+    pthread_mutex_t lock;
+} ChaChaGenerator;
+
+struct EntropyPool {
+    ChaChaGenerator gen;
+    pthread_mutex_t lock;
+    pthread_cond_t refill_cond;
+    uint8_t *buf;
+    int size;
+    int avail; /* valid bytes are buf[0..avail-1] */
+    pthread_t refill_thread;
+};
+
+#define ROTL32(v, n) (((v) << (n)) | ((v) >> (32 - (n))))
+
+#define QUARTERROUND(a, b, c, d) \
+    a += b; d ^= a; d = ROTL32(d, 16); \
+    c += d; b ^= c; b = ROTL32(b, 12); \
+    a += b; d ^= a; d = ROTL32(d, 8); \
+    c += d; b ^= c; b = ROTL32(b, 7);
+
+static void chacha20_block(uint8_t *out, const uint32_t *key,
+                           const uint32_t *nonce, uint32_t counter)
+{
+    uint32_t in[16], x[16];
+    int i;
+
+    in[0] = 0x61707865;
+    in[1] = 0x3320646e;
+    in[2] = 0x79622d32;
+    in[3] = 0x6b206574;
+    for (i = 0; i < 8; i++)
+        in[4 + i] = key[i];
+    in[12] = counter;
+    in[13] = nonce[0];
+    in[14] = nonce[1];
+    in[15] = nonce[2];
+    memcpy(x, in, sizeof(x));
+    for (i = 0; i < 10; i++) {
+        QUARTERROUND(x[0], x[4], x[8], x[12]);
+        QUARTERROUND(x[1], x[5], x[9], x[13]);
+        QUARTERROUND(x[2], x[6], x[10], x[14]);
+        QUARTERROUND(x[3], x[7], x[11], x[15]);
+        QUARTERROUND(x[0], x[5], x[10], x[15]);
+        QUARTERROUND(x[1], x[6], x[11], x[12]);
+        QUARTERROUND(x[2], x[7], x[8], x[13]);
+        QUARTERROUND(x[3], x[4], x[9], x[14]);
+    }
+    for (i = 0; i < 16; i++)
+        put_le32(out + 4 * i, x[i] + in[i]);
+}
+
+static void chacha_seed(ChaChaGenerator *g)
+{
+    uint8_t seed[CHACHA_KEY_SIZE + 12];
+    int i, ret, len = 0;
+
+    while (len < sizeof(seed)) {
+        ret = getrandom(seed + len, sizeof(seed) - len, 0);
+        if (ret <= 0) {
+            fprintf(stderr, "Error: getrandom failed\r\n");
+            abort();
+        }
+        len += ret;
+    }
+    /* mix into the current key so a reseed never loses entropy */
+    for (i = 0; i < 8; i++)
+        g->key[i] ^= get_le32(seed + 4 * i);
+    for (i = 0; i < 3; i++)
+        g->nonce[i] = get_le32(seed + CHACHA_KEY_SIZE + 4 * i);
+    g->output_count = 0;
+    memset(seed, 0, sizeof(seed));
+}
+
+/* Generate len bytes. Must be called with g->lock held. */
+static void chacha_generate(ChaChaGenerator *g, uint8_t *buf, int len)
+{
+    uint8_t block[CHACHA_BLOCK_SIZE];
+    uint32_t counter = 1;
+    int i, n;
+
+    if (g->output_count >= ENTROPY_RESEED_INTERVAL)
+        chacha_seed(g);
+    while (len > 0) {
+        n = min_int(len, CHACHA_BLOCK_SIZE);
+        if (n == CHACHA_BLOCK_SIZE) {
+            chacha20_block(buf, g->key, g->nonce, counter++);
+        } else {
+            chacha20_block(block, g->key, g->nonce, counter++);
+            memcpy(buf, block, n);
+        }
+        buf += n;
+        len -= n;
+        g->output_count += n;
+    }
+    /* fast key erasure: block 0 of this key becomes the next key */
+    chacha20_block(block, g->key, g->nonce, 0);
+    for (i = 0; i < 8; i++)
+        g->key[i] = get_le32(block + 4 * i);
+    memset(block, 0, sizeof(block));
+}
+
+static void *entropy_refill_thread(void *opaque)
+{
+    EntropyPool *p = opaque;
+    uint8_t *chunk = malloc(ENTROPY_REFILL_CHUNK);
+    int n;
+
+    for (;;) {
+        pthread_mutex_lock(&p->lock);
+        while (p->avail > p->size / 2)
+            pthread_cond_wait(&p->refill_cond, &p->lock);
+        n = min_int(p->size - p->avail, ENTROPY_REFILL_CHUNK);
+        pthread_mutex_unlock(&p->lock);
+
+        /* generate outside the pool lock so readers are not held up */
+        pthread_mutex_lock(&p->gen.lock);
+        chacha_generate(&p->gen, chunk, n);
+        pthread_mutex_unlock(&p->gen.lock);
+
+        pthread_mutex_lock(&p->lock);
+        n = min_int(n, p->size - p->avail);
+        memcpy(p->buf + p->avail, chunk, n);
+        p->avail += n;
+        pthread_mutex_unlock(&p->lock);
+    }
+    return NULL;
+}
+
+EntropyPool *entropy_pool_new(int size)
+{
+    EntropyPool *p;
+
+    p = mallocz(sizeof(*p));
+    pthread_mutex_init(&p->gen.lock, NULL);
+    chacha_seed(&p->gen);
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->refill_cond, NULL);
+    p->size = size;
+    p->buf = thread_topology_alloc(size);
+    chacha_generate(&p->gen, p->buf, size);
+    p->avail = size;
+
+    pthread_create(&p->refill_thread, NULL, entropy_refill_thread, p);
+    pthread_setname_np(p->refill_thread, "Entropy pool");
+    thread_topology_apply(THREAD_ROLE_ENTROPY, p->refill_thread);
+    return p;
+}
+
+void entropy_pool_read(EntropyPool *p, uint8_t *buf, int len)
+{
+    int n;
+
+    pthread_mutex_lock(&p->lock);
+    n = min_int(len, p->avail);
+    p->avail -= n;
+    memcpy(buf, p->buf + p->avail, n);
+    /* never hand out the same bytes twice */
+    memset(p->buf + p->avail, 0, n);
+    if (p->avail <= p->size / 2)
+        pthread_cond_signal(&p->refill_cond);
+    pthread_mutex_unlock(&p->lock);
+
+    if (n < len) {
+        /* pool drained: generate the rest inline */
+        pthread_mutex_lock(&p->gen.lock);
+        chacha_generate(&p->gen, buf + n, len - n);
+        pthread_mutex_unlock(&p->gen.lock);
+    }
+}
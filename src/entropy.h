@@ -0,0 +1,16 @@
+/*
+ * Pre-filled entropy pool for the virtio entropy device
+ */
+#ifndef ENTROPY_H
+#define ENTROPY_H
+
+#define ENTROPY_POOL_DEFAULT_SIZE (256 * 1024)
+
+typedef struct EntropyPool EntropyPool;
+
+/* Start a pool of 'size' bytes refilled by a background thread */
+EntropyPool *entropy_pool_new(int size);
+/* Fill buf with len random bytes; never blocks on the refill thread */
+void entropy_pool_read(EntropyPool *p, uint8_t *buf, int len);
+
+#endif /* ENTROPY_H */
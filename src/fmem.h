@@ -35,6 +35,11 @@
 #include <sys/uio.h>
 #include <sys/ioctl.h>
 
+#include "metrics.h"
+
+/* ioctl counters, registered by the fmem transport (see metrics.c) */
+extern Metric *fmem_read_metric, *fmem_write_metric;
+
 struct fmem_request {
     uint32_t offset;
     uint32_t data;
@@ -58,6 +63,7 @@ uint32_t fmem_read(int fd, uint32_t offset, uint8_t width)
     req.offset = offset & adr_mask;
     req.access_width = 4;
 
+    metric_inc(fmem_read_metric);
     error = ioctl(fd, FMEM_READ, &req);
     if (error == 0){
         uint32_t wide = req.data;
@@ -95,6 +101,7 @@ uint64_t fmem_write(int fd, uint32_t offset, uint32_t data, uint8_t width)
     req.data = data;
     req.access_width = width;
 
+    metric_inc(fmem_write_metric);
     error = ioctl(fd, FMEM_WRITE, &req);
     printf("write! offset: %x, req.data: %x, width: %x \r\n", offset, req.data, width);
     return (error);
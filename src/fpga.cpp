@@ -6,9 +6,23 @@
 #include <sys/types.h>
 
 #include "fpga.h"
+#include "htif.h"
 #include "util.h"
 #include "fmem.h"
 
+extern "C" {
+#include "boottime.h"
+#include "probes.h"
+#include "topology.h"
+#include "trace.h"
+}
+#ifdef SIMULATION
+#include <deque>
+#include <map>
+#include <sched.h>
+#include "cosim.h"
+#endif
+
 #define TOHOST_OFFSET 0
 #define FROMHOST_OFFSET 8
 #define FIRST_VIRTIO_IRQ 3
@@ -16,15 +30,34 @@
 static int debug_virtio = 1;
 static int debug_stray_io = 1;
 
+static Metric *mmio_read_metric;
+static Metric *mmio_write_metric;
+static Metric *mmio_latency_metric;
+static Metric *window_switch_metric;
+
+static int boot_rom_fetched;
+static int boot_htif_syscalled;
+
 extern FPGA *fpga;
 
 class FPGA_io {
-private:
+protected:
     FPGA *fpga;
     int mmio_fd;
     int dma_fd;
     int irq_fd;
     int selector_fd;
+
+    // For transports that do not use the fmem devices.
+    FPGA_io(FPGA *fpga) : fpga(fpga), mmio_fd(-1), dma_fd(-1), irq_fd(-1), selector_fd(-1) {}
+    void handle_mmio_write(uint32_t waddr, uint64_t wdata, uint8_t wstrb);
+    uint64_t handle_mmio_read(uint32_t araddr);
+    static uint64_t rom_read(void *opaque, uint32_t offset);
+    static void tohost_write(void *opaque, uint32_t offset, uint64_t wdata);
+    static uint64_t fromhost_read(void *opaque, uint32_t offset);
+    static void fromhost_write(void *opaque, uint32_t offset, uint64_t wdata);
+    static uint64_t sifive_test_read(void *opaque, uint32_t offset);
+    static void sifive_test_write(void *opaque, uint32_t offset, uint64_t wdata);
 public:
     FPGA_io(int id, FPGA *fpga) : fpga(fpga), mmio_fd(-1), dma_fd(-1), irq_fd(-1) { // XXX What is "id" for? What was AWSP2_ResponseWrapper?
         // Initialise Memory-mapped IO
@@ -80,19 +113,29 @@ public:
             fprintf(stderr, "ERROR: Failed to open fmem interrupts device file: %s\r\n", strerror(errno));
             abort();
         }
+        fmem_read_metric = metric_new(METRIC_COUNTER, "fmem_ioctls_total",
+                                      "fmem device ioctls", "op=\"read\"");
+        fmem_write_metric = metric_new(METRIC_COUNTER, "fmem_ioctls_total",
+                                       "fmem device ioctls", "op=\"write\"");
     }
-    bool emulated_mmio_has_request() {
+    virtual ~FPGA_io() {}
+    virtual bool emulated_mmio_has_request() {
         return (fmem_read8(mmio_fd, VD_REQ_LEVEL) != 0);
     }
     //void close_dma();
     int get_dma_fd() { return dma_fd; }
     int get_irq_fd() { return irq_fd; }
+    // Host pointer to guest memory shared with this process, if any.
+    virtual uint8_t *get_dram_ptr(uint64_t addr, size_t size) { return NULL; }
     void dma_set_window(uint64_t addr);
-    uint8_t dma_read8(uint64_t raddr);
-    uint32_t dma_read32(uint64_t raddr);
-    void dma_write8(uint64_t waddr, uint8_t wdata);
-    void dma_write32(uint64_t waddr, uint32_t wdata);
-    void emulated_mmio_respond();
+    virtual uint8_t dma_read8(uint64_t raddr);
+    virtual uint32_t dma_read32(uint64_t raddr);
+    virtual void dma_write8(uint64_t waddr, uint8_t wdata);
+    virtual void dma_write32(uint64_t waddr, uint32_t wdata);
+    virtual void irq_set_levels(uint32_t w1s) { fmem_write32(irq_fd, 0, w1s); }
+    virtual void irq_clear_levels(uint32_t w1c) { fmem_write32(irq_fd, 4, w1c); }
+    virtual void emulated_mmio_respond();
+    void register_host_ranges(PhysMemoryMap *map);
     void console_putchar(uint64_t wdata);
     virtual void uart_tohost(uint8_t ch);
 };
@@ -112,7 +155,7 @@ void FPGA_io::dma_set_window(uint64_t addr) {
         if (selector_fd >= 0) {
             printf("writing address selector (write) 0x0 == 0x%" PRIx64 "\n",
                     offset);
-            int error = fmem_write(0, 4, (uint32_t)offset, selector_fd);
+            int error = fmem_write(selector_fd, 0, (uint32_t)offset, 4);
             if (error != 0) {
                 printf("error with address selector (write) 0x0 == 0x%" PRIx64 "\n",
                        offset);
@@ -120,6 +163,7 @@ void FPGA_io::dma_set_window(uint64_t addr) {
             // Only support 32-bit address space for the moment.  Unclear if the top-half of the selector is supported, actually...
             //error = fmem_write(4, 4, (uint32_t)(offset>>32), address_selector_fd);
             last_offset = offset;
+            metric_inc(window_switch_metric);
         }
         else {
             fprintf(stderr, "ERROR: Attempted write unusable fmem address selector device file: %s\r\n", strerror(errno));
@@ -178,119 +222,696 @@ FPGA_io::emulated_mmio_respond() {
         uint32_t waddr = fmem_read32(mmio_fd, VD_WRITE_ADDR);
         uint64_t wdata = fmem_read64(mmio_fd, VD_WRITE_DATA);
         uint8_t wstrb = fmem_read8(mmio_fd, VD_WRITE_BYEN);
-        PhysMemoryRange *pr = fpga->virtio_devices.get_phys_mem_range(waddr);
-        if (pr) {
-            int size_log2 = 2;
-            uint32_t offset = waddr - pr->addr;
-            if (waddr & 4) {
-                wdata = (wdata >> 32) & 0xFFFFFFFF;;
-            }
-            if (debug_virtio) fprintf(stderr, "virtio waddr %08x offset %x wdata %08lx wstrb %x\r\n", waddr, offset, wdata, wstrb);
-            pr->write_func(pr->opaque, offset, wdata, size_log2);
-        } else if (waddr == fpga->tohost_addr) {
-            // tohost
-            uint8_t dev = (wdata >> 56) & 0xFF;
-            uint8_t cmd = (wdata >> 48) & 0xFF;
-            uint64_t payload = wdata & 0x0000FFFFFFFFFFFFul;
-            if (dev == 1 && cmd == 1) {
-                console_putchar(payload);
-            } else if (dev == 0 && cmd == 0) {
-                int code;
-                if (payload == 1) {
-                    code = 0;
-                    fprintf(stderr, "PASS\r\n");
-                } else {
-                    code = payload >> 1;
-                    fprintf(stderr, "FAIL: error %u\r\n", code);
-                }
-                fpga->stop_io(code);
-            } else {
-                fprintf(stderr, "\r\nHTIF: dev=%d cmd=%02x payload=%08lx\r\n", dev, cmd, payload);
-            }
-        } else if (waddr == fpga->fromhost_addr) {
-            //fprintf(stderr, "\r\nHTIF: addr %08x wdata=%08lx\r\n", addr, wdata);
-        } else if (waddr == fpga->sifive_test_addr) {
-            // Similar to HTIF, but the address is in the device tree so an
-            // unmodified BBL can use it. It gets used for shutdown so we make it
-            // silent.
-            int status = wdata & 0xFFFF;
-            if (status == 0x3333) {
-                // FAIL
-                int code = (wdata >> 16) & 0xFFFF;
-                fpga->stop_io(code);
-            } else if (status == 0x5555) {
-                // PASS
-                fpga->stop_io(0);
-            } else if (status == 0x7777) {
-                // RESET
-                fpga->stop_io(EXIT_CODE_RESET);
-            } else {
-                fprintf(stderr, "\r\nSiFive Test Finisher: status=%04x\r\n", status);
-            }
-        } else {
-            if (debug_stray_io) fprintf(stderr, "Stray io! waddr %08x io_wdata wdata=%lx wstrb=%x\r\n", waddr, wdata, wstrb);
-        }
+        handle_mmio_write(waddr, wdata, wstrb);
     } else { // must be a read request
         uint32_t araddr = fmem_read32(mmio_fd, VD_READ_ADDR);
         uint16_t arlen = 0;//fmem_read8(VD_FLIT_SIZE); // Non-0 arlen is likely to break something.
         uint16_t arid = fmem_read32(mmio_fd, VD_REQ_ID);
-        PhysMemoryRange *pr = fpga->virtio_devices.get_phys_mem_range(araddr);
         if (arlen != 0) fprintf(stderr, "ERROR: fromhost araddr %08x arlen %d\r\n", araddr, arlen);
-        else if (pr) {
-            uint32_t offset = araddr - pr->addr;
-            int size_log2 = 2;
-            uint64_t val = pr->read_func(pr->opaque, offset, size_log2);
-            if ((offset % 8) == 4)
-                val = (val << 32); // Assuming a 64-bit virtualised data width.
-            fmem_write64(mmio_fd, VD_READ_DATA,val);
-            if (debug_virtio)
-                fprintf(stderr, "virtio araddr %0x device addr %08lx offset %08x len %d val %08lx\r\n",
-                        araddr, pr->addr, offset, arlen, val);
-        } else if (fpga->rom.base <= araddr && araddr < fpga->rom.limit) {
-            int offset = (araddr - fpga->rom.base) / 8;
-            //fprintf(stderr, "rom offset %x data %08lx\r\n", (int)(araddr - fpga->rom.base), fpga->rom.data[offset]);
-            fmem_write64(mmio_fd, VD_READ_DATA,fpga->rom.data[offset]);
-        } else if (araddr == fpga->fromhost_addr) {
-            uint8_t ch = 0;
-            
-            if (fpga->htif_enabled && fpga->dequeue_stdin(&ch)) {
-                uint64_t cmd = (1ul << 56) | (0ul << 48) | ch;
-                fmem_write64(mmio_fd, VD_READ_DATA,cmd);
-            } else {
-                fmem_write64(mmio_fd, VD_READ_DATA,0);
-            }
-        } else if (araddr == fpga->sifive_test_addr) {
-            fmem_write64(mmio_fd, VD_READ_DATA,0);
+        else fmem_write64(mmio_fd, VD_READ_DATA, handle_mmio_read(araddr));
+    }
+    fmem_write32(mmio_fd, VD_SEND_RESP, 1); // Send any response.
+}
+
+// Host-emulated devices share the PhysMemoryMap with the virtio devices so
+// each access is decoded by a single lookup.
+void FPGA_io::register_host_ranges(PhysMemoryMap *map)
+{
+    Rom &rom = fpga->rom;
+    fpga->rom_range = cpu_register_device64(map, rom.base, rom.limit - rom.base, this,
+                                            rom_read, NULL, 0);
+    fpga->tohost_range = cpu_register_device64(map, fpga->tohost_addr, 8, this,
+                                               NULL, tohost_write, 0);
+    fpga->fromhost_range = cpu_register_device64(map, fpga->fromhost_addr, 8, this,
+                                                 fromhost_read, fromhost_write, 0);
+    fpga->sifive_test_range = cpu_register_device64(map, fpga->sifive_test_addr, 8, this,
+                                                    sifive_test_read, sifive_test_write, 0);
+}
+
+uint64_t FPGA_io::rom_read(void *opaque, uint32_t offset)
+{
+    FPGA_io *io = (FPGA_io *)opaque;
+    BOOT_MILESTONE_ONCE(boot_rom_fetched, "first boot rom fetch");
+    //fprintf(stderr, "rom offset %x data %08lx\r\n", offset, io->fpga->rom.data[offset / 8]);
+    return io->fpga->rom.data[offset / 8];
+}
+
+void FPGA_io::tohost_write(void *opaque, uint32_t offset, uint64_t wdata)
+{
+    FPGA_io *io = (FPGA_io *)opaque;
+    FPGA *fpga = io->fpga;
+    uint8_t dev = (wdata >> 56) & 0xFF;
+    uint8_t cmd = (wdata >> 48) & 0xFF;
+    uint64_t payload = wdata & 0x0000FFFFFFFFFFFFul;
+
+    if (offset != 0)
+        return;
+    if (dev == 1 && cmd == 1) {
+        io->console_putchar(payload);
+    } else if (dev == 0 && cmd == 0 && !(payload & 1) && fpga->htif_syscalls) {
+        // payload is the address of a frontend syscall argument block
+        BOOT_MILESTONE_ONCE(boot_htif_syscalled, "first htif syscall");
+        fpga->htif_syscalls->execute(payload);
+        fpga->fromhost_pending = (0ul << 56) | (0ul << 48) | 1;
+    } else if (dev == 0 && cmd == 0) {
+        int code;
+        if (payload == 1) {
+            code = 0;
+            fprintf(stderr, "PASS\r\n");
         } else {
-            if (araddr != 0x10001000 && araddr != 0x10001008 && araddr != 0x50001000 && araddr != 0x50001008)
-                if (debug_stray_io) fprintf(stderr, "io_araddr araddr=%08x arlen=%d\r\n", araddr, arlen);
-            fmem_write64(mmio_fd, VD_READ_DATA,0);
+            code = payload >> 1;
+            fprintf(stderr, "FAIL: error %u\r\n", code);
         }
+        fpga->stop_io(code);
+    } else {
+        fprintf(stderr, "\r\nHTIF: dev=%d cmd=%02x payload=%08lx\r\n", dev, cmd, payload);
     }
-    fmem_write32(mmio_fd, VD_SEND_RESP, 1); // Send any response.
+}
+
+uint64_t FPGA_io::fromhost_read(void *opaque, uint32_t offset)
+{
+    FPGA *fpga = ((FPGA_io *)opaque)->fpga;
+    uint8_t ch = 0;
+
+    if (offset != 0)
+        return 0;
+    if (fpga->fromhost_pending) {
+        return fpga->fromhost_pending;
+    } else if (fpga->htif_enabled && fpga->dequeue_stdin(&ch)) {
+        return (1ul << 56) | (0ul << 48) | ch;
+    } else {
+        return 0;
+    }
+}
+
+void FPGA_io::fromhost_write(void *opaque, uint32_t offset, uint64_t wdata)
+{
+    FPGA *fpga = ((FPGA_io *)opaque)->fpga;
+    //fprintf(stderr, "\r\nHTIF: addr %08x wdata=%08lx\r\n", addr, wdata);
+    // The guest acknowledges a syscall response by clearing fromhost.
+    if (offset == 0 && wdata == 0)
+        fpga->fromhost_pending = 0;
+}
+
+uint64_t FPGA_io::sifive_test_read(void *opaque, uint32_t offset)
+{
+    return 0;
+}
+
+void FPGA_io::sifive_test_write(void *opaque, uint32_t offset, uint64_t wdata)
+{
+    FPGA *fpga = ((FPGA_io *)opaque)->fpga;
+    // Similar to HTIF, but the address is in the device tree so an
+    // unmodified BBL can use it. It gets used for shutdown so we make it
+    // silent.
+    int status = wdata & 0xFFFF;
+    if (offset != 0)
+        return;
+    if (status == 0x3333) {
+        // FAIL
+        int code = (wdata >> 16) & 0xFFFF;
+        fpga->stop_io(code);
+    } else if (status == 0x5555) {
+        // PASS
+        fpga->stop_io(0);
+    } else if (status == 0x7777) {
+        // RESET
+        fpga->stop_io(EXIT_CODE_RESET);
+    } else {
+        fprintf(stderr, "\r\nSiFive Test Finisher: status=%04x\r\n", status);
+    }
+}
+
+void FPGA_io::handle_mmio_write(uint32_t waddr, uint64_t wdata, uint8_t wstrb) {
+    if (trace_recording)
+        trace_record(TRACE_MMIO_WRITE, waddr, wdata, wstrb, NULL, 0);
+    PROBE(mmio_write, waddr, wdata, wstrb);
+    metric_inc(mmio_write_metric);
+    boot_count_mmio();
+    PhysMemoryRange *pr = fpga->virtio_devices.get_phys_mem_range(waddr);
+    if (pr && (pr->devio_flags & DEVIO_SIZE64)) {
+        if (pr->write64_func)
+            pr->write64_func(pr->opaque, waddr - pr->addr, wdata);
+        else if (debug_stray_io)
+            fprintf(stderr, "Stray io! waddr %08x io_wdata wdata=%lx wstrb=%x\r\n", waddr, wdata, wstrb);
+    } else if (pr) {
+        int size_log2 = 2;
+        uint32_t offset = waddr - pr->addr;
+        if (waddr & 4) {
+            wdata = (wdata >> 32) & 0xFFFFFFFF;;
+        }
+        if (debug_virtio) fprintf(stderr, "virtio waddr %08x offset %x wdata %08lx wstrb %x\r\n", waddr, offset, wdata, wstrb);
+        pr->write_func(pr->opaque, offset, wdata, size_log2);
+    } else {
+        if (debug_stray_io) fprintf(stderr, "Stray io! waddr %08x io_wdata wdata=%lx wstrb=%x\r\n", waddr, wdata, wstrb);
+    }
+}
+
+uint64_t FPGA_io::handle_mmio_read(uint32_t araddr) {
+    PhysMemoryRange *pr = fpga->virtio_devices.get_phys_mem_range(araddr);
+    uint64_t val = 0;
+    if (pr && (pr->devio_flags & DEVIO_SIZE64)) {
+        val = pr->read64_func ? pr->read64_func(pr->opaque, araddr - pr->addr) : 0;
+    } else if (pr) {
+        uint32_t offset = araddr - pr->addr;
+        int size_log2 = 2;
+        val = pr->read_func(pr->opaque, offset, size_log2);
+        if ((offset % 8) == 4)
+            val = (val << 32); // Assuming a 64-bit virtualised data width.
+        if (debug_virtio)
+            fprintf(stderr, "virtio araddr %0x device addr %08lx offset %08x val %08lx\r\n",
+                    araddr, pr->addr, offset, val);
+    } else {
+        if (araddr != 0x10001000 && araddr != 0x10001008 && araddr != 0x50001000 && araddr != 0x50001008)
+            if (debug_stray_io) fprintf(stderr, "io_araddr araddr=%08x\r\n", araddr);
+    }
+    if (trace_recording)
+        trace_record(TRACE_MMIO_READ, araddr, val, 0, NULL, 0);
+    PROBE(mmio_read, araddr, val);
+    metric_inc(mmio_read_metric);
+    boot_count_mmio();
+    return val;
 }
 
 void FPGA_io::uart_tohost(uint8_t ch) {
     console_putchar(ch);
-    fprintf(stdout, "uart{%x}\r\n", ch); fflush(stdout);
+    debugLog("uart{%x}\r\n", ch);
 }
 
 void FPGA_io::console_putchar(uint64_t wdata) {
-    fputc(wdata, stdout);
-    fflush(stdout);
+    fpga->console_output.putchar(CONSOLE_OUTPUT_HTIF, wdata);
+}
+
+#ifdef SIMULATION
+// Transport for RTL simulation: MMIO requests, IRQ levels and out-of-window
+// DMA are messages on the CosimShared rings, and the guest DRAM window is
+// mapped directly so DMA to it is a memcpy.
+class CosimIO : public FPGA_io {
+    CosimShared *shared;
+    size_t shared_size;
+    int shared_fd; // kept open for the vhost-user backends
+    uint8_t *dram;
+
+    // to_host has a single consumer; requests and DMA responses are sorted
+    // out here so any thread may poll it.
+    std::mutex rx_mutex;
+    std::deque<CosimMessage> mmio_requests;
+    std::map<uint16_t, uint64_t> dma_responses;
+
+    std::mutex tx_mutex;
+    uint32_t tx_head;
+    uint16_t next_dma_id;
+
+    void poll_rx();
+    void send(const CosimMessage &m, bool publish);
+    uint64_t dma_transaction(uint16_t type, uint64_t addr, uint8_t size, uint64_t data);
+
+public:
+    CosimIO(FPGA *fpga);
+    virtual ~CosimIO();
+    bool emulated_mmio_has_request() override;
+    void emulated_mmio_respond() override;
+    uint8_t *get_dram_ptr(uint64_t addr, size_t size) override;
+    uint8_t *get_dram() { return dram; }
+    uint64_t get_dram_base() { return shared->dram_base; }
+    uint64_t get_dram_size() { return shared->dram_size; }
+    int get_dram_fd() { return shared_fd; }
+    uint64_t get_dram_fd_offset() { return shared->dram_offset; }
+    uint8_t dma_read8(uint64_t raddr) override;
+    uint32_t dma_read32(uint64_t raddr) override;
+    void dma_write8(uint64_t waddr, uint8_t wdata) override;
+    void dma_write32(uint64_t waddr, uint32_t wdata) override;
+    void irq_set_levels(uint32_t w1s) override;
+    void irq_clear_levels(uint32_t w1c) override;
+};
+
+CosimIO::CosimIO(FPGA *fpga)
+    : FPGA_io(fpga), tx_head(0), next_dma_id(0)
+{
+    const char *name = getenv("RISCV_COSIM_SHM");
+    const char *base = getenv("RISCV_COSIM_DRAM_BASE");
+    const char *size = getenv("RISCV_COSIM_DRAM_SIZE");
+    uint64_t dram_base = base ? strtoull(base, 0, 0) : COSIM_DEFAULT_DRAM_BASE;
+    uint64_t dram_size = size ? strtoull(size, 0, 0) : COSIM_DEFAULT_DRAM_SIZE;
+    size_t header_size = (sizeof(CosimShared) + 4095) & ~4095ul;
+
+    if (!name)
+        name = COSIM_DEFAULT_SHM_NAME;
+    int fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "ERROR: Failed to open cosim shared memory %s: %s\r\n", name, strerror(errno));
+        abort();
+    }
+    shared_size = header_size + dram_size;
+    if (ftruncate(fd, shared_size) < 0) {
+        fprintf(stderr, "ERROR: Failed to size cosim shared memory %s: %s\r\n", name, strerror(errno));
+        abort();
+    }
+    void *p = mmap(0, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    shared_fd = fd;
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Failed to map cosim shared memory %s: %s\r\n", name, strerror(errno));
+        abort();
+    }
+    shared = (CosimShared *)p;
+    memset(shared, 0, sizeof(*shared));
+    shared->magic = COSIM_MAGIC;
+    shared->version = COSIM_VERSION;
+    shared->dram_base = dram_base;
+    shared->dram_size = dram_size;
+    shared->dram_offset = header_size;
+    dram = (uint8_t *)p + header_size;
+    __atomic_store_n(&shared->host_ready, 1, __ATOMIC_RELEASE);
+    fprintf(stderr, "cosim: shared memory %s, DRAM window %08lx size %lx\r\n",
+            name, (long)dram_base, (long)dram_size);
+}
+
+CosimIO::~CosimIO()
+{
+    munmap(shared, shared_size);
+    close(shared_fd);
+}
+
+void CosimIO::poll_rx()
+{
+    CosimMessage m;
+    while (cosim_ring_get(&shared->to_host, &m)) {
+        if (m.type == COSIM_MSG_DMA_RESP)
+            dma_responses[m.id] = m.data;
+        else
+            mmio_requests.push_back(m);
+    }
 }
 
-FPGA::FPGA(int id, const Rom &rom, const char *tun_iface)
+// Messages are published in batches; callers pass publish=false while they
+// know more messages follow immediately.
+void CosimIO::send(const CosimMessage &m, bool publish)
+{
+    std::lock_guard<std::mutex> lock(tx_mutex);
+    while (cosim_ring_put(&shared->to_sim, &tx_head, &m) < 0) {
+        // Ring full: let the simulator catch up.
+        cosim_ring_publish(&shared->to_sim, tx_head);
+        sched_yield();
+    }
+    if (publish)
+        cosim_ring_publish(&shared->to_sim, tx_head);
+}
+
+bool CosimIO::emulated_mmio_has_request()
+{
+    std::lock_guard<std::mutex> lock(rx_mutex);
+    if (mmio_requests.empty())
+        poll_rx();
+    return !mmio_requests.empty();
+}
+
+void CosimIO::emulated_mmio_respond()
+{
+    CosimMessage req;
+    bool more;
+    {
+        std::lock_guard<std::mutex> lock(rx_mutex);
+        if (mmio_requests.empty())
+            return;
+        req = mmio_requests.front();
+        mmio_requests.pop_front();
+        more = !mmio_requests.empty();
+    }
+    if (req.type == COSIM_MSG_MMIO_WRITE) {
+        handle_mmio_write(req.addr, req.data, req.strb);
+    } else if (req.type == COSIM_MSG_MMIO_READ) {
+        CosimMessage resp = {};
+        resp.type = COSIM_MSG_MMIO_RESP;
+        resp.id = req.id;
+        resp.addr = req.addr;
+        resp.data = handle_mmio_read(req.addr);
+        // Hold read responses back while more requests of the batch are queued.
+        send(resp, !more);
+        return;
+    } else {
+        fprintf(stderr, "cosim: unexpected message type %d\r\n", req.type);
+    }
+    if (!more) {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        cosim_ring_publish(&shared->to_sim, tx_head);
+    }
+}
+
+uint8_t *CosimIO::get_dram_ptr(uint64_t addr, size_t size)
+{
+    if (addr < shared->dram_base || addr - shared->dram_base + size > shared->dram_size)
+        return NULL;
+    return dram + (addr - shared->dram_base);
+}
+
+uint64_t CosimIO::dma_transaction(uint16_t type, uint64_t addr, uint8_t size, uint64_t data)
+{
+    CosimMessage m = {};
+    uint16_t id;
+    {
+        std::lock_guard<std::mutex> lock(tx_mutex);
+        id = next_dma_id++;
+    }
+    m.type = type;
+    m.id = id;
+    m.size = size;
+    m.addr = addr;
+    m.data = data;
+    send(m, true);
+    if (type == COSIM_MSG_DMA_WRITE)
+        return 0;
+    for (;;) {
+        {
+            std::lock_guard<std::mutex> lock(rx_mutex);
+            poll_rx();
+            auto it = dma_responses.find(id);
+            if (it != dma_responses.end()) {
+                uint64_t val = it->second;
+                dma_responses.erase(it);
+                return val;
+            }
+        }
+        sched_yield();
+    }
+}
+
+uint8_t CosimIO::dma_read8(uint64_t raddr)
+{
+    uint8_t *p = get_dram_ptr(raddr, 1);
+    if (p)
+        return *p;
+    return dma_transaction(COSIM_MSG_DMA_READ, raddr, 1, 0);
+}
+
+uint32_t CosimIO::dma_read32(uint64_t raddr)
+{
+    uint8_t *p = get_dram_ptr(raddr, 4);
+    uint32_t val;
+    if (p) {
+        memcpy(&val, p, 4);
+        return val;
+    }
+    return dma_transaction(COSIM_MSG_DMA_READ, raddr, 4, 0);
+}
+
+void CosimIO::dma_write8(uint64_t waddr, uint8_t wdata)
+{
+    uint8_t *p = get_dram_ptr(waddr, 1);
+    if (p)
+        *p = wdata;
+    else
+        dma_transaction(COSIM_MSG_DMA_WRITE, waddr, 1, wdata);
+}
+
+void CosimIO::dma_write32(uint64_t waddr, uint32_t wdata)
+{
+    uint8_t *p = get_dram_ptr(waddr, 4);
+    if (p)
+        memcpy(p, &wdata, 4);
+    else
+        dma_transaction(COSIM_MSG_DMA_WRITE, waddr, 4, wdata);
+}
+
+void CosimIO::irq_set_levels(uint32_t w1s)
+{
+    CosimMessage m = {};
+    m.type = COSIM_MSG_IRQ_SET;
+    m.data = w1s;
+    send(m, true);
+}
+
+void CosimIO::irq_clear_levels(uint32_t w1c)
+{
+    CosimMessage m = {};
+    m.type = COSIM_MSG_IRQ_CLEAR;
+    m.data = w1c;
+    send(m, true);
+}
+#endif
+
+// Drives the devices from a trace written with --trace instead of a guest.
+// Guest memory is an anonymous mapping covering the 32-bit physical address
+// space; the data the host read from it while recording is copied in ahead
+// of the MMIO request that follows it, so the device backends see the same
+// descriptors and buffers as in the recorded run.
+class ReplayIO : public FPGA_io {
+    TraceReader *reader;
+    uint8_t *dram;
+    int dram_fd; // a memfd, so that vhost-user backends can map it
+    double speed;
+    bool have_next;
+    bool done;
+    TraceEvent next;
+    uint64_t start_ns;
+
+    uint64_t events;
+    uint64_t mmio_reads;
+    uint64_t mmio_writes;
+    uint64_t read_mismatches;
+    uint64_t dma_read_bytes;
+    uint64_t dma_write_bytes;
+    uint64_t irq_recorded;
+    uint64_t irq_replayed;
+    uint64_t trace_ns;
+
+    static const uint64_t DRAM_SIZE = 1ull << 32;
+
+    static uint64_t now_ns();
+    void read_ahead();
+    void finish();
+
+public:
+    ReplayIO(FPGA *fpga, const char *filename, double speed);
+    virtual ~ReplayIO();
+    bool emulated_mmio_has_request() override;
+    void emulated_mmio_respond() override;
+    uint8_t *get_dram_ptr(uint64_t addr, size_t size) override;
+    uint8_t *get_dram() { return dram; }
+    uint64_t get_dram_size() { return DRAM_SIZE; }
+    int get_dram_fd() { return dram_fd; }
+    uint8_t dma_read8(uint64_t raddr) override { return dram[(uint32_t)raddr]; }
+    uint32_t dma_read32(uint64_t raddr) override;
+    void dma_write8(uint64_t waddr, uint8_t wdata) override { dram[(uint32_t)waddr] = wdata; }
+    void dma_write32(uint64_t waddr, uint32_t wdata) override;
+    void irq_set_levels(uint32_t w1s) override;
+    void irq_clear_levels(uint32_t w1c) override;
+};
+
+ReplayIO::ReplayIO(FPGA *fpga, const char *filename, double speed)
+    : FPGA_io(fpga), speed(speed), have_next(false), done(false), start_ns(0),
+      events(0), mmio_reads(0), mmio_writes(0), read_mismatches(0),
+      dma_read_bytes(0), dma_write_bytes(0), irq_recorded(0), irq_replayed(0),
+      trace_ns(0)
+{
+    reader = trace_reader_open(filename);
+    if (!reader)
+        abort();
+    dram_fd = memfd_create("replay-dram", MFD_CLOEXEC);
+    if (dram_fd < 0 || ftruncate(dram_fd, DRAM_SIZE) < 0) {
+        fprintf(stderr, "ERROR: Failed to create replay guest memory: %s\r\n", strerror(errno));
+        abort();
+    }
+    void *p = mmap(0, DRAM_SIZE, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_NORESERVE, dram_fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "ERROR: Failed to map replay guest memory: %s\r\n", strerror(errno));
+        abort();
+    }
+    dram = (uint8_t *)p;
+    fprintf(stderr, "replay: %s at %s speed\r\n", filename,
+            speed > 0 ? (speed == 1 ? "recorded" : "scaled") : "full");
+}
+
+ReplayIO::~ReplayIO()
+{
+    trace_reader_close(reader);
+    munmap(dram, DRAM_SIZE);
+    close(dram_fd);
+}
+
+uint64_t ReplayIO::now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Consume the trace up to the next MMIO request, applying the guest memory
+// the host read on the way.
+void ReplayIO::read_ahead()
+{
+    int ret;
+
+    have_next = false;
+    while ((ret = trace_reader_next(reader, &next)) > 0) {
+        events++;
+        trace_ns = next.time_ns;
+        switch (next.type) {
+        case TRACE_MMIO_READ:
+        case TRACE_MMIO_WRITE:
+            have_next = true;
+            return;
+        case TRACE_DMA_READ:
+            if (uint8_t *p = get_dram_ptr(next.addr, next.len))
+                memcpy(p, next.data, next.len);
+            dma_read_bytes += next.len;
+            break;
+        case TRACE_DMA_WRITE:
+            // The devices write these again as the requests are replayed.
+            dma_write_bytes += next.len;
+            break;
+        case TRACE_IRQ_SET:
+        case TRACE_IRQ_CLEAR:
+            irq_recorded++;
+            break;
+        }
+    }
+    if (ret < 0)
+        fprintf(stderr, "replay: trace is truncated after %ld events\r\n", (long)events);
+}
+
+void ReplayIO::finish()
+{
+    double wall = (now_ns() - start_ns) / 1e9;
+
+    done = true;
+    fprintf(stderr, "replay: %ld events, %ld MMIO reads (%ld mismatched), %ld MMIO writes\r\n",
+            (long)events, (long)mmio_reads, (long)read_mismatches, (long)mmio_writes);
+    fprintf(stderr, "replay: DMA %ld bytes read, %ld bytes written\r\n",
+            (long)dma_read_bytes, (long)dma_write_bytes);
+    fprintf(stderr, "replay: IRQ changes %ld recorded, %ld replayed\r\n",
+            (long)irq_recorded, (long)__atomic_load_n(&irq_replayed, __ATOMIC_RELAXED));
+    fprintf(stderr, "replay: %.3f s traced, %.3f s replayed\r\n", trace_ns / 1e9, wall);
+    fpga->stop_io(0);
+}
+
+bool ReplayIO::emulated_mmio_has_request()
+{
+    if (done)
+        return false;
+    if (!start_ns) {
+        start_ns = now_ns();
+        read_ahead();
+    }
+    if (!have_next) {
+        finish();
+        return false;
+    }
+    if (speed > 0) {
+        uint64_t due = start_ns + (uint64_t)(next.time_ns / speed);
+        uint64_t now = now_ns();
+        if (due > now)
+            usleep((due - now) / 1000);
+    }
+    return true;
+}
+
+void ReplayIO::emulated_mmio_respond()
+{
+    if (!have_next)
+        return;
+    TraceEvent req = next;
+    read_ahead();
+    if (req.type == TRACE_MMIO_WRITE) {
+        mmio_writes++;
+        handle_mmio_write(req.addr, req.val, req.strb);
+    } else {
+        mmio_reads++;
+        uint64_t val = handle_mmio_read(req.addr);
+        if (val != req.val && read_mismatches++ < 16)
+            fprintf(stderr, "replay: read %08lx returned %016lx, recorded %016lx\r\n",
+                    (long)req.addr, (long)val, (long)req.val);
+    }
+}
+
+uint8_t *ReplayIO::get_dram_ptr(uint64_t addr, size_t size)
+{
+    if (addr >= DRAM_SIZE || size > DRAM_SIZE - addr)
+        return NULL;
+    return dram + addr;
+}
+
+uint32_t ReplayIO::dma_read32(uint64_t raddr)
+{
+    uint32_t val;
+    memcpy(&val, dram + (uint32_t)raddr, 4);
+    return val;
+}
+
+void ReplayIO::dma_write32(uint64_t waddr, uint32_t wdata)
+{
+    memcpy(dram + (uint32_t)waddr, &wdata, 4);
+}
+
+void ReplayIO::irq_set_levels(uint32_t w1s)
+{
+    __atomic_fetch_add(&irq_replayed, 1, __ATOMIC_RELAXED);
+}
+
+void ReplayIO::irq_clear_levels(uint32_t w1c)
+{
+    __atomic_fetch_add(&irq_replayed, 1, __ATOMIC_RELAXED);
+}
+
+FPGA::FPGA(int id, const Rom &rom, const char *net_backend,
+           const char *replay_filename, double replay_speed)
     : io(0), rom(rom), ctrla_seen(0), irq_state(0), sifive_test_addr(0x50000000),
-      htif_enabled(0), uart_enabled(0), virtio_devices(FIRST_VIRTIO_IRQ, tun_iface)
+      htif_enabled(0), uart_enabled(0), htif_syscalls(0), xdma(0), fromhost_pending(0),
+      virtio_devices(FIRST_VIRTIO_IRQ, net_backend), console_output(STDOUT_FILENO)
 {
     sem_init(&sem_misc_response, 0, 0);
-    io = new FPGA_io(id, this);
+    exit_code = 0;
+    stopped = 0;
+    mmio_read_metric = metric_new(METRIC_COUNTER, "mmio_requests_total",
+                                  "MMIO requests from the guest", "op=\"read\"");
+    mmio_write_metric = metric_new(METRIC_COUNTER, "mmio_requests_total",
+                                   "MMIO requests from the guest", "op=\"write\"");
+    mmio_latency_metric = metric_new(METRIC_HISTOGRAM, "mmio_request_duration_seconds",
+                                     "Time to answer an MMIO request, transport included",
+                                     NULL);
+    window_switch_metric = metric_new(METRIC_COUNTER, "dma_window_switches_total",
+                                      "Changes of the fmem DMA address window", NULL);
+    if (replay_filename) {
+        ReplayIO *replay = new ReplayIO(this, replay_filename, replay_speed);
+        io = replay;
+        virtio_devices.set_virtio_dram(replay->get_dram(), 0, replay->get_dram_size(),
+                                       replay->get_dram_fd());
+    } else {
+#ifdef SIMULATION
+        CosimIO *cosim = new CosimIO(this);
+        io = cosim;
+        virtio_devices.set_virtio_dram(cosim->get_dram(), cosim->get_dram_base(), cosim->get_dram_size(),
+                                       cosim->get_dram_fd(), cosim->get_dram_fd_offset());
+#else
+        io = new FPGA_io(id, this);
+#endif
+    }
     virtio_devices.set_virtio_dma_fd(io->get_dma_fd());
-    set_htif_base_addr(0x10001000);
+    tohost_addr = 0x10001000 + TOHOST_OFFSET;
+    fromhost_addr = 0x10001000 + FROMHOST_OFFSET;
+    io->register_host_ranges(virtio_devices.get_mem_map());
 }
 
 FPGA::~FPGA() {
+    close_xdma();
+    delete htif_syscalls;
+}
+
+// Route bulk guest memory transfers over the XDMA H2C/C2H channels.
+bool FPGA::open_xdma()
+{
+    xdma = xdma_open_default();
+    if (!xdma)
+        return false;
+    virtio_devices.set_virtio_xdma(xdma);
+    return true;
+}
+
+void FPGA::close_xdma()
+{
+    virtio_devices.set_virtio_xdma(0);
+    xdma_close(xdma);
+    xdma = 0;
 }
 /* // Assume these are unused for fmem world for now.
 void FPGA::map_pcis_dma()
@@ -332,33 +953,55 @@ void FPGA::close_dma()
 }
 */
 
-void FPGA::dma_read(uint32_t addr, uint8_t *data, size_t size) {
-    printf("DMA read? addr %08x size %ld",
-                    addr, size);
-    int i=0;
-    if (addr&3 == 0) {
-        for (; i<size; i+=4) {
-            ((uint32_t *)(data+i))[0] = io->dma_read32(addr+i);
+// Bulk transfers: single bytes up to a word boundary, then whole 32-bit
+// words, then the tail.
+void FPGA::dma_read(uint64_t addr, uint8_t *data, size_t size) {
+    debugLog("DMA read addr %08lx size %ld\r\n", addr, size);
+    boot_count_dma(size);
+    if (uint8_t *p = io->get_dram_ptr(addr, size)) {
+        memcpy(data, p, size);
+    } else if (xdma && size >= XDMA_MIN_TRANSFER) {
+        if (xdma_read(xdma, addr - FMEM_HOST_CACHED_MEM_BASE, data, size) < 0)
+            abort();
+    } else {
+        size_t i = 0;
+        for (; i < size && ((addr + i) & 3); i++)
+            data[i] = io->dma_read8(addr + i);
+        for (; i + 4 <= size; i += 4) {
+            uint32_t word = io->dma_read32(addr + i);
+            memcpy(data + i, &word, 4);
         }
-        i -= 4; // undo add that pushed us over so the byte loop
-                // can clean up
+        for (; i < size; i++)
+            data[i] = io->dma_read8(addr + i);
     }
-    for (int i=0; i<size; i++) data[i] = io->dma_read8(addr+i);
-    printf(" data[0]: %c\r\n", data[0]);
+    if (trace_recording)
+        trace_record(TRACE_DMA_READ, addr, 0, 0, data, size);
 }
 
-void FPGA::dma_write(uint32_t addr, uint8_t *data, size_t size) {
-    printf("DMA write? addr %08x size %ld data[0]: %c\r\n",
-                    addr, size, data[0]);
-    int i=0;
-    if (addr&3 == 0) {
-        for (; i<size; i+=4) {
-            io->dma_write32(addr+i, ((uint32_t *)(data+i))[0]);
-        }
-        i -= 4; // undo add that pushed us over so the byte loop
-                // can clean up
+void FPGA::dma_write(uint64_t addr, const uint8_t *data, size_t size) {
+    debugLog("DMA write addr %08lx size %ld\r\n", addr, size);
+    boot_count_dma(size);
+    if (trace_recording)
+        trace_record(TRACE_DMA_WRITE, addr, 0, 0, data, size);
+    if (uint8_t *p = io->get_dram_ptr(addr, size)) {
+        memcpy(p, data, size);
+        return;
+    }
+    if (xdma && size >= XDMA_MIN_TRANSFER) {
+        if (xdma_write(xdma, addr - FMEM_HOST_CACHED_MEM_BASE, data, size) < 0)
+            abort();
+        return;
     }
-    for (int i=0; i<size; i++) io->dma_write8(addr+i, data[i]);
+    size_t i = 0;
+    for (; i < size && ((addr + i) & 3); i++)
+        io->dma_write8(addr + i, data[i]);
+    for (; i + 4 <= size; i += 4) {
+        uint32_t word;
+        memcpy(&word, data + i, 4);
+        io->dma_write32(addr + i, word);
+    }
+    for (; i < size; i++)
+        io->dma_write8(addr + i, data[i]);
 }
 
 /* XXX Implement IRQs somehow.  Just stubbed out for now. */
@@ -366,7 +1009,9 @@ void FPGA::dma_write(uint32_t addr, uint8_t *data, size_t size) {
 void FPGA::irq_set_levels(uint32_t w1s)
 {
     std::lock_guard<std::mutex> lock(misc_request_mutex);
-    fmem_write32(io->get_irq_fd(), 0, w1s);
+    if (trace_recording)
+        trace_record(TRACE_IRQ_SET, 0, w1s, 0, NULL, 0);
+    io->irq_set_levels(w1s);
     irq_state |= w1s;
     //request->irq_set_levels(w1s);
 }
@@ -374,7 +1019,9 @@ void FPGA::irq_set_levels(uint32_t w1s)
 void FPGA::irq_clear_levels(uint32_t w1c)
 {
     std::lock_guard<std::mutex> lock(misc_request_mutex);
-    fmem_write32(io->get_irq_fd(), 4, w1c);
+    if (trace_recording)
+        trace_record(TRACE_IRQ_CLEAR, 0, w1c, 0, NULL, 0);
+    io->irq_clear_levels(w1c);
     irq_state &= ~w1c;
     //request->irq_clear_levels(w1c);
 }
@@ -529,18 +1176,24 @@ void FPGA::start_io()
     fcntl(stop_stdin_pipe[1], F_SETFL, O_NONBLOCK);
     pthread_create(&stdin_thread, NULL, &process_stdin_thread, this);
     pthread_setname_np(stdin_thread, "Console input");
+    thread_topology_apply(THREAD_ROLE_CONSOLE_INPUT, stdin_thread);
 
     if (virtio_devices.has_virtio_console_device()) {
         pipe(virtio_stdio_pipe);
         virtio_devices.set_virtio_stdin_fd(virtio_stdio_pipe[0]);
     }
 
+    console_output.start();
     virtio_devices.start();
 }
 
 void FPGA::stop_io(int code)
 {
+    // The guest and the end of a replay may both ask to stop.
+    if (__atomic_exchange_n(&stopped, 1, __ATOMIC_ACQ_REL))
+        return;
     exit_code = code;
+    boot_milestone("guest stop (code %d)", code);
 
     char dummy = 'X';
     ::write(stop_stdin_pipe[1], &dummy, sizeof(dummy));
@@ -554,6 +1207,7 @@ int FPGA::join_io()
     pthread_join(stdin_thread, NULL);
 
     virtio_devices.join();
+    console_output.stop();
 
     return exit_code;
 }
@@ -570,18 +1224,20 @@ void FPGA::reset_termios()
 
 void FPGA::set_htif_base_addr(uint64_t baseaddr)
 {
-    tohost_addr = baseaddr + TOHOST_OFFSET;
-    fromhost_addr = baseaddr + FROMHOST_OFFSET;
+    set_tohost_addr(baseaddr + TOHOST_OFFSET);
+    set_fromhost_addr(baseaddr + FROMHOST_OFFSET);
 }
 
 void FPGA::set_tohost_addr(uint64_t addr)
 {
     tohost_addr = addr;
+    phys_mem_set_addr(tohost_range, addr, TRUE);
 }
 
 void FPGA::set_fromhost_addr(uint64_t addr)
 {
     fromhost_addr = addr;
+    phys_mem_set_addr(fromhost_range, addr, TRUE);
 }
 
 void FPGA::set_htif_enabled(bool enabled)
@@ -594,6 +1250,16 @@ void FPGA::set_uart_enabled(bool enabled)
     uart_enabled = enabled;
 }
 
+void FPGA::set_htif_syscalls_enabled(bool enabled)
+{
+    if (enabled && !htif_syscalls) {
+        htif_syscalls = new HTIFSyscallProxy(this);
+    } else if (!enabled && htif_syscalls) {
+        delete htif_syscalls;
+        htif_syscalls = 0;
+    }
+}
+
 bool FPGA::emulated_mmio_has_request()
 {
     return(io->emulated_mmio_has_request());
@@ -601,5 +1267,12 @@ bool FPGA::emulated_mmio_has_request()
 
 void FPGA::emulated_mmio_respond()
 {
+    uint64_t start_ns = metric_time_ns();
+    uint64_t latency_ns;
+
+    PROBE(mmio_request_start);
     io->emulated_mmio_respond();
+    latency_ns = metric_time_ns() - start_ns;
+    metric_observe(mmio_latency_metric, latency_ns);
+    PROBE(mmio_request_done, latency_ns);
 }
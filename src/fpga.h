@@ -7,6 +7,7 @@
 #include <pthread.h>
 #include <termios.h>
 
+#include "consoleoutput.h"
 #include "virtiodevices.h"
 
 // The SiFive test finisher provides 16 bits for an exit code, unsigned, so we
@@ -49,6 +50,7 @@ struct virtual_device_request {
 
 class DmaManager;
 class FPGA_io;
+class HTIFSyscallProxy;
 
 class FPGA {
     sem_t sem_misc_response;
@@ -64,9 +66,17 @@ class FPGA {
     uint64_t tohost_addr;
     uint64_t fromhost_addr;
     uint64_t sifive_test_addr;
+    PhysMemoryRange *rom_range;
+    PhysMemoryRange *tohost_range;
+    PhysMemoryRange *fromhost_range;
+    PhysMemoryRange *sifive_test_range;
     uint64_t htif_enabled;
     uint64_t uart_enabled;
+    HTIFSyscallProxy *htif_syscalls;
+    XDMATransport *xdma;
+    uint64_t fromhost_pending;
     int exit_code;
+    int stopped;
 
     std::mutex misc_request_mutex;
     std::mutex stdin_mutex;
@@ -77,10 +87,14 @@ class FPGA {
     static struct termios orig_stdin_termios;
     static struct termios orig_stdout_termios;
     static bool done_termios;
+    ConsoleOutput console_output;
 
     friend class FPGA_io;
 public:
-    FPGA(int id, const Rom &rom, const char *tun_iface);
+    // With a replay_filename, the MMIO requests come from a trace written
+    // with trace_open() instead of the guest; see ReplayIO.
+    FPGA(int id, const Rom &rom, const char *net_backend,
+         const char *replay_filename = 0, double replay_speed = 1.0);
     virtual ~FPGA();
 
     void wait_misc_response();
@@ -89,8 +103,10 @@ public:
     //void unmap_pcis_dma();
     void open_dma();
     void close_dma();
-    void dma_read(uint32_t addr, uint8_t * data, size_t num_bytes);
-    void dma_write(uint32_t addr, uint8_t *data, size_t num_bytes);
+    bool open_xdma();
+    void close_xdma();
+    void dma_read(uint64_t addr, uint8_t * data, size_t num_bytes);
+    void dma_write(uint64_t addr, const uint8_t *data, size_t num_bytes);
 
     void irq_set_levels(uint32_t w1s);
     void irq_clear_levels(uint32_t w1c);
@@ -100,15 +116,18 @@ public:
     int dequeue_stdin(uint8_t *chp);
 
     VirtioDevices &get_virtio_devices() { return virtio_devices; }
+    ConsoleOutput &get_console_output() { return console_output; }
     void start_io();
     void stop_io(int code);
     int join_io();
+    bool io_stopped() { return __atomic_load_n(&stopped, __ATOMIC_ACQUIRE); }
 
     void set_htif_base_addr(uint64_t baseaddr);
     void set_tohost_addr(uint64_t addr);
     void set_fromhost_addr(uint64_t addr);
     void set_htif_enabled(bool enabled);
     void set_uart_enabled(bool enabled);
+    void set_htif_syscalls_enabled(bool enabled);
     
     bool emulated_mmio_has_request();
     void emulated_mmio_respond();
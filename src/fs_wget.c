@@ -35,6 +35,7 @@
 #include "fs.h"
 #include "fs_utils.h"
 #include "fs_wget.h"
+#include "probes.h"
 
 #if defined(EMSCRIPTEN)
 #include <emscripten.h>
@@ -141,6 +142,8 @@ struct XHRState {
 
     BOOL single_write;
     DynBuf dbuf; /* used if single_write */
+    uint64_t size; /* bytes received so far */
+    uint64_t start_ns;
 };
 
 typedef struct {
@@ -174,6 +177,7 @@ static size_t fs_wget_write_cb(char *ptr, size_t size, size_t nmemb,
     XHRState *s = userdata;
     size *= nmemb;
 
+    s->size += size;
     if (s->single_write) {
         dbuf_write(&s->dbuf, s->dbuf.size, (void *)ptr, size);
     } else {
@@ -227,6 +231,10 @@ XHRState *fs_wget2(const char *url, const char *user, const char *password,
     }
     curl_multi_add_handle(curl_multi_ctx, s->eh);
     list_add_tail(&s->link, &xhr_list);
+    /* 0 if the request was not traced from its start */
+    if (PROBE_ENABLED(fs_wget_done))
+        s->start_ns = probe_time_ns();
+    PROBE(fs_wget_start, s, url, post_data_len);
     return s;
 }
 
@@ -262,6 +270,8 @@ void fs_net_set_fdset(int *pfd_max, fd_set *rfds, fd_set *wfds, fd_set *efds,
             curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char **)&s);
             curl_easy_getinfo(msg->easy_handle, CURLINFO_RESPONSE_CODE,
                               &http_code);
+            PROBE(fs_wget_done, s, http_code, s->size,
+                  s->start_ns ? probe_time_ns() - s->start_ns : 0);
             /* signal the end of the transfer or error */
             if (http_code == 200) {
                 if (s->single_write) {
@@ -0,0 +1,263 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <algorithm>
+
+extern "C" {
+#include "cutils.h"
+#include "topology.h"
+}
+
+#include "fpga.h"
+#include "htif.h"
+#include "util.h"
+
+#define HTIF_PATH_MAX 4096
+
+// struct stat as laid out by riscv-pk/newlib (see fesvr's riscv_stat)
+#define RISCV_STAT_SIZE 128
+
+HTIFSyscallProxy::HTIFSyscallProxy(FPGA *fpga)
+    : fpga(fpga)
+{
+    buf = (uint8_t *)thread_topology_alloc(HTIF_SYSCALL_BUF_SIZE);
+    // The guest's stdin/stdout/stderr map onto the console.
+    fds.push_back(STDIN_FILENO);
+    fds.push_back(STDOUT_FILENO);
+    fds.push_back(STDERR_FILENO);
+}
+
+HTIFSyscallProxy::~HTIFSyscallProxy()
+{
+    for (size_t i = 3; i < fds.size(); i++) {
+        if (fds[i] >= 0)
+            close(fds[i]);
+    }
+    thread_topology_free(buf, HTIF_SYSCALL_BUF_SIZE);
+}
+
+int HTIFSyscallProxy::lookup_fd(uint64_t guest_fd)
+{
+    if (guest_fd >= fds.size())
+        return -1;
+    return fds[guest_fd];
+}
+
+int HTIFSyscallProxy::alloc_fd(int host_fd)
+{
+    for (size_t i = 0; i < fds.size(); i++) {
+        if (fds[i] < 0) {
+            fds[i] = host_fd;
+            return i;
+        }
+    }
+    fds.push_back(host_fd);
+    return fds.size() - 1;
+}
+
+int64_t HTIFSyscallProxy::copy_path(uint64_t paddr, uint64_t len, char *path, size_t path_size)
+{
+    if (len == 0 || len > path_size)
+        return -ENAMETOOLONG;
+    fpga->dma_read(paddr, (uint8_t *)path, len);
+    path[len - 1] = '\0';
+    return 0;
+}
+
+// offset < 0 means use and advance the file position.
+int64_t HTIFSyscallProxy::sys_read(uint64_t guest_fd, uint64_t paddr, uint64_t len, int64_t offset)
+{
+    int fd = lookup_fd(guest_fd);
+    if (fd < 0)
+        return -EBADF;
+
+    if (fd == STDIN_FILENO) {
+        // Never block the MMIO thread on the terminal: return what is queued.
+        size_t n = 0;
+        len = std::min<uint64_t>(len, HTIF_SYSCALL_BUF_SIZE);
+        while (n < len && fpga->dequeue_stdin(&buf[n]))
+            n++;
+        if (n)
+            fpga->dma_write(paddr, buf, n);
+        return n;
+    }
+
+    int64_t total = 0;
+    while (len > 0) {
+        size_t chunk = std::min<uint64_t>(len, HTIF_SYSCALL_BUF_SIZE);
+        ssize_t ret;
+        if (offset < 0)
+            ret = read(fd, buf, chunk);
+        else
+            ret = pread(fd, buf, chunk, offset + total);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return total ? total : -errno;
+        }
+        if (ret == 0)
+            break;
+        fpga->dma_write(paddr + total, buf, ret);
+        total += ret;
+        len -= ret;
+        if ((size_t)ret < chunk)
+            break;
+    }
+    return total;
+}
+
+int64_t HTIFSyscallProxy::sys_write(uint64_t guest_fd, uint64_t paddr, uint64_t len, int64_t offset)
+{
+    int fd = lookup_fd(guest_fd);
+    if (fd < 0)
+        return -EBADF;
+
+    int64_t total = 0;
+    while (len > 0) {
+        size_t chunk = std::min<uint64_t>(len, HTIF_SYSCALL_BUF_SIZE);
+        fpga->dma_read(paddr + total, buf, chunk);
+        if (fd == STDOUT_FILENO || fd == STDERR_FILENO) {
+            fpga->get_console_output().write(CONSOLE_OUTPUT_HTIF, buf, chunk);
+            total += chunk;
+            len -= chunk;
+            continue;
+        }
+        size_t done = 0;
+        while (done < chunk) {
+            ssize_t ret;
+            if (offset < 0)
+                ret = write(fd, buf + done, chunk - done);
+            else
+                ret = pwrite(fd, buf + done, chunk - done, offset + total + done);
+            if (ret < 0) {
+                if (errno == EINTR)
+                    continue;
+                total += done;
+                return total ? total : -errno;
+            }
+            done += ret;
+        }
+        total += chunk;
+        len -= chunk;
+    }
+    return total;
+}
+
+int64_t HTIFSyscallProxy::sys_openat(int dirfd, uint64_t pname, uint64_t len, uint64_t flags, uint64_t mode)
+{
+    char path[HTIF_PATH_MAX];
+    int64_t ret = copy_path(pname, len, path, sizeof(path));
+    if (ret < 0)
+        return ret;
+    int fd = openat(dirfd, path, (int)flags | O_CLOEXEC, (mode_t)mode);
+    debugLog("HTIF: open %s flags %lx -> %d\r\n", path, (long)flags, fd);
+    if (fd < 0)
+        return -errno;
+    return alloc_fd(fd);
+}
+
+int64_t HTIFSyscallProxy::sys_close(uint64_t guest_fd)
+{
+    int fd = lookup_fd(guest_fd);
+    if (fd < 0)
+        return -EBADF;
+    // Keep the console descriptors open on the host.
+    if (guest_fd > STDERR_FILENO)
+        close(fd);
+    fds[guest_fd] = -1;
+    return 0;
+}
+
+int64_t HTIFSyscallProxy::sys_lseek(uint64_t guest_fd, uint64_t offset, uint64_t whence)
+{
+    int fd = lookup_fd(guest_fd);
+    if (fd < 0)
+        return -EBADF;
+    off_t ret = lseek(fd, (off_t)offset, (int)whence);
+    return ret < 0 ? -errno : ret;
+}
+
+int64_t HTIFSyscallProxy::sys_fstat(uint64_t guest_fd, uint64_t paddr)
+{
+    int fd = lookup_fd(guest_fd);
+    struct stat st;
+    uint8_t rst[RISCV_STAT_SIZE];
+
+    if (fd < 0)
+        return -EBADF;
+    if (fstat(fd, &st) < 0)
+        return -errno;
+
+    memset(rst, 0, sizeof(rst));
+    put_le64(rst + 0, st.st_dev);
+    put_le64(rst + 8, st.st_ino);
+    put_le32(rst + 16, st.st_mode);
+    put_le32(rst + 20, st.st_nlink);
+    put_le32(rst + 24, st.st_uid);
+    put_le32(rst + 28, st.st_gid);
+    put_le64(rst + 32, st.st_rdev);
+    put_le64(rst + 48, st.st_size);
+    put_le32(rst + 56, st.st_blksize);
+    put_le64(rst + 64, st.st_blocks);
+    put_le64(rst + 72, st.st_atime);
+    put_le64(rst + 88, st.st_mtime);
+    put_le64(rst + 104, st.st_ctime);
+    fpga->dma_write(paddr, rst, sizeof(rst));
+    return 0;
+}
+
+void HTIFSyscallProxy::execute(uint64_t magic_mem)
+{
+    uint8_t args[8 * 8];
+    uint64_t a[8];
+    int64_t ret;
+
+    fpga->dma_read(magic_mem, args, sizeof(args));
+    for (int i = 0; i < 8; i++)
+        a[i] = get_le64(args + 8 * i);
+
+    switch (a[0]) {
+    case HTIF_SYS_exit:
+        fprintf(stderr, "%s\r\n", a[1] ? "FAIL" : "PASS");
+        fpga->stop_io(a[1]);
+        return;
+    case HTIF_SYS_read:
+        ret = sys_read(a[1], a[2], a[3], -1);
+        break;
+    case HTIF_SYS_write:
+        ret = sys_write(a[1], a[2], a[3], -1);
+        break;
+    case HTIF_SYS_pread:
+        ret = sys_read(a[1], a[2], a[3], (int64_t)a[4]);
+        break;
+    case HTIF_SYS_pwrite:
+        ret = sys_write(a[1], a[2], a[3], (int64_t)a[4]);
+        break;
+    case HTIF_SYS_openat:
+        ret = sys_openat((int)a[1] == -100 ? AT_FDCWD : lookup_fd(a[1]), a[2], a[3], a[4], a[5]);
+        break;
+    case HTIF_SYS_open:
+        ret = sys_openat(AT_FDCWD, a[1], a[2], a[3], a[4]);
+        break;
+    case HTIF_SYS_close:
+        ret = sys_close(a[1]);
+        break;
+    case HTIF_SYS_lseek:
+        ret = sys_lseek(a[1], a[2], a[3]);
+        break;
+    case HTIF_SYS_fstat:
+        ret = sys_fstat(a[1], a[2]);
+        break;
+    default:
+        fprintf(stderr, "HTIF: unsupported syscall %ld\r\n", (long)a[0]);
+        ret = -ENOSYS;
+        break;
+    }
+
+    put_le64(args, ret);
+    fpga->dma_write(magic_mem, args, 8);
+}
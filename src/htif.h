@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+class FPGA;
+
+// riscv-fesvr frontend syscalls, as issued by riscv-pk and newlib's
+// libgloss-htif through tohost (dev=0, cmd=0, payload=address of an
+// eight-word argument block).
+#define HTIF_SYS_openat 56
+#define HTIF_SYS_close  57
+#define HTIF_SYS_lseek  62
+#define HTIF_SYS_read   63
+#define HTIF_SYS_write  64
+#define HTIF_SYS_pread  67
+#define HTIF_SYS_pwrite 68
+#define HTIF_SYS_fstat  80
+#define HTIF_SYS_exit   93
+#define HTIF_SYS_open   1024
+
+#define HTIF_SYSCALL_BUF_SIZE (1024 * 1024)
+
+// Proxies guest syscalls onto host files. Argument blocks and data buffers
+// are moved with FPGA::dma_read/dma_write in chunks of up to
+// HTIF_SYSCALL_BUF_SIZE rather than a character at a time.
+class HTIFSyscallProxy {
+    FPGA *fpga;
+    std::vector<int> fds; // guest fd -> host fd, -1 if closed
+    uint8_t *buf;
+
+    int lookup_fd(uint64_t guest_fd);
+    int alloc_fd(int host_fd);
+    int64_t copy_path(uint64_t paddr, uint64_t len, char *path, size_t path_size);
+    int64_t sys_read(uint64_t guest_fd, uint64_t paddr, uint64_t len, int64_t offset);
+    int64_t sys_write(uint64_t guest_fd, uint64_t paddr, uint64_t len, int64_t offset);
+    int64_t sys_openat(int dirfd, uint64_t pname, uint64_t len, uint64_t flags, uint64_t mode);
+    int64_t sys_close(uint64_t guest_fd);
+    int64_t sys_lseek(uint64_t guest_fd, uint64_t offset, uint64_t whence);
+    int64_t sys_fstat(uint64_t guest_fd, uint64_t paddr);
+
+public:
+    HTIFSyscallProxy(FPGA *fpga);
+    ~HTIFSyscallProxy();
+
+    // Run the syscall described by the argument block at magic_mem and write
+    // the result back into its first word.
+    void execute(uint64_t magic_mem);
+};
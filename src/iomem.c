@@ -63,18 +63,71 @@ void phys_mem_map_end(PhysMemoryMap *s)
     free(s);
 }
 
-/* return NULL if not found */
-/* XXX: optimize */
-PhysMemoryRange *get_phys_mem_range(PhysMemoryMap *s, uint64_t paddr)
+/* rebuild the sorted decode table after the set of ranges changed */
+static void phys_mem_map_update(PhysMemoryMap *s)
 {
-    PhysMemoryRange *pr;
-    int i;
+    PhysMemoryRange *pr, **tab;
+    int i, j, n, idx;
+
+    idx = s->decode_index ^ 1;
+    tab = s->decode_tab[idx];
+    n = 0;
     for(i = 0; i < s->n_phys_mem_range; i++) {
         pr = &s->phys_mem_range[i];
-        if (paddr >= pr->addr && paddr < pr->addr + pr->size)
-            return pr;
+        if (pr->size == 0)
+            continue;
+        /* insertion sort, at most PHYS_MEM_RANGE_MAX entries */
+        for(j = n; j > 0 && tab[j - 1]->addr > pr->addr; j--)
+            tab[j] = tab[j - 1];
+        tab[j] = pr;
+        n++;
+    }
+    s->decode_count[idx] = n;
+    __atomic_store_n(&s->decode_index, idx, __ATOMIC_RELEASE);
+    __atomic_add_fetch(&s->decode_generation, 1, __ATOMIC_RELEASE);
+}
+
+/* last range found by this thread */
+static __thread struct {
+    PhysMemoryMap *map;
+    uint32_t generation;
+    PhysMemoryRange *pr;
+} decode_cache;
+
+/* return NULL if not found */
+PhysMemoryRange *get_phys_mem_range(PhysMemoryMap *s, uint64_t paddr)
+{
+    PhysMemoryRange *pr, **tab;
+    uint32_t generation;
+    int idx, lo, hi, mid;
+
+    generation = __atomic_load_n(&s->decode_generation, __ATOMIC_ACQUIRE);
+    pr = decode_cache.pr;
+    if (decode_cache.map == s && decode_cache.generation == generation &&
+        paddr >= pr->addr && paddr < pr->addr + pr->size)
+        return pr;
+
+    idx = __atomic_load_n(&s->decode_index, __ATOMIC_ACQUIRE);
+    tab = s->decode_tab[idx];
+    /* find the last range starting at or below paddr */
+    lo = 0;
+    hi = s->decode_count[idx];
+    while (lo < hi) {
+        mid = (lo + hi) >> 1;
+        if (tab[mid]->addr <= paddr)
+            lo = mid + 1;
+        else
+            hi = mid;
     }
-    return NULL;
+    if (lo == 0)
+        return NULL;
+    pr = tab[lo - 1];
+    if (paddr >= pr->addr + pr->size)
+        return NULL;
+    decode_cache.map = s;
+    decode_cache.generation = generation;
+    decode_cache.pr = pr;
+    return pr;
 }
 
 PhysMemoryRange *register_ram_entry(PhysMemoryMap *s, uint64_t addr,
@@ -96,6 +149,7 @@ PhysMemoryRange *register_ram_entry(PhysMemoryMap *s, uint64_t addr,
         pr->size = pr->org_size;
     pr->phys_mem = NULL;
     pr->dirty_bits = NULL;
+    phys_mem_map_update(s);
     return pr;
 }
 
@@ -202,6 +256,22 @@ PhysMemoryRange *cpu_register_device(PhysMemoryMap *s, uint64_t addr,
     pr->read_func = read_func;
     pr->write_func = write_func;
     pr->devio_flags = devio_flags;
+    phys_mem_map_update(s);
+    return pr;
+}
+
+/* device with 64 bit accesses; read_func and write_func may be NULL */
+PhysMemoryRange *cpu_register_device64(PhysMemoryMap *s, uint64_t addr,
+                                       uint64_t size, void *opaque,
+                                       DeviceRead64Func *read_func,
+                                       DeviceWrite64Func *write_func,
+                                       int devio_flags)
+{
+    PhysMemoryRange *pr;
+    pr = cpu_register_device(s, addr, size, opaque, NULL, NULL,
+                             devio_flags | DEVIO_SIZE64);
+    pr->read64_func = read_func;
+    pr->write64_func = write_func;
     return pr;
 }
 
@@ -237,8 +307,9 @@ void phys_mem_set_addr(PhysMemoryRange *pr, uint64_t addr, BOOL enabled)
     if (!pr->is_ram) {
         default_set_addr(map, pr, addr, enabled);
     } else {
-        return map->set_ram_addr(map, pr, addr, enabled);
+        map->set_ram_addr(map, pr, addr, enabled);
     }
+    phys_mem_map_update(map);
 }
 
 /* return NULL if no valid RAM page. The access can only be done in the page */
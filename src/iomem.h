@@ -29,12 +29,14 @@
 typedef void DeviceWriteFunc(void *opaque, uint32_t offset,
                              uint32_t val, int size_log2);
 typedef uint32_t DeviceReadFunc(void *opaque, uint32_t offset, int size_log2);
+typedef void DeviceWrite64Func(void *opaque, uint32_t offset, uint64_t val);
+typedef uint64_t DeviceRead64Func(void *opaque, uint32_t offset);
 
 #define DEVIO_SIZE8  (1 << 0)
 #define DEVIO_SIZE16 (1 << 1)
 #define DEVIO_SIZE32 (1 << 2)
-/* not supported, could add specific 64 bit callbacks when needed */
-//#define DEVIO_SIZE64 (1 << 3) 
+/* uses read64_func/write64_func, see cpu_register_device64() */
+#define DEVIO_SIZE64 (1 << 3)
 #define DEVIO_DISABLED (1 << 4)
 
 #define DEVRAM_FLAG_ROM        (1 << 0) /* not writable */
@@ -62,6 +64,8 @@ typedef struct {
     void *opaque;
     DeviceReadFunc *read_func;
     DeviceWriteFunc *write_func;
+    DeviceRead64Func *read64_func;
+    DeviceWrite64Func *write64_func;
     int devio_flags;
 } PhysMemoryRange;
 
@@ -70,6 +74,13 @@ typedef struct {
 struct PhysMemoryMap {
     int n_phys_mem_range;
     PhysMemoryRange phys_mem_range[PHYS_MEM_RANGE_MAX];
+    /* enabled ranges sorted by address, rebuilt whenever a range is
+       registered or moved. There are two copies so that a rebuild does
+       not disturb a lookup running on another thread. */
+    PhysMemoryRange *decode_tab[2][PHYS_MEM_RANGE_MAX];
+    int decode_count[2];
+    int decode_index;
+    uint32_t decode_generation;
     PhysMemoryRange *(*register_ram)(PhysMemoryMap *s, uint64_t addr,
                                      uint64_t size, int devram_flags);
     void (*free_ram)(PhysMemoryMap *s, PhysMemoryRange *pr);
@@ -95,6 +106,11 @@ PhysMemoryRange *cpu_register_device(PhysMemoryMap *s, uint64_t addr,
                                      uint64_t size, void *opaque,
                                      DeviceReadFunc *read_func, DeviceWriteFunc *write_func,
                                      int devio_flags);
+PhysMemoryRange *cpu_register_device64(PhysMemoryMap *s, uint64_t addr,
+                                       uint64_t size, void *opaque,
+                                       DeviceRead64Func *read_func,
+                                       DeviceWrite64Func *write_func,
+                                       int devio_flags);
 PhysMemoryRange *get_phys_mem_range(PhysMemoryMap *s, uint64_t paddr);
 void phys_mem_set_addr(PhysMemoryRange *pr, uint64_t addr, BOOL enabled);
 
@@ -2,6 +2,7 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
+#include <signal.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -10,16 +11,20 @@
 #include <sys/stat.h>
 #include <vector>
 
+extern "C" {
+#include "boottime.h"
+#include "metrics.h"
+#include "netcap.h"
+#include "topology.h"
+#include "trace.h"
+}
+
 #include "fpga.h"
 #include "loadelf.h"
 #include "util.h"
 
 #define DEFAULT_DMA_ENABLED 0
-#ifdef SIMULATION
 #define DEFAULT_XDMA_ENABLED 0
-#else
-#define DEFAULT_XDMA_ENABLED 0 // XXX make DMA work.
-#endif
 
 #define DEBUG_LOOP 0
 
@@ -30,16 +35,32 @@
 
 const struct option long_options[] = {
     { "block", required_argument, 0, 'B' },
+    { "boot-timeline", no_argument, 0, 'b' },
+    { "console-log", required_argument, 0, 'l' },
     { "dma",     optional_argument, 0, 'D' },
     { "dtb",     optional_argument, 0, 'd' },
     { "elf",     optional_argument, 0, 'e' },
     { "help",    no_argument, 0, 'h' },
+    { "hugepages", no_argument, 0, 'G' },
+    { "metrics",  required_argument, 0, 'm' },
     { "htif-console",  optional_argument, 0, 'H' },
+    { "htif-syscalls", no_argument, 0, 'S' },
+    { "net",      required_argument, 0, 'n' },
+    { "numa",     required_argument, 0, 'N' },
+    { "pcap",     required_argument, 0, 'w' },
+    { "replay",   required_argument, 0, 'R' },
+    { "replay-speed", required_argument, 0, 'Y' },
+    { "thread",   required_argument, 0, 'T' },
+    { "trace",    required_argument, 0, 'r' },
     { "tun",      required_argument,       0, 't' },
     { "uart",          optional_argument, 0, 'U' },
     { "uart-console",  optional_argument, 0, 'U' },
     { "usemem",  no_argument,       0, 'M' },
+    { "vhost-user", required_argument, 0, 'u' },
     { "virtio-console", optional_argument, 0, 'C' },
+    { "virtio-console-port", required_argument, 0, 'P' },
+    { "vsock",    required_argument, 0, 'V' },
+    { "vsock-cid", required_argument, 0, 'c' },
     { "xdma",     optional_argument, 0, 'X' },
     { "debug-log", no_argument,     0, 'L' },
     { 0,         0,                 0, 0 }
@@ -72,27 +93,45 @@ int main(int argc, char * const *argv)
     int sleep_seconds = 1;
 #endif
     int usemem = 0;
-    const char *tun_iface = 0;
+    std::string net_backend;
     int tv = 0;
     int enable_virtio_console = 0;
     uint64_t htif_enabled = 0;
     uint64_t uart_enabled = 0;
+    int htif_syscalls = 0;
     int dma_enabled = DEFAULT_DMA_ENABLED;
     int xdma_enabled = DEFAULT_XDMA_ENABLED;
     std::vector<std::string> block_files;
+    std::vector<std::string> console_ports;
+    std::vector<std::string> vhost_user_devices;
     int debug_log = 0;
+    const char *console_log_filename = 0;
+    const char *vsock_path = 0;
+    uint64_t vsock_cid = 3;
+    const char *trace_filename = 0;
+    const char *pcap_spec = 0;
+    const char *metrics_path = 0;
+    const char *replay_filename = 0;
+    double replay_speed = 1.0;
+    int boot_timeline = 0;
 
     while (1) {
         int option_index = optind ? optind : 1;
-        char c = getopt_long(argc, argv, "B:C:d:D:e:hH:LMp:U:X:",
+        char c = getopt_long(argc, argv, "bB:c:C:d:D:e:GhH:l:Lm:Mn:N:p:P:r:R:ST:u:U:V:w:X:Y:",
                              long_options, &option_index);
         if (c == -1)
             break;
 
         switch (c) {
+        case 'b':
+            boot_timeline = 1;
+            break;
         case 'B':
             block_files.push_back(std::string(optarg));
             break;
+        case 'c':
+            vsock_cid = strtoull(optarg, 0, 0);
+            break;
         case 'C':
             if (optarg) {
                 enable_virtio_console = strtoul(optarg, 0, 0);
@@ -111,26 +150,68 @@ int main(int argc, char * const *argv)
         case 'e':
             elf_files.push_back(std::string(optarg));
             break;
+        case 'l':
+            console_log_filename = optarg;
+            break;
         case 'E':
             entry = strtoul(optarg, 0, 0);
             break;
+        case 'G':
+            virtio_set_buffer_pool_flags(BUFFER_POOL_HUGEPAGES);
+            break;
         case 'h':
             usage(argv[0]);
             return 2;
+        case 'm':
+            metrics_path = optarg;
+            break;
         case 'M':
             usemem = 1;
             break;
+        case 'n':
+            // slirp[:http-cache=DIR[,port=N]...], tun:IFNAME,
+            // packet:IFNAME[:FANOUT] or vswitch:NAME
+            net_backend = optarg;
+            break;
+        case 'N':
+            if (thread_topology_set_numa(optarg) < 0)
+                return -1;
+            break;
+        case 'P':
+            console_ports.push_back(std::string(optarg));
+            enable_virtio_console = 1;
+            break;
+        case 'r':
+            trace_filename = optarg;
+            break;
+        case 'R':
+            replay_filename = optarg;
+            break;
+        case 'Y':
+            // 0 replays as fast as the devices answer
+            replay_speed = strtod(optarg, 0);
+            break;
 #if DEBUG_LOOP
         case 's':
             sleep_seconds = strtoul(optarg, 0, 0);
             break;
 #endif
+        case 'S':
+            htif_syscalls = 1;
+            break;
+        case 'T':
+            if (thread_topology_set_role(optarg) < 0)
+                return -1;
+            break;
         case 't':
-            tun_iface = optarg;
+            net_backend = std::string("tun:") + optarg;
             break;
         case 'v':
             cpuverbosity = strtoul(optarg, 0, 0);
             break;
+        case 'u':
+            vhost_user_devices.push_back(std::string(optarg));
+            break;
         case 'U':
             if (optarg) {
                 uart_enabled = strtoul(optarg, 0, 0);
@@ -139,6 +220,13 @@ int main(int argc, char * const *argv)
             }
 	    //fprintf(stderr, "UART %d\r\n", uart_enabled);
             break;
+        case 'V':
+            vsock_path = optarg;
+            break;
+        case 'w':
+            // FILE[,snaplen=N][,proto=tcp][,port=N][,rotate=MB]...
+            pcap_spec = optarg;
+            break;
         case 'X':
             if (optarg) {
                 xdma_enabled = strtoul(optarg, 0, 0);
@@ -174,8 +262,21 @@ int main(int argc, char * const *argv)
     debugLog("romBuffer=%lx\r\n", (long)romBuffer);
 
     Rom rom = { BOOTROM_BASE, BOOTROM_LIMIT, (uint64_t *)romBuffer };
-    fpga = new FPGA(1, rom, tun_iface); // What is/was IfcNames_FPGA_ResponseH2S? I put "1" instead; it's an ID of some sort.
+    // Milestones are always recorded; SIGUSR1 prints them at any time
+    boot_timeline_init();
+    boot_timeline_report_on_signal(SIGUSR1);
+    if (trace_filename && trace_open(trace_filename) < 0)
+        return -1;
+    // before the network device is created
+    if (pcap_spec && net_capture_open(pcap_spec) < 0)
+        return -1;
+    fpga = new FPGA(1, rom, net_backend.size() ? net_backend.c_str() : 0, replay_filename, replay_speed); // What is/was IfcNames_FPGA_ResponseH2S? I put "1" instead; it's an ID of some sort.
     fpga->set_uart_enabled(uart_enabled);
+    fpga->set_htif_syscalls_enabled(htif_syscalls);
+    if (xdma_enabled && !fpga->open_xdma())
+        return -1;
+    if (console_log_filename && fpga->get_console_output().set_log_file(console_log_filename) < 0)
+        return -1;
 
     for (std::string block_file: block_files) {
         fpga->get_virtio_devices().add_virtio_block_device(block_file);
@@ -189,6 +290,17 @@ int main(int argc, char * const *argv)
         debugLog("Enabling virtio console\r\n");
         fpga->get_virtio_devices().add_virtio_console_device();
     }
+    for (std::string console_port: console_ports) {
+        if (!fpga->get_virtio_devices().add_virtio_console_port(console_port))
+            return -1;
+    }
+
+    if (vsock_path && !fpga->get_virtio_devices().add_virtio_vsock_device(vsock_path, vsock_cid))
+        return -1;
+    for (std::string vhost_user_device: vhost_user_devices) {
+        if (!fpga->get_virtio_devices().add_vhost_user_device(vhost_user_device))
+            return -1;
+    }
 
     if (dtb_filename) {
         copyFile((char *)romBuffer + DEVICETREE_OFFSET, dtb_filename, rom_alloc_sz - 0x10);
@@ -196,14 +308,25 @@ int main(int argc, char * const *argv)
 
     // Start up vitio device emulation
     fpga->start_io();
+    if (metrics_path && metrics_serve(metrics_path) < 0)
+        return -1;
+    boot_milestone("host ready");
 
-    while (1) {
+    // This thread answers the MMIO requests
+    thread_topology_apply(THREAD_ROLE_MMIO, pthread_self());
+    thread_topology_report();
+
+    while (!fpga->io_stopped()) {
+        boot_timeline_poll();
         if (fpga->emulated_mmio_has_request())
             fpga->emulated_mmio_respond();
         else usleep(1000000); // Wait in hope of a new request.
     }
     
     int exit_code = fpga->join_io();
+    metrics_stop();
+    if (boot_timeline)
+        boot_timeline_report();
     if (exit_code == EXIT_CODE_RESET) {
         fpga->get_virtio_devices().reset();
     }
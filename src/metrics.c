@@ -0,0 +1,443 @@
+/*
+ * Counters, gauges and histograms served in the Prometheus text format
+ *
+ * Counters and histograms keep one slot per thread (up to METRIC_SHARDS
+ * threads, then threads share slots), each on its own cache lines, so an
+ * update is a single uncontended atomic add. The slots are only summed
+ * when the metrics are read.
+ *
+ * The metrics are served on a unix socket by a SCHED_IDLE thread: every
+ * connection gets the current values and is closed. A client may send an
+ * HTTP GET first (curl --unix-socket PATH http://localhost/metrics), in
+ * which case the reply has HTTP headers.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cutils.h"
+#include "metrics.h"
+#include "topology.h"
+
+#define CACHE_LINE_SIZE 64
+#define METRIC_SHARDS 16
+/* histogram buckets: powers of two from 256 ns to about 17 s */
+#define METRIC_HIST_MIN_SHIFT 8
+#define METRIC_HIST_BUCKETS 27
+/* per shard: the buckets, then the count and the sum */
+#define METRIC_HIST_SLOTS (METRIC_HIST_BUCKETS + 2)
+#define METRIC_HIST_STRIDE \
+    ((METRIC_HIST_SLOTS * 8 + CACHE_LINE_SIZE - 1) / CACHE_LINE_SIZE * \
+     (CACHE_LINE_SIZE / 8))
+#define METRIC_COUNTER_STRIDE (CACHE_LINE_SIZE / 8)
+
+struct Metric {
+    struct Metric *next;
+    MetricType type;
+    char *name;
+    char *help;
+    char *labels; /* may be empty */
+    MetricReadFunc *read_func;
+    void *opaque;
+    int64_t gauge;
+    uint64_t *slots; /* METRIC_SHARDS strides, cache line aligned */
+};
+
+static pthread_mutex_t metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static Metric *metrics_head, **metrics_tail = &metrics_head;
+static int metrics_next_shard;
+static __thread int metrics_shard = -1;
+
+/* for the accessors of fmem.h, which are compiled into each file using them */
+Metric *fmem_read_metric, *fmem_write_metric;
+
+static int metrics_listen_fd = -1;
+static int metrics_stop_pipe[2] = { -1, -1 };
+static pthread_t metrics_thread;
+
+static int metric_stride(MetricType type)
+{
+    return type == METRIC_HISTOGRAM ? METRIC_HIST_STRIDE : METRIC_COUNTER_STRIDE;
+}
+
+static Metric *metric_new_va(MetricType type, const char *name,
+                             const char *help, const char *labels, va_list ap)
+{
+    Metric *m;
+    char buf[256];
+    void *p;
+
+    m = mallocz(sizeof(*m));
+    m->type = type;
+    m->name = strdup(name);
+    m->help = strdup(help);
+    if (labels)
+        vsnprintf(buf, sizeof(buf), labels, ap);
+    else
+        buf[0] = '\0';
+    m->labels = strdup(buf);
+    if (type != METRIC_GAUGE) {
+        if (posix_memalign(&p, CACHE_LINE_SIZE,
+                           METRIC_SHARDS * metric_stride(type) * 8) != 0)
+            abort();
+        memset(p, 0, METRIC_SHARDS * metric_stride(type) * 8);
+        m->slots = p;
+    }
+    pthread_mutex_lock(&metrics_lock);
+    *metrics_tail = m;
+    metrics_tail = &m->next;
+    pthread_mutex_unlock(&metrics_lock);
+    return m;
+}
+
+Metric *metric_new(MetricType type, const char *name, const char *help,
+                   const char *labels, ...)
+{
+    va_list ap;
+    Metric *m;
+
+    va_start(ap, labels);
+    m = metric_new_va(type, name, help, labels, ap);
+    va_end(ap);
+    return m;
+}
+
+Metric *metric_new_gauge_func(const char *name, const char *help,
+                              MetricReadFunc *func, void *opaque,
+                              const char *labels, ...)
+{
+    va_list ap;
+    Metric *m;
+
+    va_start(ap, labels);
+    m = metric_new_va(METRIC_GAUGE, name, help, labels, ap);
+    va_end(ap);
+    /* published without the lock: set before anyone reads it */
+    m->opaque = opaque;
+    __atomic_store_n(&m->read_func, func, __ATOMIC_RELEASE);
+    return m;
+}
+
+void metric_free(Metric *m)
+{
+    Metric **pm;
+
+    if (!m)
+        return;
+    pthread_mutex_lock(&metrics_lock);
+    for(pm = &metrics_head; *pm; pm = &(*pm)->next) {
+        if (*pm == m) {
+            *pm = m->next;
+            if (metrics_tail == &m->next)
+                metrics_tail = pm;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+    free(m->name);
+    free(m->help);
+    free(m->labels);
+    free(m->slots);
+    free(m);
+}
+
+static inline uint64_t *metric_shard_slots(Metric *m)
+{
+    int shard = metrics_shard;
+
+    if (unlikely(shard < 0)) {
+        shard = __atomic_fetch_add(&metrics_next_shard, 1, __ATOMIC_RELAXED) %
+            METRIC_SHARDS;
+        metrics_shard = shard;
+    }
+    return m->slots + shard * metric_stride(m->type);
+}
+
+void metric_add(Metric *m, uint64_t n)
+{
+    if (!m)
+        return;
+    __atomic_fetch_add(metric_shard_slots(m), n, __ATOMIC_RELAXED);
+}
+
+void metric_gauge_set(Metric *m, int64_t val)
+{
+    if (!m)
+        return;
+    __atomic_store_n(&m->gauge, val, __ATOMIC_RELAXED);
+}
+
+void metric_gauge_add(Metric *m, int64_t delta)
+{
+    if (!m)
+        return;
+    __atomic_fetch_add(&m->gauge, delta, __ATOMIC_RELAXED);
+}
+
+void metric_observe(Metric *m, uint64_t duration_ns)
+{
+    uint64_t *slots;
+    int b;
+
+    if (!m)
+        return;
+    slots = metric_shard_slots(m);
+    /* bucket b counts the durations up to 2^(b + METRIC_HIST_MIN_SHIFT) */
+    if (duration_ns <= (1 << METRIC_HIST_MIN_SHIFT))
+        b = 0;
+    else
+        b = min_int(64 - __builtin_clzll(duration_ns - 1) - METRIC_HIST_MIN_SHIFT,
+                    METRIC_HIST_BUCKETS - 1);
+    __atomic_fetch_add(&slots[b], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slots[METRIC_HIST_BUCKETS], 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&slots[METRIC_HIST_BUCKETS + 1], duration_ns,
+                       __ATOMIC_RELAXED);
+}
+
+uint64_t metric_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t metric_sum_slot(Metric *m, int slot)
+{
+    uint64_t sum = 0;
+    int i;
+
+    for(i = 0; i < METRIC_SHARDS; i++)
+        sum += __atomic_load_n(&m->slots[i * metric_stride(m->type) + slot],
+                               __ATOMIC_RELAXED);
+    return sum;
+}
+
+static void dbuf_printf(DynBuf *s, const char *fmt, ...)
+    __attribute__((format(printf, 2, 3)));
+
+static void dbuf_printf(DynBuf *s, const char *fmt, ...)
+{
+    char buf[512];
+    va_list ap;
+    int len;
+
+    va_start(ap, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    dbuf_write(s, s->size, (uint8_t *)buf, min_int(len, sizeof(buf) - 1));
+}
+
+/* "name{labels,extra}" with the braces only if needed */
+static void metric_print_name(DynBuf *s, Metric *m, const char *suffix,
+                              const char *extra)
+{
+    dbuf_printf(s, "%s%s", m->name, suffix);
+    if (m->labels[0] || extra) {
+        dbuf_printf(s, "{%s%s%s}", m->labels,
+                    m->labels[0] && extra ? "," : "", extra ? extra : "");
+    }
+}
+
+static void metric_print(DynBuf *s, Metric *m)
+{
+    MetricReadFunc *func;
+    uint64_t count, total;
+    char le[32];
+    int b;
+
+    switch(m->type) {
+    case METRIC_COUNTER:
+        metric_print_name(s, m, "", NULL);
+        dbuf_printf(s, " %" PRIu64 "\n", metric_sum_slot(m, 0));
+        break;
+    case METRIC_GAUGE:
+        func = __atomic_load_n(&m->read_func, __ATOMIC_ACQUIRE);
+        metric_print_name(s, m, "", NULL);
+        dbuf_printf(s, " %" PRId64 "\n", func ? func(m->opaque) :
+                    __atomic_load_n(&m->gauge, __ATOMIC_RELAXED));
+        break;
+    case METRIC_HISTOGRAM:
+        count = 0;
+        for(b = 0; b < METRIC_HIST_BUCKETS - 1; b++) {
+            count += metric_sum_slot(m, b);
+            snprintf(le, sizeof(le), "le=\"%g\"",
+                     (double)((uint64_t)1 << (b + METRIC_HIST_MIN_SHIFT)) / 1e9);
+            metric_print_name(s, m, "_bucket", le);
+            dbuf_printf(s, " %" PRIu64 "\n", count);
+        }
+        /* the count is read last so that it is never below the buckets */
+        total = metric_sum_slot(m, METRIC_HIST_BUCKETS);
+        if (total > count)
+            count = total;
+        metric_print_name(s, m, "_bucket", "le=\"+Inf\"");
+        dbuf_printf(s, " %" PRIu64 "\n", count);
+        metric_print_name(s, m, "_sum", NULL);
+        dbuf_printf(s, " %.9f\n",
+                    metric_sum_slot(m, METRIC_HIST_BUCKETS + 1) / 1e9);
+        metric_print_name(s, m, "_count", NULL);
+        dbuf_printf(s, " %" PRIu64 "\n", count);
+        break;
+    }
+}
+
+static void metrics_format(DynBuf *s)
+{
+    static const char *type_names[] = { "counter", "gauge", "histogram" };
+    Metric *m, *m1, *m2;
+
+    pthread_mutex_lock(&metrics_lock);
+    for(m = metrics_head; m; m = m->next) {
+        /* each name once, with all its label sets */
+        for(m1 = metrics_head; m1 != m; m1 = m1->next) {
+            if (!strcmp(m1->name, m->name))
+                break;
+        }
+        if (m1 != m)
+            continue;
+        dbuf_printf(s, "# HELP %s %s\n", m->name, m->help);
+        dbuf_printf(s, "# TYPE %s %s\n", m->name, type_names[m->type]);
+        for(m2 = m; m2; m2 = m2->next) {
+            if (!strcmp(m2->name, m->name))
+                metric_print(s, m2);
+        }
+    }
+    pthread_mutex_unlock(&metrics_lock);
+}
+
+static void write_all(int fd, const uint8_t *buf, size_t len)
+{
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = write(fd, buf, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            return;
+        buf += ret;
+        len -= ret;
+    }
+}
+
+static void metrics_handle_client(int fd)
+{
+    struct pollfd pfd;
+    char req[512];
+    char header[128];
+    DynBuf body;
+    int len, http;
+
+    /* give an HTTP client a moment to send its request */
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    len = 0;
+    if (poll(&pfd, 1, 100) > 0)
+        len = read(fd, req, sizeof(req) - 1);
+    http = len >= 4 && !memcmp(req, "GET ", 4);
+
+    dbuf_init(&body);
+    metrics_format(&body);
+    if (http) {
+        len = snprintf(header, sizeof(header),
+                       "HTTP/1.0 200 OK\r\n"
+                       "Content-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\n\r\n", body.size);
+        write_all(fd, (uint8_t *)header, len);
+    }
+    write_all(fd, body.buf, body.size);
+    dbuf_free(&body);
+}
+
+static void *metrics_thread_func(void *opaque)
+{
+    struct pollfd pfd[2];
+    int fd;
+
+    for(;;) {
+        pfd[0].fd = metrics_listen_fd;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = metrics_stop_pipe[0];
+        pfd[1].events = POLLIN;
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+        if (pfd[1].revents)
+            break;
+        if (pfd[0].revents & POLLIN) {
+            fd = accept4(metrics_listen_fd, NULL, NULL, SOCK_CLOEXEC);
+            if (fd < 0)
+                continue;
+            metrics_handle_client(fd);
+            close(fd);
+        }
+    }
+    return NULL;
+}
+
+int metrics_serve(const char *path)
+{
+    struct sockaddr_un addr;
+    struct sched_param param;
+    int fd;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Metrics socket path too long: %s\r\n", path);
+        return -1;
+    }
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        fprintf(stderr, "Cannot create the metrics socket: %s\r\n",
+                strerror(errno));
+        return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+    unlink(path);
+    if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 4) < 0) {
+        fprintf(stderr, "Cannot listen on %s: %s\r\n", path, strerror(errno));
+        close(fd);
+        return -1;
+    }
+    if (pipe(metrics_stop_pipe) < 0) {
+        close(fd);
+        return -1;
+    }
+    metrics_listen_fd = fd;
+
+    pthread_create(&metrics_thread, NULL, metrics_thread_func, NULL);
+    pthread_setname_np(metrics_thread, "Metrics");
+    memset(&param, 0, sizeof(param));
+    pthread_setschedparam(metrics_thread, SCHED_IDLE, &param);
+    thread_topology_apply(THREAD_ROLE_METRICS, metrics_thread);
+    return 0;
+}
+
+void metrics_stop(void)
+{
+    char dummy = 'X';
+
+    if (metrics_listen_fd < 0)
+        return;
+    if (write(metrics_stop_pipe[1], &dummy, 1) != 1)
+        return;
+    pthread_join(metrics_thread, NULL);
+    close(metrics_listen_fd);
+    close(metrics_stop_pipe[0]);
+    close(metrics_stop_pipe[1]);
+    metrics_listen_fd = -1;
+}
@@ -0,0 +1,59 @@
+/*
+ * Counters, gauges and histograms served in the Prometheus text format
+ */
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <inttypes.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef enum {
+    METRIC_COUNTER,
+    METRIC_GAUGE,
+    METRIC_HISTOGRAM, /* of durations in nanoseconds, exported in seconds */
+} MetricType;
+
+typedef struct Metric Metric;
+
+/* value of a gauge computed when the metrics are read */
+typedef int64_t MetricReadFunc(void *opaque);
+
+/* 'labels' is a printf format for the label list without the braces, e.g.
+   "device=\"%s\",queue=\"%d\"", or NULL. Metrics with the same name must
+   have the same type and help text. */
+Metric *metric_new(MetricType type, const char *name, const char *help,
+                   const char *labels, ...)
+    __attribute__((format(printf, 4, 5)));
+Metric *metric_new_gauge_func(const char *name, const char *help,
+                              MetricReadFunc *func, void *opaque,
+                              const char *labels, ...)
+    __attribute__((format(printf, 5, 6)));
+void metric_free(Metric *m);
+
+/* The update functions take no lock and do nothing if 'm' is NULL.
+   Counters and histograms are split per thread, so concurrent updates
+   never share a cache line. */
+void metric_add(Metric *m, uint64_t n);
+static inline void metric_inc(Metric *m)
+{
+    metric_add(m, 1);
+}
+void metric_gauge_set(Metric *m, int64_t val);
+void metric_gauge_add(Metric *m, int64_t delta);
+void metric_observe(Metric *m, uint64_t duration_ns);
+
+uint64_t metric_time_ns(void);
+
+/* Serve the metrics on the unix socket 'path' from a low priority
+   thread. Return 0 if OK, -1 on error. */
+int metrics_serve(const char *path);
+void metrics_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* METRICS_H */
@@ -0,0 +1,590 @@
+/*
+ * Capture of the guest network traffic to pcap-ng files
+ *
+ * The device threads copy each frame that passes the filter into a
+ * ring of their own and never wait for the writer: a frame that does
+ * not fit is counted as dropped. Frames to the guest come both from the
+ * I/O thread and from the thread sending guest frames, when slirp
+ * answers them at once, so each ring has a single producer and needs no
+ * lock. A background thread drains the rings in time order every few
+ * milliseconds and writes them as enhanced packet blocks whose flags
+ * give the direction. The drop counts are written as interface
+ * statistics when a file is closed.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cutils.h"
+#include "topology.h"
+#include "netcap.h"
+
+#define CAPTURE_RING_SIZE (4 << 20) /* bytes per thread, power of two */
+#define CAPTURE_MAX_RINGS 8
+#define CAPTURE_DRAIN_INTERVAL_MS 10
+#define CAPTURE_REOPEN_INTERVAL_MS 5000
+#define CAPTURE_FILE_BUF_SIZE (1 << 20)
+#define CAPTURE_DEFAULT_SNAPLEN 65535
+#define CAPTURE_DEFAULT_FILES 4
+
+/* record flags */
+#define CAPTURE_REC_PAD 1 /* fills the end of the ring, no frame */
+#define CAPTURE_REC_INBOUND 2 /* network to guest */
+
+/* pcap-ng */
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 1
+#define PCAPNG_ISB 5
+#define PCAPNG_EPB 6
+#define PCAPNG_BYTE_ORDER_MAGIC 0x1a2b3c4d
+#define PCAPNG_LINKTYPE_ETHERNET 1
+#define PCAPNG_OPT_END 0
+#define PCAPNG_IF_NAME 2
+#define PCAPNG_IF_TSRESOL 9
+#define PCAPNG_EPB_FLAGS 2
+#define PCAPNG_EPB_INBOUND 1
+#define PCAPNG_EPB_OUTBOUND 2
+#define PCAPNG_ISB_IFDROP 5
+
+typedef struct {
+    uint32_t size; /* of the record, multiple of 8 */
+    uint32_t flags;
+    uint32_t caplen;
+    uint32_t len;
+    uint64_t time_ns;
+} CaptureRecord;
+
+typedef struct {
+    uint8_t *buf;
+    uint64_t head __attribute__((aligned(64))); /* written by its thread */
+    uint64_t tail __attribute__((aligned(64))); /* written by the writer */
+    uint64_t dropped;
+} CaptureRing;
+
+typedef struct {
+    /* the wrapped backend */
+    EthernetDevice *net;
+    /* what the device sees */
+    EthernetDevice dev;
+} CaptureDevice;
+
+static char *capture_filename;
+static FILE *capture_file;
+static uint64_t capture_file_size;
+static uint32_t capture_snaplen = CAPTURE_DEFAULT_SNAPLEN;
+static int capture_ethertype = -1;
+static int capture_proto = -1;
+static uint32_t capture_host;
+static int capture_port = -1;
+static uint64_t capture_rotate_size;
+static int capture_files = CAPTURE_DEFAULT_FILES;
+
+/* one per thread recording frames, never freed before exit */
+static CaptureRing capture_rings[CAPTURE_MAX_RINGS];
+static int capture_nb_rings;
+static pthread_mutex_t capture_rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int capture_ring_index = -1; /* -2 if none was left */
+/* frames of the threads without a ring or written without a file */
+static uint64_t capture_dropped;
+static uint64_t capture_reopen_time; /* while there is no file */
+static pthread_t capture_thread;
+static int capture_running;
+static int capture_stop;
+
+static uint64_t capture_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* called by the device threads on every frame */
+static BOOL capture_filter(const uint8_t *buf, int len)
+{
+    int ethertype, ihl, proto, sport, dport;
+    const uint8_t *ip;
+
+    if (len < 14)
+        return FALSE;
+    ethertype = (buf[12] << 8) | buf[13];
+    if (capture_ethertype >= 0 && ethertype != capture_ethertype)
+        return FALSE;
+    if (capture_proto < 0 && !capture_host && capture_port < 0)
+        return TRUE;
+    ip = buf + 14;
+    if (ethertype != 0x0800 || len < 14 + 20)
+        return FALSE;
+    proto = ip[9];
+    if (capture_proto >= 0 && proto != capture_proto)
+        return FALSE;
+    if (capture_host && get_be32(ip + 12) != capture_host &&
+        get_be32(ip + 16) != capture_host)
+        return FALSE;
+    if (capture_port >= 0) {
+        ihl = (ip[0] & 0xf) * 4;
+        if ((proto != 6 && proto != 17) || len < 14 + ihl + 4)
+            return FALSE;
+        sport = (ip[ihl] << 8) | ip[ihl + 1];
+        dport = (ip[ihl + 2] << 8) | ip[ihl + 3];
+        if (sport != capture_port && dport != capture_port)
+            return FALSE;
+    }
+    return TRUE;
+}
+
+/* the ring of the calling thread, or NULL */
+static CaptureRing *capture_thread_ring(void)
+{
+    int i = capture_ring_index;
+
+    if (i >= 0)
+        return &capture_rings[i];
+    if (i == -2)
+        return NULL;
+    pthread_mutex_lock(&capture_rings_lock);
+    i = capture_nb_rings;
+    if (i < CAPTURE_MAX_RINGS) {
+        capture_rings[i].buf = malloc(CAPTURE_RING_SIZE);
+        __atomic_store_n(&capture_nb_rings, i + 1, __ATOMIC_RELEASE);
+    } else {
+        fprintf(stderr, "capture: more than %d threads, frames dropped\r\n",
+                CAPTURE_MAX_RINGS);
+        i = -2;
+    }
+    pthread_mutex_unlock(&capture_rings_lock);
+    capture_ring_index = i;
+    return i >= 0 ? &capture_rings[i] : NULL;
+}
+
+static void capture_record(const uint8_t *buf, int len, uint32_t flags)
+{
+    CaptureRing *r;
+    CaptureRecord *rec;
+    uint64_t head, tail;
+    uint32_t caplen, size, pos, contig;
+
+    if (!capture_filter(buf, len))
+        return;
+    r = capture_thread_ring();
+    if (!r) {
+        __atomic_fetch_add(&capture_dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    caplen = min_int(len, capture_snaplen);
+    size = (sizeof(CaptureRecord) + caplen + 7) & ~7;
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    pos = head & (CAPTURE_RING_SIZE - 1);
+    contig = CAPTURE_RING_SIZE - pos;
+    if (size + (size > contig ? contig : 0) > CAPTURE_RING_SIZE - (head - tail)) {
+        __atomic_fetch_add(&r->dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    if (size > contig) {
+        rec = (CaptureRecord *)(r->buf + pos);
+        rec->size = contig;
+        rec->flags = CAPTURE_REC_PAD;
+        head += contig;
+        pos = 0;
+    }
+    rec = (CaptureRecord *)(r->buf + pos);
+    rec->size = size;
+    rec->flags = flags;
+    rec->caplen = caplen;
+    rec->len = len;
+    rec->time_ns = capture_time_ns();
+    memcpy(rec + 1, buf, caplen);
+    __atomic_store_n(&r->head, head + size, __ATOMIC_RELEASE);
+}
+
+/* return the next record of 'r' or NULL, skipping the padding */
+static CaptureRecord *capture_peek(CaptureRing *r)
+{
+    CaptureRecord *rec;
+    uint64_t head;
+
+    head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    while (r->tail != head) {
+        rec = (CaptureRecord *)(r->buf + (r->tail & (CAPTURE_RING_SIZE - 1)));
+        if (!(rec->flags & CAPTURE_REC_PAD))
+            return rec;
+        __atomic_store_n(&r->tail, r->tail + rec->size, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+static void capture_write_block(uint32_t type, const void *body,
+                                uint32_t body_len)
+{
+    uint8_t hdr[8];
+    uint32_t block_len = 12 + body_len;
+
+    put_le32(hdr, type);
+    put_le32(hdr + 4, block_len);
+    fwrite_unlocked(hdr, 1, 8, capture_file);
+    fwrite_unlocked(body, 1, body_len, capture_file);
+    fwrite_unlocked(hdr + 4, 1, 4, capture_file);
+    capture_file_size += block_len;
+}
+
+static void capture_write_headers(void)
+{
+    static const char if_name[] = "virtio-net";
+    uint8_t shb[16], idb[8 + 4 + 12 + 8 + 4];
+    uint8_t *q;
+
+    put_le32(shb, PCAPNG_BYTE_ORDER_MAGIC);
+    put_le16(shb + 4, 1);
+    put_le16(shb + 6, 0);
+    /* unknown section length */
+    put_le32(shb + 8, 0xffffffff);
+    put_le32(shb + 12, 0xffffffff);
+    capture_write_block(PCAPNG_SHB, shb, sizeof(shb));
+
+    memset(idb, 0, sizeof(idb));
+    put_le16(idb, PCAPNG_LINKTYPE_ETHERNET);
+    put_le32(idb + 4, capture_snaplen);
+    q = idb + 8;
+    put_le16(q, PCAPNG_IF_NAME);
+    put_le16(q + 2, sizeof(if_name) - 1);
+    memcpy(q + 4, if_name, sizeof(if_name) - 1);
+    q += 4 + 12;
+    /* nanosecond timestamps */
+    put_le16(q, PCAPNG_IF_TSRESOL);
+    put_le16(q + 2, 1);
+    q[4] = 9;
+    q += 8;
+    put_le16(q, PCAPNG_OPT_END);
+    put_le16(q + 2, 0);
+    capture_write_block(PCAPNG_IDB, idb, sizeof(idb));
+}
+
+static void capture_write_epb(const CaptureRecord *rec)
+{
+    uint8_t hdr[8 + 20], opts[12];
+    uint32_t pad = -rec->caplen & 3;
+    uint32_t block_len = sizeof(hdr) + rec->caplen + pad + sizeof(opts) + 4;
+    static const uint8_t zero[4];
+
+    put_le32(hdr, PCAPNG_EPB);
+    put_le32(hdr + 4, block_len);
+    put_le32(hdr + 8, 0);
+    put_le32(hdr + 12, rec->time_ns >> 32);
+    put_le32(hdr + 16, rec->time_ns);
+    put_le32(hdr + 20, rec->caplen);
+    put_le32(hdr + 24, rec->len);
+    put_le16(opts, PCAPNG_EPB_FLAGS);
+    put_le16(opts + 2, 4);
+    put_le32(opts + 4, rec->flags & CAPTURE_REC_INBOUND ?
+             PCAPNG_EPB_INBOUND : PCAPNG_EPB_OUTBOUND);
+    put_le16(opts + 8, PCAPNG_OPT_END);
+    put_le16(opts + 10, 0);
+    fwrite_unlocked(hdr, 1, sizeof(hdr), capture_file);
+    fwrite_unlocked(rec + 1, 1, rec->caplen, capture_file);
+    fwrite_unlocked(zero, 1, pad, capture_file);
+    fwrite_unlocked(opts, 1, sizeof(opts), capture_file);
+    fwrite_unlocked(hdr + 4, 1, 4, capture_file);
+    capture_file_size += block_len;
+}
+
+/* frames dropped since the capture started, for the whole interface */
+static void capture_write_stats(void)
+{
+    uint8_t isb[12 + 12 + 4];
+    uint64_t now = capture_time_ns();
+    uint64_t dropped;
+    int i, n;
+
+    dropped = __atomic_load_n(&capture_dropped, __ATOMIC_RELAXED);
+    n = __atomic_load_n(&capture_nb_rings, __ATOMIC_ACQUIRE);
+    for(i = 0; i < n; i++)
+        dropped += __atomic_load_n(&capture_rings[i].dropped, __ATOMIC_RELAXED);
+
+    put_le32(isb, 0);
+    put_le32(isb + 4, now >> 32);
+    put_le32(isb + 8, now);
+    put_le16(isb + 12, PCAPNG_ISB_IFDROP);
+    put_le16(isb + 14, 8);
+    put_le64(isb + 16, dropped);
+    put_le16(isb + 24, PCAPNG_OPT_END);
+    put_le16(isb + 26, 0);
+    capture_write_block(PCAPNG_ISB, isb, sizeof(isb));
+}
+
+static FILE *capture_fopen(void)
+{
+    FILE *f;
+
+    f = fopen(capture_filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Cannot open capture file %s: %s\r\n",
+                capture_filename, strerror(errno));
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, CAPTURE_FILE_BUF_SIZE);
+    return f;
+}
+
+static void capture_rotate(void)
+{
+    char src[1024], dst[1024];
+    int i;
+
+    capture_write_stats();
+    if (fclose(capture_file) != 0)
+        fprintf(stderr, "Cannot write capture file %s: %s\r\n",
+                capture_filename, strerror(errno));
+    for(i = capture_files - 1; i >= 1; i--) {
+        if (i == 1)
+            pstrcpy(src, sizeof(src), capture_filename);
+        else
+            snprintf(src, sizeof(src), "%s.%d", capture_filename, i - 1);
+        snprintf(dst, sizeof(dst), "%s.%d", capture_filename, i);
+        rename(src, dst);
+    }
+    capture_file_size = 0;
+    capture_file = NULL;
+    capture_reopen_time = 0;
+}
+
+/* Open the file again after a failure, at most every few seconds: the
+   frames received meanwhile are counted as dropped */
+static void capture_reopen(void)
+{
+    uint64_t now = capture_time_ns();
+
+    if (now < capture_reopen_time)
+        return;
+    capture_reopen_time = now + (uint64_t)CAPTURE_REOPEN_INTERVAL_MS * 1000000;
+    capture_file = capture_fopen();
+    if (capture_file)
+        capture_write_headers();
+}
+
+/* write the records of all the rings in time order */
+static void capture_drain(void)
+{
+    CaptureRecord *recs[CAPTURE_MAX_RINGS], *rec;
+    CaptureRing *r;
+    int i, n;
+
+    n = __atomic_load_n(&capture_nb_rings, __ATOMIC_ACQUIRE);
+    memset(recs, 0, sizeof(recs));
+    for(;;) {
+        if (!capture_file)
+            capture_reopen();
+        rec = NULL;
+        r = NULL;
+        for(i = 0; i < n; i++) {
+            if (!recs[i])
+                recs[i] = capture_peek(&capture_rings[i]);
+            if (recs[i] && (!rec || recs[i]->time_ns < rec->time_ns)) {
+                rec = recs[i];
+                r = &capture_rings[i];
+            }
+        }
+        if (!rec)
+            break;
+        if (capture_file)
+            capture_write_epb(rec);
+        else
+            __atomic_fetch_add(&capture_dropped, 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&r->tail, r->tail + rec->size, __ATOMIC_RELEASE);
+        recs[r - capture_rings] = NULL;
+        if (capture_file && capture_rotate_size &&
+            capture_file_size >= capture_rotate_size)
+            capture_rotate();
+    }
+    if (capture_file)
+        fflush(capture_file);
+}
+
+static void *capture_thread_func(void *opaque)
+{
+    struct timespec ts;
+    int stop;
+
+    ts.tv_sec = 0;
+    ts.tv_nsec = CAPTURE_DRAIN_INTERVAL_MS * 1000000;
+    do {
+        stop = __atomic_load_n(&capture_stop, __ATOMIC_ACQUIRE);
+        capture_drain();
+        if (!stop)
+            nanosleep(&ts, NULL);
+    } while (!stop);
+    return NULL;
+}
+
+static void capture_atexit(void)
+{
+    net_capture_close();
+}
+
+static int capture_parse_option(const char *opt)
+{
+    const char *val = strchr(opt, '=');
+    int a, b, c, d;
+
+    if (!val)
+        return -1;
+    val++;
+    if (strstart(opt, "snaplen=", NULL)) {
+        capture_snaplen = strtoul(val, NULL, 0);
+        if (capture_snaplen < 14)
+            return -1;
+    } else if (strstart(opt, "ether=", NULL)) {
+        capture_ethertype = strtoul(val, NULL, 0);
+    } else if (strstart(opt, "proto=", NULL)) {
+        if (!strcmp(val, "tcp"))
+            capture_proto = 6;
+        else if (!strcmp(val, "udp"))
+            capture_proto = 17;
+        else if (!strcmp(val, "icmp"))
+            capture_proto = 1;
+        else
+            capture_proto = strtoul(val, NULL, 0);
+    } else if (strstart(opt, "host=", NULL)) {
+        if (sscanf(val, "%d.%d.%d.%d", &a, &b, &c, &d) != 4)
+            return -1;
+        capture_host = (a << 24) | (b << 16) | (c << 8) | d;
+    } else if (strstart(opt, "port=", NULL)) {
+        capture_port = strtoul(val, NULL, 0);
+    } else if (strstart(opt, "rotate=", NULL)) {
+        capture_rotate_size = strtoull(val, NULL, 0) << 20;
+    } else if (strstart(opt, "files=", NULL)) {
+        capture_files = strtoul(val, NULL, 0);
+        if (capture_files < 1)
+            return -1;
+    } else {
+        return -1;
+    }
+    return 0;
+}
+
+int net_capture_open(const char *spec)
+{
+    char *str, *opt, *saveptr;
+
+    str = strdup(spec);
+    capture_filename = strdup(strtok_r(str, ",", &saveptr));
+    while ((opt = strtok_r(NULL, ",", &saveptr)) != NULL) {
+        if (capture_parse_option(opt) < 0) {
+            fprintf(stderr, "Invalid capture option: %s\r\n", opt);
+            free(str);
+            return -1;
+        }
+    }
+    free(str);
+
+    capture_file = capture_fopen();
+    if (!capture_file)
+        return -1;
+    capture_write_headers();
+    pthread_create(&capture_thread, NULL, capture_thread_func, NULL);
+    pthread_setname_np(capture_thread, "Capture");
+    thread_topology_apply(THREAD_ROLE_CAPTURE, capture_thread);
+    capture_running = 1;
+    atexit(capture_atexit);
+    return 0;
+}
+
+void net_capture_close(void)
+{
+    if (!capture_running)
+        return;
+    capture_running = 0;
+    __atomic_store_n(&capture_stop, 1, __ATOMIC_RELEASE);
+    pthread_join(capture_thread, NULL);
+    if (capture_file) {
+        capture_write_stats();
+        fclose(capture_file);
+        capture_file = NULL;
+    }
+}
+
+static void capture_write_packet(EthernetDevice *dev, const uint8_t *buf,
+                                 int len)
+{
+    CaptureDevice *c = dev->opaque;
+
+    capture_record(buf, len, 0);
+    c->net->write_packet(c->net, buf, len);
+}
+
+static void capture_flush(EthernetDevice *dev)
+{
+    CaptureDevice *c = dev->opaque;
+
+    if (c->net->flush)
+        c->net->flush(c->net);
+}
+
+static void capture_select_fill(EthernetDevice *dev, int *pfd_max,
+                                fd_set *rfds, fd_set *wfds, fd_set *efds,
+                                int *pdelay)
+{
+    CaptureDevice *c = dev->opaque;
+
+    c->net->select_fill(c->net, pfd_max, rfds, wfds, efds, pdelay);
+}
+
+static void capture_select_poll(EthernetDevice *dev,
+                                fd_set *rfds, fd_set *wfds, fd_set *efds,
+                                int select_ret)
+{
+    CaptureDevice *c = dev->opaque;
+
+    c->net->select_poll(c->net, rfds, wfds, efds, select_ret);
+}
+
+/* called by the backend: forward to the device */
+
+static BOOL capture_device_can_write_packet(EthernetDevice *net)
+{
+    CaptureDevice *c = net->device_opaque;
+
+    return c->dev.device_can_write_packet(&c->dev);
+}
+
+static void capture_device_write_packet(EthernetDevice *net,
+                                        const uint8_t *buf, int len)
+{
+    CaptureDevice *c = net->device_opaque;
+
+    capture_record(buf, len, CAPTURE_REC_INBOUND);
+    c->dev.device_write_packet(&c->dev, buf, len);
+}
+
+static void capture_device_set_carrier(EthernetDevice *net,
+                                       BOOL carrier_state)
+{
+    CaptureDevice *c = net->device_opaque;
+
+    if (c->dev.device_set_carrier)
+        c->dev.device_set_carrier(&c->dev, carrier_state);
+}
+
+EthernetDevice *net_capture_wrap(EthernetDevice *net)
+{
+    CaptureDevice *c;
+
+    if (!capture_running)
+        return net;
+    c = mallocz(sizeof(*c));
+    c->net = net;
+    memcpy(c->dev.mac_addr, net->mac_addr, sizeof(net->mac_addr));
+    c->dev.opaque = c;
+    c->dev.write_packet = capture_write_packet;
+    c->dev.flush = capture_flush;
+    c->dev.select_fill = capture_select_fill;
+    c->dev.select_poll = capture_select_poll;
+    net->device_opaque = c;
+    net->device_can_write_packet = capture_device_can_write_packet;
+    net->device_write_packet = capture_device_write_packet;
+    net->device_set_carrier = capture_device_set_carrier;
+    return &c->dev;
+}
@@ -0,0 +1,27 @@
+/*
+ * Capture of the guest network traffic to pcap-ng files
+ */
+#ifndef NETCAP_H
+#define NETCAP_H
+
+#include "virtio.h"
+
+/* 'spec' is FILE[,option...] with the options
+     snaplen=N     bytes kept of each frame (default 65535)
+     ether=TYPE    only frames of this ethertype, e.g. 0x806
+     proto=P       only IPv4 frames of this protocol: tcp, udp, icmp or N
+     host=A.B.C.D  only IPv4 frames from or to this address
+     port=N        only TCP or UDP segments from or to this port
+     rotate=MB     start a new file when FILE reaches this size, the
+                   previous ones being renamed FILE.1, FILE.2...
+     files=N       rotated files kept (default 4)
+   Return 0 if OK, -1 on error. */
+int net_capture_open(const char *spec);
+void net_capture_close(void);
+
+/* Return a device recording the frames sent and received through 'net',
+   or 'net' itself if no capture was opened: the uncaptured path is left
+   untouched. Frames may be sent and received from any thread. */
+EthernetDevice *net_capture_wrap(EthernetDevice *net);
+
+#endif /* NETCAP_H */
@@ -49,6 +49,11 @@ struct PCIDevice {
     uint8_t next_cap_offset; /* offset of the next capability */
     char *name; /* for debug only */
     PCIIORegion io_regions[PCI_NUM_REGIONS];
+    /* MSI-X */
+    int msix_cap; /* config offset of the capability, 0 if none */
+    int msix_nentries;
+    uint8_t *msix_table;
+    uint8_t *msix_pba;
 };
 
 struct PCIBus {
@@ -58,6 +63,8 @@ struct PCIBus {
     PhysMemoryMap *port_map;
     uint32_t irq_state[4][8]; /* one bit per device */
     IRQSignal irq[4];
+    PCIMSISendFunc *msi_send;
+    void *msi_opaque;
 };
 
 static int bus_map_irq(PCIDevice *d, int irq_num)
@@ -333,11 +340,20 @@ static void pci_device_config_write8(PCIDevice *d, uint32_t addr,
         }
         break;
     }
+    if (d->msix_cap && addr >= d->msix_cap &&
+        addr < d->msix_cap + PCI_MSIX_CAP_SIZE) {
+        /* only the enable and function mask bits are writable */
+        if (addr == d->msix_cap + PCI_MSIX_FLAGS + 1)
+            d->config[addr] = (d->config[addr] & 0x3f) | (data & 0xc0);
+        return;
+    }
     if (can_write)
         d->config[addr] = data;
 }
                                   
 
+static void pci_msix_deliver_pending(PCIDevice *d);
+
 static void pci_device_config_write(PCIDevice *d, uint32_t addr,
                                     uint32_t data, int size_log2)
 {
@@ -364,6 +380,11 @@ static void pci_device_config_write(PCIDevice *d, uint32_t addr,
     if (PCI_COMMAND >= addr && PCI_COMMAND < addr + size) {
         pci_update_mappings(d);
     }
+    if (d->msix_cap && addr < d->msix_cap + PCI_MSIX_CAP_SIZE &&
+        addr + size > d->msix_cap) {
+        /* enabling or unmasking may release pending messages */
+        pci_msix_deliver_pending(d);
+    }
 }
 
 
@@ -440,6 +461,159 @@ int pci_add_capability(PCIDevice *d, const uint8_t *buf, int size)
     return offset;
 }
 
+/* MSI-X */
+
+void pci_bus_set_msi_sink(PCIBus *b, PCIMSISendFunc *send, void *opaque)
+{
+    b->msi_send = send;
+    b->msi_opaque = opaque;
+}
+
+BOOL pci_bus_has_msi_sink(PCIBus *b)
+{
+    return b->msi_send != NULL;
+}
+
+PCIBus *pci_device_get_bus(PCIDevice *d)
+{
+    return d->bus;
+}
+
+/* The table and PBA live in BAR 'bar_num' at the given offsets; the owner
+   of the BAR forwards accesses to pci_msix_table_read/write() and
+   pci_msix_pba_read(). Return the capability offset or < 0 if error. */
+int pci_msix_init(PCIDevice *d, int nentries, unsigned int bar_num,
+                  uint32_t table_offset, uint32_t pba_offset)
+{
+    uint8_t cap[PCI_MSIX_CAP_SIZE];
+    int i, offset;
+
+    assert(nentries > 0 && nentries <= PCI_MSIX_MAX_ENTRIES);
+    assert(bar_num < PCI_ROM_SLOT);
+    memset(cap, 0, sizeof(cap));
+    cap[0] = PCI_CAP_ID_MSIX;
+    put_le16(cap + PCI_MSIX_FLAGS, nentries - 1);
+    put_le32(cap + 4, table_offset | bar_num);
+    put_le32(cap + 8, pba_offset | bar_num);
+    offset = pci_add_capability(d, cap, sizeof(cap));
+    if (offset < 0)
+        return offset;
+
+    d->msix_nentries = nentries;
+    d->msix_table = mallocz(nentries * PCI_MSIX_ENTRY_SIZE);
+    d->msix_pba = mallocz((nentries + 63) / 64 * 8);
+    /* all vectors start masked */
+    for(i = 0; i < nentries; i++) {
+        put_le32(d->msix_table + i * PCI_MSIX_ENTRY_SIZE +
+                 PCI_MSIX_ENTRY_VECTOR_CTRL, PCI_MSIX_ENTRY_CTRL_MASKBIT);
+    }
+    d->msix_cap = offset;
+    return offset;
+}
+
+BOOL pci_msix_enabled(PCIDevice *d)
+{
+    return d->msix_cap &&
+        (get_le16(d->config + d->msix_cap + PCI_MSIX_FLAGS) &
+         PCI_MSIX_FLAGS_ENABLE) != 0;
+}
+
+static BOOL pci_msix_is_masked(PCIDevice *d, int vector)
+{
+    uint16_t flags = get_le16(d->config + d->msix_cap + PCI_MSIX_FLAGS);
+    if (flags & PCI_MSIX_FLAGS_MASKALL)
+        return TRUE;
+    return (get_le32(d->msix_table + vector * PCI_MSIX_ENTRY_SIZE +
+                     PCI_MSIX_ENTRY_VECTOR_CTRL) &
+            PCI_MSIX_ENTRY_CTRL_MASKBIT) != 0;
+}
+
+static void pci_msix_send(PCIDevice *d, int vector)
+{
+    PCIBus *b = d->bus;
+    uint8_t *entry = d->msix_table + vector * PCI_MSIX_ENTRY_SIZE;
+    uint64_t addr;
+
+    if (!b->msi_send)
+        return;
+    addr = get_le32(entry + PCI_MSIX_ENTRY_LOWER_ADDR) |
+        ((uint64_t)get_le32(entry + PCI_MSIX_ENTRY_UPPER_ADDR) << 32);
+    b->msi_send(b->msi_opaque, addr, get_le32(entry + PCI_MSIX_ENTRY_DATA));
+}
+
+void pci_msix_notify(PCIDevice *d, int vector)
+{
+    if (!pci_msix_enabled(d) || vector < 0 || vector >= d->msix_nentries)
+        return;
+    if (pci_msix_is_masked(d, vector)) {
+        /* remember it until the vector is unmasked */
+        d->msix_pba[vector >> 3] |= 1 << (vector & 7);
+        return;
+    }
+    pci_msix_send(d, vector);
+}
+
+static void pci_msix_deliver_pending(PCIDevice *d)
+{
+    int vector;
+
+    if (!pci_msix_enabled(d))
+        return;
+    for(vector = 0; vector < d->msix_nentries; vector++) {
+        if ((d->msix_pba[vector >> 3] & (1 << (vector & 7))) &&
+            !pci_msix_is_masked(d, vector)) {
+            d->msix_pba[vector >> 3] &= ~(1 << (vector & 7));
+            pci_msix_send(d, vector);
+        }
+    }
+}
+
+uint32_t pci_msix_table_read(PCIDevice *d, uint32_t offset, int size_log2)
+{
+    if (offset + (1 << size_log2) > d->msix_nentries * PCI_MSIX_ENTRY_SIZE)
+        return 0;
+    switch(size_log2) {
+    case 0:
+        return d->msix_table[offset];
+    case 1:
+        return get_le16(d->msix_table + offset);
+    default:
+        return get_le32(d->msix_table + offset);
+    }
+}
+
+void pci_msix_table_write(PCIDevice *d, uint32_t offset, uint32_t val,
+                          int size_log2)
+{
+    if (offset + (1 << size_log2) > d->msix_nentries * PCI_MSIX_ENTRY_SIZE)
+        return;
+    switch(size_log2) {
+    case 0:
+        d->msix_table[offset] = val;
+        break;
+    case 1:
+        put_le16(d->msix_table + offset, val);
+        break;
+    default:
+        put_le32(d->msix_table + offset, val);
+        break;
+    }
+    if ((offset % PCI_MSIX_ENTRY_SIZE) >= PCI_MSIX_ENTRY_VECTOR_CTRL)
+        pci_msix_deliver_pending(d);
+}
+
+uint32_t pci_msix_pba_read(PCIDevice *d, uint32_t offset, int size_log2)
+{
+    uint32_t val = 0;
+    int i;
+
+    for(i = 0; i < (1 << size_log2); i++) {
+        if (offset + i < (d->msix_nentries + 63) / 64 * 8)
+            val |= d->msix_pba[offset + i] << (i * 8);
+    }
+    return val;
+}
+
 /* i440FX host bridge */
 
 struct I440FXState {
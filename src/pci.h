@@ -52,6 +52,21 @@ typedef struct PCIDevice PCIDevice;
 #define PCI_INTERRUPT_LINE	0x3c    /* 8 bits */
 #define PCI_INTERRUPT_PIN	0x3d    /* 8 bits */
 
+/* MSI-X */
+#define PCI_CAP_ID_MSIX		0x11
+#define PCI_MSIX_FLAGS		2	/* 16 bits, offset in the capability */
+#define  PCI_MSIX_FLAGS_QSIZE	0x07ff
+#define  PCI_MSIX_FLAGS_MASKALL	(1 << 14)
+#define  PCI_MSIX_FLAGS_ENABLE	(1 << 15)
+#define PCI_MSIX_CAP_SIZE	12
+#define PCI_MSIX_ENTRY_SIZE	16
+#define PCI_MSIX_ENTRY_LOWER_ADDR	0
+#define PCI_MSIX_ENTRY_UPPER_ADDR	4
+#define PCI_MSIX_ENTRY_DATA		8
+#define PCI_MSIX_ENTRY_VECTOR_CTRL	12
+#define  PCI_MSIX_ENTRY_CTRL_MASKBIT	1
+#define PCI_MSIX_MAX_ENTRIES	2048
+
 typedef void PCIBarSetFunc(void *opaque, int bar_num, uint32_t addr,
                            BOOL enabled);
 
@@ -70,6 +85,23 @@ void pci_device_set_config16(PCIDevice *d, uint8_t addr, uint16_t val);
 int pci_device_get_devfn(PCIDevice *d);
 int pci_add_capability(PCIDevice *d, const uint8_t *buf, int size);
 
+/* A message signalled interrupt is a 32 bit write of 'data' at 'addr';
+   the sink delivers it to the interrupt controller. */
+typedef void PCIMSISendFunc(void *opaque, uint64_t addr, uint32_t data);
+
+void pci_bus_set_msi_sink(PCIBus *b, PCIMSISendFunc *send, void *opaque);
+BOOL pci_bus_has_msi_sink(PCIBus *b);
+PCIBus *pci_device_get_bus(PCIDevice *d);
+int pci_msix_init(PCIDevice *d, int nentries, unsigned int bar_num,
+                  uint32_t table_offset, uint32_t pba_offset);
+BOOL pci_msix_enabled(PCIDevice *d);
+void pci_msix_notify(PCIDevice *d, int vector);
+/* accesses to the table and PBA, forwarded by the owner of the BAR */
+uint32_t pci_msix_table_read(PCIDevice *d, uint32_t offset, int size_log2);
+void pci_msix_table_write(PCIDevice *d, uint32_t offset, uint32_t val,
+                          int size_log2);
+uint32_t pci_msix_pba_read(PCIDevice *d, uint32_t offset, int size_log2);
+
 typedef struct I440FXState I440FXState;
 
 I440FXState *i440fx_init(PCIBus **pbus, int *ppiix3_devfn,
@@ -0,0 +1,14 @@
+/*
+ * Semaphores of the USDT probes of probes.h
+ *
+ * The tracers find them through the probe notes and increment them in
+ * the running process while they are attached.
+ */
+#include "probes.h"
+
+#ifdef CONFIG_SDT
+#define PROBE_DEFINE_SEMAPHORE(name)                                    \
+    volatile unsigned short PROBE_SEMAPHORE(name)                       \
+        __attribute__((section(".probes")));
+PROBE_LIST(PROBE_DEFINE_SEMAPHORE)
+#endif
@@ -0,0 +1,86 @@
+/*
+ * USDT probes for perf and bpftrace
+ *
+ * Built with CONFIG_SDT (set by CMake when <sys/sdt.h> is present), each
+ * probe has a semaphore, a counter in the .probes section that the
+ * tracers increment while attached to it. PROBE() tests it and only then
+ * evaluates its arguments and reaches the probe point (a nop plus a note
+ * in the ELF file): an untraced probe costs a load and a branch not
+ * taken. Code computing something only for a probe tests
+ * PROBE_ENABLED() itself. Without CONFIG_SDT, PROBE() compiles to
+ * nothing and its arguments are never evaluated.
+ * The probes of the "fmem_virtio" provider are listed in
+ * bpftrace/README; a new probe is added to PROBE_LIST.
+ */
+#ifndef PROBES_H
+#define PROBES_H
+
+#include <inttypes.h>
+#include <time.h>
+
+#define PROBE_LIST(P)                           \
+    P(mmio_request_start)                       \
+    P(mmio_request_done)                        \
+    P(mmio_read)                                \
+    P(mmio_write)                               \
+    P(async_queue_notify)                       \
+    P(queue_notify)                             \
+    P(consume_desc)                             \
+    P(block_req_start)                          \
+    P(block_req_end)                            \
+    P(net_tx)                                   \
+    P(net_rx)                                   \
+    P(slirp_if_start)                           \
+    P(slirp_if_output)                          \
+    P(fs_wget_start)                            \
+    P(fs_wget_done)
+
+#ifdef CONFIG_SDT
+/* the notes give the address of the semaphores */
+#define _SDT_HAS_SEMAPHORES 1
+#include <sys/sdt.h>
+
+/* the name sdt.h expects, defined in probes.c */
+#define PROBE_SEMAPHORE(name) fmem_virtio_ ## name ## _semaphore
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+#define PROBE_DECLARE_SEMAPHORE(name) \
+    extern volatile unsigned short PROBE_SEMAPHORE(name);
+PROBE_LIST(PROBE_DECLARE_SEMAPHORE)
+#ifdef __cplusplus
+}
+#endif
+
+#define PROBE_ENABLED(name) __builtin_expect(PROBE_SEMAPHORE(name) != 0, 0)
+
+#define PROBE(name, ...) do {                                   \
+        if (PROBE_ENABLED(name))                                \
+            STAP_PROBEV(fmem_virtio, name, ##__VA_ARGS__);      \
+    } while (0)
+
+/* timestamp for the latency arguments */
+static inline uint64_t probe_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+#else
+/* keeps the arguments used so that disabled probes do not warn */
+static inline void probe_unused(int dummy, ...)
+{
+}
+
+#define PROBE_ENABLED(name) 0
+
+#define PROBE(name, ...) do { if (0) probe_unused(0, ##__VA_ARGS__); } while (0)
+
+static inline uint64_t probe_time_ns(void)
+{
+    return 0;
+}
+#endif
+
+#endif /* PROBES_H */
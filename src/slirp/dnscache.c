@@ -0,0 +1,673 @@
+/*
+ * Caching DNS forwarder for the guest queries to the virtual name server
+ *
+ * Repeated queries are answered from the cache with their TTLs counted
+ * down, negative answers are kept for the SOA minimum (RFC 2308), and
+ * identical queries in flight share a single upstream query.
+ *
+ * Each upstream query has a random ID and its own socket, bound to a
+ * random port and connected to the server it was sent to, so that an
+ * off-path host must guess both to spoof an answer (RFC 5452).
+ *
+ * The guest queries come from the thread sending the guest frames and
+ * the upstream answers from the I/O thread: a mutex protects the cache.
+ */
+#include <pthread.h>
+#include <sys/random.h>
+
+#include "slirp.h"
+
+#define DNS_HDR_LEN     12
+#define DNS_MAX_NAME    255
+#define DNS_MAX_MSG     4096
+#define DNS_KEY_MAX     (DNS_MAX_NAME + 5)
+
+#define DNS_TYPE_SOA    6
+#define DNS_TYPE_OPT    41
+#define DNS_TYPE_IXFR   251
+#define DNS_TYPE_AXFR   252
+
+#define DNS_FLAG_QR     0x8000
+#define DNS_FLAG_TC     0x0200
+#define DNS_FLAG_RD     0x0100
+#define DNS_FLAG_CD     0x0010
+
+#define DNS_RCODE_NOERROR  0
+#define DNS_RCODE_NXDOMAIN 3
+
+#define DNS_CACHE_ENTRIES  256
+#define DNS_HASH_SIZE      512 /* power of two */
+#define DNS_MAX_WAITERS    8
+#define DNS_MAX_TTLS       64    /* records of a cached response */
+#define DNS_MAX_TTL        86400 /* s */
+#define DNS_RETRY_MS       1000
+#define DNS_MAX_TRIES      3
+#define DNS_POLL_BATCH     32
+#define DNS_PORT_TRIES     8     /* random ports tried before any port */
+
+/* last byte of the key: query flags the answer depends on */
+#define DNS_KEY_RD      0x01
+#define DNS_KEY_CD      0x02
+#define DNS_KEY_EDNS    0x04
+#define DNS_KEY_DO      0x08
+
+typedef struct {
+    struct in_addr addr;
+    uint16_t port;                 /* network order */
+    uint8_t id[2];
+    int max_len;                   /* largest response it accepts */
+    uint8_t qname[DNS_MAX_NAME];   /* with its own letter case */
+} DNSWaiter;
+
+typedef struct DNSEntry {
+    struct DNSEntry *hash_next;
+    struct DNSEntry *prev, *next;  /* in the LRU or the pending list */
+    uint32_t hash;
+    uint8_t key[DNS_KEY_MAX];      /* lower case name, type, class, flags */
+    int key_len;
+    int qname_len;
+    int pending;
+    u_int time;                    /* query sent or response received */
+    /* pending */
+    int fd;                        /* connected to the server, or -1 */
+    uint16_t upstream_id;
+    int tries;
+    uint8_t *query;
+    int query_len;
+    DNSWaiter *waiters;
+    int nb_waiters;
+    /* cached */
+    uint32_t ttl;                  /* s */
+    uint8_t *resp;
+    int resp_len;
+    int nb_ttls;
+    uint16_t ttl_ofs[DNS_MAX_TTLS];
+} DNSEntry;
+
+struct DNSCache {
+    pthread_mutex_t lock;
+    DNSEntry *hash_table[DNS_HASH_SIZE];
+    DNSEntry lru;                  /* most recently used first */
+    DNSEntry pending;
+    int nb_entries;
+    uint32_t id_state;
+    Metric *hits_metric;
+    Metric *misses_metric;
+    Metric *coalesced_metric;
+    Metric *entries_metric;
+};
+
+static inline int get16(const uint8_t *p)
+{
+    return (p[0] << 8) | p[1];
+}
+
+static inline uint32_t get32(const uint8_t *p)
+{
+    return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static inline uint32_t min_u32(uint32_t a, uint32_t b)
+{
+    return a < b ? a : b;
+}
+
+static inline void put16(uint8_t *p, int v)
+{
+    p[0] = v >> 8;
+    p[1] = v;
+}
+
+static inline void put32(uint8_t *p, uint32_t v)
+{
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static void list_del(DNSEntry *e)
+{
+    e->prev->next = e->next;
+    e->next->prev = e->prev;
+}
+
+static void list_add(DNSEntry *head, DNSEntry *e)
+{
+    e->prev = head;
+    e->next = head->next;
+    head->next->prev = e;
+    head->next = e;
+}
+
+static int64_t dns_read_entries(void *opaque)
+{
+    DNSCache *c = opaque;
+    return c->nb_entries;
+}
+
+void dns_cache_init(Slirp *slirp)
+{
+    DNSCache *c = mallocz(sizeof(DNSCache));
+
+    pthread_mutex_init(&c->lock, NULL);
+    c->lru.prev = c->lru.next = &c->lru;
+    c->pending.prev = c->pending.next = &c->pending;
+    c->id_state = os_get_time_ms() ^ (getpid() << 16) ^
+        (uint32_t)(uintptr_t)c;
+    c->hits_metric = metric_new(METRIC_COUNTER, "slirp_dns_queries_total",
+                                "Guest DNS queries", "result=\"hit\"");
+    c->misses_metric = metric_new(METRIC_COUNTER, "slirp_dns_queries_total",
+                                  "Guest DNS queries", "result=\"miss\"");
+    c->coalesced_metric = metric_new(METRIC_COUNTER, "slirp_dns_queries_total",
+                                     "Guest DNS queries",
+                                     "result=\"coalesced\"");
+    c->entries_metric = metric_new_gauge_func("slirp_dns_cache_entries",
+                                              "Cached or pending DNS questions",
+                                              dns_read_entries, c, NULL);
+    slirp->dns_cache = c;
+}
+
+static void dns_entry_free(DNSCache *c, DNSEntry *e)
+{
+    DNSEntry **pe;
+
+    for(pe = &c->hash_table[e->hash & (DNS_HASH_SIZE - 1)]; *pe != e;
+        pe = &(*pe)->hash_next)
+        continue;
+    *pe = e->hash_next;
+    list_del(e);
+    if (e->fd >= 0)
+        closesocket(e->fd);
+    free(e->query);
+    free(e->waiters);
+    free(e->resp);
+    free(e);
+    c->nb_entries--;
+}
+
+void dns_cache_cleanup(Slirp *slirp)
+{
+    DNSCache *c = slirp->dns_cache;
+
+    while (c->lru.next != &c->lru)
+        dns_entry_free(c, c->lru.next);
+    while (c->pending.next != &c->pending)
+        dns_entry_free(c, c->pending.next);
+    metric_free(c->hits_metric);
+    metric_free(c->misses_metric);
+    metric_free(c->coalesced_metric);
+    metric_free(c->entries_metric);
+    pthread_mutex_destroy(&c->lock);
+    free(c);
+}
+
+static uint32_t dns_hash(const uint8_t *key, int len)
+{
+    uint32_t h = 2166136261u;
+    int i;
+
+    for(i = 0; i < len; i++)
+        h = (h ^ key[i]) * 16777619u;
+    return h;
+}
+
+static DNSEntry *dns_lookup(DNSCache *c, const uint8_t *key, int key_len,
+                            uint32_t hash)
+{
+    DNSEntry *e;
+
+    for(e = c->hash_table[hash & (DNS_HASH_SIZE - 1)]; e; e = e->hash_next) {
+        if (e->hash == hash && e->key_len == key_len &&
+            !memcmp(e->key, key, key_len))
+            return e;
+    }
+    return NULL;
+}
+
+/* Return the offset after the name at 'pos', or -1 */
+static int dns_skip_name(const uint8_t *buf, int len, int pos)
+{
+    int l;
+
+    for(;;) {
+        if (pos >= len)
+            return -1;
+        l = buf[pos];
+        if (l == 0)
+            return pos + 1;
+        if ((l & 0xc0) == 0xc0)
+            return pos + 2 <= len ? pos + 2 : -1;
+        if (l & 0xc0)
+            return -1;
+        pos += 1 + l;
+    }
+}
+
+/* Build the key of the question of a standard query. Return 0 if OK,
+   -1 if the query is not cacheable. */
+static int dns_parse_query(const uint8_t *buf, int len, uint8_t *key,
+                           int *pkey_len, int *pqname_len, int *pmax_len,
+                           int *popt_pos)
+{
+    int flags, pos, l, i, type, key_flags, max_len, opt_pos;
+
+    if (len < DNS_HDR_LEN)
+        return -1;
+    flags = get16(buf + 2);
+    /* response, opcode other than QUERY, or truncated query */
+    if (flags & (DNS_FLAG_QR | 0x7800 | DNS_FLAG_TC))
+        return -1;
+    if (get16(buf + 4) != 1 || get16(buf + 6) != 0 || get16(buf + 8) != 0 ||
+        get16(buf + 10) > 1)
+        return -1;
+
+    pos = DNS_HDR_LEN;
+    for(;;) {
+        if (pos >= len)
+            return -1;
+        l = buf[pos];
+        if (l & 0xc0)
+            return -1;
+        if (pos + 1 + l - DNS_HDR_LEN > DNS_MAX_NAME || pos + 1 + l > len)
+            return -1;
+        key[pos - DNS_HDR_LEN] = l;
+        for(i = 1; i <= l; i++) {
+            int ch = buf[pos + i];
+            if (ch >= 'A' && ch <= 'Z')
+                ch += 'a' - 'A';
+            key[pos - DNS_HDR_LEN + i] = ch;
+        }
+        pos += 1 + l;
+        if (l == 0)
+            break;
+    }
+    *pqname_len = pos - DNS_HDR_LEN;
+    if (pos + 4 > len)
+        return -1;
+    type = get16(buf + pos);
+    if (type == DNS_TYPE_AXFR || type == DNS_TYPE_IXFR ||
+        type == DNS_TYPE_OPT)
+        return -1;
+    memcpy(key + *pqname_len, buf + pos, 4);
+    pos += 4;
+
+    key_flags = 0;
+    if (flags & DNS_FLAG_RD)
+        key_flags |= DNS_KEY_RD;
+    if (flags & DNS_FLAG_CD)
+        key_flags |= DNS_KEY_CD;
+    max_len = 512;
+    opt_pos = -1;
+    if (get16(buf + 10) == 1) {
+        /* EDNS: a single OPT record for the root */
+        if (pos + 11 > len || buf[pos] != 0 ||
+            get16(buf + pos + 1) != DNS_TYPE_OPT ||
+            pos + 11 + get16(buf + pos + 9) != len)
+            return -1;
+        opt_pos = pos;
+        max_len = max_int(get16(buf + pos + 3), 512);
+        key_flags |= DNS_KEY_EDNS;
+        if (buf[pos + 7] & 0x80)
+            key_flags |= DNS_KEY_DO;
+    } else if (pos != len) {
+        return -1;
+    }
+    key[*pqname_len + 4] = key_flags;
+    *pkey_len = *pqname_len + 5;
+    *pmax_len = min_int(max_len, DNS_MAX_MSG);
+    *popt_pos = opt_pos;
+    return 0;
+}
+
+/* Check that 'buf' answers the question of 'e', note the position of
+   its TTLs and return in *pttl how long it may be cached (0 if not).
+   Return -1 if it is not an answer to 'e'. */
+static int dns_scan_response(DNSEntry *e, const uint8_t *buf, int len,
+                             uint32_t *pttl)
+{
+    int flags, rcode, pos, i, n, an, ns, type, rdlen, cacheable, ch;
+    uint32_t ttl, min_ttl, neg_ttl;
+
+    if (len < DNS_HDR_LEN)
+        return -1;
+    flags = get16(buf + 2);
+    if (!(flags & DNS_FLAG_QR) || get16(buf + 4) != 1)
+        return -1;
+    /* question */
+    if (DNS_HDR_LEN + e->qname_len + 4 > len)
+        return -1;
+    for(i = 0; i < e->qname_len; i++) {
+        ch = buf[DNS_HDR_LEN + i];
+        if (ch >= 'A' && ch <= 'Z')
+            ch += 'a' - 'A';
+        if (ch != e->key[i])
+            return -1;
+    }
+    pos = DNS_HDR_LEN + e->qname_len;
+    if (memcmp(buf + pos, e->key + e->qname_len, 4) != 0)
+        return -1;
+    pos += 4;
+
+    rcode = flags & 0xf;
+    an = get16(buf + 6);
+    ns = get16(buf + 8);
+    n = an + ns + get16(buf + 10);
+    cacheable = !(flags & DNS_FLAG_TC) &&
+        (rcode == DNS_RCODE_NOERROR || rcode == DNS_RCODE_NXDOMAIN);
+    min_ttl = DNS_MAX_TTL;
+    neg_ttl = 0;
+    e->nb_ttls = 0;
+    for(i = 0; i < n; i++) {
+        pos = dns_skip_name(buf, len, pos);
+        if (pos < 0 || pos + 10 > len)
+            return -1;
+        type = get16(buf + pos);
+        ttl = get32(buf + pos + 4);
+        rdlen = get16(buf + pos + 8);
+        if (pos + 10 + rdlen > len)
+            return -1;
+        if (type != DNS_TYPE_OPT) {
+            if (ttl & 0x80000000) /* RFC 2181 */
+                ttl = 0;
+            min_ttl = min_u32(min_ttl, ttl);
+            if (e->nb_ttls < DNS_MAX_TTLS)
+                e->ttl_ofs[e->nb_ttls++] = pos + 4;
+            else
+                cacheable = 0;
+            if (type == DNS_TYPE_SOA && i >= an && i < an + ns &&
+                rdlen >= 22) {
+                neg_ttl = min_u32(ttl, get32(buf + pos + 10 + rdlen - 4));
+            }
+        }
+        pos += 10 + rdlen;
+    }
+
+    if (!cacheable)
+        *pttl = 0;
+    else if (rcode == DNS_RCODE_NXDOMAIN || an == 0)
+        *pttl = min_u32(min_ttl, neg_ttl); /* no SOA: not cached */
+    else
+        *pttl = min_ttl;
+    return 0;
+}
+
+/* Send 'buf' as the answer to 'w', its TTLs being decreased by 'elapsed'
+   seconds. */
+static void dns_send_reply(Slirp *slirp, DNSEntry *e, DNSWaiter *w,
+                           const uint8_t *buf, int len, uint32_t elapsed)
+{
+    struct sockaddr_in saddr, daddr;
+    struct mbuf *m;
+    uint8_t *p;
+    int i, truncated;
+
+    truncated = len > w->max_len;
+    if (truncated)
+        len = DNS_HDR_LEN + e->qname_len + 4;
+
+    m = m_get(slirp);
+    if (!m) {
+        return;
+    }
+    m->m_data += IF_MAXLINKHDR + sizeof(struct udpiphdr);
+    if (len > M_FREEROOM(m))
+        m_inc(m, (m->m_data - m->m_dat) + len + 1);
+    p = (uint8_t *)m->m_data;
+    memcpy(p, buf, len);
+    memcpy(p, w->id, 2);
+    memcpy(p + DNS_HDR_LEN, w->qname, e->qname_len);
+    if (truncated) {
+        /* the guest retries over TCP */
+        p[2] |= DNS_FLAG_TC >> 8;
+        memset(p + 6, 0, 6);
+    } else if (elapsed) {
+        for(i = 0; i < e->nb_ttls; i++) {
+            uint8_t *q = p + e->ttl_ofs[i];
+            uint32_t ttl = get32(q);
+            put32(q, ttl > elapsed ? ttl - elapsed : 0);
+        }
+    }
+    m->m_len = len;
+
+    saddr.sin_addr = slirp->vnameserver_addr;
+    saddr.sin_port = htons(DNS_SERVER);
+    daddr.sin_addr = w->addr;
+    daddr.sin_port = w->port;
+    udp_output2(NULL, m, &saddr, &daddr, IPTOS_LOWDELAY);
+}
+
+static uint16_t dns_random16(DNSCache *c)
+{
+    uint16_t v;
+    uint32_t x;
+
+    if (getrandom(&v, sizeof(v), GRND_NONBLOCK) == sizeof(v))
+        return v;
+    /* xorshift32 if the kernel pool is not ready yet */
+    x = c->id_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    c->id_state = x;
+    return x;
+}
+
+/* Open the socket of the query 'e': a random source port, and only the
+   answers of the server the query goes to */
+static int dns_open_upstream(DNSCache *c, DNSEntry *e)
+{
+    struct sockaddr_in addr;
+    int i;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    e->fd = os_socket(AF_INET, SOCK_DGRAM, 0);
+    if (e->fd < 0)
+        return -1;
+    for(i = 0; i < DNS_PORT_TRIES; i++) {
+        addr.sin_port = htons(1024 + dns_random16(c) % (65536 - 1024));
+        if (bind(e->fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+            break;
+    }
+    /* else the kernel picks the port when connecting */
+    addr.sin_port = htons(DNS_SERVER);
+    if (get_dns_addr(&addr.sin_addr) < 0 ||
+        connect(e->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        closesocket(e->fd);
+        e->fd = -1;
+        return -1;
+    }
+    fd_nonblock(e->fd);
+    return 0;
+}
+
+static int dns_send_query(DNSCache *c, DNSEntry *e)
+{
+    e->time = curtime;
+    e->tries++;
+    return send(e->fd, e->query, e->query_len, 0);
+}
+
+static int dns_cache_input1(Slirp *slirp, struct mbuf *m, int iphlen)
+{
+    DNSCache *c = slirp->dns_cache;
+    struct ip *ip = mtod(m, struct ip *);
+    struct udphdr *uh = (struct udphdr *)((caddr_t)ip + iphlen);
+    uint8_t *buf = (uint8_t *)(uh + 1);
+    int len = ntohs(uh->uh_ulen) - (int)sizeof(struct udphdr);
+    uint8_t key[DNS_KEY_MAX];
+    int key_len, qname_len, max_len, opt_pos, i;
+    uint32_t hash, age;
+    DNSWaiter w;
+    DNSEntry *e;
+
+    if (dns_parse_query(buf, len, key, &key_len, &qname_len, &max_len,
+                        &opt_pos) < 0)
+        return 0;
+    w.addr = ip->ip_src;
+    w.port = uh->uh_sport;
+    memcpy(w.id, buf, 2);
+    w.max_len = max_len;
+    memcpy(w.qname, buf + DNS_HDR_LEN, qname_len);
+
+    hash = dns_hash(key, key_len);
+    e = dns_lookup(c, key, key_len, hash);
+    if (e && !e->pending) {
+        age = curtime - e->time;
+        if (age < e->ttl * 1000) {
+            list_del(e);
+            list_add(&c->lru, e);
+            dns_send_reply(slirp, e, &w, e->resp, e->resp_len, age / 1000);
+            metric_inc(c->hits_metric);
+            return 1;
+        }
+        dns_entry_free(c, e);
+        e = NULL;
+    }
+
+    if (e) {
+        for(i = 0; i < e->nb_waiters; i++) {
+            DNSWaiter *w1 = &e->waiters[i];
+            if (w1->addr.s_addr == w.addr.s_addr && w1->port == w.port &&
+                !memcmp(w1->id, w.id, 2))
+                return 1; /* retransmission */
+        }
+        if (e->nb_waiters >= DNS_MAX_WAITERS)
+            return 0;
+        e->waiters[e->nb_waiters++] = w;
+        metric_inc(c->coalesced_metric);
+        return 1;
+    }
+
+    if (c->nb_entries >= DNS_CACHE_ENTRIES) {
+        if (c->lru.prev == &c->lru)
+            return 0; /* all pending */
+        dns_entry_free(c, c->lru.prev);
+    }
+
+    e = mallocz(sizeof(DNSEntry));
+    e->hash = hash;
+    memcpy(e->key, key, key_len);
+    e->key_len = key_len;
+    e->qname_len = qname_len;
+    e->pending = 1;
+    e->fd = -1;
+    e->query = malloc(len);
+    memcpy(e->query, buf, len);
+    e->query_len = len;
+    e->upstream_id = dns_random16(c);
+    put16(e->query, e->upstream_id);
+    /* the upstream answer must fit in our receive buffer */
+    if (opt_pos >= 0 && get16(e->query + opt_pos + 3) > DNS_MAX_MSG)
+        put16(e->query + opt_pos + 3, DNS_MAX_MSG);
+    e->waiters = malloc(sizeof(DNSWaiter) * DNS_MAX_WAITERS);
+    e->waiters[0] = w;
+    e->nb_waiters = 1;
+    e->hash_next = c->hash_table[hash & (DNS_HASH_SIZE - 1)];
+    c->hash_table[hash & (DNS_HASH_SIZE - 1)] = e;
+    list_add(&c->pending, e);
+    c->nb_entries++;
+    metric_inc(c->misses_metric);
+
+    if (dns_open_upstream(c, e) < 0 || dns_send_query(c, e) < 0) {
+        dns_entry_free(c, e);
+        return 0;
+    }
+    return 1;
+}
+
+int dns_cache_input(Slirp *slirp, struct mbuf *m, int iphlen)
+{
+    DNSCache *c = slirp->dns_cache;
+    int ret;
+
+    pthread_mutex_lock(&c->lock);
+    ret = dns_cache_input1(slirp, m, iphlen);
+    pthread_mutex_unlock(&c->lock);
+    return ret;
+}
+
+/* Handle the answer 'buf' received on the socket of 'e'. Return 1 if
+   it was accepted, 0 if not. */
+static int dns_upstream_input(Slirp *slirp, DNSEntry *e, const uint8_t *buf,
+                              int len)
+{
+    DNSCache *c = slirp->dns_cache;
+    uint32_t ttl;
+    int i;
+
+    if (len < DNS_HDR_LEN || get16(buf) != e->upstream_id ||
+        dns_scan_response(e, buf, len, &ttl) < 0)
+        return 0;
+
+    for(i = 0; i < e->nb_waiters; i++)
+        dns_send_reply(slirp, e, &e->waiters[i], buf, len, 0);
+
+    if (ttl == 0) {
+        dns_entry_free(c, e);
+        return 1;
+    }
+    closesocket(e->fd);
+    e->fd = -1;
+    free(e->query);
+    e->query = NULL;
+    free(e->waiters);
+    e->waiters = NULL;
+    e->nb_waiters = 0;
+    e->resp = malloc(len);
+    memcpy(e->resp, buf, len);
+    e->resp_len = len;
+    e->ttl = ttl;
+    e->time = curtime;
+    e->pending = 0;
+    list_del(e);
+    list_add(&c->lru, e);
+    return 1;
+}
+
+void dns_cache_select_fill(Slirp *slirp, int *pnfds, fd_set *readfds)
+{
+    DNSCache *c = slirp->dns_cache;
+
+    DNSEntry *e;
+
+    pthread_mutex_lock(&c->lock);
+    for(e = c->pending.next; e != &c->pending; e = e->next) {
+        FD_SET(e->fd, readfds);
+        if (*pnfds < e->fd)
+            *pnfds = e->fd;
+    }
+    pthread_mutex_unlock(&c->lock);
+}
+
+void dns_cache_select_poll(Slirp *slirp, fd_set *readfds)
+{
+    DNSCache *c = slirp->dns_cache;
+    uint8_t buf[DNS_MAX_MSG];
+    DNSEntry *e, *e_next;
+    int i, len, answered;
+
+    pthread_mutex_lock(&c->lock);
+    for(e = c->pending.next; e != &c->pending; e = e_next) {
+        e_next = e->next;
+        if (FD_ISSET(e->fd, readfds)) {
+            /* the connected socket only gets the datagrams of the server */
+            answered = 0;
+            for(i = 0; i < DNS_POLL_BATCH && !answered; i++) {
+                len = recv(e->fd, buf, sizeof(buf), 0);
+                if (len < 0)
+                    break;
+                answered = dns_upstream_input(slirp, e, buf, len);
+            }
+            if (answered)
+                continue; /* 'e' is cached or freed */
+        }
+        if (curtime - e->time >= DNS_RETRY_MS) {
+            /* the guest retries on its own once we give up */
+            if (e->tries >= DNS_MAX_TRIES || dns_send_query(c, e) < 0)
+                dns_entry_free(c, e);
+        }
+    }
+    pthread_mutex_unlock(&c->lock);
+}
@@ -0,0 +1,14 @@
+/* DNS cache defines */
+
+#define DNS_SERVER	53
+
+typedef struct DNSCache DNSCache;
+
+void dns_cache_init(Slirp *slirp);
+void dns_cache_cleanup(Slirp *slirp);
+/* Return 1 if the guest query in 'm' was answered or queued by the
+   cache, 0 if it must be forwarded as any other datagram. 'm' is left
+   to the caller. */
+int dns_cache_input(Slirp *slirp, struct mbuf *m, int iphlen);
+void dns_cache_select_fill(Slirp *slirp, int *pnfds, fd_set *readfds);
+void dns_cache_select_poll(Slirp *slirp, fd_set *readfds);
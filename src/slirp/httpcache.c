@@ -0,0 +1,1274 @@
+/*
+ * Transparent HTTP cache for the guest connections to selected ports
+ *
+ * tcp_fconnect hands such a connection to a proxy thread through a
+ * socket pair. Fresh cached responses are served from disk without a
+ * host connection, stale ones are revalidated with a conditional request
+ * and the others are fetched and stored. Bodies are stored once per
+ * content as DIR/objects/SHA256 and indexed in DIR/index by server
+ * address and URL: the Host header alone is chosen by the guest. When
+ * the objects exceed the size limit, the least recently used entries
+ * are removed with the objects no other entry uses.
+ */
+#include "slirp.h"
+#include <pthread.h>
+#include <poll.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "../topology.h"
+
+#define HTTP_MAX_PORTS  8
+#define HTTP_HEAD_MAX   16384
+#define HTTP_URL_MAX    4096
+#define HTTP_MAX_FRESH  86400   /* s, cap of the heuristic freshness */
+#define HTTP_LINGER     10      /* s */
+#define HTTP_DEFAULT_SIZE 2048  /* MB */
+#define HTTP_ORPHAN_AGE 60      /* s, objects being stored are spared */
+
+struct HTTPCache {
+    char *dir;
+    uint16_t ports[HTTP_MAX_PORTS]; /* network order */
+    int nb_ports;
+    int64_t max_size;
+    int64_t size;                   /* of the objects, estimated */
+    pthread_mutex_t collect_lock;
+    int refcount;
+    Metric *hit_metric;
+    Metric *miss_metric;
+    Metric *revalidated_metric;
+    Metric *pass_metric;
+};
+
+typedef struct {
+    int fd;
+    int pos, len;
+    uint8_t buf[HTTP_HEAD_MAX];
+} HTTPReader;
+
+typedef struct {
+    HTTPCache *cache;
+    struct sockaddr_in addr;    /* server */
+    HTTPReader guest;
+    HTTPReader server;          /* fd is -1 until needed */
+} HTTPConn;
+
+typedef struct {
+    char object[65];            /* SHA-256 of the body */
+    int64_t size;
+    int64_t expires;            /* unix time */
+    char key[HTTP_URL_MAX];
+    char head[HTTP_HEAD_MAX];   /* status line and end-to-end headers */
+} HTTPEntry;
+
+static inline int64_t min_int64(int64_t a, int64_t b)
+{
+    return a < b ? a : b;
+}
+
+/*******************************************************/
+/* SHA-256 */
+
+typedef struct {
+    uint32_t h[8];
+    uint64_t len;
+    uint8_t buf[64];
+} SHA256State;
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+    0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+    0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+    0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+    0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+    0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROR32(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static void sha256_block(SHA256State *s, const uint8_t *p)
+{
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        w[i] = ((uint32_t)p[4 * i] << 24) | (p[4 * i + 1] << 16) |
+            (p[4 * i + 2] << 8) | p[4 * i + 3];
+    for(i = 16; i < 64; i++)
+        w[i] = w[i - 16] + w[i - 7] +
+            (ROR32(w[i - 15], 7) ^ ROR32(w[i - 15], 18) ^ (w[i - 15] >> 3)) +
+            (ROR32(w[i - 2], 17) ^ ROR32(w[i - 2], 19) ^ (w[i - 2] >> 10));
+    a = s->h[0]; b = s->h[1]; c = s->h[2]; d = s->h[3];
+    e = s->h[4]; f = s->h[5]; g = s->h[6]; h = s->h[7];
+    for(i = 0; i < 64; i++) {
+        t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) +
+            ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) +
+            ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    s->h[0] += a; s->h[1] += b; s->h[2] += c; s->h[3] += d;
+    s->h[4] += e; s->h[5] += f; s->h[6] += g; s->h[7] += h;
+}
+
+static void sha256_init(SHA256State *s)
+{
+    static const uint32_t h0[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(s->h, h0, sizeof(h0));
+    s->len = 0;
+}
+
+static void sha256_update(SHA256State *s, const uint8_t *p, size_t len)
+{
+    int l, n;
+
+    while (len > 0) {
+        l = s->len & 63;
+        n = min_int(64 - l, len);
+        if (l == 0 && n == 64) {
+            sha256_block(s, p);
+        } else {
+            memcpy(s->buf + l, p, n);
+            if (l + n == 64)
+                sha256_block(s, s->buf);
+        }
+        s->len += n;
+        p += n;
+        len -= n;
+    }
+}
+
+/* 'hex' receives 65 bytes */
+static void sha256_final(SHA256State *s, char *hex)
+{
+    uint64_t bits = s->len * 8;
+    uint8_t pad[72];
+    int i, n;
+
+    n = 64 - ((s->len + 8) & 63);
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    for(i = 0; i < 8; i++)
+        pad[n + i] = bits >> (56 - 8 * i);
+    sha256_update(s, pad, n + 8);
+    for(i = 0; i < 8; i++)
+        snprintf(hex + 8 * i, 9, "%08x", s->h[i]);
+}
+
+static void sha256_hex(const char *str, char *hex)
+{
+    SHA256State s;
+
+    sha256_init(&s);
+    sha256_update(&s, (const uint8_t *)str, strlen(str));
+    sha256_final(&s, hex);
+}
+
+/*******************************************************/
+/* I/O */
+
+static int http_write(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = send(fd, p, len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int reader_fill(HTTPReader *r)
+{
+    int n;
+
+    if (r->pos > 0) {
+        memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (r->len == sizeof(r->buf))
+        return -1;
+    do {
+        n = read(r->fd, r->buf + r->len, sizeof(r->buf) - r->len);
+    } while (n < 0 && errno == EINTR);
+    if (n > 0)
+        r->len += n;
+    return n;
+}
+
+/* Read up to and including 'delim' into 'out' as a string. Return its
+   length, 0 on end of file before any byte, -1 on error. */
+static int reader_until(HTTPReader *r, const char *delim, char *out, int size)
+{
+    int dlen = strlen(delim), n;
+    uint8_t *p;
+
+    for(;;) {
+        p = memmem(r->buf + r->pos, r->len - r->pos, delim, dlen);
+        if (p) {
+            n = p + dlen - (r->buf + r->pos);
+            if (n >= size)
+                return -1;
+            memcpy(out, r->buf + r->pos, n);
+            out[n] = '\0';
+            r->pos += n;
+            return n;
+        }
+        n = reader_fill(r);
+        if (n <= 0)
+            return n == 0 && r->len == 0 ? 0 : -1;
+    }
+}
+
+/* Return in *pp up to 'max' bytes, valid until the next read */
+static int reader_read(HTTPReader *r, uint8_t **pp, int64_t max)
+{
+    int n;
+
+    if (r->pos == r->len) {
+        r->pos = r->len = 0;
+        n = reader_fill(r);
+        if (n <= 0)
+            return n;
+    }
+    n = min_int64(r->len - r->pos, max);
+    *pp = r->buf + r->pos;
+    r->pos += n;
+    return n;
+}
+
+/*******************************************************/
+/* headers */
+
+/* Copy the value of the header 'name' of 'head' to 'val'. Return 0 if
+   found, -1 if not. */
+static int http_header(const char *head, const char *name, char *val,
+                       int size)
+{
+    const char *p, *v, *e;
+    int nlen = strlen(name), n;
+
+    for(p = strstr(head, "\r\n"); p && p[2] != '\r' && p[2] != '\0';
+        p = strstr(p + 2, "\r\n")) {
+        if (strncasecmp(p + 2, name, nlen) != 0 || p[2 + nlen] != ':')
+            continue;
+        v = p + 2 + nlen + 1;
+        while (*v == ' ' || *v == '\t')
+            v++;
+        e = strstr(v, "\r\n");
+        while (e > v && (e[-1] == ' ' || e[-1] == '\t'))
+            e--;
+        n = min_int(e - v, size - 1);
+        memcpy(val, v, n);
+        val[n] = '\0';
+        return 0;
+    }
+    return -1;
+}
+
+static int http_has_header(const char *head, const char *name)
+{
+    char val[8];
+    return http_header(head, name, val, sizeof(val)) == 0;
+}
+
+/* Find 'token' in the comma separated list 'list'. Return a pointer
+   after it, or NULL. */
+static const char *http_token(const char *list, const char *token)
+{
+    int len = strlen(token);
+    const char *p = list;
+
+    for(;;) {
+        while (*p == ' ' || *p == '\t' || *p == ',')
+            p++;
+        if (*p == '\0')
+            return NULL;
+        if (!strncasecmp(p, token, len) &&
+            (p[len] == '\0' || p[len] == ',' || p[len] == '=' ||
+             p[len] == ' ' || p[len] == ';'))
+            return p + len;
+        p = strchr(p, ',');
+        if (!p)
+            return NULL;
+    }
+}
+
+static int http_header_has_token(const char *head, const char *name,
+                                 const char *token)
+{
+    char val[1024];
+
+    return http_header(head, name, val, sizeof(val)) == 0 &&
+        http_token(val, token) != NULL;
+}
+
+/* Return the value of the directive 'name' of the Cache-Control header,
+   or -1 */
+static int64_t http_max_age(const char *head, const char *name)
+{
+    char val[1024];
+    const char *p;
+
+    if (http_header(head, "Cache-Control", val, sizeof(val)) < 0)
+        return -1;
+    p = http_token(val, name);
+    if (!p || *p != '=')
+        return -1;
+    return strtoll(p + 1 + (p[1] == '"'), NULL, 10);
+}
+
+static int64_t http_date(const char *head, const char *name)
+{
+    char val[64];
+    struct tm tm;
+
+    if (http_header(head, name, val, sizeof(val)) < 0)
+        return -1;
+    memset(&tm, 0, sizeof(tm));
+    if (!strptime(val, "%a, %d %b %Y %H:%M:%S GMT", &tm))
+        return -1;
+    return timegm(&tm);
+}
+
+/* Seconds for which the response 'head' received at 'now' is fresh */
+static int64_t http_freshness(const char *head, int64_t now)
+{
+    int64_t age, date, t;
+
+    if (http_header_has_token(head, "Cache-Control", "no-cache"))
+        return 0;
+    age = http_max_age(head, "s-maxage");
+    if (age < 0)
+        age = http_max_age(head, "max-age");
+    if (age >= 0)
+        return age;
+    date = http_date(head, "Date");
+    if (date < 0)
+        date = now;
+    t = http_date(head, "Expires");
+    if (t >= 0 || http_has_header(head, "Expires"))
+        return t > date ? t - date : 0; /* invalid dates are in the past */
+    t = http_date(head, "Last-Modified");
+    if (t >= 0 && t < date)
+        return min_int64((date - t) / 10, HTTP_MAX_FRESH);
+    return 0;
+}
+
+/* Age of the response 'head' received at 'now': it spent part of its
+   freshness in the caches on the way */
+static int64_t http_age(const char *head, int64_t now)
+{
+    char val[32];
+    int64_t age = 0, date;
+
+    if (http_header(head, "Age", val, sizeof(val)) == 0)
+        age = strtoll(val, NULL, 10);
+    date = http_date(head, "Date");
+    if (date >= 0 && now - date > age)
+        age = now - date;
+    return age > 0 ? age : 0;
+}
+
+static int http_storable(const char *req, const char *resp)
+{
+    char val[256];
+
+    if (http_header_has_token(req, "Cache-Control", "no-store") ||
+        http_header_has_token(resp, "Cache-Control", "no-store") ||
+        http_header_has_token(resp, "Cache-Control", "private") ||
+        http_has_header(resp, "Set-Cookie"))
+        return 0;
+    /* Accept-Encoding is part of the key */
+    if (http_header(resp, "Vary", val, sizeof(val)) == 0 &&
+        strcasecmp(val, "Accept-Encoding") != 0)
+        return 0;
+    return 1;
+}
+
+/* Copy the status line and the end-to-end headers of 'head' to 'out' */
+static void http_filter_head(char *out, int size, const char *head)
+{
+    static const char * const hop_by_hop[] = {
+        "Connection", "Keep-Alive", "Proxy-Connection", "Transfer-Encoding",
+        "TE", "Trailer", "Upgrade", "Content-Length", "Age", NULL,
+    };
+    const char *p, *e;
+    int len = 0, n, i, skip;
+
+    for(p = head; *p != '\0' && !(p != head && p[0] == '\r'); p = e) {
+        e = strstr(p, "\r\n");
+        if (!e)
+            break;
+        e += 2;
+        skip = 0;
+        for(i = 0; p != head && hop_by_hop[i]; i++) {
+            n = strlen(hop_by_hop[i]);
+            if (!strncasecmp(p, hop_by_hop[i], n) && p[n] == ':')
+                skip = 1;
+        }
+        if (!skip && len + (e - p) < size - 3) {
+            memcpy(out + len, p, e - p);
+            len += e - p;
+        }
+    }
+    memcpy(out + len, "\r\n", 3);
+}
+
+/*******************************************************/
+/* store */
+
+typedef struct {
+    char name[65];
+    int64_t size;
+    time_t mtime;
+    int refs;
+} HTTPObject;
+
+typedef struct {
+    char name[65];
+    HTTPObject *object;         /* NULL if missing */
+    time_t mtime;               /* last use */
+} HTTPIndexFile;
+
+static int http_object_cmp(const void *a, const void *b)
+{
+    return strcmp(((const HTTPObject *)a)->name,
+                  ((const HTTPObject *)b)->name);
+}
+
+static int http_index_file_cmp(const void *a, const void *b)
+{
+    time_t ta = ((const HTTPIndexFile *)a)->mtime;
+    time_t tb = ((const HTTPIndexFile *)b)->mtime;
+    return ta < tb ? -1 : ta > tb;
+}
+
+/* Call 'cb' for each file of DIR/'subdir' named by a SHA-256 */
+static void http_scan(HTTPCache *c, const char *subdir,
+                      void (*cb)(void *opaque, const char *name,
+                                 const char *path, const struct stat *st),
+                      void *opaque)
+{
+    char path[1024];
+    struct dirent *de;
+    struct stat st;
+    DIR *d;
+
+    snprintf(path, sizeof(path), "%s/%s", c->dir, subdir);
+    d = opendir(path);
+    if (!d)
+        return;
+    while ((de = readdir(d)) != NULL) {
+        if (strlen(de->d_name) != 64)
+            continue;
+        snprintf(path, sizeof(path), "%s/%s/%s", c->dir, subdir, de->d_name);
+        if (stat(path, &st) == 0)
+            cb(opaque, de->d_name, path, &st);
+    }
+    closedir(d);
+}
+
+typedef struct {
+    HTTPObject *objects;
+    int nb_objects, objects_size;
+    HTTPIndexFile *index;
+    int nb_index, index_size;
+} HTTPScan;
+
+static void http_scan_object(void *opaque, const char *name,
+                             const char *path, const struct stat *st)
+{
+    HTTPScan *s = opaque;
+    HTTPObject *o;
+
+    if (s->nb_objects == s->objects_size) {
+        s->objects_size = max(16, s->objects_size * 2);
+        s->objects = realloc(s->objects, s->objects_size * sizeof(HTTPObject));
+    }
+    o = &s->objects[s->nb_objects++];
+    pstrcpy(o->name, sizeof(o->name), name);
+    o->size = st->st_size;
+    o->mtime = st->st_mtime;
+    o->refs = 0;
+}
+
+static void http_scan_index(void *opaque, const char *name,
+                            const char *path, const struct stat *st)
+{
+    HTTPScan *s = opaque;
+    HTTPIndexFile *ix;
+    HTTPObject key;
+    char line[256];
+    FILE *f;
+
+    if (s->nb_index == s->index_size) {
+        s->index_size = max(16, s->index_size * 2);
+        s->index = realloc(s->index, s->index_size * sizeof(HTTPIndexFile));
+    }
+    ix = &s->index[s->nb_index++];
+    pstrcpy(ix->name, sizeof(ix->name), name);
+    ix->mtime = st->st_mtime;
+    ix->object = NULL;
+    f = fopen(path, "r");
+    if (!f)
+        return;
+    if (fgets(line, sizeof(line), f) && sscanf(line, "%64s", key.name) == 1)
+        ix->object = bsearch(&key, s->objects, s->nb_objects,
+                             sizeof(HTTPObject), http_object_cmp);
+    fclose(f);
+    if (ix->object)
+        ix->object->refs++;
+}
+
+/* Remove the objects no entry uses, then the least recently used
+   entries until the objects take less than 90% of the size limit */
+static void http_collect(HTTPCache *c)
+{
+    HTTPScan s;
+    HTTPObject *o;
+    char path[1024];
+    int64_t total, now;
+    int i;
+
+    memset(&s, 0, sizeof(s));
+    http_scan(c, "objects", http_scan_object, &s);
+    qsort(s.objects, s.nb_objects, sizeof(HTTPObject), http_object_cmp);
+    http_scan(c, "index", http_scan_index, &s);
+
+    now = time(NULL);
+    total = 0;
+    for(i = 0; i < s.nb_objects; i++) {
+        o = &s.objects[i];
+        if (o->refs > 0) {
+            total += o->size;
+        } else if (now - o->mtime > HTTP_ORPHAN_AGE) {
+            /* the recent ones may be getting their entry */
+            snprintf(path, sizeof(path), "%s/objects/%s", c->dir, o->name);
+            unlink(path);
+        }
+    }
+
+    qsort(s.index, s.nb_index, sizeof(HTTPIndexFile), http_index_file_cmp);
+    for(i = 0; i < s.nb_index && total > c->max_size / 10 * 9; i++) {
+        snprintf(path, sizeof(path), "%s/index/%s", c->dir, s.index[i].name);
+        unlink(path);
+        o = s.index[i].object;
+        if (o && --o->refs == 0) {
+            snprintf(path, sizeof(path), "%s/objects/%s", c->dir, o->name);
+            unlink(path);
+            total -= o->size;
+        }
+    }
+    __atomic_store_n(&c->size, total, __ATOMIC_RELAXED);
+    free(s.objects);
+    free(s.index);
+}
+
+/* Account a stored object of 'size' bytes */
+static void http_add_size(HTTPCache *c, int64_t size)
+{
+    if (__atomic_add_fetch(&c->size, size, __ATOMIC_RELAXED) <= c->max_size)
+        return;
+    /* one connection collects, the others go on */
+    if (pthread_mutex_trylock(&c->collect_lock) != 0)
+        return;
+    if (__atomic_load_n(&c->size, __ATOMIC_RELAXED) > c->max_size)
+        http_collect(c);
+    pthread_mutex_unlock(&c->collect_lock);
+}
+
+static void http_index_path(HTTPCache *c, char *path, int size,
+                            const char *key)
+{
+    char hex[65];
+
+    sha256_hex(key, hex);
+    snprintf(path, size, "%s/index/%s", c->dir, hex);
+}
+
+static int http_load_entry(HTTPCache *c, const char *key, HTTPEntry *e)
+{
+    char path[1024], line[256];
+    FILE *f;
+    int n;
+
+    http_index_path(c, path, sizeof(path), key);
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (!fgets(line, sizeof(line), f) ||
+        sscanf(line, "%64s %" SCNd64 " %" SCNd64, e->object, &e->size,
+               &e->expires) != 3 ||
+        !fgets(e->key, sizeof(e->key), f) ||
+        strcspn(e->key, "\n") != strlen(key) ||
+        strncmp(e->key, key, strlen(key)) != 0) {
+        fclose(f);
+        return -1;
+    }
+    n = fread(e->head, 1, sizeof(e->head) - 1, f);
+    fclose(f);
+    e->head[n] = '\0';
+    pstrcpy(e->key, sizeof(e->key), key);
+    return strstr(e->head, "\r\n\r\n") ? 0 : -1;
+}
+
+/* Mark the entry 'key' as used for the eviction order */
+static void http_touch_entry(HTTPCache *c, const char *key)
+{
+    char path[1024];
+
+    http_index_path(c, path, sizeof(path), key);
+    utimes(path, NULL);
+}
+
+static int http_save_entry(HTTPCache *c, const HTTPEntry *e)
+{
+    char path[1024], tmp[1024];
+    FILE *f;
+    int fd;
+
+    snprintf(tmp, sizeof(tmp), "%s/tmp/index.XXXXXX", c->dir);
+    fd = mkstemp(tmp);
+    if (fd < 0)
+        return -1;
+    f = fdopen(fd, "w");
+    fprintf(f, "%s %" PRId64 " %" PRId64 "\n%s\n%s", e->object, e->size,
+            e->expires, e->key, e->head);
+    if (fclose(f) != 0) {
+        unlink(tmp);
+        return -1;
+    }
+    http_index_path(c, path, sizeof(path), e->key);
+    if (rename(tmp, path) < 0) {
+        unlink(tmp);
+        return -1;
+    }
+    return 0;
+}
+
+/* Send the cached response 'e'. Return 0 if OK, -1 if its body is
+   missing and nothing was sent, -2 on a guest error. */
+static int http_send_entry(HTTPConn *conn, HTTPEntry *e, int head_only,
+                           int keep_alive, int64_t now)
+{
+    char path[1024], head[HTTP_HEAD_MAX + 256];
+    uint8_t buf[65536];
+    int64_t pos;
+    int fd, len, n;
+
+    snprintf(path, sizeof(path), "%s/objects/%s", conn->cache->dir,
+             e->object);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    len = strlen(e->head) - 2;
+    memcpy(head, e->head, len);
+    len += snprintf(head + len, sizeof(head) - len,
+                    "Content-Length: %" PRId64 "\r\n%s\r\n", e->size,
+                    keep_alive ? "" : "Connection: close\r\n");
+    if (http_write(conn->guest.fd, head, len) < 0)
+        goto fail;
+    for(pos = 0; !head_only && pos < e->size; pos += n) {
+        n = pread(fd, buf, min_int64(sizeof(buf), e->size - pos), pos);
+        if (n <= 0 || http_write(conn->guest.fd, buf, n) < 0)
+            goto fail;
+    }
+    close(fd);
+    return 0;
+ fail:
+    close(fd);
+    return -2;
+}
+
+/* Answer a conditional request matching 'e' with 304 */
+static int http_send_not_modified(HTTPConn *conn, HTTPEntry *e,
+                                  int keep_alive)
+{
+    static const char * const names[] = {
+        "ETag", "Last-Modified", "Cache-Control", "Expires", NULL,
+    };
+    char head[4096], val[1024];
+    int len, i;
+
+    len = snprintf(head, sizeof(head), "HTTP/1.1 304 Not Modified\r\n");
+    for(i = 0; names[i]; i++) {
+        if (http_header(e->head, names[i], val, sizeof(val)) == 0)
+            len += snprintf(head + len, sizeof(head) - len, "%s: %s\r\n",
+                            names[i], val);
+    }
+    len += snprintf(head + len, sizeof(head) - len, "%s\r\n",
+                    keep_alive ? "" : "Connection: close\r\n");
+    return http_write(conn->guest.fd, head, min_int(len, sizeof(head) - 1));
+}
+
+static int http_not_modified(const char *req, HTTPEntry *e)
+{
+    char val[1024], etag[256];
+    int64_t ims, lm;
+
+    if (http_header(req, "If-None-Match", val, sizeof(val)) == 0) {
+        return http_header(e->head, "ETag", etag, sizeof(etag)) == 0 &&
+            (!strcmp(val, "*") || strstr(val, etag) != NULL);
+    }
+    ims = http_date(req, "If-Modified-Since");
+    lm = http_date(e->head, "Last-Modified");
+    return ims >= 0 && lm >= 0 && lm <= ims;
+}
+
+/*******************************************************/
+/* proxy */
+
+static int http_server_connect(HTTPConn *conn)
+{
+    int fd;
+
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return -1;
+    if (connect(fd, (struct sockaddr *)&conn->addr, sizeof(conn->addr)) < 0) {
+        close(fd);
+        return -1;
+    }
+    conn->server.fd = fd;
+    conn->server.pos = conn->server.len = 0;
+    return 0;
+}
+
+static void http_server_close(HTTPConn *conn)
+{
+    if (conn->server.fd >= 0) {
+        close(conn->server.fd);
+        conn->server.fd = -1;
+    }
+}
+
+/* Send the request 'req' to the server and read the response head.
+   Return its length, or -1. */
+static int http_server_request(HTTPConn *conn, const char *req, int req_len,
+                               char *resp, int size)
+{
+    int reused, n;
+
+    for(;;) {
+        reused = conn->server.fd >= 0;
+        if (!reused && http_server_connect(conn) < 0)
+            return -1;
+        n = -1;
+        if (http_write(conn->server.fd, req, req_len) == 0)
+            n = reader_until(&conn->server, "\r\n\r\n", resp, size);
+        if (n > 0)
+            return n;
+        http_server_close(conn);
+        /* a kept alive connection may have been closed meanwhile */
+        if (!reused)
+            return -1;
+    }
+}
+
+/* Relay the rest of the connection both ways, for the requests the
+   cache does not understand */
+static void http_tunnel(HTTPConn *conn, const char *req, int req_len)
+{
+    HTTPReader *r[2] = { &conn->guest, &conn->server };
+    struct pollfd pfd[2];
+    uint8_t buf[65536];
+    int i, n, open_dirs = 2;
+
+    metric_inc(conn->cache->pass_metric);
+    if (conn->server.fd < 0 && http_server_connect(conn) < 0)
+        return;
+    if (http_write(conn->server.fd, req, req_len) < 0)
+        return;
+    for(i = 0; i < 2; i++) {
+        if (r[i]->len > r[i]->pos &&
+            http_write(r[1 - i]->fd, r[i]->buf + r[i]->pos,
+                       r[i]->len - r[i]->pos) < 0)
+            return;
+        r[i]->pos = r[i]->len = 0;
+        pfd[i].fd = r[i]->fd;
+        pfd[i].events = POLLIN;
+    }
+    while (open_dirs > 0) {
+        if (poll(pfd, 2, -1) < 0) {
+            if (errno == EINTR)
+                continue;
+            return;
+        }
+        for(i = 0; i < 2; i++) {
+            if (!pfd[i].revents)
+                continue;
+            n = read(pfd[i].fd, buf, sizeof(buf));
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                /* the server closing ends the connection */
+                if (i == 1)
+                    return;
+                shutdown(pfd[1].fd, SHUT_WR);
+                pfd[i].fd = -1;
+                open_dirs--;
+            } else if (http_write(pfd[1 - i].fd, buf, n) < 0) {
+                return;
+            }
+        }
+    }
+}
+
+typedef struct {
+    int fd;                     /* temporary object file, or -1 */
+    char tmp[1024];
+    SHA256State sha;
+    int64_t size;
+} HTTPBody;
+
+/* Copy 'len' body bytes, or up to the end of file if 'len' is -1, from
+   the server to the guest and the object file. Return 0 if OK, -1 on
+   error. */
+static int http_copy_body(HTTPConn *conn, HTTPBody *b, int64_t len)
+{
+    uint8_t *p;
+    int n;
+
+    while (len != 0) {
+        n = reader_read(&conn->server, &p, len < 0 ? sizeof(conn->server.buf) : len);
+        if (n <= 0)
+            return n == 0 && len < 0 ? 0 : -1;
+        if (http_write(conn->guest.fd, p, n) < 0)
+            return -1;
+        if (b->fd >= 0) {
+            sha256_update(&b->sha, p, n);
+            if (write(b->fd, p, n) != n) {
+                close(b->fd);
+                unlink(b->tmp);
+                b->fd = -1;
+            }
+        }
+        b->size += n;
+        if (len > 0)
+            len -= n;
+    }
+    return 0;
+}
+
+/* Copy a line of the chunked encoding. Return its length, or -1. */
+static int http_copy_line(HTTPConn *conn, char *line, int size)
+{
+    int n;
+
+    n = reader_until(&conn->server, "\r\n", line, size);
+    if (n <= 0 || http_write(conn->guest.fd, line, n) < 0)
+        return -1;
+    return n;
+}
+
+static int http_copy_chunked(HTTPConn *conn, HTTPBody *b)
+{
+    char line[256];
+    int64_t chunk;
+
+    for(;;) {
+        if (http_copy_line(conn, line, sizeof(line)) < 0)
+            return -1;
+        chunk = strtoll(line, NULL, 16);
+        if (chunk <= 0)
+            break;
+        if (http_copy_body(conn, b, chunk) < 0 ||
+            http_copy_line(conn, line, sizeof(line)) < 0)
+            return -1;
+    }
+    /* trailers up to the empty line */
+    do {
+        if (http_copy_line(conn, line, sizeof(line)) < 0)
+            return -1;
+    } while (strcmp(line, "\r\n") != 0);
+    return 0;
+}
+
+/* Forward the request 'req' and its response. If 'e' is not NULL, it is
+   a stale entry which is revalidated first. If 'key' is not NULL, the
+   response is stored under it when possible. Return 0 to go on with
+   the next request, -1 to close the connection. */
+static int http_forward(HTTPConn *conn, const char *req, int req_len,
+                        HTTPEntry *e, const char *key, int head_only,
+                        int keep_alive)
+{
+    HTTPCache *c = conn->cache;
+    const char *orig_req = req;
+    int orig_len = req_len;
+    char resp[HTTP_HEAD_MAX], creq[HTTP_HEAD_MAX], val[1024], path[1024];
+    int resp_len, status, store, chunked, close_delimited, server_close;
+    int64_t now, length, freshness;
+    int len, ret;
+    HTTPEntry *ne;
+    HTTPBody body;
+
+    /* add our validators to revalidate a stale entry */
+    if (e) {
+        len = req_len - 2;
+        memcpy(creq, req, len);
+        if (http_header(e->head, "ETag", val, sizeof(val)) == 0)
+            len += snprintf(creq + len, sizeof(creq) - len,
+                            "If-None-Match: %s\r\n", val);
+        if (http_header(e->head, "Last-Modified", val, sizeof(val)) == 0)
+            len += snprintf(creq + len, sizeof(creq) - len,
+                            "If-Modified-Since: %s\r\n", val);
+        if (len == req_len - 2 || len + 2 >= sizeof(creq)) {
+            e = NULL;
+        } else {
+            memcpy(creq + len, "\r\n", 2);
+            req = creq;
+            req_len = len + 2;
+        }
+    }
+
+    resp_len = http_server_request(conn, req, req_len, resp, sizeof(resp));
+    if (resp_len < 0) {
+        static const char bad_gateway[] = "HTTP/1.1 502 Bad Gateway\r\n"
+            "Content-Length: 0\r\nConnection: close\r\n\r\n";
+        http_write(conn->guest.fd, bad_gateway, sizeof(bad_gateway) - 1);
+        return -1;
+    }
+    if (sscanf(resp, "HTTP/%*d.%*d %d", &status) != 1)
+        return -1;
+    now = time(NULL);
+    server_close = http_header_has_token(resp, "Connection", "close") ||
+        (!strncmp(resp, "HTTP/1.0", 8) &&
+         !http_header_has_token(resp, "Connection", "keep-alive"));
+
+    if (e && status == 304) {
+        /* the new response headers update the freshness */
+        if (http_has_header(resp, "Cache-Control") ||
+            http_has_header(resp, "Expires"))
+            freshness = http_freshness(resp, now);
+        else
+            freshness = http_freshness(e->head, now);
+        e->expires = now + max(freshness - http_age(resp, now), 0);
+        http_save_entry(c, e);
+        if (server_close)
+            http_server_close(conn);
+        ret = http_send_entry(conn, e, head_only, keep_alive, now);
+        if (ret == -1) {
+            /* the body went missing: fetch it again */
+            return http_forward(conn, orig_req, orig_len, NULL, key,
+                                head_only, keep_alive);
+        }
+        if (ret == 0)
+            metric_inc(c->revalidated_metric);
+        return ret == 0 && keep_alive ? 0 : -1;
+    }
+
+    freshness = max(http_freshness(resp, now) - http_age(resp, now), 0);
+    store = key && status == 200 && !head_only && http_storable(req, resp) &&
+        (freshness > 0 || http_has_header(resp, "ETag") ||
+         http_has_header(resp, "Last-Modified"));
+    metric_inc(key ? c->miss_metric : c->pass_metric);
+
+    chunked = 0;
+    close_delimited = 0;
+    length = 0;
+    if (head_only || status == 204 || status == 304 ||
+        (status >= 100 && status < 200)) {
+        /* no body */
+    } else if (http_header_has_token(resp, "Transfer-Encoding", "chunked")) {
+        chunked = 1;
+    } else if (http_header(resp, "Content-Length", val, sizeof(val)) == 0) {
+        length = strtoll(val, NULL, 10);
+    } else {
+        close_delimited = 1;
+        store = 0; /* a truncated body could not be told apart */
+    }
+
+    if (http_write(conn->guest.fd, resp, resp_len) < 0)
+        return -1;
+
+    body.fd = -1;
+    body.size = 0;
+    if (store) {
+        snprintf(body.tmp, sizeof(body.tmp), "%s/tmp/object.XXXXXX", c->dir);
+        body.fd = mkstemp(body.tmp);
+        sha256_init(&body.sha);
+    }
+    if (chunked)
+        ret = http_copy_chunked(conn, &body);
+    else
+        ret = http_copy_body(conn, &body, close_delimited ? -1 : length);
+
+    if (body.fd >= 0) {
+        if (ret == 0 && close(body.fd) == 0) {
+            ne = malloc(sizeof(HTTPEntry));
+            sha256_final(&body.sha, ne->object);
+            ne->size = body.size;
+            ne->expires = now + freshness;
+            pstrcpy(ne->key, sizeof(ne->key), key);
+            http_filter_head(ne->head, sizeof(ne->head), resp);
+            snprintf(path, sizeof(path), "%s/objects/%s", c->dir, ne->object);
+            /* identical contents share the object */
+            if (rename(body.tmp, path) == 0) {
+                http_save_entry(c, ne);
+                http_add_size(c, ne->size);
+            } else
+                unlink(body.tmp);
+            free(ne);
+        } else {
+            if (ret < 0)
+                close(body.fd);
+            unlink(body.tmp);
+        }
+    }
+    if (ret < 0 || server_close || close_delimited)
+        http_server_close(conn);
+    if (ret < 0 || close_delimited || !keep_alive)
+        return -1;
+    return 0;
+}
+
+/* Handle the request with head 'req'. Return 0 to go on with the next
+   request, -1 to close the connection. */
+static int http_handle(HTTPConn *conn, const char *req, int req_len)
+{
+    HTTPCache *c = conn->cache;
+    char method[16], target[HTTP_URL_MAX], version[16], host[256];
+    char encoding[256], key[HTTP_URL_MAX + 512], val[256], dest[32];
+    int keep_alive, head_only, ret;
+    HTTPEntry *e;
+    int64_t now;
+
+    if (sscanf(req, "%15s %4095s %15s", method, target, version) != 3)
+        return -1;
+    if (!strcmp(version, "HTTP/1.1"))
+        keep_alive = !http_header_has_token(req, "Connection", "close");
+    else
+        keep_alive = http_header_has_token(req, "Connection", "keep-alive");
+    head_only = !strcmp(method, "HEAD");
+
+    /* requests with a body, protocol upgrades and other methods are
+       passed through */
+    if ((strcmp(method, "GET") && !head_only) ||
+        http_has_header(req, "Upgrade") ||
+        http_has_header(req, "Transfer-Encoding") ||
+        (http_header(req, "Content-Length", val, sizeof(val)) == 0 &&
+         strtoll(val, NULL, 10) != 0)) {
+        http_tunnel(conn, req, req_len);
+        return -1;
+    }
+    if (http_has_header(req, "Authorization") ||
+        http_has_header(req, "Range") ||
+        http_header(req, "Host", host, sizeof(host)) < 0)
+        return http_forward(conn, req, req_len, NULL, NULL, head_only,
+                            keep_alive);
+
+    if (http_header(req, "Accept-Encoding", encoding, sizeof(encoding)) < 0)
+        encoding[0] = '\0';
+    /* a guest could store any page under another Host: the entries of
+       a URL are per server */
+    inet_ntop(AF_INET, &conn->addr.sin_addr, dest, sizeof(dest));
+    if (!strncmp(target, "http://", 7))
+        snprintf(key, sizeof(key), "%s:%d %s %s", dest,
+                 ntohs(conn->addr.sin_port), target, encoding);
+    else
+        snprintf(key, sizeof(key), "%s:%d http://%s%s %s", dest,
+                 ntohs(conn->addr.sin_port), host, target, encoding);
+
+    e = malloc(sizeof(HTTPEntry));
+    now = time(NULL);
+    if (http_load_entry(c, key, e) < 0) {
+        free(e);
+        e = NULL;
+    } else if (now < e->expires &&
+               !http_header_has_token(req, "Cache-Control", "no-cache") &&
+               http_max_age(req, "max-age") != 0 &&
+               !http_header_has_token(req, "Pragma", "no-cache")) {
+        if (http_not_modified(req, e))
+            ret = http_send_not_modified(conn, e, keep_alive) < 0 ? -2 : 0;
+        else
+            ret = http_send_entry(conn, e, head_only, keep_alive, now);
+        if (ret != -1) {
+            free(e);
+            http_touch_entry(c, key);
+            metric_inc(c->hit_metric);
+            return ret == 0 && keep_alive ? 0 : -1;
+        }
+        /* the body went missing */
+        free(e);
+        e = NULL;
+    }
+
+    /* the guest validates its own copy */
+    if (e && (http_has_header(req, "If-None-Match") ||
+              http_has_header(req, "If-Modified-Since") || head_only)) {
+        free(e);
+        e = NULL;
+    }
+    ret = http_forward(conn, req, req_len, e, head_only ? NULL : key,
+                       head_only, keep_alive);
+    free(e);
+    return ret;
+}
+
+static void http_cache_unref(HTTPCache *c)
+{
+    if (__atomic_sub_fetch(&c->refcount, 1, __ATOMIC_ACQ_REL) > 0)
+        return;
+    metric_free(c->hit_metric);
+    metric_free(c->miss_metric);
+    metric_free(c->revalidated_metric);
+    metric_free(c->pass_metric);
+    pthread_mutex_destroy(&c->collect_lock);
+    free(c->dir);
+    free(c);
+}
+
+static void *http_conn_thread(void *opaque)
+{
+    HTTPConn *conn = opaque;
+    char req[HTTP_HEAD_MAX];
+    struct timeval tv;
+    int n;
+
+    for(;;) {
+        n = reader_until(&conn->guest, "\r\n\r\n", req, sizeof(req));
+        if (n <= 0 || http_handle(conn, req, n) < 0)
+            break;
+    }
+    http_server_close(conn);
+
+    /* lingering close: slirp must not write to a closed socket */
+    shutdown(conn->guest.fd, SHUT_WR);
+    tv.tv_sec = HTTP_LINGER;
+    tv.tv_usec = 0;
+    setsockopt(conn->guest.fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    while (read(conn->guest.fd, req, sizeof(req)) > 0)
+        continue;
+    close(conn->guest.fd);
+
+    http_cache_unref(conn->cache);
+    free(conn);
+    return NULL;
+}
+
+int http_cache_connect(HTTPCache *c, const struct sockaddr_in *addr)
+{
+    HTTPConn *conn;
+    pthread_attr_t attr;
+    pthread_t thread;
+    int sv[2], err;
+
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+        return -1;
+    conn = mallocz(sizeof(HTTPConn));
+    conn->cache = c;
+    conn->addr = *addr;
+    conn->guest.fd = sv[1];
+    conn->server.fd = -1;
+    __atomic_add_fetch(&c->refcount, 1, __ATOMIC_ACQ_REL);
+
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    err = pthread_create(&thread, &attr, http_conn_thread, conn);
+    pthread_attr_destroy(&attr);
+    if (err != 0) {
+        close(sv[0]);
+        close(sv[1]);
+        http_cache_unref(c);
+        free(conn);
+        errno = err;
+        return -1;
+    }
+    pthread_setname_np(thread, "HTTP cache");
+    thread_topology_apply(THREAD_ROLE_HTTP_CACHE, thread);
+    return sv[0];
+}
+
+int http_cache_port(HTTPCache *c, uint16_t port)
+{
+    int i;
+
+    for(i = 0; i < c->nb_ports; i++) {
+        if (c->ports[i] == port)
+            return 1;
+    }
+    return 0;
+}
+
+HTTPCache *http_cache_new(const char *spec)
+{
+    static const char * const subdirs[] = { "", "/index", "/objects", "/tmp" };
+    char *str, *opt, *saveptr, path[1024];
+    HTTPCache *c;
+    int i, port;
+    long size;
+
+    c = mallocz(sizeof(HTTPCache));
+    c->max_size = (int64_t)HTTP_DEFAULT_SIZE << 20;
+    str = strdup(spec);
+    c->dir = strdup(strtok_r(str, ",", &saveptr));
+    while ((opt = strtok_r(NULL, ",", &saveptr)) != NULL) {
+        if (!strncmp(opt, "port=", 5) && c->nb_ports < HTTP_MAX_PORTS &&
+            (port = strtol(opt + 5, NULL, 0)) > 0 && port < 65536) {
+            c->ports[c->nb_ports++] = htons(port);
+        } else if (!strncmp(opt, "size=", 5) &&
+                   (size = strtol(opt + 5, NULL, 0)) > 0) {
+            c->max_size = (int64_t)size << 20;
+        } else {
+            fprintf(stderr, "http cache: invalid option '%s'\n", opt);
+            goto fail;
+        }
+    }
+    if (c->nb_ports == 0)
+        c->ports[c->nb_ports++] = htons(80);
+    for(i = 0; i < countof(subdirs); i++) {
+        snprintf(path, sizeof(path), "%s%s", c->dir, subdirs[i]);
+        if (mkdir(path, 0755) < 0 && errno != EEXIST) {
+            fprintf(stderr, "http cache: %s: %s\n", path, strerror(errno));
+            goto fail;
+        }
+    }
+    free(str);
+
+    pthread_mutex_init(&c->collect_lock, NULL);
+    http_collect(c);
+    c->refcount = 1;
+    c->hit_metric = metric_new(METRIC_COUNTER, "slirp_http_cache_requests_total",
+                               "Guest HTTP requests through the cache",
+                               "result=\"hit\"");
+    c->miss_metric = metric_new(METRIC_COUNTER, "slirp_http_cache_requests_total",
+                                "Guest HTTP requests through the cache",
+                                "result=\"miss\"");
+    c->revalidated_metric = metric_new(METRIC_COUNTER,
+                                       "slirp_http_cache_requests_total",
+                                       "Guest HTTP requests through the cache",
+                                       "result=\"revalidated\"");
+    c->pass_metric = metric_new(METRIC_COUNTER, "slirp_http_cache_requests_total",
+                                "Guest HTTP requests through the cache",
+                                "result=\"pass\"");
+    return c;
+ fail:
+    free(str);
+    free(c->dir);
+    free(c);
+    return NULL;
+}
+
+/* The connections still open keep their reference */
+void http_cache_free(HTTPCache *c)
+{
+    http_cache_unref(c);
+}
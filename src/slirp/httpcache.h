@@ -0,0 +1,13 @@
+/* http cache defines */
+
+typedef struct HTTPCache HTTPCache;
+
+/* 'spec' is DIR[,port=N]...[,size=MB] (default port 80, 2048 MB).
+   Return NULL on error. */
+HTTPCache *http_cache_new(const char *spec);
+void http_cache_free(HTTPCache *c);
+/* 'port' in network order */
+int http_cache_port(HTTPCache *c, uint16_t port);
+/* Return the slirp end of a connection served by the cache, which
+   connects to 'addr' itself when needed, or -1 with errno set. */
+int http_cache_connect(HTTPCache *c, const struct sockaddr_in *addr);
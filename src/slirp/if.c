@@ -6,6 +6,7 @@
  */
 
 #include "slirp.h"
+#include "probes.h"
 
 #define ifs_init(ifm) ((ifm)->ifs_next = (ifm)->ifs_prev = (ifm))
 
@@ -160,6 +161,8 @@ if_start(Slirp *slirp)
 	if (slirp->if_queued == 0)
 	   return; /* Nothing to do */
 
+	PROBE(slirp_if_start, slirp, slirp->if_queued);
+
  again:
         /* check if we can really output */
         if (!slirp_can_output(slirp->opaque))
@@ -201,6 +204,7 @@ if_start(Slirp *slirp)
 
 	/* Encapsulate the packet for sending */
         if_encap(slirp, (uint8_t *)ifm->m_data, ifm->m_len);
+        PROBE(slirp_if_output, slirp, ifm->m_len, slirp->if_queued);
 
         m_free(ifm);
 
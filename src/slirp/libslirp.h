@@ -25,6 +25,8 @@ void slirp_select_poll(Slirp *slirp,
                        int select_error);
 
 void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len);
+/* Call after a batch of slirp_input(), from the same thread */
+void slirp_flush(Slirp *slirp);
 
 /* you must provide the following functions: */
 int slirp_can_output(void *opaque);
@@ -37,6 +39,9 @@ int slirp_remove_hostfwd(Slirp *slirp, int is_udp,
                          struct in_addr host_addr, int host_port);
 int slirp_add_exec(Slirp *slirp, int do_pty, const void *args,
                    struct in_addr *guest_addr, int guest_port);
+/* Serve the guest connections to some ports through a caching HTTP
+   proxy. 'spec' is DIR[,port=N]... Return 0 if OK, -1 on error. */
+int slirp_set_http_cache(Slirp *slirp, const char *spec);
 
 void slirp_socket_recv(Slirp *slirp, struct in_addr guest_addr,
                        int guest_port, const uint8_t *buf, int size);
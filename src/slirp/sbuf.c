@@ -55,16 +55,14 @@ sbreserve(struct sbuf *sb, int size)
 }
 
 /*
- * Try and write() to the socket, whatever doesn't get written
- * append to the buffer... for a host with a fast net connection,
- * this prevents an unnecessary copy of the data
- * (the socket is non-blocking, so we won't hang)
+ * Append the data to the buffer. The in-order segments of a batch of
+ * guest packets are coalesced there and written to the socket by the
+ * I/O thread with a single writev(), instead of one send() each: see
+ * slirp_flush()
  */
 void
 sbappend(struct socket *so, struct mbuf *m)
 {
-	int ret = 0;
-
 	DEBUG_CALL("sbappend");
 	DEBUG_ARG("so = %lx", (long)so);
 	DEBUG_ARG("m = %lx", (long)m);
@@ -88,32 +86,9 @@ sbappend(struct socket *so, struct mbuf *m)
 		return;
 	}
 
-	/*
-	 * We only write if there's nothing in the buffer,
-	 * ottherwise it'll arrive out of order, and hence corrupt
-	 */
-	if (!so->so_rcv.sb_cc)
-	   ret = slirp_send(so, m->m_data, m->m_len, 0);
-
-	if (ret <= 0) {
-		/*
-		 * Nothing was written
-		 * It's possible that the socket has closed, but
-		 * we don't need to check because if it has closed,
-		 * it will be detected in the normal way by soread()
-		 */
-		sbappendsb(&so->so_rcv, m);
-	} else if (ret != m->m_len) {
-		/*
-		 * Something was written, but not everything..
-		 * sbappendsb the rest
-		 */
-		m->m_len -= ret;
-		m->m_data += ret;
-		sbappendsb(&so->so_rcv, m);
-	} /* else */
-	/* Whatever happened, we free the mbuf */
+	sbappendsb(&so->so_rcv, m);
 	m_free(m);
+	so->slirp->flush_pending = 1;
 }
 
 /*
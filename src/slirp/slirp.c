@@ -186,6 +186,20 @@ static void slirp_init_once(void)
     loopback_addr.s_addr = htonl(INADDR_LOOPBACK);
 }
 
+/* read without the lock of the slirp thread: a slightly stale value is
+   fine for a gauge */
+static int64_t slirp_read_mbufs(void *opaque)
+{
+    Slirp *slirp = opaque;
+    return *(volatile int *)&slirp->mbuf_alloced;
+}
+
+static int64_t slirp_read_queued(void *opaque)
+{
+    Slirp *slirp = opaque;
+    return *(volatile int *)&slirp->if_queued;
+}
+
 Slirp *slirp_init(int restricted, struct in_addr vnetwork,
                   struct in_addr vnetmask, struct in_addr vhost,
                   const char *vhostname, const char *tftp_path,
@@ -196,6 +210,15 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp_init_once();
 
+    if (pipe(slirp->flush_pipe) < 0) {
+        perror("slirp: pipe");
+        free(slirp);
+        return NULL;
+    }
+    fd_nonblock(slirp->flush_pipe[0]);
+    fd_nonblock(slirp->flush_pipe[1]);
+    pthread_mutex_init(&slirp->lock, NULL);
+
     slirp->restricted = restricted;
 
     if_init(slirp);
@@ -222,6 +245,29 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
     slirp->opaque = opaque;
 
+    slirp->sockets_metric = metric_new(METRIC_GAUGE, "slirp_sockets",
+                                       "Host sockets opened for the guest", NULL);
+    slirp->mbufs_metric = metric_new_gauge_func("slirp_mbufs",
+                                                "Allocated mbufs",
+                                                slirp_read_mbufs, slirp, NULL);
+    slirp->queued_metric = metric_new_gauge_func("slirp_queued_packets",
+                                                 "Packets waiting to be sent to the guest",
+                                                 slirp_read_queued, slirp, NULL);
+    slirp->in_packets_metric = metric_new(METRIC_COUNTER, "slirp_packets_total",
+                                          "Ethernet frames through slirp",
+                                          "dir=\"from_guest\"");
+    slirp->in_bytes_metric = metric_new(METRIC_COUNTER, "slirp_bytes_total",
+                                        "Ethernet bytes through slirp",
+                                        "dir=\"from_guest\"");
+    slirp->out_packets_metric = metric_new(METRIC_COUNTER, "slirp_packets_total",
+                                           "Ethernet frames through slirp",
+                                           "dir=\"to_guest\"");
+    slirp->out_bytes_metric = metric_new(METRIC_COUNTER, "slirp_bytes_total",
+                                         "Ethernet bytes through slirp",
+                                         "dir=\"to_guest\"");
+
+    dns_cache_init(slirp);
+
     //struct in_addr hostaddr = { .s_addr = htonl(0x7f000001)};
     //slirp_add_hostfwd(slirp, FALSE, hostaddr,
     //                  5556, vhost, 23);
@@ -231,8 +277,21 @@ Slirp *slirp_init(int restricted, struct in_addr vnetwork,
 
 void slirp_cleanup(Slirp *slirp)
 {
+    dns_cache_cleanup(slirp);
+    close(slirp->flush_pipe[0]);
+    close(slirp->flush_pipe[1]);
+    if (slirp->http_cache)
+        http_cache_free(slirp->http_cache);
+    metric_free(slirp->sockets_metric);
+    metric_free(slirp->mbufs_metric);
+    metric_free(slirp->queued_metric);
+    metric_free(slirp->in_packets_metric);
+    metric_free(slirp->in_bytes_metric);
+    metric_free(slirp->out_packets_metric);
+    metric_free(slirp->out_bytes_metric);
     free(slirp->tftp_prefix);
     free(slirp->bootp_filename);
+    pthread_mutex_destroy(&slirp->lock);
     free(slirp);
 }
 
@@ -240,12 +299,33 @@ void slirp_cleanup(Slirp *slirp)
 #define CONN_CANFRCV(so) (((so)->so_state & (SS_FCANTRCVMORE|SS_ISFCONNECTED)) == SS_ISFCONNECTED)
 #define UPD_NFDS(x) if (nfds < (x)) nfds = (x)
 
+/*
+ * Wake the I/O thread if guest data was appended to the socket buffers
+ * since the last call: it writes each buffer to its host socket, only
+ * thread to do so
+ */
+void slirp_flush(Slirp *slirp)
+{
+    char dummy = 0;
+    int pending;
+
+    pthread_mutex_lock(&slirp->lock);
+    pending = slirp->flush_pending;
+    slirp->flush_pending = 0;
+    pthread_mutex_unlock(&slirp->lock);
+    if (pending && write(slirp->flush_pipe[1], &dummy, 1) < 0 &&
+        errno != EAGAIN)
+        perror("slirp: flush");
+}
+
 void slirp_select_fill(Slirp *slirp, int *pnfds,
                        fd_set *readfds, fd_set *writefds, fd_set *xfds)
 {
     struct socket *so, *so_next;
     int nfds;
 
+    pthread_mutex_lock(&slirp->lock);
+
     /* fail safe */
     global_readfds = NULL;
     global_writefds = NULL;
@@ -355,7 +435,14 @@ void slirp_select_fill(Slirp *slirp, int *pnfds,
 		}
 	}
 
+        dns_cache_select_fill(slirp, &nfds, readfds);
+
+        FD_SET(slirp->flush_pipe[0], readfds);
+        UPD_NFDS(slirp->flush_pipe[0]);
+
         *pnfds = nfds;
+
+        pthread_mutex_unlock(&slirp->lock);
 }
 
 void slirp_select_poll(Slirp *slirp,
@@ -365,6 +452,8 @@ void slirp_select_poll(Slirp *slirp,
     struct socket *so, *so_next;
     int ret;
 
+    pthread_mutex_lock(&slirp->lock);
+
     global_readfds = readfds;
     global_writefds = writefds;
     global_xfds = xfds;
@@ -457,14 +546,14 @@ void slirp_select_poll(Slirp *slirp,
 			     */
 			    tcp_input((struct mbuf *)NULL, sizeof(struct ip), so);
 			    /* continue; */
-			  } else
-			    ret = sowrite(so);
-			  /*
-			   * XXXXX If we wrote something (a lot), there
-			   * could be a need for a window update.
-			   * In the worst case, the remote will send
-			   * a window probe to get things going again
-			   */
+			  } else if (sowrite(so) > 0) {
+			    /*
+			     * The buffer holds up to a window of
+			     * coalesced segments: the freed space may
+			     * deserve a window update
+			     */
+			    tcp_output(sototcpcb(so));
+			  }
 			}
 
 			/*
@@ -518,6 +607,20 @@ void slirp_select_poll(Slirp *slirp,
                             sorecvfrom(so);
                         }
 		}
+
+		/*
+		 * Answers of the upstream name server
+		 */
+		dns_cache_select_poll(slirp, readfds);
+
+		/*
+		 * Guest data to write: done by the next select
+		 */
+		if (FD_ISSET(slirp->flush_pipe[0], readfds)) {
+			char buf[64];
+			while (read(slirp->flush_pipe[0], buf, sizeof(buf)) > 0)
+				;
+		}
 	}
 
 	/*
@@ -536,6 +639,8 @@ void slirp_select_poll(Slirp *slirp,
 	 global_readfds = NULL;
 	 global_writefds = NULL;
 	 global_xfds = NULL;
+
+	 pthread_mutex_unlock(&slirp->lock);
 }
 
 #define ETH_ALEN 6
@@ -629,14 +734,13 @@ static void arp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
-void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+static void slirp_input1(Slirp *slirp, const uint8_t *pkt, int pkt_len)
 {
     struct mbuf *m;
     int proto;
 
-    if (pkt_len < ETH_HLEN)
-        return;
-
+    metric_inc(slirp->in_packets_metric);
+    metric_add(slirp->in_bytes_metric, pkt_len);
     proto = ntohs(*(uint16_t *)(pkt + 12));
     switch(proto) {
     case ETH_P_ARP:
@@ -663,6 +767,16 @@ void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
     }
 }
 
+void slirp_input(Slirp *slirp, const uint8_t *pkt, int pkt_len)
+{
+    if (pkt_len < ETH_HLEN)
+        return;
+
+    pthread_mutex_lock(&slirp->lock);
+    slirp_input1(slirp, pkt, pkt_len);
+    pthread_mutex_unlock(&slirp->lock);
+}
+
 /* output the IP packet to the ethernet device */
 void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
 {
@@ -710,6 +824,8 @@ void if_encap(Slirp *slirp, const uint8_t *ip_data, int ip_data_len)
         memcpy(&eh->h_source[2], &slirp->vhost_addr, 4);
         eh->h_proto = htons(ETH_P_IP);
         memcpy(buf + sizeof(struct ethhdr), ip_data, ip_data_len);
+        metric_inc(slirp->out_packets_metric);
+        metric_add(slirp->out_bytes_metric, ip_data_len + ETH_HLEN);
         slirp_output(slirp->opaque, buf, ip_data_len + ETH_HLEN);
     }
 }
@@ -774,6 +890,18 @@ int slirp_add_exec(Slirp *slirp, int do_pty, const void *args,
                     htons(guest_port));
 }
 
+int slirp_set_http_cache(Slirp *slirp, const char *spec)
+{
+    HTTPCache *c = http_cache_new(spec);
+
+    if (!c)
+        return -1;
+    if (slirp->http_cache)
+        http_cache_free(slirp->http_cache);
+    slirp->http_cache = c;
+    return 0;
+}
+
 ssize_t slirp_send(struct socket *so, const void *buf, size_t len, int flags)
 {
 #if 0
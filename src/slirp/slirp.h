@@ -2,6 +2,7 @@
 #define __COMMON_H__
 
 #include <stdlib.h>
+#include <pthread.h>
 #include "../cutils.h"
 #include "slirp_config.h"
 
@@ -164,8 +165,15 @@ int inet_aton(const char *cp, struct in_addr *ia);
 
 #include "bootp.h"
 #include "tftp.h"
+#include "dnscache.h"
+#include "httpcache.h"
+#include "../metrics.h"
 
 struct Slirp {
+    /* slirp_input() runs on the thread sending the guest frames and
+       slirp_select_fill/poll() on the I/O thread: they take it */
+    pthread_mutex_t lock;
+
     /* virtual network configuration */
     struct in_addr vnetwork_addr;
     struct in_addr vnetwork_mask;
@@ -206,6 +214,8 @@ struct Slirp {
     struct socket *tcp_last_so;
     tcp_seq tcp_iss;        /* tcp initial send seq # */
     uint32_t tcp_now;       /* for RFC 1323 timestamps */
+    int flush_pending;      /* guest data appended since slirp_flush() */
+    int flush_pipe[2];      /* wakes the I/O thread to write it */
 
     /* udp states */
     struct socket udb;
@@ -215,6 +225,21 @@ struct Slirp {
     char *tftp_prefix;
     struct tftp_session tftp_sessions[TFTP_SESSIONS_MAX];
 
+    /* dns states */
+    DNSCache *dns_cache;
+
+    /* http cache, or NULL */
+    HTTPCache *http_cache;
+
+    /* metrics */
+    Metric *sockets_metric;
+    Metric *mbufs_metric;
+    Metric *queued_metric;
+    Metric *in_packets_metric; /* from the guest */
+    Metric *in_bytes_metric;
+    Metric *out_packets_metric; /* to the guest */
+    Metric *out_bytes_metric;
+
     void *opaque;
 };
 
@@ -47,6 +47,7 @@ socreate(Slirp *slirp)
     so->so_state = SS_NOFDREF;
     so->s = -1;
     so->slirp = slirp;
+    metric_gauge_add(slirp->sockets_metric, 1);
   }
   return(so);
 }
@@ -73,6 +74,7 @@ sofree(struct socket *so)
   if(so->so_next && so->so_prev)
     remque(so);  /* crashes if so is not in a queue */
 
+  metric_gauge_add(slirp->sockets_metric, -1);
   free(so);
 }
 
@@ -39,7 +39,7 @@ typedef	uint32_t tcp_seq;
 #define      PR_FASTHZ       5               /* 5 fast timeouts per second (not important) */
 
 #define TCP_SNDSPACE 8192
-#define TCP_RCVSPACE 8192
+#define TCP_RCVSPACE 65535 /* guest data coalesced per batch, see sbappend() */
 
 /*
  * TCP header.
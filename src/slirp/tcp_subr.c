@@ -352,8 +352,20 @@ int tcp_fconnect(struct socket *so)
     DEBUG_MISC((dfd, " connect()ing, addr.sin_port=%d, "
 		"addr.sin_addr.s_addr=%.16s\n",
 		ntohs(addr.sin_port), inet_ntoa(addr.sin_addr)));
-    /* We don't care what port we get */
-    ret = connect(s,(struct sockaddr *)&addr,sizeof (addr));
+    if (slirp->http_cache &&
+        http_cache_port(slirp->http_cache, addr.sin_port)) {
+      /* The cache connects to the server itself, if it needs to */
+      closesocket(s);
+      ret = so->s = http_cache_connect(slirp->http_cache, &addr);
+      if (ret < 0)
+        return ret;
+      fd_nonblock(so->s);
+      errno = EINPROGRESS;
+      ret = -1;
+    } else {
+      /* We don't care what port we get */
+      ret = connect(s,(struct sockaddr *)&addr,sizeof (addr));
+    }
 
     /*
      * If it's not in progress, it failed, so we just return 0,
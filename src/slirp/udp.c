@@ -129,6 +129,15 @@ udp_input(register struct mbuf *m, int iphlen)
             goto bad;
         }
 
+        /*
+         *  answer the queries to the virtual name server from the cache
+         */
+        if (ip->ip_dst.s_addr == slirp->vnameserver_addr.s_addr &&
+            ntohs(uh->uh_dport) == DNS_SERVER &&
+            dns_cache_input(slirp, m, iphlen)) {
+            goto bad;
+        }
+
 #if 0
         /*
          *  handle TFTP
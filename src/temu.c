@@ -37,6 +37,11 @@
 #include <sys/ioctl.h>
 #include <net/if.h>
 #include <linux/if_tun.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
 #endif
 #include <sys/stat.h>
 #include <signal.h>
@@ -454,6 +459,340 @@ EthernetDevice *tun_open(const char *ifname)
     return net;
 }
 
+/*******************************************************/
+/* AF_PACKET */
+
+/*
+ * The interface is bound with TPACKET_V3 rings mapped in our address
+ * space: the kernel fills whole blocks of received frames that are
+ * handed to the guest straight from the ring, and the frames the guest
+ * sends are queued in the tx ring and given to the kernel with a single
+ * send() per batch.
+ *
+ * To test it on a veth pair in a namespace:
+ *   ip netns add peer
+ *   ip link add veth0 type veth peer name veth1 netns peer
+ *   ip link set veth0 up
+ *   ip -n peer addr add 192.168.4.1/24 dev veth1
+ *   ip -n peer link set veth1 up
+ * then start with --net packet:veth0 and in the VM:
+ *   ifconfig eth0 192.168.4.2; ping 192.168.4.1
+ * For a TCP transfer, which checks the checksums completed below (the
+ * peer must not send segmentation offload frames larger than the MTU):
+ *   ip netns exec peer ethtool -K veth1 tso off gso off
+ *   ip netns exec peer sh -c 'head -c 10000000 /dev/urandom | nc -l -p 5000'
+ * and in the VM:
+ *   nc 192.168.4.1 5000 | wc -c
+ *
+ * The frames sent by the sockets of the host have their TCP/UDP
+ * checksum left to the hardware (TP_STATUS_CSUMNOTREADY). The guest is
+ * not offered checksum offload, so it is completed before passing them.
+ */
+
+#define PACKET_RX_BLOCK_SIZE (1 << 16)
+#define PACKET_RX_BLOCK_NR 32
+#define PACKET_RX_BLOCK_TIMEOUT 1 /* ms before a partly filled block is
+                                     given to us */
+#define PACKET_FRAME_SIZE 2048
+#define PACKET_TX_FRAME_NR 256
+#define PACKET_TX_BLOCK_SIZE (1 << 16)
+/* offset of the frame data in a tx ring slot */
+#define PACKET_TX_DATA_OFFSET \
+    (TPACKET_ALIGN(sizeof(struct tpacket3_hdr)))
+
+typedef struct {
+    int fd;
+    BOOL select_filled;
+    uint8_t *rx_ring;
+    uint8_t *tx_ring;
+    /* receive position: block, and next frame of that block if some of
+       its frames were not taken by the guest yet */
+    int rx_block;
+    int rx_pkt_left;
+    struct tpacket3_hdr *rx_pkt;
+    int tx_frame;
+    int tx_pending; /* frames queued since the last send() */
+} PacketState;
+
+static void packet_flush(EthernetDevice *net)
+{
+    PacketState *s = net->opaque;
+
+    if (s->tx_pending == 0)
+        return;
+    s->tx_pending = 0;
+    if (send(s->fd, NULL, 0, MSG_DONTWAIT) < 0 &&
+        errno != EAGAIN && errno != ENOBUFS)
+        fprintf(stderr, "packet: send: %s\n", strerror(errno));
+}
+
+static void packet_write_packet(EthernetDevice *net,
+                                const uint8_t *buf, int len)
+{
+    PacketState *s = net->opaque;
+    struct tpacket3_hdr *h;
+
+    if (len > PACKET_FRAME_SIZE - PACKET_TX_DATA_OFFSET)
+        return;
+    h = (struct tpacket3_hdr *)(s->tx_ring +
+                                s->tx_frame * PACKET_FRAME_SIZE);
+    if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE) {
+        /* ring full: let the kernel catch up before dropping */
+        packet_flush(net);
+        if (__atomic_load_n(&h->tp_status, __ATOMIC_ACQUIRE) != TP_STATUS_AVAILABLE)
+            return;
+    }
+    memcpy((uint8_t *)h + PACKET_TX_DATA_OFFSET, buf, len);
+    h->tp_len = len;
+    h->tp_snaplen = len;
+    h->tp_next_offset = 0;
+    __atomic_store_n(&h->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+    s->tx_frame = (s->tx_frame + 1) % PACKET_TX_FRAME_NR;
+    /* the device calls flush() at the end of its batch */
+    if (++s->tx_pending >= PACKET_TX_FRAME_NR / 4)
+        packet_flush(net);
+}
+
+static uint32_t packet_csum_add(uint32_t sum, const uint8_t *buf, int len)
+{
+    int i;
+
+    for(i = 0; i + 1 < len; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    if (len & 1)
+        sum += buf[len - 1] << 8;
+    return sum;
+}
+
+/* Compute the TCP or UDP checksum of the IPv4 or IPv6 frame 'buf' */
+static void packet_complete_csum(uint8_t *buf, int len)
+{
+    int l3, l3_len, l4_len, proto, type, off;
+    uint32_t sum;
+    uint8_t *l4;
+
+    l3 = ETH_HLEN;
+    if (len < l3)
+        return;
+    type = (buf[12] << 8) | buf[13];
+    if (type == ETH_P_8021Q && len >= l3 + 4) {
+        type = (buf[16] << 8) | buf[17];
+        l3 += 4;
+    }
+    if (type == ETH_P_IP && len >= l3 + 20) {
+        l3_len = (buf[l3] & 0xf) * 4;
+        l4_len = ((buf[l3 + 2] << 8) | buf[l3 + 3]) - l3_len;
+        proto = buf[l3 + 9];
+        sum = packet_csum_add(0, buf + l3 + 12, 8);
+    } else if (type == ETH_P_IPV6 && len >= l3 + 40) {
+        /* the kernel offloads no checksum after extension headers */
+        l3_len = 40;
+        l4_len = (buf[l3 + 4] << 8) | buf[l3 + 5];
+        proto = buf[l3 + 6];
+        sum = packet_csum_add(0, buf + l3 + 8, 32);
+    } else {
+        return;
+    }
+    if (proto == IPPROTO_TCP)
+        off = 16;
+    else if (proto == IPPROTO_UDP)
+        off = 6;
+    else
+        return;
+    if (l3_len < 20 || l4_len < off + 2 || l3 + l3_len + l4_len > len)
+        return;
+    l4 = buf + l3 + l3_len;
+    l4[off] = l4[off + 1] = 0;
+    sum = packet_csum_add(sum + proto + l4_len, l4, l4_len);
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    sum = ~sum & 0xffff;
+    if (sum == 0 && proto == IPPROTO_UDP)
+        sum = 0xffff;
+    l4[off] = sum >> 8;
+    l4[off + 1] = sum;
+}
+
+static struct tpacket_block_desc *packet_rx_block(PacketState *s)
+{
+    return (struct tpacket_block_desc *)(s->rx_ring +
+                                         s->rx_block * PACKET_RX_BLOCK_SIZE);
+}
+
+static BOOL packet_rx_ready(PacketState *s)
+{
+    return s->rx_pkt_left > 0 ||
+        (__atomic_load_n(&packet_rx_block(s)->hdr.bh1.block_status,
+                         __ATOMIC_ACQUIRE) & TP_STATUS_USER);
+}
+
+static void packet_select_fill(EthernetDevice *net, int *pfd_max,
+                               fd_set *rfds, fd_set *wfds, fd_set *efds,
+                               int *pdelay)
+{
+    PacketState *s = net->opaque;
+
+    s->select_filled = net->device_can_write_packet(net);
+    if (s->select_filled) {
+        FD_SET(s->fd, rfds);
+        *pfd_max = max_int(*pfd_max, s->fd);
+        /* blocks filled while we were waiting for guest buffers */
+        if (packet_rx_ready(s))
+            *pdelay = 0;
+    }
+}
+
+static void packet_select_poll(EthernetDevice *net,
+                               fd_set *rfds, fd_set *wfds, fd_set *efds,
+                               int select_ret)
+{
+    PacketState *s = net->opaque;
+    struct tpacket_block_desc *b;
+
+    if (!s->select_filled)
+        return;
+    for(;;) {
+        b = packet_rx_block(s);
+        if (s->rx_pkt_left == 0) {
+            if (!(__atomic_load_n(&b->hdr.bh1.block_status, __ATOMIC_ACQUIRE) &
+                  TP_STATUS_USER))
+                break;
+            s->rx_pkt_left = b->hdr.bh1.num_pkts;
+            s->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)b +
+                                                b->hdr.bh1.offset_to_first_pkt);
+        }
+        while (s->rx_pkt_left > 0) {
+            if (!net->device_can_write_packet(net))
+                return;
+            if (s->rx_pkt->tp_status & TP_STATUS_CSUMNOTREADY)
+                packet_complete_csum((uint8_t *)s->rx_pkt + s->rx_pkt->tp_mac,
+                                     s->rx_pkt->tp_snaplen);
+            net->device_write_packet(net, (uint8_t *)s->rx_pkt +
+                                     s->rx_pkt->tp_mac,
+                                     s->rx_pkt->tp_snaplen);
+            s->rx_pkt = (struct tpacket3_hdr *)((uint8_t *)s->rx_pkt +
+                                                s->rx_pkt->tp_next_offset);
+            s->rx_pkt_left--;
+        }
+        /* give the block back */
+        __atomic_store_n(&b->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                         __ATOMIC_RELEASE);
+        s->rx_block = (s->rx_block + 1) % PACKET_RX_BLOCK_NR;
+    }
+}
+
+/* spec is IFNAME or IFNAME:GROUP; the sockets of a fanout group share the
+   frames received on the interface by flow hash */
+EthernetDevice *packet_open(const char *spec)
+{
+    char ifname[IFNAMSIZ];
+    const char *p;
+    struct tpacket_req3 rx_req, tx_req;
+    struct sockaddr_ll sll;
+    struct packet_mreq mreq;
+    EthernetDevice *net;
+    PacketState *s;
+    int fd, ifindex, version, one, fanout;
+    size_t rx_size, ring_size;
+    void *ring;
+
+    p = strchr(spec, ':');
+    pstrcpy(ifname, min_int(sizeof(ifname), p ? p - spec + 1 : sizeof(ifname)),
+            spec);
+    fanout = p ? strtoul(p + 1, NULL, 0) : -1;
+    ifindex = if_nametoindex(ifname);
+    if (ifindex == 0) {
+        fprintf(stderr, "Error: no interface %s\n", ifname);
+        return NULL;
+    }
+    fd = socket(AF_PACKET, SOCK_RAW | SOCK_CLOEXEC, htons(ETH_P_ALL));
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open a packet socket: %s\n",
+                strerror(errno));
+        return NULL;
+    }
+    version = TPACKET_V3;
+    if (setsockopt(fd, SOL_PACKET, PACKET_VERSION, &version,
+                   sizeof(version)) < 0)
+        goto fail;
+
+    memset(&rx_req, 0, sizeof(rx_req));
+    rx_req.tp_block_size = PACKET_RX_BLOCK_SIZE;
+    rx_req.tp_block_nr = PACKET_RX_BLOCK_NR;
+    rx_req.tp_frame_size = PACKET_FRAME_SIZE;
+    rx_req.tp_frame_nr = PACKET_RX_BLOCK_SIZE / PACKET_FRAME_SIZE *
+        PACKET_RX_BLOCK_NR;
+    rx_req.tp_retire_blk_tov = PACKET_RX_BLOCK_TIMEOUT;
+    memset(&tx_req, 0, sizeof(tx_req));
+    tx_req.tp_block_size = PACKET_TX_BLOCK_SIZE;
+    tx_req.tp_frame_size = PACKET_FRAME_SIZE;
+    tx_req.tp_frame_nr = PACKET_TX_FRAME_NR;
+    tx_req.tp_block_nr = PACKET_TX_FRAME_NR * PACKET_FRAME_SIZE /
+        PACKET_TX_BLOCK_SIZE;
+    if (setsockopt(fd, SOL_PACKET, PACKET_RX_RING, &rx_req,
+                   sizeof(rx_req)) < 0 ||
+        setsockopt(fd, SOL_PACKET, PACKET_TX_RING, &tx_req,
+                   sizeof(tx_req)) < 0)
+        goto fail;
+    /* the guest does not want its own frames back */
+    one = 1;
+    setsockopt(fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one, sizeof(one));
+
+    /* a single mapping, rx ring first */
+    rx_size = (size_t)PACKET_RX_BLOCK_SIZE * PACKET_RX_BLOCK_NR;
+    ring_size = rx_size + (size_t)PACKET_TX_FRAME_NR * PACKET_FRAME_SIZE;
+    ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (ring == MAP_FAILED)
+        goto fail;
+
+    memset(&sll, 0, sizeof(sll));
+    sll.sll_family = AF_PACKET;
+    sll.sll_protocol = htons(ETH_P_ALL);
+    sll.sll_ifindex = ifindex;
+    if (bind(fd, (struct sockaddr *)&sll, sizeof(sll)) < 0)
+        goto fail_unmap;
+    /* the guest has its own MAC address */
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    if (setsockopt(fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                   sizeof(mreq)) < 0)
+        goto fail_unmap;
+    if (fanout >= 0) {
+        fanout = (fanout & 0xffff) |
+            ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+        if (setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &fanout,
+                       sizeof(fanout)) < 0)
+            goto fail_unmap;
+    }
+
+    s = mallocz(sizeof(*s));
+    s->fd = fd;
+    s->rx_ring = ring;
+    s->tx_ring = (uint8_t *)ring + rx_size;
+
+    net = mallocz(sizeof(*net));
+    net->mac_addr[0] = 0x02;
+    net->mac_addr[1] = 0x00;
+    net->mac_addr[2] = 0x00;
+    net->mac_addr[3] = 0x00;
+    net->mac_addr[4] = 0x00;
+    net->mac_addr[5] = 0x01;
+    net->opaque = s;
+    net->write_packet = packet_write_packet;
+    net->flush = packet_flush;
+    net->select_fill = packet_select_fill;
+    net->select_poll = packet_select_poll;
+    return net;
+ fail_unmap:
+    munmap(ring, ring_size);
+ fail:
+    fprintf(stderr, "Error: could not set up the packet rings on %s: %s\n",
+            ifname, strerror(errno));
+    close(fd);
+    return NULL;
+}
+
 #endif /* !_WIN32 */
 
 #ifdef CONFIG_SLIRP
@@ -470,6 +809,12 @@ static void slirp_write_packet(EthernetDevice *net,
     slirp_input(slirp_state, buf, len);
 }
 
+static void slirp_flush1(EthernetDevice *net)
+{
+    Slirp *slirp_state = net->opaque;
+    slirp_flush(slirp_state);
+}
+
 int slirp_can_output(void *opaque)
 {
     EthernetDevice *net = opaque;
@@ -498,7 +843,8 @@ static void slirp_select_poll1(EthernetDevice *net,
     slirp_select_poll(slirp_state, rfds, wfds, efds, (select_ret <= 0));
 }
 
-EthernetDevice *slirp_open(void)
+/* 'spec' is NULL or http-cache=DIR[,port=N]...[,size=MB] */
+EthernetDevice *slirp_open(const char *spec)
 {
     EthernetDevice *net;
     struct in_addr net_addr  = { .s_addr = htonl(0x0a000200) }; /* 10.0.2.0 */
@@ -514,10 +860,24 @@ EthernetDevice *slirp_open(void)
         fprintf(stderr, "Only a single slirp instance is allowed\n");
         return NULL;
     }
+    if (spec && strncmp(spec, "http-cache=", 11) != 0) {
+        fprintf(stderr, "slirp: unknown option '%s'\n", spec);
+        return NULL;
+    }
     net = mallocz(sizeof(*net));
 
     slirp_state = slirp_init(restricted, net_addr, mask, host, vhostname,
                              "", bootfile, dhcp, dns, net);
+    if (!slirp_state) {
+        free(net);
+        return NULL;
+    }
+    if (spec && slirp_set_http_cache(slirp_state, spec + 11) < 0) {
+        slirp_cleanup(slirp_state);
+        slirp_state = NULL;
+        free(net);
+        return NULL;
+    }
     
     net->mac_addr[0] = 0x02;
     net->mac_addr[1] = 0x00;
@@ -527,6 +887,7 @@ EthernetDevice *slirp_open(void)
     net->mac_addr[5] = 0x01;
     net->opaque = slirp_state;
     net->write_packet = slirp_write_packet;
+    net->flush = slirp_flush1;
     net->select_fill = slirp_select_fill1;
     net->select_poll = slirp_select_poll1;
     
@@ -33,5 +33,9 @@ typedef enum {
 } BlockDeviceModeEnum;
 BlockDevice *block_device_init(const char *filename, BlockDeviceModeEnum mode);
 
-EthernetDevice *slirp_open(void);
+EthernetDevice *slirp_open(const char *spec);
 EthernetDevice *tun_open(const char *tun_iface);
+EthernetDevice *packet_open(const char *spec);
+EthernetDevice *vswitch_open(const char *name);
+
+VsockDevice *vsock_unix_open(const char *uds_path, uint64_t guest_cid);
@@ -0,0 +1,331 @@
+/*
+ * Host thread placement: CPU affinity, real-time priority and NUMA node
+ *
+ * Every long-running host thread belongs to a role. A role may be pinned
+ * to a CPU list and run under SCHED_FIFO so that MMIO responses are not
+ * delayed by unrelated work on the host. When a NUMA node is given
+ * (directly or through the FPGA's PCI address), roles without their own
+ * CPU list stay on that node and buffers shared with the card are
+ * allocated from it.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <ctype.h>
+#include <errno.h>
+#include <sched.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "cutils.h"
+#include "topology.h"
+
+#define MAX_TOPOLOGY_THREADS 32
+#define MPOL_PREFERRED 1
+#define MAX_NUMA_NODES 1024
+
+typedef struct {
+    BOOL has_cpus;
+    cpu_set_t cpus;
+    int policy; /* SCHED_OTHER or SCHED_FIFO */
+    int priority;
+} RoleConfig;
+
+typedef struct {
+    ThreadRole role;
+    pthread_t thread;
+} TopologyThread;
+
+static const char *role_names[THREAD_ROLE_COUNT] = {
+    [THREAD_ROLE_MMIO] = "mmio",
+    [THREAD_ROLE_CONSOLE_INPUT] = "console-input",
+    [THREAD_ROLE_CONSOLE_OUTPUT] = "console-output",
+    [THREAD_ROLE_VIRTIO_IO] = "virtio-io",
+    [THREAD_ROLE_VIRTIO_QUEUES] = "virtio-queues",
+    [THREAD_ROLE_ENTROPY] = "entropy",
+    [THREAD_ROLE_METRICS] = "metrics",
+    [THREAD_ROLE_CAPTURE] = "capture",
+    [THREAD_ROLE_HTTP_CACHE] = "http-cache",
+};
+
+static RoleConfig role_config[THREAD_ROLE_COUNT];
+static int numa_node = -1;
+static cpu_set_t numa_cpus;
+
+static pthread_mutex_t topology_lock = PTHREAD_MUTEX_INITIALIZER;
+static TopologyThread topology_threads[MAX_TOPOLOGY_THREADS];
+static int topology_thread_count;
+
+/* parse a kernel style CPU list such as "0,2,4-7" */
+static int parse_cpulist(const char *str, cpu_set_t *set)
+{
+    const char *p = str;
+    char *end;
+    long first, last, i;
+
+    CPU_ZERO(set);
+    while (*p != '\0') {
+        first = strtol(p, &end, 10);
+        if (end == p || first < 0 || first >= CPU_SETSIZE)
+            return -1;
+        last = first;
+        p = end;
+        if (*p == '-') {
+            p++;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE)
+                return -1;
+            p = end;
+        }
+        for(i = first; i <= last; i++)
+            CPU_SET(i, set);
+        if (*p == ',')
+            p++;
+        else if (*p != '\0' && *p != '\n')
+            return -1;
+        else
+            break;
+    }
+    return CPU_COUNT(set) ? 0 : -1;
+}
+
+static void format_cpulist(const cpu_set_t *set, char *buf, int buf_size)
+{
+    int i, first, len = 0;
+
+    buf[0] = '\0';
+    for(i = 0; i < CPU_SETSIZE && len < buf_size; i++) {
+        if (!CPU_ISSET(i, set))
+            continue;
+        first = i;
+        while (i + 1 < CPU_SETSIZE && CPU_ISSET(i + 1, set))
+            i++;
+        if (first == i)
+            len += snprintf(buf + len, buf_size - len, "%s%d",
+                            len ? "," : "", first);
+        else
+            len += snprintf(buf + len, buf_size - len, "%s%d-%d",
+                            len ? "," : "", first, i);
+    }
+}
+
+static int read_sysfs_line(const char *path, char *buf, int buf_size)
+{
+    FILE *f;
+
+    f = fopen(path, "r");
+    if (!f)
+        return -1;
+    if (!fgets(buf, buf_size, f)) {
+        fclose(f);
+        return -1;
+    }
+    fclose(f);
+    return 0;
+}
+
+int thread_topology_set_role(const char *spec)
+{
+    char buf[256], *cpus, *policy, *prio;
+    RoleConfig *rc;
+    int role;
+
+    pstrcpy(buf, sizeof(buf), spec);
+    cpus = strchr(buf, '=');
+    if (!cpus)
+        goto fail;
+    *cpus++ = '\0';
+    for(role = 0; role < THREAD_ROLE_COUNT; role++) {
+        if (!strcmp(buf, role_names[role]))
+            break;
+    }
+    if (role == THREAD_ROLE_COUNT)
+        goto fail;
+    rc = &role_config[role];
+
+    policy = strchr(cpus, ':');
+    if (policy)
+        *policy++ = '\0';
+    if (*cpus != '\0') {
+        if (parse_cpulist(cpus, &rc->cpus) < 0)
+            goto fail;
+        rc->has_cpus = TRUE;
+    }
+    rc->policy = SCHED_OTHER;
+    rc->priority = 0;
+    if (policy) {
+        prio = strchr(policy, ':');
+        if (prio)
+            *prio++ = '\0';
+        if (strcmp(policy, "fifo") != 0)
+            goto fail;
+        rc->policy = SCHED_FIFO;
+        rc->priority = prio ? atoi(prio) : 1;
+        if (rc->priority < sched_get_priority_min(SCHED_FIFO) ||
+            rc->priority > sched_get_priority_max(SCHED_FIFO))
+            goto fail;
+    }
+    return 0;
+ fail:
+    fprintf(stderr, "Invalid thread placement '%s' (expected role=cpus[:fifo[:prio]] with role one of", spec);
+    for(role = 0; role < THREAD_ROLE_COUNT; role++)
+        fprintf(stderr, " %s", role_names[role]);
+    fprintf(stderr, ")\r\n");
+    return -1;
+}
+
+int thread_topology_set_numa(const char *node)
+{
+    char path[256], line[1024];
+    char *end;
+    long n;
+
+    n = strtol(node, &end, 10);
+    if (end == node || *end != '\0') {
+        /* PCI address of the card */
+        snprintf(path, sizeof(path), "/sys/bus/pci/devices/%s/numa_node",
+                 node);
+        if (read_sysfs_line(path, line, sizeof(line)) < 0) {
+            fprintf(stderr, "Cannot read %s\r\n", path);
+            return -1;
+        }
+        n = strtol(line, NULL, 10);
+        if (n < 0) {
+            fprintf(stderr, "Warning: %s has no NUMA affinity\r\n", node);
+            numa_node = -1;
+            return 0;
+        }
+    }
+    if (n < 0 || n >= MAX_NUMA_NODES) {
+        fprintf(stderr, "Invalid NUMA node '%s'\r\n", node);
+        return -1;
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/node/node%ld/cpulist",
+             n);
+    if (read_sysfs_line(path, line, sizeof(line)) < 0 ||
+        parse_cpulist(line, &numa_cpus) < 0) {
+        fprintf(stderr, "Cannot read the CPUs of NUMA node %ld\r\n", n);
+        return -1;
+    }
+    numa_node = n;
+    return 0;
+}
+
+int thread_topology_get_numa_node(void)
+{
+    return numa_node;
+}
+
+void thread_topology_apply(ThreadRole role, pthread_t thread)
+{
+    RoleConfig *rc = &role_config[role];
+    const cpu_set_t *cpus = NULL;
+    struct sched_param param;
+    int ret;
+
+    if (rc->has_cpus)
+        cpus = &rc->cpus;
+    else if (numa_node >= 0)
+        cpus = &numa_cpus;
+    if (cpus) {
+        ret = pthread_setaffinity_np(thread, sizeof(cpu_set_t), cpus);
+        if (ret != 0)
+            fprintf(stderr, "Warning: cannot set the CPU affinity of %s: %s\r\n",
+                    role_names[role], strerror(ret));
+    }
+    if (rc->policy == SCHED_FIFO) {
+        memset(&param, 0, sizeof(param));
+        param.sched_priority = rc->priority;
+        ret = pthread_setschedparam(thread, SCHED_FIFO, &param);
+        if (ret != 0)
+            fprintf(stderr, "Warning: cannot make %s SCHED_FIFO: %s%s\r\n",
+                    role_names[role], strerror(ret),
+                    ret == EPERM ? " (needs CAP_SYS_NICE)" : "");
+    }
+
+    pthread_mutex_lock(&topology_lock);
+    if (topology_thread_count < MAX_TOPOLOGY_THREADS) {
+        topology_threads[topology_thread_count].role = role;
+        topology_threads[topology_thread_count].thread = thread;
+        topology_thread_count++;
+    }
+    pthread_mutex_unlock(&topology_lock);
+}
+
+void thread_topology_report(void)
+{
+    char name[16], cpus[256];
+    struct sched_param param;
+    cpu_set_t set;
+    int i, policy;
+
+    fprintf(stderr, "Thread placement");
+    if (numa_node >= 0)
+        fprintf(stderr, " (NUMA node %d)", numa_node);
+    fprintf(stderr, ":\r\n");
+    pthread_mutex_lock(&topology_lock);
+    for(i = 0; i < topology_thread_count; i++) {
+        TopologyThread *t = &topology_threads[i];
+        if (pthread_getname_np(t->thread, name, sizeof(name)) != 0)
+            pstrcpy(name, sizeof(name), "?");
+        if (pthread_getaffinity_np(t->thread, sizeof(set), &set) == 0)
+            format_cpulist(&set, cpus, sizeof(cpus));
+        else
+            pstrcpy(cpus, sizeof(cpus), "?");
+        if (pthread_getschedparam(t->thread, &policy, &param) != 0)
+            policy = -1;
+        fprintf(stderr, "  %-15s %-15s cpus %-12s ", role_names[t->role],
+                name, cpus);
+        if (policy == SCHED_FIFO)
+            fprintf(stderr, "SCHED_FIFO/%d\r\n", param.sched_priority);
+        else if (policy == SCHED_OTHER)
+            fprintf(stderr, "SCHED_OTHER\r\n");
+        else if (policy == SCHED_IDLE)
+            fprintf(stderr, "SCHED_IDLE\r\n");
+        else
+            fprintf(stderr, "policy %d\r\n", policy);
+    }
+    pthread_mutex_unlock(&topology_lock);
+}
+
+void thread_topology_bind(void *ptr, size_t size)
+{
+#ifdef SYS_mbind
+    if (numa_node >= 0) {
+        unsigned long mask[MAX_NUMA_NODES / (8 * sizeof(unsigned long))];
+
+        memset(mask, 0, sizeof(mask));
+        mask[numa_node / (8 * sizeof(unsigned long))] |=
+            1UL << (numa_node % (8 * sizeof(unsigned long)));
+        /* pages are placed on first touch, so this only sets the policy */
+        if (syscall(SYS_mbind, ptr, size, MPOL_PREFERRED, mask,
+                    MAX_NUMA_NODES + 1, 0) < 0)
+            fprintf(stderr, "Warning: mbind to NUMA node %d failed: %s\r\n",
+                    numa_node, strerror(errno));
+    }
+#endif
+}
+
+void *thread_topology_alloc(size_t size)
+{
+    void *ptr;
+
+    ptr = mmap(NULL, size, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        fprintf(stderr, "Error: cannot allocate %zu bytes: %s\r\n", size,
+                strerror(errno));
+        abort();
+    }
+    thread_topology_bind(ptr, size);
+    return ptr;
+}
+
+void thread_topology_free(void *ptr, size_t size)
+{
+    if (ptr)
+        munmap(ptr, size);
+}
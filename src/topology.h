@@ -0,0 +1,44 @@
+/*
+ * Host thread placement: CPU affinity, real-time priority and NUMA node
+ */
+#ifndef TOPOLOGY_H
+#define TOPOLOGY_H
+
+#include <pthread.h>
+
+typedef enum {
+    THREAD_ROLE_MMIO,           /* main thread answering MMIO requests */
+    THREAD_ROLE_CONSOLE_INPUT,
+    THREAD_ROLE_CONSOLE_OUTPUT,
+    THREAD_ROLE_VIRTIO_IO,
+    THREAD_ROLE_VIRTIO_QUEUES,
+    THREAD_ROLE_ENTROPY,
+    THREAD_ROLE_METRICS,
+    THREAD_ROLE_CAPTURE,        /* pcap-ng writer */
+    THREAD_ROLE_HTTP_CACHE,     /* slirp http cache connections */
+    THREAD_ROLE_COUNT,
+} ThreadRole;
+
+/* Parse "role=cpulist[:fifo[:prio]]", e.g. "mmio=2:fifo:50" or
+   "virtio-io=4-5". Return 0 if OK, -1 on error. */
+int thread_topology_set_role(const char *spec);
+/* 'node' is a NUMA node number or a PCI address such as 0000:65:00.0
+   whose node is read from sysfs. Roles without an explicit CPU list are
+   then confined to the CPUs of that node. Return 0 if OK, -1 on error. */
+int thread_topology_set_numa(const char *node);
+int thread_topology_get_numa_node(void);
+
+/* Apply the configuration of 'role' to a freshly created thread and
+   remember it for the placement report */
+void thread_topology_apply(ThreadRole role, pthread_t thread);
+/* Print where every registered thread actually ended up */
+void thread_topology_report(void);
+
+/* Allocate a buffer whose pages prefer the configured NUMA node. The
+   memory is zeroed and must be released with thread_topology_free(). */
+void *thread_topology_alloc(size_t size);
+void thread_topology_free(void *ptr, size_t size);
+/* Apply the NUMA policy to memory mapped by the caller */
+void thread_topology_bind(void *ptr, size_t size);
+
+#endif /* TOPOLOGY_H */
@@ -0,0 +1,221 @@
+/*
+ * Binary trace of the host/guest interface
+ *
+ * The file starts with a header (magic, version) followed by one record
+ * per event: a type byte, then the time since the previous record, the
+ * address and the value as LEB128 varints. MMIO writes add the byte
+ * strobe; DMA records use the value as the length and carry the data.
+ * Most records fit in a handful of bytes.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+
+#include "cutils.h"
+#include "trace.h"
+
+#define TRACE_MAGIC 0x52545646 /* "FVTR" */
+#define TRACE_VERSION 1
+#define TRACE_BUF_SIZE (1 << 20)
+
+int trace_recording;
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static FILE *trace_file;
+static uint64_t trace_start_ns, trace_last_ns;
+
+struct TraceReader {
+    FILE *f;
+    uint64_t time_ns;
+    uint8_t *buf;
+    uint32_t buf_size;
+};
+
+static uint64_t trace_get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void put_varint(FILE *f, uint64_t v)
+{
+    while (v >= 0x80) {
+        putc_unlocked((v & 0x7f) | 0x80, f);
+        v >>= 7;
+    }
+    putc_unlocked(v, f);
+}
+
+static int get_varint(FILE *f, uint64_t *pv)
+{
+    uint64_t v = 0;
+    int c, shift;
+
+    for(shift = 0; shift < 64; shift += 7) {
+        c = getc_unlocked(f);
+        if (c == EOF)
+            return -1;
+        v |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *pv = v;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+static void trace_atexit(void)
+{
+    trace_close();
+}
+
+int trace_open(const char *filename)
+{
+    uint8_t header[8];
+
+    trace_file = fopen(filename, "wb");
+    if (!trace_file) {
+        fprintf(stderr, "Cannot open trace file %s: %s\r\n", filename,
+                strerror(errno));
+        return -1;
+    }
+    setvbuf(trace_file, NULL, _IOFBF, TRACE_BUF_SIZE);
+    put_le32(header, TRACE_MAGIC);
+    put_le32(header + 4, TRACE_VERSION);
+    fwrite(header, 1, sizeof(header), trace_file);
+    trace_start_ns = trace_last_ns = trace_get_time_ns();
+    atexit(trace_atexit);
+    trace_recording = 1;
+    return 0;
+}
+
+void trace_close(void)
+{
+    pthread_mutex_lock(&trace_lock);
+    trace_recording = 0;
+    if (trace_file) {
+        fclose(trace_file);
+        trace_file = NULL;
+    }
+    pthread_mutex_unlock(&trace_lock);
+}
+
+void trace_record(TraceEventType type, uint64_t addr, uint64_t val,
+                  uint8_t strb, const uint8_t *data, uint32_t len)
+{
+    uint64_t now;
+
+    pthread_mutex_lock(&trace_lock);
+    if (!trace_file) {
+        pthread_mutex_unlock(&trace_lock);
+        return;
+    }
+    /* taken under the lock so that the deltas are never negative */
+    now = trace_get_time_ns();
+    putc_unlocked(type, trace_file);
+    put_varint(trace_file, now - trace_last_ns);
+    put_varint(trace_file, addr);
+    switch(type) {
+    case TRACE_MMIO_WRITE:
+        put_varint(trace_file, val);
+        putc_unlocked(strb, trace_file);
+        break;
+    case TRACE_DMA_READ:
+    case TRACE_DMA_WRITE:
+        put_varint(trace_file, len);
+        fwrite_unlocked(data, 1, len, trace_file);
+        break;
+    default:
+        put_varint(trace_file, val);
+        break;
+    }
+    trace_last_ns = now;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+TraceReader *trace_reader_open(const char *filename)
+{
+    TraceReader *r;
+    uint8_t header[8];
+    FILE *f;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "Cannot open trace file %s: %s\r\n", filename,
+                strerror(errno));
+        return NULL;
+    }
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) ||
+        get_le32(header) != TRACE_MAGIC ||
+        get_le32(header + 4) != TRACE_VERSION) {
+        fprintf(stderr, "%s is not a version %d trace\r\n", filename,
+                TRACE_VERSION);
+        fclose(f);
+        return NULL;
+    }
+    setvbuf(f, NULL, _IOFBF, TRACE_BUF_SIZE);
+    r = mallocz(sizeof(*r));
+    r->f = f;
+    return r;
+}
+
+int trace_reader_next(TraceReader *r, TraceEvent *ev)
+{
+    uint64_t delta, val;
+    int c;
+
+    c = getc_unlocked(r->f);
+    if (c == EOF)
+        return 0;
+    memset(ev, 0, sizeof(*ev));
+    ev->type = c;
+    if (get_varint(r->f, &delta) < 0 || get_varint(r->f, &ev->addr) < 0 ||
+        get_varint(r->f, &val) < 0)
+        return -1;
+    r->time_ns += delta;
+    ev->time_ns = r->time_ns;
+    switch(ev->type) {
+    case TRACE_MMIO_WRITE:
+        ev->val = val;
+        c = getc_unlocked(r->f);
+        if (c == EOF)
+            return -1;
+        ev->strb = c;
+        break;
+    case TRACE_DMA_READ:
+    case TRACE_DMA_WRITE:
+        if (val > INT32_MAX)
+            return -1;
+        ev->len = val;
+        if (ev->len > r->buf_size) {
+            r->buf_size = max_int(ev->len, 2 * r->buf_size);
+            r->buf = realloc(r->buf, r->buf_size);
+        }
+        if (fread_unlocked(r->buf, 1, ev->len, r->f) != ev->len)
+            return -1;
+        ev->data = r->buf;
+        break;
+    case TRACE_MMIO_READ:
+    case TRACE_IRQ_SET:
+    case TRACE_IRQ_CLEAR:
+        ev->val = val;
+        break;
+    default:
+        return -1;
+    }
+    return 1;
+}
+
+void trace_reader_close(TraceReader *r)
+{
+    if (!r)
+        return;
+    fclose(r->f);
+    free(r->buf);
+    free(r);
+}
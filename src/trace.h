@@ -0,0 +1,46 @@
+/*
+ * Binary trace of the host/guest interface
+ */
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <inttypes.h>
+
+typedef enum {
+    TRACE_MMIO_READ = 1, /* val is the response */
+    TRACE_MMIO_WRITE,    /* val and strb as received */
+    TRACE_DMA_READ,      /* data is what the host read */
+    TRACE_DMA_WRITE,
+    TRACE_IRQ_SET,       /* val is the mask of levels */
+    TRACE_IRQ_CLEAR,
+} TraceEventType;
+
+typedef struct {
+    TraceEventType type;
+    uint64_t time_ns; /* since the trace was opened */
+    uint64_t addr;
+    uint64_t val;
+    uint8_t strb;
+    uint32_t len;
+    const uint8_t *data;
+} TraceEvent;
+
+/* non zero while a trace is being written; test it before building
+   the arguments of trace_record() */
+extern int trace_recording;
+
+/* Return 0 if OK, -1 on error */
+int trace_open(const char *filename);
+void trace_close(void);
+void trace_record(TraceEventType type, uint64_t addr, uint64_t val,
+                  uint8_t strb, const uint8_t *data, uint32_t len);
+
+typedef struct TraceReader TraceReader;
+
+TraceReader *trace_reader_open(const char *filename);
+/* Return 1 and fill 'ev', 0 at the end of the trace, -1 if it is
+   corrupted. ev->data stays valid until the next call. */
+int trace_reader_next(TraceReader *r, TraceEvent *ev);
+void trace_reader_close(TraceReader *r);
+
+#endif /* TRACE_H */
@@ -0,0 +1,616 @@
+// Transport microbenchmarks
+//
+// Measures what the host pays for each way of reaching the card: single
+// fmem ioctls of every width, bulk transfers as a run of 32-bit ioctls or
+// as one XDMA call, DMA window switches and the MMIO request/response
+// handshake through VD_REQ_LEVEL and VD_SEND_RESP. With --sim the same
+// questions are asked of the shared-memory cosimulation rings, with a
+// thread in this process playing the simulator.
+//
+// Every operation is timed on its own and the results are printed as
+// latency histograms.
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+extern "C" {
+#include "cutils.h"
+#include "xdma.h"
+}
+
+#include "cosim.h"
+#include "fmem.h"
+#include "fpga.h"
+
+#define MEM_MASK_1GB 0x3FFFFFFF
+#define BULK_SIZE 4096
+
+// Eight sub-buckets per power of two up to 2^40 ns
+#define HIST_SUB_BITS 3
+#define HIST_BUCKETS (40 << HIST_SUB_BITS)
+
+static FILE *out;
+static int iterations = 10000;
+
+static inline uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+struct Histogram {
+    const char *name;
+    uint64_t count;
+    uint64_t sum;
+    uint64_t min;
+    uint64_t max;
+    uint64_t bytes;
+    uint64_t buckets[HIST_BUCKETS];
+
+    Histogram(const char *name) : name(name), count(0), sum(0), min(~0ull), max(0), bytes(0) {
+        memset(buckets, 0, sizeof(buckets));
+    }
+
+    static int bucket(uint64_t ns) {
+        if (ns < (1 << HIST_SUB_BITS))
+            return ns;
+        int msb = 63 - __builtin_clzll(ns);
+        int sub = (ns >> (msb - HIST_SUB_BITS)) & ((1 << HIST_SUB_BITS) - 1);
+        int b = ((msb - HIST_SUB_BITS + 1) << HIST_SUB_BITS) + sub;
+        return b < HIST_BUCKETS ? b : HIST_BUCKETS - 1;
+    }
+    // Lowest value that falls in bucket b
+    static uint64_t bucket_floor(int b) {
+        if (b < (1 << HIST_SUB_BITS))
+            return b;
+        int msb = (b >> HIST_SUB_BITS) + HIST_SUB_BITS - 1;
+        uint64_t sub = b & ((1 << HIST_SUB_BITS) - 1);
+        return (1ull << msb) | (sub << (msb - HIST_SUB_BITS));
+    }
+
+    void record(uint64_t ns, uint64_t nbytes = 0) {
+        count++;
+        sum += ns;
+        bytes += nbytes;
+        if (ns < min)
+            min = ns;
+        if (ns > max)
+            max = ns;
+        buckets[bucket(ns)]++;
+    }
+
+    uint64_t percentile(double p) const {
+        uint64_t target = (uint64_t)(count * p / 100), seen = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            seen += buckets[b];
+            if (seen > target)
+                return std::min(std::max(bucket_floor(b), min), max);
+        }
+        return max;
+    }
+
+    void print() const {
+        if (!count)
+            return;
+        double mean = (double)sum / count;
+        fprintf(out, "%s: %" PRIu64 " ops, mean %.0f ns, min %" PRIu64 " p50 %" PRIu64
+                " p99 %" PRIu64 " p99.9 %" PRIu64 " max %" PRIu64 " ns, %.0f ops/s",
+                name, count, mean, min, percentile(50), percentile(99), percentile(99.9),
+                max, 1e9 / mean);
+        if (bytes)
+            fprintf(out, ", %.1f MB/s", bytes * 1e3 / sum);
+        fprintf(out, "\n");
+
+        uint64_t peak = 0;
+        for (int b = 0; b < HIST_BUCKETS; b++)
+            peak = std::max(peak, buckets[b]);
+        // empty buckets are left out to keep long tails readable
+        for (int b = 0; b < HIST_BUCKETS; b++) {
+            if (!buckets[b])
+                continue;
+            int width = std::max((int)(buckets[b] * 50 / peak), 1);
+            fprintf(out, "  %10" PRIu64 " ns %9" PRIu64 " |%.*s\n", bucket_floor(b),
+                    buckets[b], width, "##################################################");
+        }
+        fprintf(out, "\n");
+    }
+};
+
+// Cost of the timestamps themselves, to be subtracted by eye
+static void bench_clock()
+{
+    Histogram h("clock_gettime");
+    for (int i = 0; i < iterations; i++) {
+        uint64_t t0 = now_ns();
+        h.record(now_ns() - t0);
+    }
+    h.print();
+}
+
+/*********************************************************************/
+// fmem devices
+
+struct FmemDevices {
+    int mmio_fd;
+    int dma_fd;
+    int selector_fd;
+    XDMATransport *xdma;
+};
+
+static int open_fmem(const char *env, const char *def)
+{
+    const char *filename = getenv(env);
+    if (!filename)
+        filename = def;
+    int fd = open(filename, O_RDWR);
+    if (fd < 0)
+        fprintf(stderr, "ERROR: Failed to open %s: %s\r\n", filename, strerror(errno));
+    return fd;
+}
+
+static void select_window(FmemDevices &d, uint64_t addr)
+{
+    if (fmem_write(d.selector_fd, 0, (uint32_t)(addr & ~MEM_MASK_1GB), 4) != 0) {
+        fprintf(stderr, "ERROR: Failed to set the address selector: %s\r\n", strerror(errno));
+        exit(1);
+    }
+}
+
+template <typename T>
+static void bench_fmem_read(FmemDevices &d, const char *name, uint64_t addr,
+                            T (*read)(int, uint32_t))
+{
+    Histogram h(name);
+    for (int i = 0; i < iterations; i++) {
+        uint64_t t0 = now_ns();
+        read(d.dma_fd, addr);
+        h.record(now_ns() - t0, sizeof(T));
+    }
+    h.print();
+}
+
+template <typename T>
+static void bench_fmem_write(FmemDevices &d, const char *name, uint64_t addr,
+                             uint64_t (*write)(int, uint32_t, T))
+{
+    Histogram h(name);
+    for (int i = 0; i < iterations; i++) {
+        uint64_t t0 = now_ns();
+        write(d.dma_fd, addr, (T)i);
+        h.record(now_ns() - t0, sizeof(T));
+    }
+    h.print();
+}
+
+// A 4K transfer the way FPGA::dma_read/dma_write do it without XDMA: one
+// 32-bit ioctl per word
+static void bench_fmem_bulk(FmemDevices &d, uint64_t addr, bool writes)
+{
+    static uint32_t buf[BULK_SIZE / 4];
+    Histogram rh("fmem.bulk.read.4096"), wh("fmem.bulk.write.4096");
+    int n = std::max(iterations / 100, 10);
+
+    for (int i = 0; i < n; i++) {
+        uint64_t t0 = now_ns();
+        for (int j = 0; j < BULK_SIZE / 4; j++)
+            buf[j] = fmem_read32(d.dma_fd, addr + j * 4);
+        rh.record(now_ns() - t0, BULK_SIZE);
+    }
+    rh.print();
+    if (!writes)
+        return;
+    for (int i = 0; i < n; i++) {
+        uint64_t t0 = now_ns();
+        for (int j = 0; j < BULK_SIZE / 4; j++)
+            fmem_write32(d.dma_fd, addr + j * 4, buf[j]);
+        wh.record(now_ns() - t0, BULK_SIZE);
+    }
+    wh.print();
+}
+
+// The same transfers as a single XDMA system call
+static void bench_xdma(FmemDevices &d, uint64_t addr, bool writes)
+{
+    static uint8_t buf[64 * 1024];
+    static const int sizes[] = { 64, 4096, 65536 };
+    char name[64];
+
+    for (int size : sizes) {
+        snprintf(name, sizeof(name), "xdma.read.%d", size);
+        Histogram rh(name);
+        for (int i = 0; i < iterations / 10; i++) {
+            uint64_t t0 = now_ns();
+            if (xdma_read(d.xdma, addr - FMEM_HOST_CACHED_MEM_BASE, buf, size) < 0)
+                exit(1);
+            rh.record(now_ns() - t0, size);
+        }
+        rh.print();
+        if (!writes)
+            continue;
+        snprintf(name, sizeof(name), "xdma.write.%d", size);
+        Histogram wh(name);
+        for (int i = 0; i < iterations / 10; i++) {
+            uint64_t t0 = now_ns();
+            if (xdma_write(d.xdma, addr - FMEM_HOST_CACHED_MEM_BASE, buf, size) < 0)
+                exit(1);
+            wh.record(now_ns() - t0, size);
+        }
+        wh.print();
+    }
+}
+
+// Alternate between two 1GB windows so every access pays for a selector
+// write, and compare with accesses that stay in the current window
+static void bench_window_switch(FmemDevices &d, uint64_t addr)
+{
+    Histogram sel("fmem.window.select"), sw("fmem.window.switch+read32");
+    uint64_t other = addr ^ (MEM_MASK_1GB + 1);
+
+    for (int i = 0; i < iterations; i++) {
+        uint64_t t0 = now_ns();
+        select_window(d, (i & 1) ? other : addr);
+        sel.record(now_ns() - t0);
+    }
+    sel.print();
+    for (int i = 0; i < iterations; i++) {
+        uint64_t a = (i & 1) ? other : addr;
+        uint64_t t0 = now_ns();
+        select_window(d, a);
+        fmem_read32(d.dma_fd, a);
+        sw.record(now_ns() - t0);
+    }
+    sw.print();
+    select_window(d, addr);
+}
+
+// Poll cost, plus the host side of real MMIO round trips: the time from
+// seeing VD_REQ_LEVEL set to VD_SEND_RESP, answering reads with zero and
+// dropping writes. Only useful while the guest is issuing MMIO.
+static void bench_mmio(FmemDevices &d, int requests)
+{
+    Histogram poll("fmem.mmio.poll"), gap("fmem.mmio.interarrival"),
+        rsp("fmem.mmio.respond");
+
+    for (int i = 0; i < iterations; i++) {
+        uint64_t t0 = now_ns();
+        fmem_read8(d.mmio_fd, VD_REQ_LEVEL);
+        poll.record(now_ns() - t0);
+    }
+    poll.print();
+    if (!requests)
+        return;
+
+    fmem_write32(d.mmio_fd, VD_ENABLE, 1);
+    uint64_t last = 0;
+    for (int i = 0; i < requests; i++) {
+        while (fmem_read8(d.mmio_fd, VD_REQ_LEVEL) == 0)
+            ;
+        uint64_t t0 = now_ns();
+        if (last)
+            gap.record(t0 - last);
+        last = t0;
+        if (fmem_read8(d.mmio_fd, VD_IS_WRITE)) {
+            fmem_read32(d.mmio_fd, VD_WRITE_ADDR);
+            fmem_read64(d.mmio_fd, VD_WRITE_DATA);
+            fmem_read8(d.mmio_fd, VD_WRITE_BYEN);
+        } else {
+            fmem_read32(d.mmio_fd, VD_READ_ADDR);
+            fmem_read32(d.mmio_fd, VD_REQ_ID);
+            fmem_write64(d.mmio_fd, VD_READ_DATA, 0);
+        }
+        fmem_write32(d.mmio_fd, VD_SEND_RESP, 1);
+        rsp.record(now_ns() - t0);
+    }
+    gap.print();
+    rsp.print();
+}
+
+static void run_fmem(uint64_t addr, bool writes, bool use_xdma, int mmio_requests)
+{
+    FmemDevices d;
+    d.mmio_fd = open_fmem("RISCV_VIRTUAL_DEVICE_FMEM_DEV", "/dev/fmem_sys0_virtual_device");
+    d.selector_fd = open_fmem("RISCV_ADDRESS_SELECTOR_FMEM_DEV", "/dev/fmem_sys0_address_selector");
+    d.dma_fd = open_fmem("RISCV_DMA_FMEM_DEV", "/dev/fmem_sys0_dma");
+    if (d.mmio_fd < 0 || d.selector_fd < 0 || d.dma_fd < 0)
+        exit(1);
+    d.xdma = use_xdma ? xdma_open_default() : NULL;
+    if (use_xdma && !d.xdma)
+        exit(1);
+
+    select_window(d, addr);
+    bench_fmem_read<uint8_t>(d, "fmem.read8", addr, fmem_read8);
+    bench_fmem_read<uint16_t>(d, "fmem.read16", addr, fmem_read16);
+    bench_fmem_read<uint32_t>(d, "fmem.read32", addr, fmem_read32);
+    bench_fmem_read<uint64_t>(d, "fmem.read64", addr, fmem_read64);
+    if (writes) {
+        bench_fmem_write<uint8_t>(d, "fmem.write8", addr, fmem_write8);
+        bench_fmem_write<uint16_t>(d, "fmem.write16", addr, fmem_write16);
+        bench_fmem_write<uint32_t>(d, "fmem.write32", addr, fmem_write32);
+        bench_fmem_write<uint64_t>(d, "fmem.write64", addr, fmem_write64);
+    }
+    bench_fmem_bulk(d, addr, writes);
+    if (d.xdma)
+        bench_xdma(d, addr, writes);
+    bench_window_switch(d, addr);
+    bench_mmio(d, mmio_requests);
+
+    xdma_close(d.xdma);
+    close(d.mmio_fd);
+    close(d.selector_fd);
+    close(d.dma_fd);
+}
+
+/*********************************************************************/
+// Cosimulation rings
+
+#define SIM_DRAM_SIZE (1 << 20)
+
+struct SimBench {
+    CosimShared *shared;
+    uint8_t *dram; // the shared DRAM window
+    uint8_t sim_mem[BULK_SIZE]; // memory only reachable through messages
+    uint32_t host_head;
+    uint32_t sim_head;
+    int mmio_requests; // set once the DMA measurements are done
+    int mmio_answered;
+    int stop;
+    Histogram mmio_rtt;
+
+    SimBench() : mmio_rtt("sim.mmio.roundtrip") {}
+};
+
+static void sim_send(CosimRing *r, uint32_t *head, const CosimMessage &m, bool publish)
+{
+    while (cosim_ring_put(r, head, &m) < 0) {
+        cosim_ring_publish(r, *head);
+        sched_yield();
+    }
+    if (publish)
+        cosim_ring_publish(r, *head);
+}
+
+// The simulator: serves DMA messages and, once asked to, issues MMIO reads
+// and times how long the host takes to answer them
+static void *sim_thread(void *opaque)
+{
+    SimBench *b = (SimBench *)opaque;
+    CosimMessage m;
+    uint64_t t0 = 0;
+    int sent = 0, received = 0;
+
+    pthread_setname_np(pthread_self(), "cosim sim");
+    while (!__atomic_load_n(&b->stop, __ATOMIC_ACQUIRE)) {
+        if (sent == received && sent < __atomic_load_n(&b->mmio_requests, __ATOMIC_ACQUIRE)) {
+            CosimMessage req = {};
+            req.type = COSIM_MSG_MMIO_READ;
+            req.id = sent++;
+            req.addr = 0x10001000;
+            t0 = now_ns();
+            sim_send(&b->shared->to_host, &b->sim_head, req, true);
+        }
+        if (!cosim_ring_get(&b->shared->to_sim, &m)) {
+            sched_yield();
+            continue;
+        }
+        switch (m.type) {
+        case COSIM_MSG_DMA_READ: {
+            CosimMessage resp = {};
+            resp.type = COSIM_MSG_DMA_RESP;
+            resp.id = m.id;
+            memcpy(&resp.data, b->sim_mem + (m.addr & (BULK_SIZE - 8)), m.size);
+            sim_send(&b->shared->to_host, &b->sim_head, resp, true);
+            break;
+        }
+        case COSIM_MSG_DMA_WRITE:
+            memcpy(b->sim_mem + (m.addr & (BULK_SIZE - 8)), &m.data, m.size);
+            break;
+        case COSIM_MSG_MMIO_RESP:
+            b->mmio_rtt.record(now_ns() - t0);
+            received++;
+            __atomic_store_n(&b->mmio_answered, received, __ATOMIC_RELEASE);
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Round trip of a DMA read outside the window, as CosimIO::dma_transaction
+static uint64_t sim_dma_read(SimBench *b, uint64_t addr, uint8_t size)
+{
+    static uint16_t next_id;
+    CosimMessage m = {};
+    m.type = COSIM_MSG_DMA_READ;
+    m.id = next_id++;
+    m.size = size;
+    m.addr = addr;
+    sim_send(&b->shared->to_sim, &b->host_head, m, true);
+    for (;;) {
+        if (cosim_ring_get(&b->shared->to_host, &m) && m.type == COSIM_MSG_DMA_RESP)
+            return m.data;
+        sched_yield();
+    }
+}
+
+static void run_sim(int mmio_requests)
+{
+    SimBench *b = new SimBench;
+    size_t size = sizeof(CosimShared) + SIM_DRAM_SIZE;
+    pthread_t thread;
+    char name[64];
+
+    b->shared = (CosimShared *)mallocz(size);
+    b->dram = (uint8_t *)(b->shared + 1);
+    b->host_head = b->sim_head = 0;
+    b->mmio_requests = 0;
+    b->mmio_answered = 0;
+    b->stop = 0;
+    pthread_create(&thread, NULL, sim_thread, b);
+
+    // Accesses inside the shared window are plain loads and stores; they
+    // are timed in groups of 64 since a single one is below the clock
+    // resolution
+    static const int widths[] = { 1, 2, 4, 8 };
+    for (int width : widths) {
+        snprintf(name, sizeof(name), "sim.window.read%d (x64)", width * 8);
+        Histogram h(name);
+        uint64_t v = 0;
+        for (int i = 0; i < iterations; i++) {
+            uint64_t t0 = now_ns();
+            for (int j = 0; j < 64; j++) {
+                uint64_t x = 0;
+                memcpy(&x, b->dram + j * 8, width);
+                v += x;
+                __asm__ volatile("" : : : "memory");
+            }
+            h.record(now_ns() - t0, 64 * width);
+        }
+        __asm__ volatile("" : : "r"(v));
+        h.print();
+    }
+
+    Histogram rd("sim.dma.read32"), wr("sim.dma.write32"),
+        unbatched("sim.dma.write32.x64.publish-each"),
+        batched("sim.dma.write32.x64.publish-once");
+    for (int i = 0; i < iterations; i++) {
+        uint64_t t0 = now_ns();
+        sim_dma_read(b, 0x100000000ull + (i & 63) * 8, 4);
+        rd.record(now_ns() - t0, 4);
+    }
+    rd.print();
+    CosimMessage m = {};
+    m.type = COSIM_MSG_DMA_WRITE;
+    m.size = 4;
+    for (int i = 0; i < iterations; i++) {
+        m.addr = 0x100000000ull + (i & 63) * 8;
+        uint64_t t0 = now_ns();
+        sim_send(&b->shared->to_sim, &b->host_head, m, true);
+        wr.record(now_ns() - t0, 4);
+    }
+    wr.print();
+    for (int i = 0; i < iterations / 64; i++) {
+        uint64_t t0 = now_ns();
+        for (int j = 0; j < 64; j++)
+            sim_send(&b->shared->to_sim, &b->host_head, m, true);
+        unbatched.record(now_ns() - t0, 64 * 4);
+        t0 = now_ns();
+        for (int j = 0; j < 64; j++)
+            sim_send(&b->shared->to_sim, &b->host_head, m, j == 63);
+        batched.record(now_ns() - t0, 64 * 4);
+    }
+    unbatched.print();
+    batched.print();
+
+    // MMIO round trips: the simulator thread sends reads, we answer them
+    __atomic_store_n(&b->mmio_requests, mmio_requests ? mmio_requests : iterations,
+                     __ATOMIC_RELEASE);
+    for (int answered = 0; answered < b->mmio_requests;) {
+        if (!cosim_ring_get(&b->shared->to_host, &m)) {
+            sched_yield();
+            continue;
+        }
+        if (m.type != COSIM_MSG_MMIO_READ)
+            continue;
+        CosimMessage resp = {};
+        resp.type = COSIM_MSG_MMIO_RESP;
+        resp.id = m.id;
+        resp.addr = m.addr;
+        sim_send(&b->shared->to_sim, &b->host_head, resp, true);
+        answered++;
+    }
+    while (__atomic_load_n(&b->mmio_answered, __ATOMIC_ACQUIRE) < b->mmio_requests)
+        sched_yield();
+    __atomic_store_n(&b->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(thread, NULL);
+    b->mmio_rtt.print();
+
+    free(b->shared);
+    delete b;
+}
+
+/*********************************************************************/
+
+const struct option long_options[] = {
+    { "addr",       required_argument, 0, 'a' },
+    { "help",       no_argument,       0, 'h' },
+    { "iterations", required_argument, 0, 'n' },
+    { "mmio",       required_argument, 0, 'm' },
+    { "sim",        no_argument,       0, 's' },
+    { "writes",     no_argument,       0, 'W' },
+    { "xdma",       no_argument,       0, 'X' },
+    { 0,            0,                 0, 0 }
+};
+
+static void usage(const char *name)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "        --addr addr      guest physical address used for DMA (default 0x%x)\n"
+            "        --iterations n   samples per measurement (default 10000)\n"
+            "        --mmio n         answer n guest MMIO requests and time them\n"
+            "        --sim            measure the cosimulation rings instead of fmem\n"
+            "        --writes         also write to guest memory at --addr\n"
+            "        --xdma           also measure XDMA transfers\n",
+            name, FMEM_HOST_CACHED_MEM_BASE);
+}
+
+int main(int argc, char * const *argv)
+{
+    uint64_t addr = FMEM_HOST_CACHED_MEM_BASE;
+    bool sim = false, writes = false, use_xdma = false;
+    int mmio_requests = 0;
+
+    while (1) {
+        int c = getopt_long(argc, argv, "a:hm:n:sWX", long_options, 0);
+        if (c == -1)
+            break;
+        switch (c) {
+        case 'a':
+            addr = strtoull(optarg, 0, 0);
+            break;
+        case 'm':
+            mmio_requests = strtoul(optarg, 0, 0);
+            break;
+        case 'n':
+            iterations = std::max((int)strtoul(optarg, 0, 0), 1);
+            break;
+        case 's':
+            sim = true;
+            break;
+        case 'W':
+            writes = true;
+            break;
+        case 'X':
+            use_xdma = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    // fmem_read and fmem_write trace every access to stdout
+    out = fdopen(dup(STDOUT_FILENO), "w");
+    if (!out || !freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "ERROR: Failed to redirect stdout: %s\n", strerror(errno));
+        return 1;
+    }
+
+    bench_clock();
+    if (sim)
+        run_sim(mmio_requests);
+    else
+        run_fmem(addr, writes, use_xdma, mmio_requests);
+    fclose(out);
+    return 0;
+}
@@ -0,0 +1,451 @@
+/*
+ * vhost-user frontend: the messages sent to a backend process
+ *
+ * Each request is a header plus a fixed size payload on a unix stream
+ * socket, file descriptors travel as SCM_RIGHTS ancillary data. Requests
+ * that have no reply of their own are acknowledged when the backend
+ * supports VHOST_USER_PROTOCOL_F_REPLY_ACK so that errors are reported
+ * where they happen.
+ *
+ * Some requests are made from the MMIO thread (device start and reset),
+ * so a backend that stops answering must not block it: a reply not
+ * received within VHOST_USER_TIMEOUT_MS fails the request, and the
+ * connection, whose next reply could be that late one, fails all the
+ * following requests at once.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cutils.h"
+#include "vhost_user.h"
+
+#define VHOST_USER_TIMEOUT_MS 2000
+
+enum {
+    VHOST_USER_GET_FEATURES = 1,
+    VHOST_USER_SET_FEATURES = 2,
+    VHOST_USER_SET_OWNER = 3,
+    VHOST_USER_SET_MEM_TABLE = 5,
+    VHOST_USER_SET_VRING_NUM = 8,
+    VHOST_USER_SET_VRING_ADDR = 9,
+    VHOST_USER_SET_VRING_BASE = 10,
+    VHOST_USER_GET_VRING_BASE = 11,
+    VHOST_USER_SET_VRING_KICK = 12,
+    VHOST_USER_SET_VRING_CALL = 13,
+    VHOST_USER_GET_PROTOCOL_FEATURES = 15,
+    VHOST_USER_SET_PROTOCOL_FEATURES = 16,
+    VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_CONFIG = 24,
+};
+
+#define VHOST_USER_VERSION    0x1
+#define VHOST_USER_REPLY      (1 << 2)
+#define VHOST_USER_NEED_REPLY (1 << 3)
+
+/* in the u64 payload of SET_VRING_KICK/CALL: no file descriptor */
+#define VHOST_USER_VRING_NOFD (1 << 8)
+
+typedef struct {
+    uint32_t request;
+    uint32_t flags;
+    uint32_t size; /* of the payload */
+} __attribute__((packed)) VhostUserHeader;
+
+typedef struct {
+    uint32_t index;
+    uint32_t num;
+} __attribute__((packed)) VhostUserVringState;
+
+typedef struct {
+    uint32_t index;
+    uint32_t flags;
+    uint64_t desc_user_addr;
+    uint64_t used_user_addr;
+    uint64_t avail_user_addr;
+    uint64_t log_guest_addr;
+} __attribute__((packed)) VhostUserVringAddr;
+
+typedef struct {
+    uint32_t nregions;
+    uint32_t padding;
+    VhostUserMemRegion regions[VHOST_USER_MAX_MEM_REGIONS];
+} __attribute__((packed)) VhostUserMemory;
+
+typedef struct {
+    uint32_t offset;
+    uint32_t size;
+    uint32_t flags;
+    uint8_t region[VHOST_USER_MAX_CONFIG_SIZE];
+} __attribute__((packed)) VhostUserConfig;
+
+typedef struct {
+    VhostUserHeader hdr;
+    union {
+        uint64_t u64;
+        VhostUserVringState state;
+        VhostUserVringAddr addr;
+        VhostUserMemory memory;
+        VhostUserConfig config;
+    } payload;
+} __attribute__((packed)) VhostUserMsg;
+
+struct VhostUser {
+    int fd;
+    char *path;
+    uint64_t protocol_features;
+    BOOL broken; /* a reply timed out */
+    pthread_mutex_t lock; /* one request and its reply at a time */
+};
+
+static int64_t vhost_user_time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int vhost_user_send(VhostUser *vu, const VhostUserMsg *msg,
+                           const int *fds, int nfds)
+{
+    struct msghdr mh;
+    struct iovec iov;
+    union {
+        struct cmsghdr align;
+        char buf[CMSG_SPACE(VHOST_USER_MAX_MEM_REGIONS * sizeof(int))];
+    } control;
+    struct cmsghdr *cmsg;
+    ssize_t ret;
+
+    memset(&mh, 0, sizeof(mh));
+    iov.iov_base = (void *)msg;
+    iov.iov_len = sizeof(msg->hdr) + msg->hdr.size;
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    if (nfds > 0) {
+        memset(&control, 0, sizeof(control));
+        mh.msg_control = control.buf;
+        mh.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+        cmsg = CMSG_FIRSTHDR(&mh);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, nfds * sizeof(int));
+    }
+    do {
+        ret = sendmsg(vu->fd, &mh, MSG_NOSIGNAL);
+    } while (ret < 0 && errno == EINTR);
+    if (ret != iov.iov_len) {
+        fprintf(stderr, "vhost-user: %s: request %d: %s\r\n", vu->path,
+                msg->hdr.request, ret < 0 ? strerror(errno) : "short write");
+        /* a part of the message may have been sent */
+        vu->broken = TRUE;
+        return -1;
+    }
+    return 0;
+}
+
+/* read 'len' bytes before the time 'deadline' (vhost_user_time_ms()) */
+static int vhost_user_read_full(VhostUser *vu, void *buf, size_t len,
+                                int64_t deadline)
+{
+    struct pollfd pfd;
+    uint8_t *p = buf;
+    int64_t left;
+    ssize_t ret;
+
+    pfd.fd = vu->fd;
+    pfd.events = POLLIN;
+    while (len > 0) {
+        left = deadline - vhost_user_time_ms();
+        ret = left > 0 ? poll(&pfd, 1, left) : 0;
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret == 0) {
+            fprintf(stderr, "vhost-user: %s: no reply in %d ms, giving up on the backend\r\n",
+                    vu->path, VHOST_USER_TIMEOUT_MS);
+            vu->broken = TRUE;
+            return -1;
+        }
+        ret = read(vu->fd, p, len);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0) {
+            fprintf(stderr, "vhost-user: %s: %s\r\n", vu->path,
+                    ret < 0 ? strerror(errno) : "backend closed the connection");
+            return -1;
+        }
+        p += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static int vhost_user_recv(VhostUser *vu, VhostUserMsg *reply, int request)
+{
+    int64_t deadline = vhost_user_time_ms() + VHOST_USER_TIMEOUT_MS;
+
+    if (vhost_user_read_full(vu, &reply->hdr, sizeof(reply->hdr),
+                             deadline) < 0)
+        return -1;
+    if (reply->hdr.request != request || !(reply->hdr.flags & VHOST_USER_REPLY) ||
+        reply->hdr.size > sizeof(reply->payload)) {
+        fprintf(stderr, "vhost-user: %s: unexpected reply %d (flags 0x%x size %d) to request %d\r\n",
+                vu->path, reply->hdr.request, reply->hdr.flags, reply->hdr.size,
+                request);
+        return -1;
+    }
+    return vhost_user_read_full(vu, &reply->payload, reply->hdr.size,
+                                deadline);
+}
+
+/* Send 'msg' and read the reply into 'reply' if it is not NULL, otherwise
+   wait for the acknowledgement when the backend gives one. */
+static int vhost_user_request(VhostUser *vu, VhostUserMsg *msg,
+                              const int *fds, int nfds, VhostUserMsg *reply)
+{
+    VhostUserMsg ack;
+    BOOL need_ack;
+    int ret;
+
+    need_ack = !reply &&
+        (vu->protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK));
+    msg->hdr.flags = VHOST_USER_VERSION;
+    if (need_ack)
+        msg->hdr.flags |= VHOST_USER_NEED_REPLY;
+
+    pthread_mutex_lock(&vu->lock);
+    if (vu->broken) {
+        pthread_mutex_unlock(&vu->lock);
+        return -1;
+    }
+    ret = vhost_user_send(vu, msg, fds, nfds);
+    if (ret == 0 && reply) {
+        ret = vhost_user_recv(vu, reply, msg->hdr.request);
+    } else if (ret == 0 && need_ack) {
+        ret = vhost_user_recv(vu, &ack, msg->hdr.request);
+        if (ret == 0 && (ack.hdr.size != sizeof(ack.payload.u64) ||
+                         ack.payload.u64 != 0)) {
+            fprintf(stderr, "vhost-user: %s: request %d failed\r\n", vu->path,
+                    msg->hdr.request);
+            ret = -1;
+        }
+    }
+    pthread_mutex_unlock(&vu->lock);
+    return ret;
+}
+
+static int vhost_user_get_u64(VhostUser *vu, int request, uint64_t *pval)
+{
+    VhostUserMsg msg, reply;
+
+    msg.hdr.request = request;
+    msg.hdr.size = 0;
+    if (vhost_user_request(vu, &msg, NULL, 0, &reply) < 0)
+        return -1;
+    if (reply.hdr.size != sizeof(reply.payload.u64))
+        return -1;
+    *pval = reply.payload.u64;
+    return 0;
+}
+
+static int vhost_user_set_u64(VhostUser *vu, int request, uint64_t val,
+                              const int *fds, int nfds)
+{
+    VhostUserMsg msg;
+
+    msg.hdr.request = request;
+    msg.hdr.size = sizeof(msg.payload.u64);
+    msg.payload.u64 = val;
+    return vhost_user_request(vu, &msg, fds, nfds, NULL);
+}
+
+static int vhost_user_set_state(VhostUser *vu, int request, int idx, int num)
+{
+    VhostUserMsg msg;
+
+    msg.hdr.request = request;
+    msg.hdr.size = sizeof(msg.payload.state);
+    msg.payload.state.index = idx;
+    msg.payload.state.num = num;
+    return vhost_user_request(vu, &msg, NULL, 0, NULL);
+}
+
+VhostUser *vhost_user_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    struct timeval tv;
+    VhostUser *vu;
+    VhostUserMsg msg;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "vhost-user: cannot connect to %s: %s\r\n", path,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+    /* the requests are small: a full socket buffer is a stuck backend */
+    tv.tv_sec = VHOST_USER_TIMEOUT_MS / 1000;
+    tv.tv_usec = (VHOST_USER_TIMEOUT_MS % 1000) * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+    vu = mallocz(sizeof(*vu));
+    vu->fd = fd;
+    vu->path = strdup(path);
+    pthread_mutex_init(&vu->lock, NULL);
+
+    msg.hdr.request = VHOST_USER_SET_OWNER;
+    msg.hdr.size = 0;
+    if (vhost_user_request(vu, &msg, NULL, 0, NULL) < 0) {
+        vhost_user_close(vu);
+        return NULL;
+    }
+    return vu;
+}
+
+void vhost_user_close(VhostUser *vu)
+{
+    close(vu->fd);
+    pthread_mutex_destroy(&vu->lock);
+    free(vu->path);
+    free(vu);
+}
+
+int vhost_user_get_features(VhostUser *vu, uint64_t *pfeatures)
+{
+    return vhost_user_get_u64(vu, VHOST_USER_GET_FEATURES, pfeatures);
+}
+
+int vhost_user_set_features(VhostUser *vu, uint64_t features)
+{
+    return vhost_user_set_u64(vu, VHOST_USER_SET_FEATURES, features, NULL, 0);
+}
+
+int vhost_user_get_protocol_features(VhostUser *vu, uint64_t *pfeatures)
+{
+    return vhost_user_get_u64(vu, VHOST_USER_GET_PROTOCOL_FEATURES, pfeatures);
+}
+
+int vhost_user_set_protocol_features(VhostUser *vu, uint64_t features)
+{
+    /* acknowledged only once REPLY_ACK is agreed on */
+    if (vhost_user_set_u64(vu, VHOST_USER_SET_PROTOCOL_FEATURES, features,
+                           NULL, 0) < 0)
+        return -1;
+    vu->protocol_features = features;
+    return 0;
+}
+
+int vhost_user_set_mem_table(VhostUser *vu, const VhostUserMemRegion *regions,
+                             const int *fds, int count)
+{
+    VhostUserMsg msg;
+
+    if (count > VHOST_USER_MAX_MEM_REGIONS)
+        return -1;
+    msg.hdr.request = VHOST_USER_SET_MEM_TABLE;
+    msg.hdr.size = offsetof(VhostUserMemory, regions) +
+        count * sizeof(VhostUserMemRegion);
+    msg.payload.memory.nregions = count;
+    msg.payload.memory.padding = 0;
+    memcpy(msg.payload.memory.regions, regions,
+           count * sizeof(VhostUserMemRegion));
+    return vhost_user_request(vu, &msg, fds, count, NULL);
+}
+
+int vhost_user_set_vring_num(VhostUser *vu, int idx, int num)
+{
+    return vhost_user_set_state(vu, VHOST_USER_SET_VRING_NUM, idx, num);
+}
+
+int vhost_user_set_vring_addr(VhostUser *vu, int idx, uint64_t desc,
+                              uint64_t used, uint64_t avail)
+{
+    VhostUserMsg msg;
+
+    msg.hdr.request = VHOST_USER_SET_VRING_ADDR;
+    msg.hdr.size = sizeof(msg.payload.addr);
+    msg.payload.addr.index = idx;
+    msg.payload.addr.flags = 0;
+    msg.payload.addr.desc_user_addr = desc;
+    msg.payload.addr.used_user_addr = used;
+    msg.payload.addr.avail_user_addr = avail;
+    msg.payload.addr.log_guest_addr = 0;
+    return vhost_user_request(vu, &msg, NULL, 0, NULL);
+}
+
+int vhost_user_set_vring_base(VhostUser *vu, int idx, int base)
+{
+    return vhost_user_set_state(vu, VHOST_USER_SET_VRING_BASE, idx, base);
+}
+
+int vhost_user_get_vring_base(VhostUser *vu, int idx, int *pbase)
+{
+    VhostUserMsg msg, reply;
+
+    msg.hdr.request = VHOST_USER_GET_VRING_BASE;
+    msg.hdr.size = sizeof(msg.payload.state);
+    msg.payload.state.index = idx;
+    msg.payload.state.num = 0;
+    if (vhost_user_request(vu, &msg, NULL, 0, &reply) < 0)
+        return -1;
+    if (reply.hdr.size != sizeof(reply.payload.state))
+        return -1;
+    *pbase = reply.payload.state.num;
+    return 0;
+}
+
+int vhost_user_set_vring_kick(VhostUser *vu, int idx, int fd)
+{
+    if (fd < 0)
+        return vhost_user_set_u64(vu, VHOST_USER_SET_VRING_KICK,
+                                  idx | VHOST_USER_VRING_NOFD, NULL, 0);
+    return vhost_user_set_u64(vu, VHOST_USER_SET_VRING_KICK, idx, &fd, 1);
+}
+
+int vhost_user_set_vring_call(VhostUser *vu, int idx, int fd)
+{
+    if (fd < 0)
+        return vhost_user_set_u64(vu, VHOST_USER_SET_VRING_CALL,
+                                  idx | VHOST_USER_VRING_NOFD, NULL, 0);
+    return vhost_user_set_u64(vu, VHOST_USER_SET_VRING_CALL, idx, &fd, 1);
+}
+
+int vhost_user_set_vring_enable(VhostUser *vu, int idx, int enable)
+{
+    return vhost_user_set_state(vu, VHOST_USER_SET_VRING_ENABLE, idx, enable);
+}
+
+int vhost_user_get_config(VhostUser *vu, uint8_t *buf, int size)
+{
+    VhostUserMsg msg, reply;
+
+    if (size > VHOST_USER_MAX_CONFIG_SIZE)
+        return -1;
+    msg.hdr.request = VHOST_USER_GET_CONFIG;
+    msg.hdr.size = offsetof(VhostUserConfig, region) + size;
+    msg.payload.config.offset = 0;
+    msg.payload.config.size = size;
+    msg.payload.config.flags = 0;
+    memset(msg.payload.config.region, 0, size);
+    if (vhost_user_request(vu, &msg, NULL, 0, &reply) < 0)
+        return -1;
+    if (reply.hdr.size != msg.hdr.size || reply.payload.config.size != size)
+        return -1;
+    memcpy(buf, reply.payload.config.region, size);
+    return 0;
+}
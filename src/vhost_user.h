@@ -0,0 +1,56 @@
+/*
+ * vhost-user frontend: the messages sent to a backend process
+ */
+#ifndef VHOST_USER_H
+#define VHOST_USER_H
+
+#include <inttypes.h>
+
+/* features */
+#define VHOST_USER_F_PROTOCOL_FEATURES 30
+
+/* protocol features */
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_CONFIG    9
+
+#define VHOST_USER_MAX_MEM_REGIONS 8
+#define VHOST_USER_MAX_CONFIG_SIZE 256
+
+typedef struct {
+    uint64_t guest_phys_addr;
+    uint64_t memory_size;
+    uint64_t userspace_addr; /* where the region is mapped in this process */
+    uint64_t mmap_offset; /* of the region in its file */
+} VhostUserMemRegion;
+
+typedef struct VhostUser VhostUser;
+
+/* Connect to the backend listening on the unix socket 'path' and take
+   ownership of it. Return NULL on error. */
+VhostUser *vhost_user_connect(const char *path);
+void vhost_user_close(VhostUser *vu);
+
+/* All the requests return 0 if OK, -1 on error */
+int vhost_user_get_features(VhostUser *vu, uint64_t *pfeatures);
+int vhost_user_set_features(VhostUser *vu, uint64_t features);
+/* only after VHOST_USER_F_PROTOCOL_FEATURES was offered */
+int vhost_user_get_protocol_features(VhostUser *vu, uint64_t *pfeatures);
+int vhost_user_set_protocol_features(VhostUser *vu, uint64_t features);
+/* 'fds[i]' is the file holding 'regions[i]' */
+int vhost_user_set_mem_table(VhostUser *vu, const VhostUserMemRegion *regions,
+                             const int *fds, int count);
+int vhost_user_set_vring_num(VhostUser *vu, int idx, int num);
+/* addresses in this process, inside one of the memory regions */
+int vhost_user_set_vring_addr(VhostUser *vu, int idx, uint64_t desc,
+                              uint64_t used, uint64_t avail);
+int vhost_user_set_vring_base(VhostUser *vu, int idx, int base);
+/* stop the ring and return the next avail index it would have read */
+int vhost_user_get_vring_base(VhostUser *vu, int idx, int *pbase);
+int vhost_user_set_vring_kick(VhostUser *vu, int idx, int fd);
+int vhost_user_set_vring_call(VhostUser *vu, int idx, int fd);
+/* only with VHOST_USER_F_PROTOCOL_FEATURES */
+int vhost_user_set_vring_enable(VhostUser *vu, int idx, int enable);
+/* only with VHOST_USER_PROTOCOL_F_CONFIG */
+int vhost_user_get_config(VhostUser *vu, uint8_t *buf, int size);
+
+#endif /* VHOST_USER_H */
@@ -0,0 +1,55 @@
+#!/usr/bin/env python3
+# Minimal vhost-user backend: answers the requests of vhost_user.c
+# without running any queue. With --stall it never answers
+# GET_VRING_BASE, like a backend stuck in its datapath.
+import socket, struct, sys, os
+
+GET_FEATURES, SET_FEATURES, SET_OWNER, SET_MEM_TABLE = 1, 2, 3, 5
+GET_VRING_BASE, GET_PROTOCOL_FEATURES, GET_CONFIG = 11, 15, 24
+REPLY, NEED_REPLY = 1 << 2, 1 << 3
+F_PROTOCOL_FEATURES = 1 << 30
+PROTOCOL_F_REPLY_ACK = 1 << 3
+
+def recv_full(conn, n):
+    buf = b''
+    while len(buf) < n:
+        data, _, _, _ = conn.recvmsg(n - len(buf), socket.CMSG_SPACE(64))
+        if not data:
+            return None
+        buf += data
+    return buf
+
+def main():
+    path = sys.argv[1]
+    stall = '--stall' in sys.argv[2:]
+    if os.path.exists(path):
+        os.unlink(path)
+    srv = socket.socket(socket.AF_UNIX, socket.SOCK_STREAM)
+    srv.bind(path)
+    srv.listen(1)
+    conn, _ = srv.accept()
+    while True:
+        hdr = recv_full(conn, 12)
+        if hdr is None:
+            break
+        req, flags, size = struct.unpack('<III', hdr)
+        payload = recv_full(conn, size) if size else b''
+        if req == GET_VRING_BASE and stall:
+            continue
+        reply = None
+        if req == GET_FEATURES:
+            reply = struct.pack('<Q', F_PROTOCOL_FEATURES)
+        elif req == GET_PROTOCOL_FEATURES:
+            reply = struct.pack('<Q', PROTOCOL_F_REPLY_ACK)
+        elif req == GET_VRING_BASE:
+            index = struct.unpack('<I', payload[:4])[0]
+            reply = struct.pack('<II', index, 42)
+        elif req == GET_CONFIG:
+            reply = payload
+        elif flags & NEED_REPLY:
+            reply = struct.pack('<Q', 0)
+        if reply is not None:
+            conn.sendall(struct.pack('<III', req, 0x1 | REPLY, len(reply)) +
+                         reply)
+
+main()
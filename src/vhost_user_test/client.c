@@ -0,0 +1,68 @@
+/*
+ * Drives vhost_user.c against backend.py: a GET_VRING_BASE round trip,
+ * then, with --stall, the timeout of a reply that never comes.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "cutils.h"
+#include "vhost_user.h"
+
+static int64_t time_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+int main(int argc, char **argv)
+{
+    VhostUser *vu;
+    uint64_t features;
+    int base, ret, stall;
+    int64_t t;
+
+    if (argc < 2) {
+        fprintf(stderr, "usage: client socket [--stall]\n");
+        return 2;
+    }
+    stall = argc > 2 && !strcmp(argv[2], "--stall");
+    vu = vhost_user_connect(argv[1]);
+    if (!vu)
+        return 1;
+    if (vhost_user_get_features(vu, &features) < 0)
+        return 1;
+    if (vhost_user_set_vring_num(vu, 0, 256) < 0)
+        return 1;
+    t = time_ms();
+    ret = vhost_user_get_vring_base(vu, 0, &base);
+    t = time_ms() - t;
+    if (!stall) {
+        if (ret < 0 || base != 42) {
+            printf("FAIL: get_vring_base ret=%d base=%d\n", ret, base);
+            return 1;
+        }
+        printf("ok: get_vring_base = %d in %" PRId64 " ms\n", base, t);
+        return 0;
+    }
+    if (ret >= 0 || t < 1500 || t > 3000) {
+        printf("FAIL: stalled get_vring_base ret=%d after %" PRId64 " ms\n",
+               ret, t);
+        return 1;
+    }
+    printf("ok: stalled get_vring_base failed after %" PRId64 " ms\n", t);
+    t = time_ms();
+    ret = vhost_user_get_features(vu, &features);
+    t = time_ms() - t;
+    if (ret >= 0 || t > 100) {
+        printf("FAIL: request after the timeout ret=%d after %" PRId64 " ms\n",
+               ret, t);
+        return 1;
+    }
+    printf("ok: next request failed after %" PRId64 " ms\n", t);
+    vhost_user_close(vu);
+    return 0;
+}
@@ -0,0 +1,18 @@
+#!/bin/sh
+# Builds the client and runs it against backend.py, answering and stalled.
+set -e
+dir=$(cd "$(dirname "$0")" && pwd)
+tmp=$(mktemp -d)
+pid=
+trap 'if [ -n "$pid" ]; then kill $pid; fi; rm -rf "$tmp"' EXIT
+cc -O2 -Wall -D_GNU_SOURCE -I"$dir/.." -o "$tmp/client" "$dir/client.c" \
+   "$dir/../vhost_user.c" "$dir/../cutils.c" -lpthread
+for mode in "" --stall; do
+    python3 "$dir/backend.py" "$tmp/sock" $mode &
+    pid=$!
+    while [ ! -S "$tmp/sock" ]; do sleep 0.1; done
+    "$tmp/client" "$tmp/sock" $mode
+    wait $pid
+    pid=
+    rm -f "$tmp/sock"
+done
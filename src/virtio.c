@@ -33,22 +33,22 @@
 #include <unistd.h>
 #include <stdatomic.h>
 
+#include <sys/eventfd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
 
-#if __has_include(<sys/random.h>)
-#include <sys/random.h>
-#else
-#include <sys/syscall.h>
-
-static inline ssize_t getrandom(void *buf, size_t buflen, unsigned int flags) {
-    return syscall(SYS_getrandom, buf, buflen, flags);
-}
-#endif
-
+#include "boottime.h"
+#include "bufpool.h"
 #include "cutils.h"
+#include "entropy.h"
 #include "list.h"
+#include "metrics.h"
+#include "probes.h"
+#include "topology.h"
+#include "trace.h"
+#include "vhost_user.h"
 #include "virtio.h"
 #include "fmem.h"
 
@@ -108,10 +108,17 @@ static inline ssize_t getrandom(void *buf, size_t buflen, unsigned int flags) {
 #define VIRTIO_PCI_ISR_OFFSET          0x1000
 #define VIRTIO_PCI_CONFIG_OFFSET       0x2000
 #define VIRTIO_PCI_NOTIFY_OFFSET       0x3000
+#define VIRTIO_PCI_MSIX_TABLE_OFFSET   0x4000
+#define VIRTIO_PCI_MSIX_PBA_OFFSET     0x5000
+
+#define VIRTIO_MSI_NO_VECTOR 0xffff
 
 #define VIRTIO_PCI_CAP_LEN 16
 
-#define MAX_QUEUE 8
+#define MAX_QUEUE 16
+#if VIRTIO_CONSOLE_MAX_PORTS > (MAX_QUEUE - 2) / 2
+#error "not enough queues for the virtio console ports"
+#endif
 #define MAX_CONFIG_SPACE_SIZE 256
 #define MAX_QUEUE_NUM 16
 
@@ -124,6 +131,11 @@ typedef struct {
     virtio_phys_addr_t avail_addr;
     virtio_phys_addr_t used_addr;
     BOOL manual_recv; /* if TRUE, the device_recv() callback is not called */
+    uint16_t msix_vector; /* PCI only */
+    uint64_t notify_ns; /* time of the last kick */
+    Metric *kick_metric; /* registered on the first kick */
+    Metric *desc_metric;
+    Metric *bytes_metric;
 } QueueState;
 
 #define VRING_DESC_F_NEXT       1
@@ -159,8 +171,12 @@ struct VIRTIODevice {
     uint32_t int_status;
     uint32_t status;
     uint32_t device_features_sel;
+    uint32_t driver_features_sel;
+    uint64_t driver_features;
     uint32_t queue_sel; /* currently selected queue */
     QueueState queue[MAX_QUEUE];
+    int msix_nvectors; /* PCI only, 0 if no MSI-X */
+    uint16_t config_msix_vector; /* PCI only */
 
     /* device specific */
     uint32_t device_id;
@@ -169,8 +185,24 @@ struct VIRTIODevice {
     VIRTIODeviceRecvFunc *device_recv;
     void (*config_write)(VIRTIODevice *s); /* called after the config
                                               is written */
+    void (*driver_ok)(VIRTIODevice *s); /* called when the driver sets
+                                           DRIVER_OK */
+    void (*device_reset)(VIRTIODevice *s); /* called by virtio_reset() */
+    /* if set, called instead of the device_recv() processing when the
+       guest notifies a queue */
+    void (*queue_kick)(VIRTIODevice *s, int queue_idx);
+    /* if set, called when a notify has processed the available buffers */
+    void (*queue_done)(VIRTIODevice *s, int queue_idx);
     uint32_t config_space_size; /* in bytes, must be multiple of 4 */
     uint8_t config_space[MAX_CONFIG_SPACE_SIZE];
+    BufferPool *buf_pool; /* request buffers */
+    int instance; /* among the devices of the same type, for the metrics */
+    Metric *notify_latency_metric;
+    /* boot timeline milestones already reached */
+    uint8_t boot_first_mmio;
+    uint8_t boot_driver_ok;
+    uint8_t boot_first_notify;
+    uint8_t boot_first_used;
 
     _Atomic uint32_t pending_queue_notify;
 };
@@ -183,15 +215,21 @@ static void virtio_pci_write(void *opaque, uint32_t offset,
                              uint32_t val, int size_log2);
 
 static void async_queue_notify(VIRTIODevice *s, int queue_idx);
+static void virtio_queue_schedule(VIRTIODevice *s, int queue_idx);
 
 void virtio_reset(VIRTIODevice *s)
 {
     int i;
 
+    if (s->device_reset)
+        s->device_reset(s);
     s->status = 0;
     s->queue_sel = 0;
     s->device_features_sel = 0;
+    s->driver_features_sel = 0;
+    s->driver_features = 0;
     s->int_status = 0;
+    s->config_msix_vector = VIRTIO_MSI_NO_VECTOR;
     for(i = 0; i < MAX_QUEUE; i++) {
         QueueState *qs = &s->queue[i];
         qs->ready = 0;
@@ -200,6 +238,7 @@ void virtio_reset(VIRTIODevice *s)
         qs->avail_addr = 0;
         qs->used_addr = 0;
         qs->last_avail_idx = 0;
+        qs->msix_vector = VIRTIO_MSI_NO_VECTOR;
     }
 }
 
@@ -249,16 +288,106 @@ void virtio_dma_init(int dma_fd)
     virtio_dma_fd = dma_fd;
 }
 
+/* when set, bulk transfers bypass fmem */
+static XDMATransport *virtio_xdma;
+
+void virtio_xdma_init(XDMATransport *xdma)
+{
+    virtio_xdma = xdma;
+}
+
+/* when set, accesses inside the window are plain memory accesses */
+static uint8_t *virtio_dram_ptr;
+static uint64_t virtio_dram_base, virtio_dram_size;
+/* the file mapped at virtio_dram_ptr, so that other processes can map
+   the window too */
+static int virtio_dram_fd = -1;
+static uint64_t virtio_dram_fd_offset;
+
+void virtio_dram_init(uint8_t *ptr, uint64_t base, uint64_t size)
+{
+    virtio_dram_ptr = ptr;
+    virtio_dram_base = base;
+    virtio_dram_size = size;
+}
+
+void virtio_dram_set_fd(int fd, uint64_t offset)
+{
+    virtio_dram_fd = fd;
+    virtio_dram_fd_offset = offset;
+}
+
+static inline uint8_t *virtio_get_dram_ptr(virtio_phys_addr_t addr, int size)
+{
+    if (!virtio_dram_ptr || addr < virtio_dram_base ||
+        addr - virtio_dram_base + size > virtio_dram_size)
+        return NULL;
+    return virtio_dram_ptr + (addr - virtio_dram_base);
+}
+
+static int virtio_buffer_pool_flags;
+
+void virtio_set_buffer_pool_flags(int flags)
+{
+    virtio_buffer_pool_flags = flags;
+}
+
+BufferPool *virtio_get_buffer_pool(VIRTIODevice *s)
+{
+    return s->buf_pool;
+}
+
+static const char *virtio_device_name(uint32_t device_id)
+{
+    switch(device_id) {
+    case 1:
+        return "net";
+    case 2:
+        return "block";
+    case 3:
+        return "console";
+    case 4:
+        return "entropy";
+    case 9:
+        return "9p";
+    case 18:
+        return "input";
+    case 19:
+        return "vsock";
+    default:
+        return "virtio";
+    }
+}
+
+#define VIRTIO_STATUS_DRIVER_OK 4
+
+#define VIRTIO_BOOT_MILESTONE(s, flag, what)                            \
+    BOOT_MILESTONE_ONCE((s)->flag, "%s%d %s",                           \
+                        virtio_device_name((s)->device_id), (s)->instance, \
+                        what)
+
+static int virtio_instance_count[32];
+
+static int64_t virtio_read_pool_bytes(void *opaque)
+{
+    BufferPoolStats st;
+
+    buffer_pool_get_stats(opaque, &st);
+    return st.bytes_in_use;
+}
+
 static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
                         uint32_t device_id, int config_space_size,
                         VIRTIODeviceRecvFunc *device_recv)
 {
     memset(s, 0, sizeof(*s));
+    s->buf_pool = buffer_pool_new(virtio_device_name(device_id),
+                                  virtio_buffer_pool_flags);
 
     if (bus->pci_bus) {
         uint16_t pci_device_id, class_id;
         char name[32];
-        int bar_num;
+        int bar_num, bar_size;
 
         switch(device_id) {
         case 1:
@@ -285,6 +414,10 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
             pci_device_id = 0x1040 + device_id; /* use new device ID */
             class_id = 0x0980;
             break;
+        case 19:
+            pci_device_id = 0x1040 + device_id; /* use new device ID */
+            class_id = 0x0880;
+            break;
         default:
             abort();
         }
@@ -306,13 +439,23 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
         virtio_add_pci_capability(s, 2, bar_num,
                               VIRTIO_PCI_NOTIFY_OFFSET, 0x1000, 0); /* notify */
 
+        bar_size = 0x4000;
+        if (pci_bus_has_msi_sink(bus->pci_bus)) {
+            /* one vector for configuration changes plus one per queue */
+            s->msix_nvectors = MAX_QUEUE + 1;
+            pci_msix_init(s->pci_dev, s->msix_nvectors, bar_num,
+                          VIRTIO_PCI_MSIX_TABLE_OFFSET,
+                          VIRTIO_PCI_MSIX_PBA_OFFSET);
+            bar_size = 0x8000;
+        }
+
         s->get_ram_ptr = virtio_pci_get_ram_ptr;
         s->irq = pci_device_get_irq(s->pci_dev, 0);
         s->mem_map = pci_device_get_mem_map(s->pci_dev);
-        s->mem_range = cpu_register_device(s->mem_map, 0, 0x4000, s,
+        s->mem_range = cpu_register_device(s->mem_map, 0, bar_size, s,
                                            virtio_pci_read, virtio_pci_write,
                                            DEVIO_SIZE8 | DEVIO_SIZE16 | DEVIO_SIZE32 | DEVIO_DISABLED);
-        pci_register_bar(s->pci_dev, bar_num, 0x4000, PCI_ADDRESS_SPACE_MEM,
+        pci_register_bar(s->pci_dev, bar_num, bar_size, PCI_ADDRESS_SPACE_MEM,
                          s, virtio_pci_bar_set);
     } else {
         /* MMIO case */
@@ -329,14 +472,46 @@ static void virtio_init(VIRTIODevice *s, VIRTIOBusDef *bus,
     s->config_space_size = config_space_size;
     s->device_recv = device_recv;
     s->debug = 1; // XXX for debug.
+    s->instance = virtio_instance_count[device_id & 31]++;
+    s->notify_latency_metric =
+        metric_new(METRIC_HISTOGRAM, "virtio_queue_notify_duration_seconds",
+                   "Time from a queue kick to the worker looking at the queue",
+                   "device=\"%s%d\"", virtio_device_name(device_id),
+                   s->instance);
+    metric_new_gauge_func("virtio_buffer_pool_bytes",
+                          "Request buffer memory in use", virtio_read_pool_bytes,
+                          s->buf_pool, "device=\"%s%d\"",
+                          virtio_device_name(device_id), s->instance);
     virtio_reset(s);
 }
 
+static void virtio_queue_metrics_init(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+    const char *name = virtio_device_name(s->device_id);
+
+    qs->kick_metric = metric_new(METRIC_COUNTER, "virtio_queue_kicks_total",
+                                 "Queue notifications from the guest",
+                                 "device=\"%s%d\",queue=\"%d\"", name,
+                                 s->instance, queue_idx);
+    qs->desc_metric = metric_new(METRIC_COUNTER, "virtio_queue_descriptors_total",
+                                 "Descriptors returned to the guest",
+                                 "device=\"%s%d\",queue=\"%d\"", name,
+                                 s->instance, queue_idx);
+    qs->bytes_metric = metric_new(METRIC_COUNTER, "virtio_queue_bytes_total",
+                                  "Bytes written to the guest in returned descriptors",
+                                  "device=\"%s%d\",queue=\"%d\"", name,
+                                  s->instance, queue_idx);
+}
+
 static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf, virtio_phys_addr_t addr, int count);
 static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr, const uint8_t *buf, int count);
 
-static uint16_t virtio_read16(VIRTIODevice *s, virtio_phys_addr_t addr)
+static uint16_t virtio_read16_1(VIRTIODevice *s, virtio_phys_addr_t addr)
 {
+    uint8_t *ptr = virtio_get_dram_ptr(addr, 2);
+    if (ptr)
+        return get_le16(ptr);
     addr -= FMEM_HOST_CACHED_MEM_BASE;
     if (virtio_dma_fd > 0) {
         uint16_t ret = fmem_read16(virtio_dma_fd, addr);
@@ -348,9 +523,14 @@ static uint16_t virtio_read16(VIRTIODevice *s, virtio_phys_addr_t addr)
     }
 }
 
-static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr,
-                           uint16_t val)
+static void virtio_write16_1(VIRTIODevice *s, virtio_phys_addr_t addr,
+                             uint16_t val)
 {
+    uint8_t *ptr = virtio_get_dram_ptr(addr, 2);
+    if (ptr) {
+        put_le16(ptr, val);
+        return;
+    }
     addr -= FMEM_HOST_CACHED_MEM_BASE;
     if (virtio_dma_fd > 0) {
         printf("virtio_write16 phys_addr: %lx val: %x dma_fd: %x \r\n", addr, val, virtio_dma_fd);
@@ -361,9 +541,14 @@ static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr,
     }
 }
 
-static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr,
-                           uint32_t val)
+static void virtio_write32_1(VIRTIODevice *s, virtio_phys_addr_t addr,
+                             uint32_t val)
 {
+    uint8_t *ptr = virtio_get_dram_ptr(addr, 4);
+    if (ptr) {
+        put_le32(ptr, val);
+        return;
+    }
     addr -= FMEM_HOST_CACHED_MEM_BASE;
     if (virtio_dma_fd > 0) {
         printf("virtio_write32 phys_addr: %lx val: %x dma_fd: %x \r\n", addr, val, virtio_dma_fd);
@@ -374,10 +559,17 @@ static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr,
     }
 }
 
-static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf,
-                                  virtio_phys_addr_t addr, int count)
+static int virtio_memcpy_from_ram1(VIRTIODevice *s, uint8_t *buf,
+                                   virtio_phys_addr_t addr, int count)
 {
+    uint8_t *ptr = virtio_get_dram_ptr(addr, count);
+    if (ptr) {
+        memcpy(buf, ptr, count);
+        return 0;
+    }
     addr -= FMEM_HOST_CACHED_MEM_BASE;
+    if (virtio_xdma && count >= XDMA_MIN_TRANSFER)
+        return xdma_read(virtio_xdma, addr, buf, count);
     if (virtio_dma_fd > 0) {
         for (int i=0; i<count; i++) buf[i] = fmem_read8(virtio_dma_fd, addr+i);
         printf("virtio_memcpy_from_ram phys_addr: %lx ", addr);
@@ -390,10 +582,17 @@ static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf,
     }
 }
 
-static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr,
-                                const uint8_t *buf, int count)
+static int virtio_memcpy_to_ram1(VIRTIODevice *s, virtio_phys_addr_t addr,
+                                 const uint8_t *buf, int count)
 {
+    uint8_t *ptr = virtio_get_dram_ptr(addr, count);
+    if (ptr) {
+        memcpy(ptr, buf, count);
+        return 0;
+    }
     addr -= FMEM_HOST_CACHED_MEM_BASE;
+    if (virtio_xdma && count >= XDMA_MIN_TRANSFER)
+        return xdma_write(virtio_xdma, addr, buf, count);
     if (virtio_dma_fd > 0) {
         printf("virtio_memcpy_to_ram phys_addr: %lx buf[0]: %x count: %d dma_fd: %x \r\n", addr, buf[0], count, virtio_dma_fd);
         for (int i=0; i<count; i++) fmem_write8(virtio_dma_fd, addr+i, buf[i]);
@@ -404,6 +603,67 @@ static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr,
     }
 }
 
+/* the accessors above, with every transfer added to the trace */
+
+static uint16_t virtio_read16(VIRTIODevice *s, virtio_phys_addr_t addr)
+{
+    uint16_t val = virtio_read16_1(s, addr);
+    uint8_t buf[2];
+
+    boot_count_dma(2);
+    if (trace_recording) {
+        put_le16(buf, val);
+        trace_record(TRACE_DMA_READ, addr, 0, 0, buf, 2);
+    }
+    return val;
+}
+
+static void virtio_write16(VIRTIODevice *s, virtio_phys_addr_t addr,
+                           uint16_t val)
+{
+    uint8_t buf[2];
+
+    virtio_write16_1(s, addr, val);
+    boot_count_dma(2);
+    if (trace_recording) {
+        put_le16(buf, val);
+        trace_record(TRACE_DMA_WRITE, addr, 0, 0, buf, 2);
+    }
+}
+
+static void virtio_write32(VIRTIODevice *s, virtio_phys_addr_t addr,
+                           uint32_t val)
+{
+    uint8_t buf[4];
+
+    virtio_write32_1(s, addr, val);
+    boot_count_dma(4);
+    if (trace_recording) {
+        put_le32(buf, val);
+        trace_record(TRACE_DMA_WRITE, addr, 0, 0, buf, 4);
+    }
+}
+
+static int virtio_memcpy_from_ram(VIRTIODevice *s, uint8_t *buf,
+                                  virtio_phys_addr_t addr, int count)
+{
+    int ret = virtio_memcpy_from_ram1(s, buf, addr, count);
+    boot_count_dma(count);
+    if (trace_recording && ret >= 0)
+        trace_record(TRACE_DMA_READ, addr, 0, 0, buf, count);
+    return ret;
+}
+
+static int virtio_memcpy_to_ram(VIRTIODevice *s, virtio_phys_addr_t addr,
+                                const uint8_t *buf, int count)
+{
+    int ret = virtio_memcpy_to_ram1(s, addr, buf, count);
+    boot_count_dma(count);
+    if (trace_recording && ret >= 0)
+        trace_record(TRACE_DMA_WRITE, addr, 0, 0, buf, count);
+    return ret;
+}
+
 static int get_desc(VIRTIODevice *s, VIRTIODesc *desc,
                     int queue_idx, int desc_idx)
 {
@@ -495,6 +755,21 @@ static int memcpy_to_queue(VIRTIODevice *s,
                                 count, TRUE);
 }
 
+/* tell the guest that the used ring of the queue has changed */
+static void virtio_queue_interrupt(VIRTIODevice *s, int queue_idx)
+{
+    QueueState *qs = &s->queue[queue_idx];
+
+    if (s->pci_dev && pci_msix_enabled(s->pci_dev)) {
+        /* no ISR and no shared line: each queue has its own vector */
+        if (qs->msix_vector != VIRTIO_MSI_NO_VECTOR)
+            pci_msix_notify(s->pci_dev, qs->msix_vector);
+        return;
+    }
+    s->int_status |= 1;
+    set_irq(s->irq, 1);
+}
+
 /* signal that the descriptor has been consumed */
 static void virtio_consume_desc(VIRTIODevice *s,
                                 int queue_idx, int desc_idx, int desc_len)
@@ -503,6 +778,7 @@ static void virtio_consume_desc(VIRTIODevice *s,
     virtio_phys_addr_t used_idx_addr, used_elem_addr;
     uint32_t used_idx;
 
+    VIRTIO_BOOT_MILESTONE(s, boot_first_used, "first used buffer");
     used_idx_addr = qs->used_addr + 2;
     used_idx = virtio_read16(s, used_idx_addr);
 
@@ -512,9 +788,11 @@ static void virtio_consume_desc(VIRTIODevice *s,
 
     atomic_thread_fence(memory_order_release);
     virtio_write16(s, used_idx_addr, used_idx + 1);
-
-    s->int_status |= 1;
-    set_irq(s->irq, 1);
+    PROBE(consume_desc, s->device_id, s, queue_idx, desc_idx, desc_len,
+          probe_time_ns() - qs->notify_ns);
+    metric_inc(qs->desc_metric);
+    metric_add(qs->bytes_metric, desc_len);
+    virtio_queue_interrupt(s, queue_idx);
 }
 
 static int get_desc_rw_size(VIRTIODevice *s,
@@ -565,6 +843,9 @@ static void queue_notify(VIRTIODevice *s, int queue_idx)
 
     avail_idx = virtio_read16(s, qs->avail_addr + 2);
     qs->avail_idx = avail_idx;
+    PROBE(queue_notify, s->device_id, s, queue_idx,
+          (uint16_t)(avail_idx - qs->last_avail_idx),
+          probe_time_ns() - qs->notify_ns);
     if (qs->manual_recv)
         return;
 
@@ -585,6 +866,8 @@ static void queue_notify(VIRTIODevice *s, int queue_idx)
         }
         qs->last_avail_idx++;
     }
+    if (s->queue_done)
+        s->queue_done(s, queue_idx);
 }
 
 static uint32_t virtio_config_read(VIRTIODevice *s, uint32_t offset,
@@ -652,6 +935,8 @@ static uint32_t virtio_mmio_read(void *opaque, uint32_t offset, int size_log2)
     VIRTIODevice *s = opaque;
     uint32_t val;
 
+    VIRTIO_BOOT_MILESTONE(s, boot_first_mmio, "first mmio");
+
     if (offset >= VIRTIO_MMIO_CONFIG) {
         return virtio_config_read(s, offset - VIRTIO_MMIO_CONFIG, size_log2);
     }
@@ -761,11 +1046,38 @@ static void set_low32(virtio_phys_addr_t *paddr, uint32_t val)
 }
 #endif
 
+static void virtio_set_driver_features(VIRTIODevice *s, uint32_t val)
+{
+    if (s->driver_features_sel == 0)
+        s->driver_features = (s->driver_features & ~0xffffffffULL) | val;
+    else if (s->driver_features_sel == 1)
+        s->driver_features = (s->driver_features & 0xffffffff) |
+            ((uint64_t)val << 32);
+}
+
+static void virtio_set_status(VIRTIODevice *s, uint32_t val)
+{
+    uint32_t old_status = s->status;
+
+    s->status = val;
+    if (val & VIRTIO_STATUS_DRIVER_OK) {
+        VIRTIO_BOOT_MILESTONE(s, boot_driver_ok, "driver ok");
+        if (!(old_status & VIRTIO_STATUS_DRIVER_OK) && s->driver_ok)
+            s->driver_ok(s);
+    }
+    if (val == 0) {
+        /* reset */
+        set_irq(s->irq, 0);
+        virtio_reset(s);
+    }
+}
+
 static void virtio_mmio_write(void *opaque, uint32_t offset,
                               uint32_t val, int size_log2)
 {
     VIRTIODevice *s = opaque;
 
+    VIRTIO_BOOT_MILESTONE(s, boot_first_mmio, "first mmio");
 #ifdef DEBUG_VIRTIO
     if (s->debug & VIRTIO_DEBUG_IO) {
         printf("virtio_mmio_write: offset=0x%x val=0x%x size=%d\r\n",
@@ -812,13 +1124,14 @@ static void virtio_mmio_write(void *opaque, uint32_t offset,
             set_high32(&s->queue[s->queue_sel].used_addr, val);
             break;
 #endif
+        case VIRTIO_MMIO_DRIVER_FEATURES_SEL:
+            s->driver_features_sel = val;
+            break;
+        case VIRTIO_MMIO_DRIVER_FEATURES:
+            virtio_set_driver_features(s, val);
+            break;
         case VIRTIO_MMIO_STATUS:
-            s->status = val;
-            if (val == 0) {
-                /* reset */
-                set_irq(s->irq, 0);
-                virtio_reset(s);
-            }
+            virtio_set_status(s, val);
             break;
         case VIRTIO_MMIO_QUEUE_READY:
             s->queue[s->queue_sel].ready = val & 1;
@@ -845,6 +1158,7 @@ static uint32_t virtio_pci_read(void *opaque, uint32_t offset1, int size_log2)
     uint32_t offset;
     uint32_t val = 0;
 
+    VIRTIO_BOOT_MILESTONE(s, boot_first_mmio, "first mmio");
     offset = offset1 & 0xfff;
     switch(offset1 >> 12) {
     case VIRTIO_PCI_CFG_OFFSET >> 12:
@@ -892,6 +1206,12 @@ static uint32_t virtio_pci_read(void *opaque, uint32_t offset1, int size_log2)
             case VIRTIO_PCI_NUM_QUEUES:
                 val = MAX_QUEUE_NUM;
                 break;
+            case VIRTIO_PCI_MSIX_CONFIG:
+                val = s->config_msix_vector;
+                break;
+            case VIRTIO_PCI_QUEUE_MSIX_VECTOR:
+                val = s->queue[s->queue_sel].msix_vector;
+                break;
             case VIRTIO_PCI_QUEUE_SEL:
                 val = s->queue_sel;
                 break;
@@ -924,6 +1244,12 @@ static uint32_t virtio_pci_read(void *opaque, uint32_t offset1, int size_log2)
     case VIRTIO_PCI_CONFIG_OFFSET >> 12:
         val = virtio_config_read(s, offset, size_log2);
         break;
+    case VIRTIO_PCI_MSIX_TABLE_OFFSET >> 12:
+        val = pci_msix_table_read(s->pci_dev, offset, size_log2);
+        break;
+    case VIRTIO_PCI_MSIX_PBA_OFFSET >> 12:
+        val = pci_msix_pba_read(s->pci_dev, offset, size_log2);
+        break;
     }
 #ifdef DEBUG_VIRTIO
     if (s->debug & VIRTIO_DEBUG_IO) {
@@ -934,12 +1260,21 @@ static uint32_t virtio_pci_read(void *opaque, uint32_t offset1, int size_log2)
     return val;
 }
 
+/* the driver reads the vector back to check that it was accepted */
+static uint16_t virtio_pci_map_vector(VIRTIODevice *s, uint32_t val)
+{
+    if (val >= s->msix_nvectors)
+        return VIRTIO_MSI_NO_VECTOR;
+    return val;
+}
+
 static void virtio_pci_write(void *opaque, uint32_t offset1,
                              uint32_t val, int size_log2)
 {
     VIRTIODevice *s = opaque;
     uint32_t offset;
 
+    VIRTIO_BOOT_MILESTONE(s, boot_first_mmio, "first mmio");
 #ifdef DEBUG_VIRTIO
     if (s->debug & VIRTIO_DEBUG_IO) {
         printf("virto_pci_write: offset=0x%x val=0x%x size=%d\r\n",
@@ -954,6 +1289,12 @@ static void virtio_pci_write(void *opaque, uint32_t offset1,
             case VIRTIO_PCI_DEVICE_FEATURE_SEL:
                 s->device_features_sel = val;
                 break;
+            case VIRTIO_PCI_GUEST_FEATURE_SEL:
+                s->driver_features_sel = val;
+                break;
+            case VIRTIO_PCI_GUEST_FEATURE:
+                virtio_set_driver_features(s, val);
+                break;
             case VIRTIO_PCI_QUEUE_DESC_LOW:
                 set_low32(&s->queue[s->queue_sel].desc_addr, val);
                 break;
@@ -989,16 +1330,18 @@ static void virtio_pci_write(void *opaque, uint32_t offset1,
             case VIRTIO_PCI_QUEUE_ENABLE:
                 s->queue[s->queue_sel].ready = val & 1;
                 break;
+            case VIRTIO_PCI_MSIX_CONFIG:
+                s->config_msix_vector = virtio_pci_map_vector(s, val);
+                break;
+            case VIRTIO_PCI_QUEUE_MSIX_VECTOR:
+                s->queue[s->queue_sel].msix_vector =
+                    virtio_pci_map_vector(s, val);
+                break;
             }
         } else if (size_log2 == 0) {
             switch(offset) {
             case VIRTIO_PCI_DEVICE_STATUS:
-                s->status = val;
-                if (val == 0) {
-                    /* reset */
-                    set_irq(s->irq, 0);
-                    virtio_reset(s);
-                }
+                virtio_set_status(s, val);
                 break;
             }
         }
@@ -1010,6 +1353,9 @@ static void virtio_pci_write(void *opaque, uint32_t offset1,
         if (val < MAX_QUEUE)
             async_queue_notify(s, val);
         break;
+    case VIRTIO_PCI_MSIX_TABLE_OFFSET >> 12:
+        pci_msix_table_write(s->pci_dev, offset, val, size_log2);
+        break;
     }
 }
 
@@ -1020,6 +1366,11 @@ void virtio_set_debug(VIRTIODevice *s, int debug)
 
 static void virtio_config_change_notify(VIRTIODevice *s)
 {
+    if (s->pci_dev && pci_msix_enabled(s->pci_dev)) {
+        if (s->config_msix_vector != VIRTIO_MSI_NO_VECTOR)
+            pci_msix_notify(s->pci_dev, s->config_msix_vector);
+        return;
+    }
     /* INT_CONFIG interrupt */
     s->int_status |= 2;
     set_irq(s->irq, 1);
@@ -1034,6 +1385,9 @@ typedef struct {
     int write_size;
     int queue_idx;
     int desc_idx;
+    uint64_t sector_num;
+    int size; /* bytes read or written */
+    uint64_t start_ns;
 } BlockRequest;
 
 typedef struct VIRTIOBlockDevice {
@@ -1042,6 +1396,12 @@ typedef struct VIRTIOBlockDevice {
 
     BOOL req_in_progress;
     BlockRequest req; /* request in progress */
+
+    /* indexed by VIRTIO_BLK_T_IN and VIRTIO_BLK_T_OUT */
+    Metric *req_metric[2];
+    Metric *bytes_metric[2];
+    Metric *latency_metric[2];
+    Metric *error_metric;
 } VIRTIOBlockDevice;
 
 typedef struct {
@@ -1069,6 +1429,16 @@ static void virtio_block_req_end(VIRTIODevice *s, int ret)
     int desc_idx = s1->req.desc_idx;
     uint8_t *buf, buf1[1];
 
+    PROBE(block_req_end, s, queue_idx, desc_idx, s1->req.type, ret,
+          s1->req.size, probe_time_ns() - s1->req.start_ns);
+    if (s1->req.type <= VIRTIO_BLK_T_OUT) {
+        metric_inc(s1->req_metric[s1->req.type]);
+        metric_add(s1->bytes_metric[s1->req.type], s1->req.size);
+        metric_observe(s1->latency_metric[s1->req.type],
+                       metric_time_ns() - s1->req.start_ns);
+    }
+    if (ret < 0)
+        metric_inc(s1->error_metric);
     switch(s1->req.type) {
     case VIRTIO_BLK_T_IN:
         write_size = s1->req.write_size;
@@ -1079,7 +1449,7 @@ static void virtio_block_req_end(VIRTIODevice *s, int ret)
             buf[write_size - 1] = VIRTIO_BLK_S_OK;
         }
         memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, write_size);
-        free(buf);
+        buffer_pool_free(s->buf_pool, buf);
         virtio_consume_desc(s, queue_idx, desc_idx, write_size);
         break;
     case VIRTIO_BLK_T_OUT:
@@ -1129,9 +1499,15 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
     s1->req.type = h.type;
     s1->req.queue_idx = queue_idx;
     s1->req.desc_idx = desc_idx;
+    s1->req.sector_num = h.sector_num;
+    s1->req.size = h.type == VIRTIO_BLK_T_IN ? write_size - 1 :
+        read_size - (int)sizeof(h);
+    s1->req.start_ns = metric_time_ns();
+    PROBE(block_req_start, s, queue_idx, desc_idx, h.type, h.sector_num,
+          s1->req.size);
     switch(h.type) {
     case VIRTIO_BLK_T_IN:
-        s1->req.buf = malloc(write_size);
+        s1->req.buf = buffer_pool_alloc(s->buf_pool, write_size);
         s1->req.write_size = write_size;
         ret = bs->read_async(bs, h.sector_num, s1->req.buf,
                              (write_size - 1) / SECTOR_SIZE,
@@ -1146,11 +1522,11 @@ static int virtio_block_recv_request(VIRTIODevice *s, int queue_idx,
     case VIRTIO_BLK_T_OUT:
         assert(write_size >= 1);
         len = read_size - sizeof(h);
-        buf = malloc(len);
+        buf = buffer_pool_alloc(s->buf_pool, len);
         memcpy_from_queue(s, buf, queue_idx, desc_idx, sizeof(h), len);
         ret = bs->write_async(bs, h.sector_num, buf, len / SECTOR_SIZE,
                               virtio_block_req_cb, s);
-        free(buf);
+        buffer_pool_free(s->buf_pool, buf);
         if (ret > 0) {
             /* asyncronous write */
             s1->req_in_progress = TRUE;
@@ -1171,11 +1547,29 @@ VIRTIODevice *virtio_block_init(VIRTIOBusDef *bus, BlockDevice *bs)
 {
     VIRTIOBlockDevice *s;
     uint64_t nb_sectors;
+    int i;
 
     s = mallocz(sizeof(*s));
     virtio_init(&s->common, bus,
                 2, 8, virtio_block_recv_request);
     s->bs = bs;
+    for(i = 0; i < 2; i++) {
+        const char *op = i == VIRTIO_BLK_T_IN ? "read" : "write";
+        s->req_metric[i] = metric_new(METRIC_COUNTER, "virtio_block_requests_total",
+                                      "Block requests", "device=\"block%d\",op=\"%s\"",
+                                      s->common.instance, op);
+        s->bytes_metric[i] = metric_new(METRIC_COUNTER, "virtio_block_bytes_total",
+                                        "Bytes read from or written to the disk image",
+                                        "device=\"block%d\",op=\"%s\"",
+                                        s->common.instance, op);
+        s->latency_metric[i] = metric_new(METRIC_HISTOGRAM, "virtio_block_request_duration_seconds",
+                                          "Time from reading a block request to its completion",
+                                          "device=\"block%d\",op=\"%s\"",
+                                          s->common.instance, op);
+    }
+    s->error_metric = metric_new(METRIC_COUNTER, "virtio_block_errors_total",
+                                 "Block requests that failed", "device=\"block%d\"",
+                                 s->common.instance);
 
     nb_sectors = bs->get_sector_count(bs);
     put_le32(s->common.config_space, nb_sectors);
@@ -1191,6 +1585,12 @@ typedef struct VIRTIONetDevice {
     VIRTIODevice common;
     EthernetDevice *es;
     int header_size;
+    Metric *tx_packets_metric;
+    Metric *tx_bytes_metric;
+    Metric *rx_packets_metric;
+    Metric *rx_bytes_metric;
+    Metric *rx_dropped_metric;
+    uint8_t boot_first_rx;
 } VIRTIONetDevice;
 
 typedef struct {
@@ -1212,21 +1612,37 @@ static int virtio_net_recv_request(VIRTIODevice *s, int queue_idx,
     VIRTIONetHeader h;
     uint8_t *buf;
     int len;
+    uint64_t start_ns;
 
     if (queue_idx == 1) {
         /* send to network */
         if (memcpy_from_queue(s, &h, queue_idx, desc_idx, 0, s1->header_size) < 0)
             return 0;
         len = read_size - s1->header_size;
-        buf = malloc(len);
+        buf = buffer_pool_alloc(s->buf_pool, len);
         memcpy_from_queue(s, buf, queue_idx, desc_idx, s1->header_size, len);
+        start_ns = PROBE_ENABLED(net_tx) ? probe_time_ns() : 0;
         es->write_packet(es, buf, len);
-        free(buf);
+        PROBE(net_tx, s, queue_idx, desc_idx, len,
+              start_ns ? probe_time_ns() - start_ns : 0);
+        metric_inc(s1->tx_packets_metric);
+        metric_add(s1->tx_bytes_metric, len);
+        buffer_pool_free(s->buf_pool, buf);
         virtio_consume_desc(s, queue_idx, desc_idx, 0);
     }
     return 0;
 }
 
+/* lets the backend send the frames of a notify together */
+static void virtio_net_queue_done(VIRTIODevice *s, int queue_idx)
+{
+    VIRTIONetDevice *s1 = (VIRTIONetDevice *)s;
+    EthernetDevice *es = s1->es;
+
+    if (queue_idx == 1 && es->flush)
+        es->flush(es);
+}
+
 static BOOL virtio_net_can_write_packet(EthernetDevice *es)
 {
     VIRTIODevice *s = es->device_opaque;
@@ -1247,20 +1663,28 @@ static void virtio_net_write_packet(EthernetDevice *es, const uint8_t *buf, int
     VIRTIONetHeader h;
     int len, read_size, write_size;
 
-    if (!qs->ready)
-        return;
-    if (qs->last_avail_idx == qs->avail_idx)
+    if (!qs->ready || qs->last_avail_idx == qs->avail_idx) {
+        metric_inc(s1->rx_dropped_metric);
         return;
+    }
     desc_idx = virtio_read16(s, qs->avail_addr + 4 +
                              (qs->last_avail_idx & (qs->num - 1)) * 2);
     if (get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx))
         return;
     len = s1->header_size + buf_len;
-    if (len > write_size)
+    if (len > write_size) {
+        metric_inc(s1->rx_dropped_metric);
         return;
+    }
     memset(&h, 0, s1->header_size);
     memcpy_to_queue(s, queue_idx, desc_idx, 0, &h, s1->header_size);
     memcpy_to_queue(s, queue_idx, desc_idx, s1->header_size, buf, buf_len);
+    PROBE(net_rx, s, queue_idx, desc_idx, buf_len,
+          probe_time_ns() - qs->notify_ns);
+    metric_inc(s1->rx_packets_metric);
+    metric_add(s1->rx_bytes_metric, buf_len);
+    BOOT_MILESTONE_ONCE(s1->boot_first_rx, "net%d first rx packet",
+                        s->instance);
     virtio_consume_desc(s, queue_idx, desc_idx, len);
     qs->last_avail_idx++;
 }
@@ -1288,6 +1712,7 @@ VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es)
     /* VIRTIO_NET_F_MAC, VIRTIO_NET_F_STATUS */
     s->common.device_features = (1 << 5) /* | (1 << 16) */;
     s->common.queue[0].manual_recv = TRUE;
+    s->common.queue_done = virtio_net_queue_done;
     s->es = es;
     memcpy(s->common.config_space, es->mac_addr, 6);
     /* status */
@@ -1296,6 +1721,26 @@ VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es)
 
     s->header_size = sizeof(VIRTIONetHeader);
 
+    s->tx_packets_metric = metric_new(METRIC_COUNTER, "virtio_net_packets_total",
+                                      "Frames sent and received by the guest",
+                                      "device=\"net%d\",dir=\"tx\"",
+                                      s->common.instance);
+    s->tx_bytes_metric = metric_new(METRIC_COUNTER, "virtio_net_bytes_total",
+                                    "Bytes sent and received by the guest",
+                                    "device=\"net%d\",dir=\"tx\"",
+                                    s->common.instance);
+    s->rx_packets_metric = metric_new(METRIC_COUNTER, "virtio_net_packets_total",
+                                      "Frames sent and received by the guest",
+                                      "device=\"net%d\",dir=\"rx\"",
+                                      s->common.instance);
+    s->rx_bytes_metric = metric_new(METRIC_COUNTER, "virtio_net_bytes_total",
+                                    "Bytes sent and received by the guest",
+                                    "device=\"net%d\",dir=\"rx\"",
+                                    s->common.instance);
+    s->rx_dropped_metric = metric_new(METRIC_COUNTER, "virtio_net_rx_dropped_total",
+                                      "Frames dropped for lack of a large enough receive buffer",
+                                      "device=\"net%d\"", s->common.instance);
+
     es->device_opaque = s;
     es->device_can_write_packet = virtio_net_can_write_packet;
     es->device_write_packet = virtio_net_write_packet;
@@ -1306,47 +1751,190 @@ VIRTIODevice *virtio_net_init(VIRTIOBusDef *bus, EthernetDevice *es)
 /*********************************************************************/
 /* console device */
 
+#define VIRTIO_CONSOLE_F_SIZE      0
+#define VIRTIO_CONSOLE_F_MULTIPORT 1
+
+/* port 0 uses queues 0/1, the control queues are 2/3 and port n >= 1
+   uses queues 2 + 2 * n and 3 + 2 * n */
+#define VIRTIO_CONSOLE_CTRL_RX_QUEUE 2
+#define VIRTIO_CONSOLE_CTRL_TX_QUEUE 3
+
+#define VIRTIO_CONSOLE_DEVICE_READY 0
+#define VIRTIO_CONSOLE_DEVICE_ADD   1
+#define VIRTIO_CONSOLE_DEVICE_REMOVE 2
+#define VIRTIO_CONSOLE_PORT_READY   3
+#define VIRTIO_CONSOLE_CONSOLE_PORT 4
+#define VIRTIO_CONSOLE_RESIZE       5
+#define VIRTIO_CONSOLE_PORT_OPEN    6
+#define VIRTIO_CONSOLE_PORT_NAME    7
+
+#define VIRTIO_CONSOLE_CTRL_SIZE 8
+#define VIRTIO_CONSOLE_NAME_MAX 64
+#define VIRTIO_CONSOLE_CTRL_QUEUE_LEN 32
+
+typedef struct {
+    CharacterDevice *cs;
+    char name[VIRTIO_CONSOLE_NAME_MAX];
+    BOOL guest_open;
+} VIRTIOConsolePort;
+
+typedef struct {
+    int len;
+    uint8_t buf[VIRTIO_CONSOLE_CTRL_SIZE + VIRTIO_CONSOLE_NAME_MAX];
+} VIRTIOConsoleControl;
+
 typedef struct VIRTIOConsoleDevice {
     VIRTIODevice common;
     CharacterDevice *cs;
+    int nr_ports;
+    VIRTIOConsolePort ports[VIRTIO_CONSOLE_MAX_PORTS];
+    /* device to driver control messages waiting for a buffer */
+    int ctrl_head, ctrl_count;
+    VIRTIOConsoleControl ctrl[VIRTIO_CONSOLE_CTRL_QUEUE_LEN];
 } VIRTIOConsoleDevice;
 
+static int virtio_console_rx_queue(int port)
+{
+    return port == 0 ? 0 : 2 + 2 * port;
+}
+
+/* return the port of a data queue or -1 for the control queues */
+static int virtio_console_queue_port(int queue_idx)
+{
+    if (queue_idx < 2)
+        return 0;
+    if (queue_idx < 4)
+        return -1;
+    return (queue_idx - 2) / 2;
+}
+
+static void virtio_console_send_control(VIRTIOConsoleDevice *s, int id,
+                                        int event, int value,
+                                        const char *name)
+{
+    VIRTIOConsoleControl *c;
+    int name_len;
+
+    if (s->ctrl_count == VIRTIO_CONSOLE_CTRL_QUEUE_LEN) {
+        printf("virtio_console: control queue overflow\r\n");
+        return;
+    }
+    c = &s->ctrl[(s->ctrl_head + s->ctrl_count++) % VIRTIO_CONSOLE_CTRL_QUEUE_LEN];
+    put_le32(c->buf, id);
+    put_le16(c->buf + 4, event);
+    put_le16(c->buf + 6, value);
+    c->len = VIRTIO_CONSOLE_CTRL_SIZE;
+    if (name) {
+        name_len = strlen(name);
+        memcpy(c->buf + c->len, name, name_len);
+        c->len += name_len;
+    }
+    /* push it out if the driver has posted control buffers */
+    queue_notify((VIRTIODevice *)s, VIRTIO_CONSOLE_CTRL_RX_QUEUE);
+}
+
+static void virtio_console_recv_control(VIRTIOConsoleDevice *s,
+                                        const uint8_t *buf)
+{
+    uint32_t id = get_le32(buf);
+    int event = get_le16(buf + 4);
+    int value = get_le16(buf + 6);
+    int i;
+
+    switch(event) {
+    case VIRTIO_CONSOLE_DEVICE_READY:
+        if (value) {
+            for(i = 0; i < s->nr_ports; i++)
+                virtio_console_send_control(s, i, VIRTIO_CONSOLE_DEVICE_ADD, 1, NULL);
+        }
+        break;
+    case VIRTIO_CONSOLE_PORT_READY:
+        if (!value || id >= s->nr_ports)
+            break;
+        if (id == 0)
+            virtio_console_send_control(s, id, VIRTIO_CONSOLE_CONSOLE_PORT, 1, NULL);
+        if (s->ports[id].name[0])
+            virtio_console_send_control(s, id, VIRTIO_CONSOLE_PORT_NAME, 1,
+                                        s->ports[id].name);
+        /* the host side is always connected */
+        virtio_console_send_control(s, id, VIRTIO_CONSOLE_PORT_OPEN, 1, NULL);
+        break;
+    case VIRTIO_CONSOLE_PORT_OPEN:
+        if (id < s->nr_ports)
+            s->ports[id].guest_open = value;
+        break;
+    default:
+        break;
+    }
+}
+
 static int virtio_console_recv_request(VIRTIODevice *s, int queue_idx,
                                        int desc_idx, int read_size,
                                        int write_size)
 {
     VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
-    CharacterDevice *cs = s1->cs;
+    CharacterDevice *cs;
     uint8_t *buf;
+    int port;
 
     printf("virtio_console_recv_request\r\n");
 
-    if (queue_idx == 1) {
-        /* send to console */
-        buf = malloc(read_size+1);
-        memset(buf, 0, read_size+1);
+    if (queue_idx == VIRTIO_CONSOLE_CTRL_RX_QUEUE) {
+        VIRTIOConsoleControl *c;
+        /* leave the buffer posted until there is something to send */
+        if (s1->ctrl_count == 0)
+            return -1;
+        c = &s1->ctrl[s1->ctrl_head];
+        if (c->len <= write_size) {
+            memcpy_to_queue(s, queue_idx, desc_idx, 0, c->buf, c->len);
+            virtio_consume_desc(s, queue_idx, desc_idx, c->len);
+        } else {
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+        }
+        s1->ctrl_head = (s1->ctrl_head + 1) % VIRTIO_CONSOLE_CTRL_QUEUE_LEN;
+        s1->ctrl_count--;
+    } else if (queue_idx == VIRTIO_CONSOLE_CTRL_TX_QUEUE) {
+        uint8_t ctrl[VIRTIO_CONSOLE_CTRL_SIZE];
+        if (read_size >= sizeof(ctrl) &&
+            memcpy_from_queue(s, ctrl, queue_idx, desc_idx, 0, sizeof(ctrl)) == 0) {
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+            virtio_console_recv_control(s1, ctrl);
+        } else {
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+        }
+    } else if (queue_idx & 1) {
+        /* send to console or port */
+        port = virtio_console_queue_port(queue_idx);
+        if (port >= s1->nr_ports) {
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+            return 0;
+        }
+        cs = s1->ports[port].cs;
+        buf = buffer_pool_alloc(s->buf_pool, read_size);
         memcpy_from_queue(s, buf, queue_idx, desc_idx, 0, read_size);
         cs->write_data(cs->opaque, buf, read_size);
-        free(buf);
+        buffer_pool_free(s->buf_pool, buf);
         virtio_consume_desc(s, queue_idx, desc_idx, 0);
     }
     return 0;
 }
 
-BOOL virtio_console_can_write_data(VIRTIODevice *s)
+BOOL virtio_console_port_can_write_data(VIRTIODevice *s, int port)
 {
-    QueueState *qs = &s->queue[0];
-    printf("virtio_console_can_write_data\r\n");
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    QueueState *qs = &s->queue[virtio_console_rx_queue(port)];
 
+    if (port != 0 && !s1->ports[port].guest_open)
+        return FALSE;
     if (!qs->ready) {
         return FALSE;
     }
     return qs->last_avail_idx != qs->avail_idx;
 }
 
-int virtio_console_get_write_len(VIRTIODevice *s)
+int virtio_console_port_get_write_len(VIRTIODevice *s, int port)
 {
-    int queue_idx = 0;
+    int queue_idx = virtio_console_rx_queue(port);
     QueueState *qs = &s->queue[queue_idx];
     int desc_idx;
     int read_size, write_size;
@@ -1362,9 +1950,10 @@ int virtio_console_get_write_len(VIRTIODevice *s)
     return write_size;
 }
 
-int virtio_console_write_data(VIRTIODevice *s, const uint8_t *buf, int buf_len)
+int virtio_console_port_write_data(VIRTIODevice *s, int port,
+                                   const uint8_t *buf, int buf_len)
 {
-    int queue_idx = 0;
+    int queue_idx = virtio_console_rx_queue(port);
     QueueState *qs = &s->queue[queue_idx];
     int desc_idx;
 
@@ -1380,6 +1969,22 @@ int virtio_console_write_data(VIRTIODevice *s, const uint8_t *buf, int buf_len)
     return buf_len;
 }
 
+BOOL virtio_console_can_write_data(VIRTIODevice *s)
+{
+    printf("virtio_console_can_write_data\r\n");
+    return virtio_console_port_can_write_data(s, 0);
+}
+
+int virtio_console_get_write_len(VIRTIODevice *s)
+{
+    return virtio_console_port_get_write_len(s, 0);
+}
+
+int virtio_console_write_data(VIRTIODevice *s, const uint8_t *buf, int buf_len)
+{
+    return virtio_console_port_write_data(s, 0, buf, buf_len);
+}
+
 /* send a resize event */
 void virtio_console_resize_event(VIRTIODevice *s, int width, int height)
 {
@@ -1390,17 +1995,42 @@ void virtio_console_resize_event(VIRTIODevice *s, int width, int height)
     virtio_config_change_notify(s);
 }
 
+/* Add a named port (VIRTIO_CONSOLE_F_MULTIPORT). Must be called before the
+   driver starts. Return the port number or -1 if all ports are in use. */
+int virtio_console_add_port(VIRTIODevice *s, const char *name,
+                            CharacterDevice *cs)
+{
+    VIRTIOConsoleDevice *s1 = (VIRTIOConsoleDevice *)s;
+    VIRTIOConsolePort *p;
+    int port;
+
+    if (s1->nr_ports == VIRTIO_CONSOLE_MAX_PORTS)
+        return -1;
+    port = s1->nr_ports++;
+    p = &s1->ports[port];
+    p->cs = cs;
+    pstrcpy(p->name, sizeof(p->name), name);
+    s->device_features |= (1 << VIRTIO_CONSOLE_F_MULTIPORT);
+    s->queue[virtio_console_rx_queue(port)].manual_recv = TRUE;
+    return port;
+}
+
 VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice *cs)
 {
     VIRTIOConsoleDevice *s;
 
     s = mallocz(sizeof(*s));
     virtio_init(&s->common, bus,
-                3, 4, virtio_console_recv_request);
-    s->common.device_features = (1 << 0); /* VIRTIO_CONSOLE_F_SIZE */
+                3, 12, virtio_console_recv_request);
+    s->common.device_features = (1 << VIRTIO_CONSOLE_F_SIZE);
     s->common.queue[0].manual_recv = TRUE;
+    /* cols, rows, max_nr_ports, emerg_wr */
+    put_le32(s->common.config_space + 4, VIRTIO_CONSOLE_MAX_PORTS);
 
     s->cs = cs;
+    s->nr_ports = 1;
+    s->ports[0].cs = cs;
+    s->ports[0].guest_open = TRUE;
     return (VIRTIODevice *)s;
 }
 
@@ -1409,7 +2039,9 @@ VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice *cs)
 
 typedef struct VIRTIOEntropyDevice {
     VIRTIODevice common;
-    uint8_t buf[256];
+    EntropyPool *pool;
+    uint8_t *buf;
+    int buf_size;
 } VIRTIOEntropyDevice;
 
 static int virtio_entropy_recv_request(VIRTIODevice *s, int queue_idx,
@@ -1417,24 +2049,16 @@ static int virtio_entropy_recv_request(VIRTIODevice *s, int queue_idx,
                                        int write_size)
 {
     VIRTIOEntropyDevice *s1 = (VIRTIOEntropyDevice *)s;
-    int offset, block_size, ret;
 
     if (queue_idx == 0) {
-        offset = 0;
-        while (offset < write_size) {
-            block_size = sizeof(s1->buf);
-            if (write_size - offset < block_size) {
-                block_size = write_size - offset;
-            }
-            ret = getrandom(s1->buf, block_size, 0);
-            /* reads up to 256 bytes should always succeed */
-            if (ret > 0) {
-                memcpy_to_queue(s, queue_idx, desc_idx, offset, s1->buf, ret);
-                offset += ret;
-            } else {
-                abort();
-            }
+        if (write_size > s1->buf_size) {
+            s1->buf = realloc(s1->buf, write_size);
+            s1->buf_size = write_size;
         }
+        /* the whole chain in one transfer */
+        entropy_pool_read(s1->pool, s1->buf, write_size);
+        memcpy_to_queue(s, queue_idx, desc_idx, 0, s1->buf, write_size);
+        memset(s1->buf, 0, write_size);
         virtio_consume_desc(s, queue_idx, desc_idx, write_size);
     }
     return 0;
@@ -1447,10 +2071,161 @@ VIRTIODevice *virtio_entropy_init(VIRTIOBusDef *bus)
     s = mallocz(sizeof(*s));
     virtio_init(&s->common, bus,
                 4, 0, virtio_entropy_recv_request);
+    s->pool = entropy_pool_new(ENTROPY_POOL_DEFAULT_SIZE);
 
     return (VIRTIODevice *)s;
 }
 
+/*********************************************************************/
+/* vsock device */
+
+typedef struct VIRTIOVsockDevice {
+    VIRTIODevice common;
+    VsockDevice *vs;
+} VIRTIOVsockDevice;
+
+static void vsock_get_header(VsockPacketHeader *h, const uint8_t *buf)
+{
+    h->src_cid = get_le64(buf);
+    h->dst_cid = get_le64(buf + 8);
+    h->src_port = get_le32(buf + 16);
+    h->dst_port = get_le32(buf + 20);
+    h->len = get_le32(buf + 24);
+    h->type = get_le16(buf + 28);
+    h->op = get_le16(buf + 30);
+    h->flags = get_le32(buf + 32);
+    h->buf_alloc = get_le32(buf + 36);
+    h->fwd_cnt = get_le32(buf + 40);
+}
+
+static void vsock_put_header(uint8_t *buf, const VsockPacketHeader *h)
+{
+    put_le64(buf, h->src_cid);
+    put_le64(buf + 8, h->dst_cid);
+    put_le32(buf + 16, h->src_port);
+    put_le32(buf + 20, h->dst_port);
+    put_le32(buf + 24, h->len);
+    put_le16(buf + 28, h->type);
+    put_le16(buf + 30, h->op);
+    put_le32(buf + 32, h->flags);
+    put_le32(buf + 36, h->buf_alloc);
+    put_le32(buf + 40, h->fwd_cnt);
+}
+
+static int virtio_vsock_recv_request(VIRTIODevice *s, int queue_idx,
+                                     int desc_idx, int read_size,
+                                     int write_size)
+{
+    VIRTIOVsockDevice *s1 = (VIRTIOVsockDevice *)s;
+    VsockDevice *vs = s1->vs;
+    VsockPacketHeader h;
+    uint8_t *buf;
+
+    if (queue_idx == 1) {
+        /* send to host: header and payload in one transfer */
+        if (vs->can_write_packet && !vs->can_write_packet(vs))
+            return -1; /* restarted by virtio_vsock_resume() */
+        if (read_size < VSOCK_HDR_SIZE) {
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+            return 0;
+        }
+        buf = buffer_pool_alloc(s->buf_pool, read_size);
+        if (memcpy_from_queue(s, buf, queue_idx, desc_idx, 0, read_size) < 0) {
+            buffer_pool_free(s->buf_pool, buf);
+            virtio_consume_desc(s, queue_idx, desc_idx, 0);
+            return 0;
+        }
+        virtio_consume_desc(s, queue_idx, desc_idx, 0);
+        vsock_get_header(&h, buf);
+        if (h.len > read_size - VSOCK_HDR_SIZE)
+            h.len = read_size - VSOCK_HDR_SIZE;
+        vs->write_packet(vs, &h, buf + VSOCK_HDR_SIZE);
+        buffer_pool_free(s->buf_pool, buf);
+    }
+    return 0;
+}
+
+static BOOL virtio_vsock_can_write_packet(VsockDevice *vs)
+{
+    VIRTIODevice *s = vs->device_opaque;
+    QueueState *qs = &s->queue[0];
+
+    if (!qs->ready)
+        return FALSE;
+    return qs->last_avail_idx != qs->avail_idx;
+}
+
+static int virtio_vsock_get_write_len(VsockDevice *vs)
+{
+    VIRTIODevice *s = vs->device_opaque;
+    QueueState *qs = &s->queue[0];
+    int desc_idx, read_size, write_size;
+
+    if (!qs->ready || qs->last_avail_idx == qs->avail_idx)
+        return 0;
+    desc_idx = virtio_read16(s, qs->avail_addr + 4 +
+                             (qs->last_avail_idx & (qs->num - 1)) * 2);
+    if (get_desc_rw_size(s, &read_size, &write_size, 0, desc_idx))
+        return 0;
+    return max_int(write_size - VSOCK_HDR_SIZE, 0);
+}
+
+static void virtio_vsock_write_packet(VsockDevice *vs,
+                                      const VsockPacketHeader *hdr,
+                                      const uint8_t *payload)
+{
+    VIRTIODevice *s = vs->device_opaque;
+    int queue_idx = 0;
+    QueueState *qs = &s->queue[queue_idx];
+    int desc_idx, read_size, write_size, len;
+    uint8_t *buf;
+
+    if (!qs->ready)
+        return;
+    if (qs->last_avail_idx == qs->avail_idx)
+        return;
+    desc_idx = virtio_read16(s, qs->avail_addr + 4 +
+                             (qs->last_avail_idx & (qs->num - 1)) * 2);
+    if (get_desc_rw_size(s, &read_size, &write_size, queue_idx, desc_idx))
+        return;
+    len = VSOCK_HDR_SIZE + hdr->len;
+    if (len > write_size)
+        return;
+    buf = buffer_pool_alloc(s->buf_pool, len);
+    vsock_put_header(buf, hdr);
+    memcpy(buf + VSOCK_HDR_SIZE, payload, hdr->len);
+    memcpy_to_queue(s, queue_idx, desc_idx, 0, buf, len);
+    buffer_pool_free(s->buf_pool, buf);
+    virtio_consume_desc(s, queue_idx, desc_idx, len);
+    qs->last_avail_idx++;
+}
+
+static void virtio_vsock_resume(VsockDevice *vs)
+{
+    virtio_queue_schedule(vs->device_opaque, 1);
+}
+
+VIRTIODevice *virtio_vsock_init(VIRTIOBusDef *bus, VsockDevice *vs)
+{
+    VIRTIOVsockDevice *s;
+
+    s = mallocz(sizeof(*s));
+    virtio_init(&s->common, bus,
+                19, 8, virtio_vsock_recv_request);
+    /* rx and event queues are filled by the device */
+    s->common.queue[0].manual_recv = TRUE;
+    s->common.queue[2].manual_recv = TRUE;
+    put_le64(s->common.config_space, vs->guest_cid);
+    s->vs = vs;
+
+    vs->device_opaque = s;
+    vs->device_can_write_packet = virtio_vsock_can_write_packet;
+    vs->device_get_write_len = virtio_vsock_get_write_len;
+    vs->device_write_packet = virtio_vsock_write_packet;
+    vs->device_resume = virtio_vsock_resume;
+    return (VIRTIODevice *)s;
+}
+
 /*********************************************************************/
 /* input device */
 
@@ -1749,6 +2524,12 @@ typedef struct VIRTIO9PDevice {
     int msize; /* maximum message size */
     struct list_head fid_list; /* list of FIDDesc */
     BOOL req_in_progress;
+    uint64_t req_start_ns;
+    Metric *req_metric;
+    Metric *error_metric;
+    Metric *latency_metric;
+    Metric *read_bytes_metric;
+    Metric *write_bytes_metric;
 } VIRTIO9PDevice;
 
 static FIDDesc *fid_find1(VIRTIO9PDevice *s, uint32_t fid)
@@ -2069,15 +2850,19 @@ static void virtio_9p_send_reply(VIRTIO9PDevice *s, int queue_idx,
         printf("\r\n");
     }
 #endif
+    metric_inc(s->req_metric);
+    if (id == 6)
+        metric_inc(s->error_metric);
+    metric_observe(s->latency_metric, metric_time_ns() - s->req_start_ns);
     len = buf_len + 7;
-    buf1 = malloc(len);
+    buf1 = buffer_pool_alloc(s->common.buf_pool, len);
     put_le32(buf1, len);
     buf1[4] = id + 1;
     put_le16(buf1 + 5, tag);
     memcpy(buf1 + 7, buf, buf_len);
     memcpy_to_queue((VIRTIODevice *)s, queue_idx, desc_idx, 0, buf1, len);
     virtio_consume_desc((VIRTIODevice *)s, queue_idx, desc_idx, len);
-    free(buf1);
+    buffer_pool_free(s->common.buf_pool, buf1);
 }
 
 static void virtio_9p_send_error(VIRTIO9PDevice *s, int queue_idx,
@@ -2150,6 +2935,7 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
     if (s->req_in_progress)
         return -1;
 
+    s->req_start_ns = metric_time_ns();
     offset = 0;
     header_len = 4 + 1 + 2;
     if (memcpy_from_queue(s1, buf, queue_idx, desc_idx, offset, header_len)) {
@@ -2387,15 +3173,16 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf = malloc(count + 4);
+            buf = buffer_pool_alloc(s1->buf_pool, count + 4);
             n = fs->fs_readdir(fs, f, offs, buf + 4, count);
             if (n < 0) {
                 err = n;
+                buffer_pool_free(s1->buf_pool, buf);
                 goto error;
             }
             put_le32(buf, n);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
+            buffer_pool_free(s1->buf_pool, buf);
         }
         break;
     case 50: /* fsync */
@@ -2647,16 +3434,17 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf = malloc(count + 4);
+            buf = buffer_pool_alloc(s1->buf_pool, count + 4);
             n = fs->fs_read(fs, f, offs, buf + 4, count);
             if (n < 0) {
                 err = n;
-                free(buf);
+                buffer_pool_free(s1->buf_pool, buf);
                 goto error;
             }
             put_le32(buf, n);
+            metric_add(s->read_bytes_metric, n);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, n + 4);
-            free(buf);
+            buffer_pool_free(s1->buf_pool, buf);
         }
         break;
     case 118: /* write */
@@ -2673,18 +3461,19 @@ static int virtio_9p_recv_request(VIRTIODevice *s1, int queue_idx,
             f = fid_find(s, fid);
             if (!f)
                 goto fid_not_found;
-            buf1 = malloc(count);
+            buf1 = buffer_pool_alloc(s1->buf_pool, count);
             if (memcpy_from_queue(s1, buf1, queue_idx, desc_idx, offset,
                                   count)) {
-                free(buf1);
+                buffer_pool_free(s1->buf_pool, buf1);
                 goto protocol_error;
             }
             n = fs->fs_write(fs, f, offs, buf1, count);
-            free(buf1);
+            buffer_pool_free(s1->buf_pool, buf1);
             if (n < 0) {
                 err = n;
                 goto error;
             }
+            metric_add(s->write_bytes_metric, n);
             buf_len = marshall(s, buf, sizeof(buf), "w", n);
             virtio_9p_send_reply(s, queue_idx, desc_idx, id, tag, buf, buf_len);
         }
@@ -2738,7 +3527,559 @@ VIRTIODevice *virtio_9p_init(VIRTIOBusDef *bus, FSDevice *fs,
     s->msize = 8192;
     init_list_head(&s->fid_list);
 
+    s->req_metric = metric_new(METRIC_COUNTER, "virtio_9p_requests_total",
+                               "9P requests answered", "device=\"9p%d\"",
+                               s->common.instance);
+    s->error_metric = metric_new(METRIC_COUNTER, "virtio_9p_errors_total",
+                                 "9P requests answered with an error",
+                                 "device=\"9p%d\"", s->common.instance);
+    s->latency_metric = metric_new(METRIC_HISTOGRAM, "virtio_9p_request_duration_seconds",
+                                   "Time from reading a 9P request to its reply",
+                                   "device=\"9p%d\"", s->common.instance);
+    s->read_bytes_metric = metric_new(METRIC_COUNTER, "virtio_9p_bytes_total",
+                                      "File data read and written",
+                                      "device=\"9p%d\",op=\"read\"",
+                                      s->common.instance);
+    s->write_bytes_metric = metric_new(METRIC_COUNTER, "virtio_9p_bytes_total",
+                                       "File data read and written",
+                                       "device=\"9p%d\",op=\"write\"",
+                                       s->common.instance);
+
+    return (VIRTIODevice *)s;
+}
+
+/*********************************************************************/
+/* vhost-user device */
+
+/*
+ * The queues of a block or network device are served by a backend
+ * process. When the guest memory window is a file (cosimulation, replay)
+ * the backend maps it and works on the guest rings itself: only kicks and
+ * interrupts go through this process, as eventfds. Otherwise each guest
+ * request is copied to a shadow ring in a memfd shared with the backend,
+ * and the bytes the backend wrote are copied back when it is used.
+ */
+
+#define VHOST_USER_BLK_CONFIG_SIZE 60
+#define VHOST_USER_NET_CONFIG_SIZE 8
+
+#define VIRTIO_BLK_F_SIZE_MAX 1
+#define VIRTIO_BLK_F_SEG_MAX 2
+#define VIRTIO_BLK_F_MQ 12
+#define VIRTIO_NET_F_MAC 5
+#define VIRTIO_NET_F_CTRL_VQ 17
+#define VIRTIO_NET_F_MQ 22
+#define VIRTIO_STATUS_DEVICE_NEEDS_RESET 64
+#define VRING_USED_F_NO_NOTIFY 1
+
+/* proxied block requests are limited to seg_max segments of size_max */
+#define VHOST_USER_BLK_SIZE_MAX (64 * 1024)
+#define VHOST_USER_BLK_SEG_MAX 8
+#define VHOST_USER_BLK_SLOT_SIZE \
+    (VHOST_USER_BLK_SIZE_MAX * VHOST_USER_BLK_SEG_MAX + 4096)
+#define VHOST_USER_NET_SLOT_SIZE (64 * 1024 + 4096)
+
+/* shadow ring layout: descriptors, avail ring, used ring, in one page */
+#define VHOST_USER_RING_AREA_SIZE 4096
+#define VHOST_USER_AVAIL_OFFSET(num) (16 * (num))
+#define VHOST_USER_USED_OFFSET(num) \
+    ((VHOST_USER_AVAIL_OFFSET(num) + 6 + 2 * (num) + 3) & ~3)
+
+typedef struct {
+    uint16_t desc_idx; /* guest request */
+    int read_size;
+    int write_size;
+} VhostUserSlot;
+
+typedef struct {
+    int kick_fd;
+    int call_fd;
+    BOOL started;
+    /* proxy only: shadow ring of twice as many descriptors as the guest
+       ring, slot i uses descriptors 2 * i and 2 * i + 1 */
+    uint8_t *area;
+    uint64_t area_addr; /* address of 'area' for the backend */
+    int num;
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+    uint32_t free_slots; /* bitmap */
+    BOOL blocked; /* a guest request waits for a slot */
+    VhostUserSlot slots[MAX_QUEUE_NUM];
+} VhostUserQueue;
+
+typedef struct {
+    VIRTIODevice common;
+    VhostUser *vu;
+    char *path;
+    uint64_t backend_features;
+    BOOL has_protocol_features;
+    int nqueues;
+    BOOL proxy;
+    pthread_mutex_t lock; /* proxy queue state */
+    int mem_fd;
+    uint8_t *mem;
+    size_t mem_size;
+    int slot_size;
+    VhostUserQueue queues[MAX_QUEUE];
+} VIRTIOVhostUserDevice;
+
+static uint8_t *vhost_user_slot_buf(VIRTIOVhostUserDevice *s,
+                                    VhostUserQueue *vq, int slot)
+{
+    return vq->area + VHOST_USER_RING_AREA_SIZE + slot * s->slot_size;
+}
+
+static void vhost_user_set_desc(VhostUserQueue *vq, int idx, uint64_t addr,
+                                uint32_t len, uint16_t flags, uint16_t next)
+{
+    uint8_t *d = vq->area + idx * sizeof(VIRTIODesc);
+
+    put_le32(d, addr);
+    put_le32(d + 4, addr >> 32);
+    put_le32(d + 8, len);
+    put_le16(d + 12, flags);
+    put_le16(d + 14, next);
+}
+
+/* proxy: copy the guest request to a free slot of the shadow ring */
+static int vhost_user_recv_request(VIRTIODevice *s, int queue_idx,
+                                   int desc_idx, int read_size,
+                                   int write_size)
+{
+    VIRTIOVhostUserDevice *s1 = (VIRTIOVhostUserDevice *)s;
+    VhostUserQueue *vq = &s1->queues[queue_idx];
+    uint8_t *avail, *used;
+    uint64_t addr;
+    int slot, head;
+    BOOL kick;
+
+    /* the used ring is also updated by vhost_user_proxy_complete() */
+    pthread_mutex_lock(&s1->lock);
+    if (queue_idx >= s1->nqueues || read_size + write_size == 0) {
+        virtio_consume_desc(s, queue_idx, desc_idx, 0);
+        pthread_mutex_unlock(&s1->lock);
+        return 0;
+    }
+    if (read_size + write_size > s1->slot_size) {
+        fprintf(stderr, "vhost-user: %s: request of %d bytes is too large\r\n",
+                s1->path, read_size + write_size);
+        virtio_consume_desc(s, queue_idx, desc_idx, 0);
+        pthread_mutex_unlock(&s1->lock);
+        return 0;
+    }
+    if (!vq->started || !vq->free_slots) {
+        /* restarted by the completion of a request or by DRIVER_OK */
+        vq->blocked = TRUE;
+        pthread_mutex_unlock(&s1->lock);
+        return -1;
+    }
+    slot = ctz32(vq->free_slots);
+    vq->free_slots &= ~(1U << slot);
+    vq->slots[slot].desc_idx = desc_idx;
+    vq->slots[slot].read_size = read_size;
+    vq->slots[slot].write_size = write_size;
+    memcpy_from_queue(s, vhost_user_slot_buf(s1, vq, slot), queue_idx,
+                      desc_idx, 0, read_size);
+
+    head = 2 * slot;
+    addr = vq->area_addr + VHOST_USER_RING_AREA_SIZE +
+        (uint64_t)slot * s1->slot_size;
+    if (read_size == 0) {
+        vhost_user_set_desc(vq, head, addr, write_size, VRING_DESC_F_WRITE, 0);
+    } else if (write_size == 0) {
+        vhost_user_set_desc(vq, head, addr, read_size, 0, 0);
+    } else {
+        vhost_user_set_desc(vq, head, addr, read_size, VRING_DESC_F_NEXT,
+                            head + 1);
+        vhost_user_set_desc(vq, head + 1, addr + read_size, write_size,
+                            VRING_DESC_F_WRITE, 0);
+    }
+    avail = vq->area + VHOST_USER_AVAIL_OFFSET(vq->num);
+    put_le16(avail + 4 + (vq->avail_idx & (vq->num - 1)) * 2, head);
+    atomic_thread_fence(memory_order_release);
+    vq->avail_idx++;
+    put_le16(avail + 2, vq->avail_idx);
+
+    /* the backend may read the index before we look at its flags */
+    atomic_thread_fence(memory_order_seq_cst);
+    used = vq->area + VHOST_USER_USED_OFFSET(vq->num);
+    kick = !(get_le16(used) & VRING_USED_F_NO_NOTIFY);
+    pthread_mutex_unlock(&s1->lock);
+
+    if (kick)
+        eventfd_write(vq->kick_fd, 1);
+    return 0;
+}
+
+/* proxy: return the requests the backend has used to the guest */
+static void vhost_user_proxy_complete(VIRTIOVhostUserDevice *s1,
+                                      int queue_idx)
+{
+    VIRTIODevice *s = &s1->common;
+    VhostUserQueue *vq = &s1->queues[queue_idx];
+    VhostUserSlot *sl;
+    uint8_t *used, *elem;
+    uint16_t used_idx;
+    uint32_t id, len;
+    BOOL restart;
+
+    pthread_mutex_lock(&s1->lock);
+    if (!vq->started) {
+        pthread_mutex_unlock(&s1->lock);
+        return;
+    }
+    used = vq->area + VHOST_USER_USED_OFFSET(vq->num);
+    used_idx = get_le16(used + 2);
+    atomic_thread_fence(memory_order_acquire);
+    while (vq->last_used_idx != used_idx) {
+        elem = used + 4 + (vq->last_used_idx & (vq->num - 1)) * 8;
+        id = get_le32(elem);
+        len = get_le32(elem + 4);
+        if (id >= vq->num || (id & 1) ||
+            (vq->free_slots & (1U << (id / 2)))) {
+            fprintf(stderr, "vhost-user: %s: bad used descriptor %d\r\n",
+                    s1->path, id);
+            break;
+        }
+        sl = &vq->slots[id / 2];
+        len = min_int(len, sl->write_size);
+        if (len > 0)
+            memcpy_to_queue(s, queue_idx, sl->desc_idx, 0,
+                            vhost_user_slot_buf(s1, vq, id / 2) + sl->read_size,
+                            len);
+        virtio_consume_desc(s, queue_idx, sl->desc_idx, len);
+        vq->free_slots |= 1U << (id / 2);
+        vq->last_used_idx++;
+    }
+    restart = vq->blocked;
+    vq->blocked = FALSE;
+    pthread_mutex_unlock(&s1->lock);
+
+    if (restart)
+        virtio_queue_schedule(s, queue_idx);
+}
+
+static uint64_t vhost_user_dram_addr(virtio_phys_addr_t addr, int size)
+{
+    return (uintptr_t)virtio_get_dram_ptr(addr, size);
+}
+
+static int vhost_user_start_queue(VIRTIOVhostUserDevice *s1, int queue_idx)
+{
+    QueueState *qs = &s1->common.queue[queue_idx];
+    VhostUserQueue *vq = &s1->queues[queue_idx];
+    uint64_t desc, avail, used;
+    int num;
+
+    if (s1->proxy) {
+        num = 2 * qs->num;
+        memset(vq->area, 0, VHOST_USER_RING_AREA_SIZE);
+        vq->num = num;
+        vq->avail_idx = 0;
+        vq->last_used_idx = 0;
+        vq->free_slots = (1U << qs->num) - 1;
+        vq->blocked = FALSE;
+        desc = (uintptr_t)vq->area;
+        avail = desc + VHOST_USER_AVAIL_OFFSET(num);
+        used = desc + VHOST_USER_USED_OFFSET(num);
+    } else {
+        num = qs->num;
+        desc = vhost_user_dram_addr(qs->desc_addr, 16 * num);
+        avail = vhost_user_dram_addr(qs->avail_addr, 6 + 2 * num);
+        used = vhost_user_dram_addr(qs->used_addr, 6 + 8 * num);
+        if (!desc || !avail || !used) {
+            fprintf(stderr, "vhost-user: %s: queue %d is outside the shared guest memory\r\n",
+                    s1->path, queue_idx);
+            return -1;
+        }
+    }
+    if (vhost_user_set_vring_num(s1->vu, queue_idx, num) < 0 ||
+        vhost_user_set_vring_base(s1->vu, queue_idx, 0) < 0 ||
+        vhost_user_set_vring_addr(s1->vu, queue_idx, desc, used, avail) < 0 ||
+        vhost_user_set_vring_kick(s1->vu, queue_idx, vq->kick_fd) < 0 ||
+        vhost_user_set_vring_call(s1->vu, queue_idx, vq->call_fd) < 0)
+        return -1;
+    if (s1->has_protocol_features &&
+        vhost_user_set_vring_enable(s1->vu, queue_idx, 1) < 0)
+        return -1;
+    pthread_mutex_lock(&s1->lock);
+    vq->started = TRUE;
+    pthread_mutex_unlock(&s1->lock);
+    return 0;
+}
+
+static void vhost_user_driver_ok(VIRTIODevice *s)
+{
+    VIRTIOVhostUserDevice *s1 = (VIRTIOVhostUserDevice *)s;
+    VhostUserMemRegion region;
+    uint64_t features;
+    int fd, i;
+
+    features = s->driver_features & s1->backend_features;
+    if (s1->has_protocol_features)
+        features |= 1ULL << VHOST_USER_F_PROTOCOL_FEATURES;
+    if (s1->proxy) {
+        region.guest_phys_addr = 0;
+        region.memory_size = s1->mem_size;
+        region.userspace_addr = (uintptr_t)s1->mem;
+        region.mmap_offset = 0;
+        fd = s1->mem_fd;
+    } else {
+        region.guest_phys_addr = virtio_dram_base;
+        region.memory_size = virtio_dram_size;
+        region.userspace_addr = (uintptr_t)virtio_dram_ptr;
+        region.mmap_offset = virtio_dram_fd_offset;
+        fd = virtio_dram_fd;
+    }
+    if (vhost_user_set_features(s1->vu, features) < 0 ||
+        vhost_user_set_mem_table(s1->vu, &region, &fd, 1) < 0)
+        goto fail;
+    for(i = 0; i < s1->nqueues; i++) {
+        if (!s->queue[i].ready)
+            continue;
+        if (vhost_user_start_queue(s1, i) < 0)
+            goto fail;
+        /* look at the buffers queued before the start */
+        if (s1->proxy)
+            virtio_queue_schedule(s, i);
+        else
+            eventfd_write(s1->queues[i].kick_fd, 1);
+    }
+    return;
+ fail:
+    fprintf(stderr, "vhost-user: %s: cannot start the device\r\n", s1->path);
+    s->status |= VIRTIO_STATUS_DEVICE_NEEDS_RESET;
+    virtio_config_change_notify(s);
+}
+
+static void vhost_user_device_reset(VIRTIODevice *s)
+{
+    VIRTIOVhostUserDevice *s1 = (VIRTIOVhostUserDevice *)s;
+    VhostUserQueue *vq;
+    int i, base;
+
+    for(i = 0; i < s1->nqueues; i++) {
+        vq = &s1->queues[i];
+        pthread_mutex_lock(&s1->lock);
+        if (!vq->started) {
+            pthread_mutex_unlock(&s1->lock);
+            continue;
+        }
+        vq->started = FALSE;
+        pthread_mutex_unlock(&s1->lock);
+        /* stops the ring in the backend. We are on the MMIO thread: a
+           backend not answering in time is given up, and the next start
+           fails with DEVICE_NEEDS_RESET. */
+        if (vhost_user_get_vring_base(s1->vu, i, &base) < 0)
+            fprintf(stderr, "vhost-user: %s: cannot stop queue %d\r\n",
+                    s1->path, i);
+    }
+}
+
+/* shared memory: the backend reads the guest ring itself */
+static void vhost_user_queue_kick(VIRTIODevice *s, int queue_idx)
+{
+    VIRTIOVhostUserDevice *s1 = (VIRTIOVhostUserDevice *)s;
+
+    if (queue_idx < s1->nqueues && s1->queues[queue_idx].started)
+        eventfd_write(s1->queues[queue_idx].kick_fd, 1);
+}
+
+void virtio_vhost_user_select_fill(VIRTIODevice *s, int *pfd_max,
+                                   fd_set *rfds)
+{
+    VIRTIOVhostUserDevice *s1 = (VIRTIOVhostUserDevice *)s;
+    int i, fd;
+
+    for(i = 0; i < s1->nqueues; i++) {
+        fd = s1->queues[i].call_fd;
+        FD_SET(fd, rfds);
+        *pfd_max = max_int(*pfd_max, fd);
+    }
+}
+
+void virtio_vhost_user_select_poll(VIRTIODevice *s, fd_set *rfds)
+{
+    VIRTIOVhostUserDevice *s1 = (VIRTIOVhostUserDevice *)s;
+    eventfd_t val;
+    int i;
+
+    for(i = 0; i < s1->nqueues; i++) {
+        if (!FD_ISSET(s1->queues[i].call_fd, rfds))
+            continue;
+        if (eventfd_read(s1->queues[i].call_fd, &val) < 0)
+            continue;
+        if (s1->proxy)
+            vhost_user_proxy_complete(s1, i);
+        else if (s1->queues[i].started)
+            virtio_queue_interrupt(s, i);
+    }
+}
+
+static int vhost_user_proxy_init(VIRTIOVhostUserDevice *s, uint32_t device_id)
+{
+    size_t queue_size;
+    void *p;
+    int i;
+
+    s->slot_size = device_id == 2 ? VHOST_USER_BLK_SLOT_SIZE :
+        VHOST_USER_NET_SLOT_SIZE;
+    queue_size = VHOST_USER_RING_AREA_SIZE + (size_t)MAX_QUEUE_NUM * s->slot_size;
+    s->mem_size = s->nqueues * queue_size;
+    s->mem_fd = memfd_create("vhost-user", MFD_CLOEXEC);
+    if (s->mem_fd < 0 || ftruncate(s->mem_fd, s->mem_size) < 0) {
+        fprintf(stderr, "vhost-user: %s: cannot create the shared memory: %s\r\n",
+                s->path, strerror(errno));
+        return -1;
+    }
+    p = mmap(NULL, s->mem_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+             s->mem_fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "vhost-user: %s: cannot map the shared memory: %s\r\n",
+                s->path, strerror(errno));
+        return -1;
+    }
+    s->mem = p;
+    for(i = 0; i < s->nqueues; i++) {
+        s->queues[i].area = s->mem + i * queue_size;
+        s->queues[i].area_addr = i * queue_size;
+    }
+    return 0;
+}
+
+static void vhost_user_free(VIRTIOVhostUserDevice *s)
+{
+    int i;
+
+    for(i = 0; i < MAX_QUEUE; i++) {
+        if (s->queues[i].kick_fd >= 0)
+            close(s->queues[i].kick_fd);
+        if (s->queues[i].call_fd >= 0)
+            close(s->queues[i].call_fd);
+    }
+    if (s->mem)
+        munmap(s->mem, s->mem_size);
+    if (s->mem_fd >= 0)
+        close(s->mem_fd);
+    if (s->vu)
+        vhost_user_close(s->vu);
+    free(s->path);
+    free(s);
+}
+
+VIRTIODevice *virtio_vhost_user_init(VIRTIOBusDef *bus, uint32_t device_id,
+                                     const char *path)
+{
+    VIRTIOVhostUserDevice *s;
+    uint64_t features, protocol_features;
+    uint8_t cfg[VHOST_USER_MAX_CONFIG_SIZE];
+    uint32_t offered, size_max;
+    int config_size, i;
+
+    switch(device_id) {
+    case 1:
+        config_size = VHOST_USER_NET_CONFIG_SIZE;
+        break;
+    case 2:
+        config_size = VHOST_USER_BLK_CONFIG_SIZE;
+        break;
+    default:
+        fprintf(stderr, "vhost-user: unsupported device type %d\r\n", device_id);
+        return NULL;
+    }
+
+    /* talk to the backend before the device appears on the bus */
+    s = mallocz(sizeof(*s));
+    s->path = strdup(path);
+    s->mem_fd = -1;
+    for(i = 0; i < MAX_QUEUE; i++) {
+        s->queues[i].kick_fd = -1;
+        s->queues[i].call_fd = -1;
+    }
+    s->vu = vhost_user_connect(path);
+    if (!s->vu)
+        goto fail;
+    protocol_features = 0;
+    if (vhost_user_get_features(s->vu, &features) < 0)
+        goto fail;
+    s->backend_features = features;
+    s->has_protocol_features =
+        (features & (1ULL << VHOST_USER_F_PROTOCOL_FEATURES)) != 0;
+    if (s->has_protocol_features) {
+        if (vhost_user_get_protocol_features(s->vu, &protocol_features) < 0)
+            goto fail;
+        protocol_features &= (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |
+            (1ULL << VHOST_USER_PROTOCOL_F_CONFIG);
+        if (vhost_user_set_protocol_features(s->vu, protocol_features) < 0)
+            goto fail;
+    }
+
+    /* a single queue (pair): the transport has no multiqueue support */
+    offered = features & ~((1U << VHOST_USER_F_PROTOCOL_FEATURES) |
+                           (1U << VIRTIO_BLK_F_MQ) | (1U << VIRTIO_NET_F_MQ));
+    s->proxy = virtio_dram_fd < 0;
+    if (s->proxy) {
+        /* the shadow rings are plain split rings: the ring features could
+           only be honoured by the backend side */
+        offered &= 0xffffff;
+    }
+    memset(cfg, 0, sizeof(cfg));
+    if (protocol_features & (1ULL << VHOST_USER_PROTOCOL_F_CONFIG)) {
+        if (vhost_user_get_config(s->vu, cfg, config_size) < 0)
+            goto fail;
+    } else if (device_id == 2) {
+        fprintf(stderr, "vhost-user: %s: the backend does not give the block device configuration\r\n",
+                path);
+        goto fail;
+    } else {
+        /* locally administered MAC address */
+        cfg[0] = 0x02;
+        cfg[5] = 0x10 + virtio_instance_count[device_id];
+        offered |= 1 << VIRTIO_NET_F_MAC;
+    }
+    if (device_id == 1) {
+        s->nqueues = 2 + ((offered >> VIRTIO_NET_F_CTRL_VQ) & 1);
+    } else {
+        s->nqueues = 1;
+        if (s->proxy) {
+            /* keep the requests within a slot */
+            size_max = VHOST_USER_BLK_SIZE_MAX;
+            if ((offered & (1 << VIRTIO_BLK_F_SIZE_MAX)) && get_le32(cfg + 8) > 0)
+                size_max = min_int(size_max, get_le32(cfg + 8));
+            put_le32(cfg + 8, size_max);
+            put_le32(cfg + 12, VHOST_USER_BLK_SEG_MAX);
+            offered |= (1 << VIRTIO_BLK_F_SIZE_MAX) | (1 << VIRTIO_BLK_F_SEG_MAX);
+        }
+    }
+    for(i = 0; i < s->nqueues; i++) {
+        s->queues[i].kick_fd = eventfd(0, EFD_CLOEXEC);
+        s->queues[i].call_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+        if (s->queues[i].kick_fd < 0 || s->queues[i].call_fd < 0) {
+            fprintf(stderr, "vhost-user: %s: eventfd: %s\r\n", path,
+                    strerror(errno));
+            goto fail;
+        }
+    }
+    if (s->proxy && vhost_user_proxy_init(s, device_id) < 0)
+        goto fail;
+
+    virtio_init(&s->common, bus, device_id, config_size,
+                vhost_user_recv_request);
+    memcpy(s->common.config_space, cfg, config_size);
+    s->common.device_features = offered;
+    s->common.driver_ok = vhost_user_driver_ok;
+    s->common.device_reset = vhost_user_device_reset;
+    if (!s->proxy)
+        s->common.queue_kick = vhost_user_queue_kick;
+    pthread_mutex_init(&s->lock, NULL);
+    fprintf(stderr, "vhost-user: %s%d on %s, %s\r\n",
+            virtio_device_name(device_id), s->common.instance, path,
+            s->proxy ? "requests copied through shadow rings" :
+            "guest memory shared");
     return (VIRTIODevice *)s;
+ fail:
+    vhost_user_free(s);
+    return NULL;
 }
 
 static pthread_mutex_t pending_notify_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -2748,7 +4089,25 @@ static pthread_t pending_notify_thread;
 
 static void async_queue_notify(VIRTIODevice *s, int queue_idx)
 {
+    QueueState *qs = &s->queue[queue_idx];
+
     printf("async_queue_notify\r\n");
+    if (unlikely(!qs->kick_metric))
+        virtio_queue_metrics_init(s, queue_idx);
+    metric_inc(qs->kick_metric);
+    VIRTIO_BOOT_MILESTONE(s, boot_first_notify, "first notify");
+    qs->notify_ns = metric_time_ns();
+    PROBE(async_queue_notify, s->device_id, s, queue_idx);
+    if (s->queue_kick) {
+        s->queue_kick(s, queue_idx);
+        return;
+    }
+    virtio_queue_schedule(s, queue_idx);
+}
+
+/* have the notify worker look at the queue */
+static void virtio_queue_schedule(VIRTIODevice *s, int queue_idx)
+{
     atomic_fetch_or_explicit(&s->pending_queue_notify, 1 << queue_idx, memory_order_release);
     pthread_mutex_lock(&pending_notify_lock);
     pending_notify = 1;
@@ -2795,6 +4154,8 @@ static void *pending_notify_worker(void *opaque)
             uint32_t notify = atomic_exchange_explicit(&s->pending_queue_notify, 0, memory_order_acquire);
             for (int j = 0; j < 32 && notify; j++) {
                 if (notify & (1u << j)) {
+                    metric_observe(s->notify_latency_metric,
+                                   metric_time_ns() - s->queue[j].notify_ns);
                     queue_notify(s, j);
                     notify &= ~(1u << j);
                 }
@@ -2813,6 +4174,7 @@ void virtio_start_pending_notify_thread(int n, VIRTIODevice **ps)
     data->ps = ps_copy;
     pthread_create(&pending_notify_thread, NULL, &pending_notify_worker, data);
     pthread_setname_np(pending_notify_thread, "VirtIO queues");
+    thread_topology_apply(THREAD_ROLE_VIRTIO_QUEUES, pending_notify_thread);
 }
 
 void virtio_stop_pending_notify_thread(void)
@@ -26,8 +26,10 @@
 
 #include <sys/select.h>
 
+#include "bufpool.h"
 #include "iomem.h"
 #include "pci.h"
+#include "xdma.h"
 
 #define VIRTIO_PAGE_SIZE 4096
 
@@ -65,6 +67,15 @@ void virtio_join_pending_notify_thread(void);
 void virtio_reset(VIRTIODevice *s);
 
 void virtio_dma_init(int dma_fd);
+void virtio_xdma_init(XDMATransport *xdma);
+/* guest memory [base, base + size) mapped at ptr, e.g. shared with a simulator */
+void virtio_dram_init(uint8_t *ptr, uint64_t base, uint64_t size);
+/* the guest memory window is also the file 'fd' at 'offset', so that it
+   can be shared with vhost-user backends */
+void virtio_dram_set_fd(int fd, uint64_t offset);
+/* BUFFER_POOL_x flags for the request buffers of devices created later */
+void virtio_set_buffer_pool_flags(int flags);
+BufferPool *virtio_get_buffer_pool(VIRTIODevice *s);
 
 /* block device */
 
@@ -93,6 +104,8 @@ struct EthernetDevice {
     uint8_t mac_addr[6]; /* mac address of the interface */
     void (*write_packet)(EthernetDevice *net,
                          const uint8_t *buf, int len);
+    /* optional: called after a batch of write_packet() calls */
+    void (*flush)(EthernetDevice *net);
     void *opaque;
 #if !defined(EMSCRIPTEN)
     void (*select_fill)(EthernetDevice *net, int *pfd_max,
@@ -120,16 +133,87 @@ typedef struct {
     int (*read_data)(void *opaque, uint8_t *buf, int len);
 } CharacterDevice;
 
+/* port 0 plus named ports on the remaining queue pairs */
+#define VIRTIO_CONSOLE_MAX_PORTS 7
+
 VIRTIODevice *virtio_console_init(VIRTIOBusDef *bus, CharacterDevice *cs);
+int virtio_console_add_port(VIRTIODevice *s, const char *name,
+                            CharacterDevice *cs);
 BOOL virtio_console_can_write_data(VIRTIODevice *s);
 int virtio_console_get_write_len(VIRTIODevice *s);
 int virtio_console_write_data(VIRTIODevice *s, const uint8_t *buf, int buf_len);
+BOOL virtio_console_port_can_write_data(VIRTIODevice *s, int port);
+int virtio_console_port_get_write_len(VIRTIODevice *s, int port);
+int virtio_console_port_write_data(VIRTIODevice *s, int port,
+                                   const uint8_t *buf, int buf_len);
 void virtio_console_resize_event(VIRTIODevice *s, int width, int height);
 
 /* entropy device */
 
 VIRTIODevice *virtio_entropy_init(VIRTIOBusDef *bus);
 
+/* vsock device */
+
+#define VSOCK_HOST_CID 2
+
+#define VSOCK_TYPE_STREAM 1
+
+#define VSOCK_OP_INVALID        0
+#define VSOCK_OP_REQUEST        1
+#define VSOCK_OP_RESPONSE       2
+#define VSOCK_OP_RST            3
+#define VSOCK_OP_SHUTDOWN       4
+#define VSOCK_OP_RW             5
+#define VSOCK_OP_CREDIT_UPDATE  6
+#define VSOCK_OP_CREDIT_REQUEST 7
+
+#define VSOCK_SHUTDOWN_RCV  (1 << 0)
+#define VSOCK_SHUTDOWN_SEND (1 << 1)
+
+/* struct virtio_vsock_hdr, in host byte order */
+typedef struct {
+    uint64_t src_cid;
+    uint64_t dst_cid;
+    uint32_t src_port;
+    uint32_t dst_port;
+    uint32_t len;
+    uint16_t type;
+    uint16_t op;
+    uint32_t flags;
+    uint32_t buf_alloc;
+    uint32_t fwd_cnt;
+} VsockPacketHeader;
+
+#define VSOCK_HDR_SIZE 44
+
+typedef struct VsockDevice VsockDevice;
+
+struct VsockDevice {
+    uint64_t guest_cid;
+    /* packet from the guest; buf holds hdr->len bytes of payload */
+    void (*write_packet)(VsockDevice *vs, const VsockPacketHeader *hdr,
+                         const uint8_t *buf);
+    /* FALSE stops the guest packets until device_resume() */
+    BOOL (*can_write_packet)(VsockDevice *vs);
+    void *opaque;
+    void (*select_fill)(VsockDevice *vs, int *pfd_max,
+                        fd_set *rfds, fd_set *wfds, fd_set *efds,
+                        int *pdelay);
+    void (*select_poll)(VsockDevice *vs,
+                        fd_set *rfds, fd_set *wfds, fd_set *efds,
+                        int select_ret);
+    /* the following is set by the device */
+    void *device_opaque;
+    BOOL (*device_can_write_packet)(VsockDevice *vs);
+    /* largest payload the next guest receive buffer can hold */
+    int (*device_get_write_len)(VsockDevice *vs);
+    void (*device_write_packet)(VsockDevice *vs, const VsockPacketHeader *hdr,
+                                const uint8_t *buf);
+    void (*device_resume)(VsockDevice *vs);
+};
+
+VIRTIODevice *virtio_vsock_init(VIRTIOBusDef *bus, VsockDevice *vs);
+
 /* input device */
 
 typedef enum {
@@ -147,6 +231,16 @@ int virtio_input_send_mouse_event(VIRTIODevice *s, int dx, int dy, int dz,
 
 VIRTIODevice *virtio_input_init(VIRTIOBusDef *bus, VirtioInputTypeEnum type);
 
+/* vhost-user device: the queues of a net (1) or block (2) device are
+   served by the backend listening on the unix socket 'path' */
+
+VIRTIODevice *virtio_vhost_user_init(VIRTIOBusDef *bus, uint32_t device_id,
+                                     const char *path);
+/* the backend signals used buffers on eventfds polled by the I/O loop */
+void virtio_vhost_user_select_fill(VIRTIODevice *s, int *pfd_max,
+                                   fd_set *rfds);
+void virtio_vhost_user_select_poll(VIRTIODevice *s, fd_set *rfds);
+
 /* 9p filesystem device */
 
 #include "fs.h"
@@ -0,0 +1,1264 @@
+/*
+ * virtio device benchmark
+ *
+ * Plays the part of the guest driver: the devices from virtio.c are
+ * mapped on a private physical memory map, the guest RAM is an ordinary
+ * host buffer registered with virtio_dram_init() and interrupts go to a
+ * counting stub. Every test keeps a number of requests in flight for a
+ * fixed time and reports operations and megabytes per second.
+ *
+ * Results are written as JSON. With --baseline, every result is compared
+ * with the same entry of an earlier run and the exit status is non zero
+ * if one of them got slower than --threshold percent.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "cutils.h"
+#include "iomem.h"
+#include "virtio.h"
+#include "temu.h"
+
+#define GUEST_RAM_BASE  0x80000000
+#define GUEST_RAM_SIZE  (64 * 1024 * 1024)
+#define VIRTIO_MMIO_BASE 0x40000000
+#define VIRTIO_MMIO_SIZE 0x1000
+
+#define BENCH_QUEUE_SIZE 256
+#define BENCH_DISK_SIZE (64 * 1024 * 1024)
+#define BENCH_9P_FILE_SIZE (1024 * 1024)
+#define BENCH_9P_MSIZE (256 * 1024)
+#define BENCH_MAX_RESULTS 64
+#define BENCH_WAIT_TIMEOUT_MS 2000
+
+/* virtio-mmio registers used by the driver */
+#define VIRTIO_MMIO_DRIVER_FEATURES     0x020
+#define VIRTIO_MMIO_QUEUE_SEL           0x030
+#define VIRTIO_MMIO_QUEUE_NUM           0x038
+#define VIRTIO_MMIO_QUEUE_READY         0x044
+#define VIRTIO_MMIO_QUEUE_NOTIFY        0x050
+#define VIRTIO_MMIO_INTERRUPT_STATUS    0x060
+#define VIRTIO_MMIO_INTERRUPT_ACK       0x064
+#define VIRTIO_MMIO_STATUS              0x070
+#define VIRTIO_MMIO_QUEUE_DESC_LOW      0x080
+#define VIRTIO_MMIO_QUEUE_DESC_HIGH     0x084
+#define VIRTIO_MMIO_QUEUE_AVAIL_LOW     0x090
+#define VIRTIO_MMIO_QUEUE_AVAIL_HIGH    0x094
+#define VIRTIO_MMIO_QUEUE_USED_LOW      0x0a0
+#define VIRTIO_MMIO_QUEUE_USED_HIGH     0x0a4
+
+#define VIRTIO_STATUS_ACKNOWLEDGE 1
+#define VIRTIO_STATUS_DRIVER      2
+#define VIRTIO_STATUS_DRIVER_OK   4
+#define VIRTIO_STATUS_FEATURES_OK 8
+
+#define VRING_DESC_F_NEXT       1
+#define VRING_DESC_F_WRITE      2
+
+#define VIRTIO_BLK_T_IN  0
+#define VIRTIO_BLK_T_OUT 1
+#define SECTOR_SIZE 512
+
+#define VIRTIO_NET_HDR_SIZE 12
+#define ETH_FRAME_MAX 1514
+#define BENCH_NET_RX_BUFS 64
+
+typedef struct {
+    char name[64];
+    double ops_per_sec;
+    double mb_per_sec;
+    uint64_t ops;
+    uint64_t dropped;
+} BenchResult;
+
+typedef struct BenchDevice BenchDevice;
+
+typedef struct {
+    BenchDevice *bd;
+    int idx;
+    int num;
+    uint8_t *desc;
+    uint8_t *avail;
+    uint8_t *used;
+    uint64_t desc_gpa, avail_gpa, used_gpa;
+    uint16_t avail_idx;
+    uint16_t last_used;
+    uint16_t kicked_idx;
+} BenchQueue;
+
+/* The queues are set up once: resetting the device between tests would
+   race with the queue worker finishing the previous test */
+struct BenchDevice {
+    PhysMemoryRange *range;
+    VIRTIODevice *dev;
+    uint64_t addr;
+    IRQSignal irq;
+    BenchQueue queues[2];
+};
+
+static uint8_t *guest_ram;
+static uint64_t guest_ram_used;
+static PhysMemoryMap *mem_map;
+static int bench_device_count;
+
+static pthread_mutex_t irq_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t irq_cond = PTHREAD_COND_INITIALIZER;
+static uint64_t irq_count;
+
+static BenchResult results[BENCH_MAX_RESULTS];
+static int result_count;
+static int bench_duration_ms = 500;
+static const char *bench_filter;
+
+static int64_t get_time_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* guest memory */
+
+static uint64_t guest_alloc(size_t size, size_t align)
+{
+    uint64_t offset;
+
+    offset = (guest_ram_used + align - 1) & ~((uint64_t)align - 1);
+    if (offset + size > GUEST_RAM_SIZE) {
+        fprintf(stderr, "virtio_bench: out of guest memory\n");
+        exit(1);
+    }
+    guest_ram_used = offset + size;
+    return GUEST_RAM_BASE + offset;
+}
+
+static inline uint8_t *guest_ptr(uint64_t gpa)
+{
+    return guest_ram + (gpa - GUEST_RAM_BASE);
+}
+
+/* interrupts */
+
+static void bench_set_irq(void *opaque, int irq_num, int level)
+{
+    if (!level)
+        return;
+    pthread_mutex_lock(&irq_lock);
+    irq_count++;
+    pthread_cond_broadcast(&irq_cond);
+    pthread_mutex_unlock(&irq_lock);
+}
+
+/* device registers */
+
+static void mmio_write(BenchDevice *bd, uint32_t offset, uint32_t val)
+{
+    bd->range->write_func(bd->range->opaque, offset, val, 2);
+}
+
+static uint32_t mmio_read(BenchDevice *bd, uint32_t offset)
+{
+    return bd->range->read_func(bd->range->opaque, offset, 2);
+}
+
+static void bench_bus_init(VIRTIOBusDef *bus, BenchDevice *bd)
+{
+    bd->addr = VIRTIO_MMIO_BASE + bench_device_count * VIRTIO_MMIO_SIZE;
+    irq_init(&bd->irq, bench_set_irq, bd, bench_device_count);
+    bench_device_count++;
+    memset(bus, 0, sizeof(*bus));
+    bus->mem_map = mem_map;
+    bus->addr = bd->addr;
+    bus->irq = &bd->irq;
+}
+
+
+
+static void queue_init(BenchQueue *q, BenchDevice *bd, int idx, int num)
+{
+    memset(q, 0, sizeof(*q));
+    q->bd = bd;
+    q->idx = idx;
+    q->num = num;
+    q->desc_gpa = guest_alloc(16 * num, 4096);
+    q->avail_gpa = guest_alloc(6 + 2 * num, 4096);
+    q->used_gpa = guest_alloc(6 + 8 * num, 4096);
+    q->desc = guest_ptr(q->desc_gpa);
+    q->avail = guest_ptr(q->avail_gpa);
+    q->used = guest_ptr(q->used_gpa);
+
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_SEL, idx);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_NUM, num);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_DESC_LOW, q->desc_gpa);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_DESC_HIGH, q->desc_gpa >> 32);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_AVAIL_LOW, q->avail_gpa);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_AVAIL_HIGH, q->avail_gpa >> 32);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_USED_LOW, q->used_gpa);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_USED_HIGH, q->used_gpa >> 32);
+    mmio_write(bd, VIRTIO_MMIO_QUEUE_READY, 1);
+}
+
+static void bench_device_attach(BenchDevice *bd, VIRTIODevice *dev,
+                                int nqueues)
+{
+    int i;
+
+    bd->dev = dev;
+    bd->range = get_phys_mem_range(mem_map, bd->addr);
+    virtio_set_debug(dev, 0);
+
+    mmio_write(bd, VIRTIO_MMIO_STATUS, 0);
+    mmio_write(bd, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+               VIRTIO_STATUS_DRIVER);
+    mmio_write(bd, VIRTIO_MMIO_DRIVER_FEATURES, 0);
+    mmio_write(bd, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+               VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK);
+    for(i = 0; i < nqueues; i++)
+        queue_init(&bd->queues[i], bd, i, BENCH_QUEUE_SIZE);
+    mmio_write(bd, VIRTIO_MMIO_STATUS, VIRTIO_STATUS_ACKNOWLEDGE |
+               VIRTIO_STATUS_DRIVER | VIRTIO_STATUS_FEATURES_OK |
+               VIRTIO_STATUS_DRIVER_OK);
+}
+
+static void queue_set_desc(BenchQueue *q, int desc_idx, uint64_t gpa,
+                           uint32_t len, uint16_t flags, uint16_t next)
+{
+    uint8_t *d = q->desc + desc_idx * 16;
+    put_le64(d, gpa);
+    put_le32(d + 8, len);
+    put_le16(d + 12, flags);
+    put_le16(d + 14, next);
+}
+
+static void queue_add(BenchQueue *q, int head)
+{
+    put_le16(q->avail + 4 + (q->avail_idx & (q->num - 1)) * 2, head);
+    q->avail_idx++;
+}
+
+static void queue_kick(BenchQueue *q)
+{
+    if (q->avail_idx == q->kicked_idx)
+        return;
+    __atomic_store_n((uint16_t *)(q->avail + 2), q->avail_idx,
+                     __ATOMIC_RELEASE);
+    q->kicked_idx = q->avail_idx;
+    mmio_write(q->bd, VIRTIO_MMIO_QUEUE_NOTIFY, q->idx);
+}
+
+static inline uint16_t queue_used_idx(BenchQueue *q)
+{
+    return __atomic_load_n((uint16_t *)(q->used + 2), __ATOMIC_ACQUIRE);
+}
+
+/* Return the head of the next completed chain or -1 if none */
+static int queue_get_used(BenchQueue *q, uint32_t *plen)
+{
+    uint8_t *elem;
+
+    if (queue_used_idx(q) == q->last_used)
+        return -1;
+    elem = q->used + 4 + (q->last_used & (q->num - 1)) * 8;
+    q->last_used++;
+    if (plen)
+        *plen = get_le32(elem + 4);
+    return get_le32(elem);
+}
+
+static void bench_ack_irq(BenchDevice *bd)
+{
+    uint32_t status = mmio_read(bd, VIRTIO_MMIO_INTERRUPT_STATUS);
+    if (status)
+        mmio_write(bd, VIRTIO_MMIO_INTERRUPT_ACK, status);
+}
+
+/* Wait until one of the queues has a completion. Return -1 on timeout. */
+static int bench_wait(BenchQueue **qs, int n)
+{
+    struct timespec ts;
+    int64_t deadline;
+    int i;
+
+    deadline = get_time_ns() + (int64_t)BENCH_WAIT_TIMEOUT_MS * 1000000;
+    pthread_mutex_lock(&irq_lock);
+    for(;;) {
+        for(i = 0; i < n; i++) {
+            if (queue_used_idx(qs[i]) != qs[i]->last_used) {
+                pthread_mutex_unlock(&irq_lock);
+                return 0;
+            }
+        }
+        if (get_time_ns() >= deadline) {
+            pthread_mutex_unlock(&irq_lock);
+            return -1;
+        }
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&irq_cond, &irq_lock, &ts);
+    }
+}
+
+static BOOL bench_enabled(const char *name)
+{
+    return !bench_filter || strstr(name, bench_filter) != NULL;
+}
+
+static void bench_report(const char *name, uint64_t ops, uint64_t bytes,
+                         uint64_t dropped, int64_t elapsed_ns)
+{
+    BenchResult *r;
+    double secs = elapsed_ns / 1e9;
+
+    if (result_count >= BENCH_MAX_RESULTS)
+        return;
+    r = &results[result_count++];
+    pstrcpy(r->name, sizeof(r->name), name);
+    r->ops = ops;
+    r->dropped = dropped;
+    r->ops_per_sec = secs > 0 ? ops / secs : 0;
+    r->mb_per_sec = secs > 0 ? bytes / secs / 1e6 : 0;
+    fprintf(stderr, "%-28s %12.0f ops/s %10.2f MB/s", name, r->ops_per_sec,
+            r->mb_per_sec);
+    if (dropped)
+        fprintf(stderr, " (%" PRIu64 " dropped)", dropped);
+    fprintf(stderr, "\n");
+}
+
+static void bench_timeout(const char *name)
+{
+    fprintf(stderr, "virtio_bench: %s: device stopped completing requests\n",
+            name);
+    exit(1);
+}
+
+/*********************************************************************/
+/* block device */
+
+typedef struct {
+    uint8_t *data;
+    BlockDevice bs;
+} RAMDisk;
+
+static int64_t ramdisk_get_sector_count(BlockDevice *bs)
+{
+    return BENCH_DISK_SIZE / SECTOR_SIZE;
+}
+
+static int ramdisk_read_async(BlockDevice *bs, uint64_t sector_num,
+                              uint8_t *buf, int n,
+                              BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    RAMDisk *d = bs->opaque;
+    memcpy(buf, d->data + sector_num * SECTOR_SIZE, n * SECTOR_SIZE);
+    return 0;
+}
+
+static int ramdisk_write_async(BlockDevice *bs, uint64_t sector_num,
+                               const uint8_t *buf, int n,
+                               BlockDeviceCompletionFunc *cb, void *opaque)
+{
+    RAMDisk *d = bs->opaque;
+    memcpy(d->data + sector_num * SECTOR_SIZE, buf, n * SECTOR_SIZE);
+    return 0;
+}
+
+static void block_fill_request(BenchQueue *q, uint64_t hdr_gpa, int slot,
+                               int type, uint64_t sector)
+{
+    uint8_t *h = guest_ptr(hdr_gpa + slot * 16);
+    put_le32(h, type);
+    put_le32(h + 4, 0);
+    put_le64(h + 8, sector);
+}
+
+static void bench_block(BenchDevice *bd, int type, int size, int qd)
+{
+    char name[64];
+    BenchQueue *q = &bd->queues[0];
+    BenchQueue *qs[1] = { q };
+    uint64_t hdr_gpa, data_gpa, status_gpa, sector, ops = 0;
+    int64_t start, end;
+    int i, head, inflight;
+    uint16_t data_flags;
+
+    snprintf(name, sizeof(name), "block.%s.%d.qd%d",
+             type == VIRTIO_BLK_T_IN ? "read" : "write", size, qd);
+    if (!bench_enabled(name))
+        return;
+
+    hdr_gpa = guest_alloc(16 * qd, 64);
+    data_gpa = guest_alloc((uint64_t)size * qd, 4096);
+    status_gpa = guest_alloc(qd, 64);
+    data_flags = VRING_DESC_F_NEXT |
+        (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0);
+    for(i = 0; i < qd; i++) {
+        queue_set_desc(q, 3 * i, hdr_gpa + 16 * i, 16, VRING_DESC_F_NEXT,
+                       3 * i + 1);
+        queue_set_desc(q, 3 * i + 1, data_gpa + (uint64_t)size * i, size,
+                       data_flags, 3 * i + 2);
+        queue_set_desc(q, 3 * i + 2, status_gpa + i, 1, VRING_DESC_F_WRITE,
+                       0);
+    }
+
+    sector = 0;
+    start = get_time_ns();
+    end = start + (int64_t)bench_duration_ms * 1000000;
+    for(i = 0; i < qd; i++) {
+        block_fill_request(q, hdr_gpa, i, type, sector);
+        sector = (sector + size / SECTOR_SIZE) %
+            (BENCH_DISK_SIZE / SECTOR_SIZE - size / SECTOR_SIZE);
+        queue_add(q, 3 * i);
+    }
+    queue_kick(q);
+    inflight = qd;
+    while (inflight > 0) {
+        if (bench_wait(qs, 1) < 0)
+            bench_timeout(name);
+        bench_ack_irq(bd);
+        while ((head = queue_get_used(q, NULL)) >= 0) {
+            inflight--;
+            ops++;
+            if (get_time_ns() < end) {
+                i = head / 3;
+                block_fill_request(q, hdr_gpa, i, type, sector);
+                sector = (sector + size / SECTOR_SIZE) %
+                    (BENCH_DISK_SIZE / SECTOR_SIZE - size / SECTOR_SIZE);
+                queue_add(q, head);
+                inflight++;
+            }
+        }
+        queue_kick(q);
+    }
+    bench_report(name, ops, ops * size, 0, get_time_ns() - start);
+}
+
+/*********************************************************************/
+/* network device */
+
+/* loopback backend: every transmitted frame comes back on the RX queue */
+typedef struct {
+    EthernetDevice es;
+    uint64_t dropped;
+    uint64_t rx_gpa; /* receive buffers, posted by the first test */
+} LoopbackNet;
+
+static void loopback_write_packet(EthernetDevice *es, const uint8_t *buf,
+                                  int len)
+{
+    LoopbackNet *ln = es->opaque;
+    if (es->device_can_write_packet(es))
+        es->device_write_packet(es, buf, len);
+    else
+        ln->dropped++;
+}
+
+static uint16_t ip_checksum(const uint8_t *buf, int len)
+{
+    uint32_t sum = 0;
+    int i;
+
+    for(i = 0; i < len; i += 2)
+        sum += (buf[i] << 8) | buf[i + 1];
+    while (sum >> 16)
+        sum = (sum & 0xffff) + (sum >> 16);
+    return ~sum;
+}
+
+/* Ethernet + IPv4 + UDP from the guest (10.0.2.15) to the slirp host
+   alias (10.0.2.2), which slirp forwards to 127.0.0.1 */
+static int build_udp_frame(uint8_t *buf, int payload_len, uint16_t port)
+{
+    static const uint8_t host_mac[6] = { 0x52, 0x55, 0x0a, 0x00, 0x02, 0x02 };
+    static const uint8_t guest_mac[6] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+    uint8_t *ip = buf + 14, *udp = ip + 20;
+    int ip_len = 20 + 8 + payload_len;
+
+    memcpy(buf, host_mac, 6);
+    memcpy(buf + 6, guest_mac, 6);
+    buf[12] = 0x08;
+    buf[13] = 0x00;
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    ip[2] = ip_len >> 8;
+    ip[3] = ip_len;
+    ip[8] = 64; /* ttl */
+    ip[9] = 17; /* UDP */
+    ip[12] = 10; ip[13] = 0; ip[14] = 2; ip[15] = 15;
+    ip[16] = 10; ip[17] = 0; ip[18] = 2; ip[19] = 2;
+    ip[10] = ip_checksum(ip, 20) >> 8;
+    ip[11] = ip_checksum(ip, 20);
+    udp[0] = 0x10; /* source port 4096 */
+    udp[1] = 0x00;
+    udp[2] = port >> 8;
+    udp[3] = port;
+    udp[4] = (8 + payload_len) >> 8;
+    udp[5] = 8 + payload_len;
+    udp[6] = 0; /* no checksum */
+    udp[7] = 0;
+    memset(udp + 8, 0x5a, payload_len);
+    return 14 + ip_len;
+}
+
+static void net_setup_tx(BenchQueue *tx, uint64_t tx_gpa, int qd,
+                         const uint8_t *frame, int frame_len)
+{
+    int i;
+    uint8_t *p;
+
+    for(i = 0; i < qd; i++) {
+        p = guest_ptr(tx_gpa + (uint64_t)i * 2048);
+        memset(p, 0, VIRTIO_NET_HDR_SIZE);
+        memcpy(p + VIRTIO_NET_HDR_SIZE, frame, frame_len);
+        queue_set_desc(tx, i, tx_gpa + (uint64_t)i * 2048,
+                       VIRTIO_NET_HDR_SIZE + frame_len, 0, 0);
+    }
+}
+
+static void bench_net_loopback(BenchDevice *bd, LoopbackNet *ln,
+                               int frame_len, int qd)
+{
+    char name[64];
+    uint8_t frame[ETH_FRAME_MAX];
+    BenchQueue *rx = &bd->queues[0], *tx = &bd->queues[1];
+    BenchQueue *qs[2] = { rx, tx };
+    uint64_t tx_gpa, rx_pkts = 0, rx_bytes = 0;
+    int64_t start, end;
+    int i, head, tx_inflight;
+    uint32_t len;
+    BOOL running;
+
+    snprintf(name, sizeof(name), "net.loopback.%d.qd%d", frame_len, qd);
+    if (!bench_enabled(name))
+        return;
+
+    if (!ln->rx_gpa) {
+        ln->rx_gpa = guest_alloc(BENCH_NET_RX_BUFS * 2048, 4096);
+        for(i = 0; i < BENCH_NET_RX_BUFS; i++) {
+            queue_set_desc(rx, i, ln->rx_gpa + (uint64_t)i * 2048, 2048,
+                           VRING_DESC_F_WRITE, 0);
+            queue_add(rx, i);
+        }
+        queue_kick(rx);
+    }
+    /* frames left over from the previous test */
+    while ((head = queue_get_used(rx, NULL)) >= 0)
+        queue_add(rx, head);
+    queue_kick(rx);
+    ln->dropped = 0;
+
+    tx_gpa = guest_alloc((uint64_t)qd * 2048, 4096);
+    for(i = 0; i < (int)sizeof(frame); i++)
+        frame[i] = i;
+    net_setup_tx(tx, tx_gpa, qd, frame, frame_len);
+
+    start = get_time_ns();
+    end = start + (int64_t)bench_duration_ms * 1000000;
+    for(i = 0; i < qd; i++)
+        queue_add(tx, i);
+    queue_kick(tx);
+    tx_inflight = qd;
+    running = TRUE;
+    while (tx_inflight > 0) {
+        if (bench_wait(qs, 2) < 0)
+            bench_timeout(name);
+        bench_ack_irq(bd);
+        running = get_time_ns() < end;
+        /* give the buffers back to the device before transmitting more */
+        while ((head = queue_get_used(rx, &len)) >= 0) {
+            rx_pkts++;
+            rx_bytes += len - VIRTIO_NET_HDR_SIZE;
+            queue_add(rx, head);
+        }
+        queue_kick(rx);
+        while ((head = queue_get_used(tx, NULL)) >= 0) {
+            tx_inflight--;
+            if (running) {
+                queue_add(tx, head);
+                tx_inflight++;
+            }
+        }
+        queue_kick(tx);
+    }
+    bench_report(name, rx_pkts, rx_bytes, ln->dropped, get_time_ns() - start);
+}
+
+static void bench_net_slirp(BenchDevice *bd, int payload_len, int qd)
+{
+    char name[64];
+    uint8_t frame[ETH_FRAME_MAX], buf[2048];
+    BenchQueue *tx = &bd->queues[1];
+    BenchQueue *qs[1] = { tx };
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    uint64_t tx_gpa, pkts = 0, bytes = 0, sent = 0;
+    int64_t start, end;
+    int i, fd, head, frame_len, tx_inflight;
+    ssize_t ret;
+
+    snprintf(name, sizeof(name), "net.slirp.udp.%d.qd%d", payload_len, qd);
+    if (!bench_enabled(name))
+        return;
+
+    fd = socket(AF_INET, SOCK_DGRAM, 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        getsockname(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+        fprintf(stderr, "virtio_bench: cannot open a UDP socket: %s\n",
+                strerror(errno));
+        exit(1);
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+
+    tx_gpa = guest_alloc((uint64_t)qd * 2048, 4096);
+    frame_len = build_udp_frame(frame, payload_len, ntohs(addr.sin_port));
+    net_setup_tx(tx, tx_gpa, qd, frame, frame_len);
+
+    start = get_time_ns();
+    end = start + (int64_t)bench_duration_ms * 1000000;
+    for(i = 0; i < qd; i++)
+        queue_add(tx, i);
+    queue_kick(tx);
+    tx_inflight = qd;
+    while (tx_inflight > 0) {
+        if (bench_wait(qs, 1) < 0)
+            bench_timeout(name);
+        bench_ack_irq(bd);
+        while ((head = queue_get_used(tx, NULL)) >= 0) {
+            tx_inflight--;
+            sent++;
+            if (get_time_ns() < end) {
+                queue_add(tx, head);
+                tx_inflight++;
+            }
+        }
+        queue_kick(tx);
+        /* count what actually reached the host */
+        while ((ret = recv(fd, buf, sizeof(buf), 0)) > 0) {
+            pkts++;
+            bytes += ret;
+        }
+    }
+    while ((ret = recv(fd, buf, sizeof(buf), 0)) > 0) {
+        pkts++;
+        bytes += ret;
+    }
+    close(fd);
+    bench_report(name, pkts, bytes, sent - pkts, get_time_ns() - start);
+}
+
+/*********************************************************************/
+/* console device */
+
+static uint64_t console_bytes;
+
+static void bench_console_write(void *opaque, const uint8_t *buf, int len)
+{
+    console_bytes += len;
+}
+
+static int bench_console_read(void *opaque, uint8_t *buf, int len)
+{
+    return 0;
+}
+
+static void bench_console(BenchDevice *bd, int size, int qd)
+{
+    char name[64];
+    BenchQueue *tx = &bd->queues[1];
+    BenchQueue *qs[1] = { tx };
+    uint64_t tx_gpa, ops = 0;
+    int64_t start, end;
+    int i, head, inflight;
+
+    snprintf(name, sizeof(name), "console.tx.%d.qd%d", size, qd);
+    if (!bench_enabled(name))
+        return;
+
+
+    tx_gpa = guest_alloc((uint64_t)size * qd, 4096);
+    memset(guest_ptr(tx_gpa), 'x', (size_t)size * qd);
+    for(i = 0; i < qd; i++)
+        queue_set_desc(tx, i, tx_gpa + (uint64_t)size * i, size, 0, 0);
+
+    console_bytes = 0;
+    start = get_time_ns();
+    end = start + (int64_t)bench_duration_ms * 1000000;
+    for(i = 0; i < qd; i++)
+        queue_add(tx, i);
+    queue_kick(tx);
+    inflight = qd;
+    while (inflight > 0) {
+        if (bench_wait(qs, 1) < 0)
+            bench_timeout(name);
+        bench_ack_irq(bd);
+        while ((head = queue_get_used(tx, NULL)) >= 0) {
+            inflight--;
+            ops++;
+            if (get_time_ns() < end) {
+                queue_add(tx, head);
+                inflight++;
+            }
+        }
+        queue_kick(tx);
+    }
+    bench_report(name, ops, console_bytes, 0, get_time_ns() - start);
+}
+
+/*********************************************************************/
+/* 9p filesystem device */
+
+/* A root directory holding a single file named "data" */
+struct FSFile {
+    BOOL is_dir;
+};
+
+typedef struct {
+    FSDevice fs;
+    uint8_t *data;
+} BenchFS;
+
+static void bench_fs_qid(FSFile *f, FSQID *qid)
+{
+    qid->type = f->is_dir ? P9_QTDIR : P9_QTFILE;
+    qid->version = 0;
+    qid->path = f->is_dir ? 1 : 2;
+}
+
+static FSFile *bench_fs_new_file(BOOL is_dir)
+{
+    FSFile *f = mallocz(sizeof(*f));
+    f->is_dir = is_dir;
+    return f;
+}
+
+static void bench_fs_delete(FSDevice *fs, FSFile *f)
+{
+    free(f);
+}
+
+static void bench_fs_statfs(FSDevice *fs, FSStatFS *st)
+{
+    memset(st, 0, sizeof(*st));
+    st->f_bsize = 4096;
+    st->f_blocks = BENCH_9P_FILE_SIZE / 4096;
+    st->f_files = 2;
+}
+
+static int bench_fs_attach(FSDevice *fs, FSFile **pf, FSQID *qid,
+                           uint32_t uid, const char *uname, const char *aname)
+{
+    *pf = bench_fs_new_file(TRUE);
+    bench_fs_qid(*pf, qid);
+    return 0;
+}
+
+static int bench_fs_walk(FSDevice *fs, FSFile **pf, FSQID *qids,
+                         FSFile *f, int n, char **names)
+{
+    BOOL is_dir = f->is_dir;
+    int i;
+
+    for(i = 0; i < n; i++) {
+        if (!is_dir || strcmp(names[i], "data") != 0)
+            break;
+        is_dir = FALSE;
+        qids[i].type = P9_QTFILE;
+        qids[i].version = 0;
+        qids[i].path = 2;
+    }
+    if (i == 0 && n > 0)
+        return -P9_ENOENT;
+    *pf = bench_fs_new_file(is_dir);
+    return i;
+}
+
+static int bench_fs_open(FSDevice *fs, FSQID *qid, FSFile *f, uint32_t flags,
+                         FSOpenCompletionFunc *cb, void *opaque)
+{
+    bench_fs_qid(f, qid);
+    return 0;
+}
+
+static int bench_fs_stat(FSDevice *fs, FSFile *f, FSStat *st)
+{
+    memset(st, 0, sizeof(*st));
+    bench_fs_qid(f, &st->qid);
+    st->st_mode = f->is_dir ? (P9_S_IFDIR | 0755) : (P9_S_IFREG | 0644);
+    st->st_nlink = 1;
+    st->st_size = f->is_dir ? 0 : BENCH_9P_FILE_SIZE;
+    st->st_blksize = 4096;
+    st->st_blocks = st->st_size / 512;
+    return 0;
+}
+
+static void bench_fs_close(FSDevice *fs, FSFile *f)
+{
+}
+
+static int bench_fs_read(FSDevice *fs1, FSFile *f, uint64_t offset,
+                         uint8_t *buf, int count)
+{
+    BenchFS *fs = (BenchFS *)fs1;
+    if (f->is_dir)
+        return -P9_EINVAL;
+    if (offset >= BENCH_9P_FILE_SIZE)
+        return 0;
+    count = min_int(count, BENCH_9P_FILE_SIZE - offset);
+    memcpy(buf, fs->data + offset, count);
+    return count;
+}
+
+static int bench_fs_write(FSDevice *fs1, FSFile *f, uint64_t offset,
+                          const uint8_t *buf, int count)
+{
+    BenchFS *fs = (BenchFS *)fs1;
+    if (f->is_dir)
+        return -P9_EINVAL;
+    if (offset >= BENCH_9P_FILE_SIZE)
+        return -P9_ENOSPC;
+    count = min_int(count, BENCH_9P_FILE_SIZE - offset);
+    memcpy(fs->data + offset, buf, count);
+    return count;
+}
+
+/* Only the operations issued by the benchmark are implemented */
+static FSDevice *bench_fs_init(void)
+{
+    BenchFS *fs = mallocz(sizeof(*fs));
+
+    fs->data = mallocz(BENCH_9P_FILE_SIZE);
+    fs->fs.fs_delete = bench_fs_delete;
+    fs->fs.fs_statfs = bench_fs_statfs;
+    fs->fs.fs_attach = bench_fs_attach;
+    fs->fs.fs_walk = bench_fs_walk;
+    fs->fs.fs_open = bench_fs_open;
+    fs->fs.fs_stat = bench_fs_stat;
+    fs->fs.fs_close = bench_fs_close;
+    fs->fs.fs_read = bench_fs_read;
+    fs->fs.fs_write = bench_fs_write;
+    return &fs->fs;
+}
+
+typedef struct {
+    BenchDevice *bd;
+    BenchQueue *q;
+    uint64_t req_gpa, reply_gpa;
+    int req_len;
+    uint16_t tag;
+} P9Client;
+
+#define P9_REQ_BUF_SIZE (BENCH_9P_MSIZE + 64)
+
+static uint8_t *p9_begin(P9Client *c, int id)
+{
+    uint8_t *p = guest_ptr(c->req_gpa);
+    p[4] = id;
+    put_le16(p + 5, c->tag++);
+    c->req_len = 7;
+    return p;
+}
+
+static void p9_put32(P9Client *c, uint32_t v)
+{
+    put_le32(guest_ptr(c->req_gpa) + c->req_len, v);
+    c->req_len += 4;
+}
+
+static void p9_put64(P9Client *c, uint64_t v)
+{
+    put_le64(guest_ptr(c->req_gpa) + c->req_len, v);
+    c->req_len += 8;
+}
+
+static void p9_put16(P9Client *c, uint16_t v)
+{
+    put_le16(guest_ptr(c->req_gpa) + c->req_len, v);
+    c->req_len += 2;
+}
+
+static void p9_putstr(P9Client *c, const char *str)
+{
+    int len = strlen(str);
+    p9_put16(c, len);
+    memcpy(guest_ptr(c->req_gpa) + c->req_len, str, len);
+    c->req_len += len;
+}
+
+/* Send the request and wait for the reply. Return the reply id. */
+static int p9_call(P9Client *c, const char *name)
+{
+    BenchQueue *qs[1] = { c->q };
+    uint8_t *reply;
+
+    put_le32(guest_ptr(c->req_gpa), c->req_len);
+    queue_set_desc(c->q, 0, c->req_gpa, c->req_len, VRING_DESC_F_NEXT, 1);
+    queue_set_desc(c->q, 1, c->reply_gpa, P9_REQ_BUF_SIZE,
+                   VRING_DESC_F_WRITE, 0);
+    queue_add(c->q, 0);
+    queue_kick(c->q);
+    if (bench_wait(qs, 1) < 0)
+        bench_timeout(name);
+    bench_ack_irq(c->bd);
+    queue_get_used(c->q, NULL);
+    reply = guest_ptr(c->reply_gpa);
+    return reply[4];
+}
+
+static void p9_check(P9Client *c, int id, int expected, const char *name)
+{
+    if (id != expected) {
+        fprintf(stderr, "virtio_bench: %s: 9p reply %d, expected %d\n",
+                name, id, expected);
+        exit(1);
+    }
+}
+
+static void p9_walk(P9Client *c, uint32_t fid, uint32_t newfid,
+                    const char *path, const char *name)
+{
+    p9_begin(c, 110);
+    p9_put32(c, fid);
+    p9_put32(c, newfid);
+    if (path) {
+        p9_put16(c, 1);
+        p9_putstr(c, path);
+    } else {
+        p9_put16(c, 0);
+    }
+    p9_check(c, p9_call(c, name), 111, name);
+}
+
+static void p9_clunk(P9Client *c, uint32_t fid, const char *name)
+{
+    p9_begin(c, 120);
+    p9_put32(c, fid);
+    p9_check(c, p9_call(c, name), 121, name);
+}
+
+static void p9_client_init(P9Client *c, BenchDevice *bd)
+{
+    c->bd = bd;
+    c->tag = 1;
+    c->q = &bd->queues[0];
+    c->req_gpa = guest_alloc(P9_REQ_BUF_SIZE, 4096);
+    c->reply_gpa = guest_alloc(P9_REQ_BUF_SIZE, 4096);
+
+    p9_begin(c, 100); /* version */
+    p9_put32(c, BENCH_9P_MSIZE);
+    p9_putstr(c, "9P2000.L");
+    p9_check(c, p9_call(c, "9p.version"), 101, "9p.version");
+    p9_begin(c, 104); /* attach fid 0 */
+    p9_put32(c, 0);
+    p9_put32(c, ~0U);
+    p9_putstr(c, "bench");
+    p9_putstr(c, "");
+    p9_put32(c, 0);
+    p9_check(c, p9_call(c, "9p.attach"), 105, "9p.attach");
+}
+
+/* walk + getattr + clunk, counted as three operations */
+static void bench_9p_metadata(BenchDevice *bd)
+{
+    const char *name = "9p.metadata";
+    P9Client c;
+    uint64_t ops = 0;
+    int64_t start, end;
+
+    if (!bench_enabled(name))
+        return;
+    p9_client_init(&c, bd);
+    start = get_time_ns();
+    end = start + (int64_t)bench_duration_ms * 1000000;
+    while (get_time_ns() < end) {
+        p9_walk(&c, 0, 1, "data", name);
+        p9_begin(&c, 24); /* getattr */
+        p9_put32(&c, 1);
+        p9_put64(&c, 0x7ff);
+        p9_check(&c, p9_call(&c, name), 25, name);
+        p9_clunk(&c, 1, name);
+        ops += 3;
+    }
+    bench_report(name, ops, 0, 0, get_time_ns() - start);
+}
+
+static void bench_9p_data(BenchDevice *bd, BOOL is_write, int size)
+{
+    char name[64];
+    P9Client c;
+    uint64_t ops = 0, offset = 0;
+    int64_t start, end;
+
+    snprintf(name, sizeof(name), "9p.%s.%d", is_write ? "write" : "read",
+             size);
+    if (!bench_enabled(name))
+        return;
+    p9_client_init(&c, bd);
+    p9_walk(&c, 0, 1, "data", name);
+    p9_begin(&c, 12); /* lopen */
+    p9_put32(&c, 1);
+    p9_put32(&c, P9_O_RDWR);
+    p9_check(&c, p9_call(&c, name), 13, name);
+
+    start = get_time_ns();
+    end = start + (int64_t)bench_duration_ms * 1000000;
+    while (get_time_ns() < end) {
+        p9_begin(&c, is_write ? 118 : 116);
+        p9_put32(&c, 1);
+        p9_put64(&c, offset);
+        p9_put32(&c, size);
+        if (is_write) {
+            memset(guest_ptr(c.req_gpa) + c.req_len, 0xa5, size);
+            c.req_len += size;
+        }
+        p9_check(&c, p9_call(&c, name), is_write ? 119 : 117, name);
+        offset = (offset + size) % BENCH_9P_FILE_SIZE;
+        ops++;
+    }
+    p9_clunk(&c, 1, name);
+    bench_report(name, ops, ops * size, 0, get_time_ns() - start);
+}
+
+/*********************************************************************/
+/* results */
+
+/* Find "ops_per_sec" of the entry called 'name' in a previous output */
+static BOOL baseline_lookup(const char *baseline, const char *name,
+                            double *pval)
+{
+    char key[sizeof(((BenchResult *)0)->name) + 16];
+    const char *p;
+
+    snprintf(key, sizeof(key), "\"name\": \"%.*s\"",
+             (int)sizeof(((BenchResult *)0)->name) - 1, name);
+    p = strstr(baseline, key);
+    if (!p)
+        return FALSE;
+    p = strstr(p, "\"ops_per_sec\": ");
+    if (!p)
+        return FALSE;
+    *pval = strtod(p + strlen("\"ops_per_sec\": "), NULL);
+    return TRUE;
+}
+
+static char *load_file(const char *filename)
+{
+    FILE *f;
+    char *buf;
+    long len;
+
+    f = fopen(filename, "rb");
+    if (!f) {
+        fprintf(stderr, "virtio_bench: %s: %s\n", filename, strerror(errno));
+        exit(1);
+    }
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    buf = malloc(len + 1);
+    len = fread(buf, 1, len, f);
+    buf[len] = '\0';
+    fclose(f);
+    return buf;
+}
+
+/* Return the number of results slower than the baseline by more than
+   'threshold' percent */
+static int write_results(FILE *out, const char *baseline, double threshold)
+{
+    BenchResult *r;
+    double base, change;
+    int i, regressions = 0;
+
+    fprintf(out, "{\n  \"benchmark\": \"virtio_bench\",\n");
+    fprintf(out, "  \"duration_ms\": %d,\n  \"results\": [\n",
+            bench_duration_ms);
+    for(i = 0; i < result_count; i++) {
+        r = &results[i];
+        fprintf(out, "    { \"name\": \"%s\", \"ops_per_sec\": %.1f, "
+                "\"mb_per_sec\": %.3f, \"ops\": %" PRIu64 ", "
+                "\"dropped\": %" PRIu64, r->name, r->ops_per_sec,
+                r->mb_per_sec, r->ops, r->dropped);
+        if (baseline && baseline_lookup(baseline, r->name, &base) &&
+            base > 0) {
+            change = (r->ops_per_sec - base) * 100 / base;
+            fprintf(out, ", \"baseline_ops_per_sec\": %.1f, "
+                    "\"change_pct\": %.2f", base, change);
+            fprintf(stderr, "%-28s %+7.2f%%%s\n", r->name, change,
+                    change < -threshold ? "  REGRESSION" : "");
+            if (change < -threshold)
+                regressions++;
+        }
+        fprintf(out, " }%s\n", i + 1 < result_count ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+    return regressions;
+}
+
+static const struct option options[] = {
+    { "baseline", required_argument, 0, 'b' },
+    { "filter", required_argument, 0, 'f' },
+    { "help", no_argument, 0, 'h' },
+    { "output", required_argument, 0, 'o' },
+    { "threshold", required_argument, 0, 'T' },
+    { "time", required_argument, 0, 't' },
+    { 0, 0, 0, 0 }
+};
+
+static void help(void)
+{
+    printf("usage: virtio_bench [options]\n"
+           "\n"
+           "-t, --time ms         duration of each test (default 500)\n"
+           "-f, --filter str      only run the tests whose name contains str\n"
+           "-o, --output file     write the JSON results to file (default stdout)\n"
+           "-b, --baseline file   compare with the JSON results of an earlier run\n"
+           "-T, --threshold pct   slowdown reported as a regression (default 5)\n");
+    exit(1);
+}
+
+int main(int argc, char **argv)
+{
+    static const int block_sizes[] = { 512, 4096, 65536 };
+    static const int block_depths[] = { 1, 4, 16 };
+    VIRTIOBusDef bus;
+    BenchDevice block_bd, loop_bd, slirp_bd, console_bd, p9_bd;
+    VIRTIODevice *devs[5];
+    RAMDisk disk;
+    LoopbackNet loop;
+    EthernetDevice *slirp;
+    CharacterDevice console;
+    const char *output = NULL, *baseline_file = NULL;
+    char *baseline = NULL;
+    double threshold = 5;
+    FILE *out;
+    int c, i, j, regressions;
+
+    for(;;) {
+        c = getopt_long(argc, argv, "b:f:ho:T:t:", options, NULL);
+        if (c == -1)
+            break;
+        switch(c) {
+        case 'b':
+            baseline_file = optarg;
+            break;
+        case 'f':
+            bench_filter = optarg;
+            break;
+        case 'o':
+            output = optarg;
+            break;
+        case 'T':
+            threshold = strtod(optarg, NULL);
+            break;
+        case 't':
+            bench_duration_ms = strtol(optarg, NULL, 0);
+            break;
+        default:
+            help();
+        }
+    }
+    if (baseline_file)
+        baseline = load_file(baseline_file);
+
+    /* the devices trace to stdout: keep it away from the results */
+    if (output) {
+        out = fopen(output, "w");
+        if (!out) {
+            fprintf(stderr, "virtio_bench: %s: %s\n", output, strerror(errno));
+            exit(1);
+        }
+    } else {
+        out = fdopen(dup(STDOUT_FILENO), "w");
+    }
+    if (!freopen("/dev/null", "w", stdout)) {
+        fprintf(stderr, "virtio_bench: cannot redirect stdout\n");
+        exit(1);
+    }
+
+    guest_ram = mallocz(GUEST_RAM_SIZE);
+    virtio_dram_init(guest_ram, GUEST_RAM_BASE, GUEST_RAM_SIZE);
+    mem_map = phys_mem_map_init();
+
+    disk.data = mallocz(BENCH_DISK_SIZE);
+    disk.bs.opaque = &disk;
+    disk.bs.get_sector_count = ramdisk_get_sector_count;
+    disk.bs.read_async = ramdisk_read_async;
+    disk.bs.write_async = ramdisk_write_async;
+    bench_bus_init(&bus, &block_bd);
+    bench_device_attach(&block_bd, virtio_block_init(&bus, &disk.bs), 1);
+
+    memset(&loop, 0, sizeof(loop));
+    loop.es.mac_addr[0] = 0x02;
+    loop.es.mac_addr[5] = 0x02;
+    loop.es.opaque = &loop;
+    loop.es.write_packet = loopback_write_packet;
+    bench_bus_init(&bus, &loop_bd);
+    bench_device_attach(&loop_bd, virtio_net_init(&bus, &loop.es), 2);
+
+    slirp = slirp_open(NULL);
+    if (!slirp) {
+        fprintf(stderr, "virtio_bench: slirp_open failed\n");
+        exit(1);
+    }
+    bench_bus_init(&bus, &slirp_bd);
+    bench_device_attach(&slirp_bd, virtio_net_init(&bus, slirp), 2);
+
+    console.opaque = NULL;
+    console.write_data = bench_console_write;
+    console.read_data = bench_console_read;
+    bench_bus_init(&bus, &console_bd);
+    bench_device_attach(&console_bd, virtio_console_init(&bus, &console), 2);
+
+    bench_bus_init(&bus, &p9_bd);
+    bench_device_attach(&p9_bd, virtio_9p_init(&bus, bench_fs_init(),
+                                               "bench"), 1);
+
+    devs[0] = block_bd.dev;
+    devs[1] = loop_bd.dev;
+    devs[2] = slirp_bd.dev;
+    devs[3] = console_bd.dev;
+    devs[4] = p9_bd.dev;
+    virtio_start_pending_notify_thread(5, devs);
+
+    for(i = 0; i < countof(block_sizes); i++) {
+        for(j = 0; j < countof(block_depths); j++) {
+            bench_block(&block_bd, VIRTIO_BLK_T_IN, block_sizes[i],
+                        block_depths[j]);
+            bench_block(&block_bd, VIRTIO_BLK_T_OUT, block_sizes[i],
+                        block_depths[j]);
+        }
+    }
+    bench_net_loopback(&loop_bd, &loop, 64, 16);
+    bench_net_loopback(&loop_bd, &loop, ETH_FRAME_MAX, 16);
+    bench_net_slirp(&slirp_bd, 18, 16);
+    bench_net_slirp(&slirp_bd, 1472, 16);
+    bench_console(&console_bd, 64, 16);
+    bench_console(&console_bd, 4096, 16);
+    bench_9p_metadata(&p9_bd);
+    bench_9p_data(&p9_bd, FALSE, 4096);
+    bench_9p_data(&p9_bd, FALSE, 65536);
+    bench_9p_data(&p9_bd, TRUE, 4096);
+    bench_9p_data(&p9_bd, TRUE, 65536);
+
+    regressions = write_results(out, baseline, threshold);
+    fclose(out);
+    return regressions ? 2 : 0;
+}
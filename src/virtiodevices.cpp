@@ -7,10 +7,16 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <pthread.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
 extern "C" {
 #include "virtio.h"
 #include "iomem.h"
+#include "netcap.h"
+#include "topology.h"
 }
 
 #include "fpga.h"
@@ -33,21 +39,87 @@ void fpga_set_irq(void *opaque, int irq_num, int level)
 
 static void console_write_data(void *opaque, const uint8_t *buf, int buf_len)
 {
-    fwrite(buf, 1, buf_len, stdout);
-    fflush(stdout);
+    fpga->get_console_output().write(CONSOLE_OUTPUT_VIRTIO, buf, buf_len);
 }
 
+// Return -1 at the end of the input, 0 if nothing is available yet.
 static int console_read_data(void *opaque, uint8_t *buf, int len)
 {
     int ret = read((int)(intptr_t)opaque, buf, len);
     if (ret < 0)
-        return 0;
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (ret == 0 && len > 0)
+        return -1;
 
     return ret;
 }
 
-VirtioDevices::VirtioDevices(int first_irq_num, const char *tun_ifname)
-  : tun_ifname(tun_ifname) {
+// Unix socket ports stay blocking for the guest output, so that a slow
+// reader holds back the guest instead of losing data: only the reads
+// must not wait.
+static int console_socket_read_data(void *opaque, uint8_t *buf, int len)
+{
+    int ret = recv((int)(intptr_t)opaque, buf, len, MSG_DONTWAIT);
+    if (ret < 0)
+        return (errno == EAGAIN || errno == EINTR) ? 0 : -1;
+    if (ret == 0 && len > 0)
+        return -1;
+
+    return ret;
+}
+
+static void console_port_write(int fd, const uint8_t *buf, int buf_len, bool is_socket)
+{
+    while (buf_len > 0) {
+        // a closed peer must not raise SIGPIPE
+        ssize_t ret = is_socket ? send(fd, buf, buf_len, MSG_NOSIGNAL) : write(fd, buf, buf_len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "virtio console port write failed: %s\r\n", strerror(errno));
+            return;
+        }
+        buf += ret;
+        buf_len -= ret;
+    }
+}
+
+static void console_port_write_data(void *opaque, const uint8_t *buf, int buf_len)
+{
+    console_port_write((int)(intptr_t)opaque, buf, buf_len, false);
+}
+
+static void console_socket_write_data(void *opaque, const uint8_t *buf, int buf_len)
+{
+    console_port_write((int)(intptr_t)opaque, buf, buf_len, true);
+}
+
+// net_backend is slirp (the default), tun:IFNAME, packet:IFNAME[:FANOUT]
+// or vswitch:NAME
+static EthernetDevice *open_ethernet_device(const char *net_backend)
+{
+    EthernetDevice *net;
+    if (!net_backend || strcmp(net_backend, "slirp") == 0)
+        net = slirp_open(NULL);
+    else if (strncmp(net_backend, "slirp:", 6) == 0)
+        net = slirp_open(net_backend + 6);
+    else if (strncmp(net_backend, "tun:", 4) == 0)
+        net = tun_open(net_backend + 4);
+    else if (strncmp(net_backend, "packet:", 7) == 0)
+        net = packet_open(net_backend + 7);
+    else if (strncmp(net_backend, "vswitch:", 8) == 0)
+        net = vswitch_open(net_backend + 8);
+    else {
+        fprintf(stderr, "Error: unknown network backend %s\r\n", net_backend);
+        net = NULL;
+    }
+    if (!net)
+        abort();
+    return net;
+}
+
+VirtioDevices::VirtioDevices(int first_irq_num, const char *net_backend)
+  : net_backend(net_backend) {
     mem_map = phys_mem_map_init();
     irq = (IRQSignal *)mallocz(32 * sizeof(IRQSignal));
     irq_num = first_irq_num;
@@ -60,7 +132,7 @@ VirtioDevices::VirtioDevices(int first_irq_num, const char *tun_ifname)
 
     // set up a network device
     virtio_bus->irq = &irq[irq_num++];
-    ethernet_device = /*tun_ifname ? tun_open(tun_ifname) :*/ slirp_open();
+    ethernet_device = net_capture_wrap(open_ethernet_device(net_backend));
     virtio_net = virtio_net_init(virtio_bus, ethernet_device);
     debugLog("ethernet device %p virtio net device %p at addr %08lx\r\r\n", ethernet_device, virtio_net, virtio_bus->addr);
 
@@ -98,10 +170,116 @@ void VirtioDevices::add_virtio_console_device()
     virtio_bus->addr += 0x1000;
     virtio_bus->irq = &irq[irq_num++];
     virtio_console = virtio_console_init(virtio_bus, console);
+    console_ports.push_back(console);
+    console_buf.resize(64 * 1024);
+}
+
+// spec is name=unix:PATH to connect the port to a listening unix socket, or
+// name=PATH to stream the guest's output into a file.
+bool VirtioDevices::add_virtio_console_port(std::string spec)
+{
+    size_t eq = spec.find('=');
+    if (eq == std::string::npos || eq == 0) {
+        fprintf(stderr, "Error: console port must be name=path or name=unix:path: %s\r\n", spec.c_str());
+        return false;
+    }
+    std::string name = spec.substr(0, eq);
+    std::string path = spec.substr(eq + 1);
+    if (!virtio_console)
+        add_virtio_console_device();
+
+    CharacterDevice *cs = (CharacterDevice *)mallocz(sizeof(*cs));
+    int fd;
+    if (path.compare(0, 5, "unix:") == 0) {
+        struct sockaddr_un addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sun_family = AF_UNIX;
+        pstrcpy(addr.sun_path, sizeof(addr.sun_path), path.c_str() + 5);
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+            fprintf(stderr, "Error: failed to connect console port %s to %s: %s\r\n",
+                    name.c_str(), path.c_str() + 5, strerror(errno));
+            if (fd >= 0)
+                close(fd);
+            free(cs);
+            return false;
+        }
+        cs->read_data = console_socket_read_data;
+        cs->write_data = console_socket_write_data;
+    } else {
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (fd < 0) {
+            fprintf(stderr, "Error: failed to open console port %s file %s: %s\r\n",
+                    name.c_str(), path.c_str(), strerror(errno));
+            free(cs);
+            return false;
+        }
+        cs->read_data = NULL; // output only
+        cs->write_data = console_port_write_data;
+    }
+    cs->opaque = (void *)(intptr_t)fd;
+
+    int port = virtio_console_add_port(virtio_console, name.c_str(), cs);
+    if (port < 0) {
+        fprintf(stderr, "Error: too many virtio console ports\r\n");
+        close(fd);
+        free(cs);
+        return false;
+    }
+    console_ports.resize(port + 1);
+    console_ports[port] = cs;
+    debugLog("virtio console port %d \"%s\" -> %s\r\n", port, name.c_str(), path.c_str());
+    return true;
+}
+
+// Guest connections to host port P go to uds_path_P; host clients connect
+// to uds_path and send "CONNECT <guest port>\n".
+bool VirtioDevices::add_virtio_vsock_device(std::string uds_path, uint64_t guest_cid)
+{
+    vsock_device = vsock_unix_open(uds_path.c_str(), guest_cid);
+    if (!vsock_device)
+        return false;
+    virtio_bus->addr += 0x1000;
+    virtio_bus->irq = &irq[irq_num++];
+    virtio_vsock = virtio_vsock_init(virtio_bus, vsock_device);
+    debugLog("virtio vsock device %p cid %ld at addr %08lx\r\n", virtio_vsock, (long)guest_cid, virtio_bus->addr);
+    return true;
+}
+
+// spec is blk:PATH or net:PATH, PATH being the unix socket of the backend.
+// With a shared guest memory window (set_virtio_dram() with a file) the
+// backend works on the guest rings; otherwise requests are copied, so the
+// memory window must be set before adding the device.
+bool VirtioDevices::add_vhost_user_device(std::string spec)
+{
+    size_t colon = spec.find(':');
+    uint32_t device_id;
+    std::string type = spec.substr(0, colon);
+    if (colon != std::string::npos && type == "net") {
+        device_id = 1;
+    } else if (colon != std::string::npos && type == "blk") {
+        device_id = 2;
+    } else {
+        fprintf(stderr, "Error: vhost-user device must be blk:path or net:path: %s\r\n", spec.c_str());
+        return false;
+    }
+    virtio_bus->addr += 0x1000;
+    virtio_bus->irq = &irq[irq_num];
+    VIRTIODevice *s = virtio_vhost_user_init(virtio_bus, device_id, spec.c_str() + colon + 1);
+    if (!s) {
+        virtio_bus->addr -= 0x1000;
+        return false;
+    }
+    irq_num++;
+    vhost_user_devices.push_back(s);
+    debugLog("vhost-user %s device %p at addr %08lx\r\n", type.c_str(), s, virtio_bus->addr);
+    return true;
 }
 
 void VirtioDevices::set_virtio_stdin_fd(int fd)
 {
+    // forward_console_input() drains until the fd would block.
+    fcntl(fd, F_SETFL, O_NONBLOCK);
     console->opaque = (void *)(intptr_t)fd;
 }
 
@@ -110,6 +288,18 @@ void VirtioDevices::set_virtio_dma_fd(int fd)
     virtio_dma_init(fd);
 }
 
+void VirtioDevices::set_virtio_xdma(XDMATransport *xdma)
+{
+    virtio_xdma_init(xdma);
+}
+
+void VirtioDevices::set_virtio_dram(uint8_t *ptr, uint64_t base, uint64_t size,
+                                    int fd, uint64_t fd_offset)
+{
+    virtio_dram_init(ptr, base, size);
+    virtio_dram_set_fd(fd, fd_offset);
+}
+
 bool VirtioDevices::has_virtio_console_device()
 {
     return virtio_console != nullptr;
@@ -125,12 +315,34 @@ uint8_t *VirtioDevices::phys_mem_get_ram_ptr(uint64_t paddr, BOOL is_rw)
     return ::phys_mem_get_ram_ptr(mem_map, paddr, is_rw);
 }
 
+// Move as much pending host input as the guest has buffers for.
+void VirtioDevices::forward_console_input(int port, CharacterDevice *cs)
+{
+    while (virtio_console_port_can_write_data(virtio_console, port)) {
+        int len = virtio_console_port_get_write_len(virtio_console, port);
+        len = min_int(len, console_buf.size());
+        if (len <= 0)
+            break;
+        int ret = cs->read_data(cs->opaque, console_buf.data(), len);
+        if (ret < 0) {
+            // The fd would stay readable: make the port output only.
+            debugLog("virtio console port %d: end of input\r\n", port);
+            cs->read_data = NULL;
+            break;
+        }
+        if (ret == 0)
+            break;
+        virtio_console_port_write_data(virtio_console, port, console_buf.data(), ret);
+        if (ret < len)
+            break;
+    }
+}
+
 void VirtioDevices::process_io()
 {
-    int stdin_fd;
     int fd_max = -1;
     fd_set rfds, wfds, efds;
-    int delay = 10; // ms
+    int delay;
     struct timeval tv;
     int stop_fd = stop_pipe[0];
 
@@ -141,12 +353,17 @@ void VirtioDevices::process_io()
 
         FD_SET(stop_fd, &rfds);
         fd_max = stop_fd;
-
-        if (virtio_console && virtio_console_can_write_data(virtio_console)) {
-            stdin_fd = (int)(intptr_t)console->opaque;
-            FD_SET(stdin_fd, &rfds);
-            fd_max = std::max(stdin_fd, fd_max);
-
+        delay = 10; // ms, the backends may shorten it
+
+        for (size_t port = 0; virtio_console && port < console_ports.size(); port++) {
+            CharacterDevice *cs = console_ports[port];
+            if (!cs || !cs->read_data || !virtio_console_port_can_write_data(virtio_console, port))
+                continue;
+            int fd = (int)(intptr_t)cs->opaque;
+            FD_SET(fd, &rfds);
+            fd_max = std::max(fd, fd_max);
+        }
+        if (virtio_console) {
 #if 0
             if (s->resize_pending) {
                 int width, height;
@@ -159,6 +376,11 @@ void VirtioDevices::process_io()
         if (ethernet_device) {
             ethernet_device->select_fill(ethernet_device, &fd_max, &rfds, &wfds, &efds, &delay);
         }
+        if (vsock_device) {
+            vsock_device->select_fill(vsock_device, &fd_max, &rfds, &wfds, &efds, &delay);
+        }
+        for (VIRTIODevice *s : vhost_user_devices)
+            virtio_vhost_user_select_fill(s, &fd_max, &rfds);
         tv.tv_sec = delay / 1000;
         tv.tv_usec = (delay % 1000) * 1000;
         int ret = select(fd_max + 1, &rfds, &wfds, &efds, &tv);
@@ -170,16 +392,18 @@ void VirtioDevices::process_io()
         if (ethernet_device) {
             ethernet_device->select_poll(ethernet_device, &rfds, &wfds, &efds, ret);
         }
+        if (vsock_device) {
+            vsock_device->select_poll(vsock_device, &rfds, &wfds, &efds, ret);
+        }
+        if (ret > 0) {
+            for (VIRTIODevice *s : vhost_user_devices)
+                virtio_vhost_user_select_poll(s, &rfds);
+        }
 
-        if (virtio_console && FD_ISSET(stdin_fd, &rfds)) {
-            uint8_t buf[128];
-            int ret, len;
-            len = virtio_console_get_write_len(virtio_console);
-            len = min_int(len, sizeof(buf));
-            ret = console->read_data(console->opaque, buf, len);
-            if (ret > 0) {
-                virtio_console_write_data(virtio_console, buf, ret);
-            }
+        for (size_t port = 0; virtio_console && port < console_ports.size(); port++) {
+            CharacterDevice *cs = console_ports[port];
+            if (cs && cs->read_data && FD_ISSET((int)(intptr_t)cs->opaque, &rfds))
+                forward_console_input(port, cs);
         }
     }
 }
@@ -193,20 +417,22 @@ void *VirtioDevices::process_io_thread(void *opaque)
 void VirtioDevices::start()
 {
     printf("VirtioDevices::start\r\n");
-    VIRTIODevice *ps[4];
-    int n = 0;
-#define ADD_DEVICE(s) if (s) ps[n++] = s
+    std::vector<VIRTIODevice *> ps;
+#define ADD_DEVICE(s) if (s) ps.push_back(s)
     ADD_DEVICE(virtio_net);
     ADD_DEVICE(virtio_entropy);
     ADD_DEVICE(virtio_block);
     ADD_DEVICE(virtio_console);
+    ADD_DEVICE(virtio_vsock);
 #undef ADD_DEVICE
-    virtio_start_pending_notify_thread(n, ps);
+    ps.insert(ps.end(), vhost_user_devices.begin(), vhost_user_devices.end());
+    virtio_start_pending_notify_thread(ps.size(), ps.data());
 
     pipe(stop_pipe);
     fcntl(stop_pipe[1], F_SETFL, O_NONBLOCK);
     pthread_create(&io_thread, NULL, &process_io_thread, this);
     pthread_setname_np(io_thread, "VirtIO I/O");
+    thread_topology_apply(THREAD_ROLE_VIRTIO_IO, io_thread);
 }
 
 void VirtioDevices::stop()
@@ -230,5 +456,8 @@ void VirtioDevices::reset()
     RESET_DEVICE(virtio_entropy);
     RESET_DEVICE(virtio_block);
     RESET_DEVICE(virtio_console);
+    RESET_DEVICE(virtio_vsock);
 #undef RESET_DEVICE
+    for (VIRTIODevice *s : vhost_user_devices)
+        virtio_reset(s);
 }
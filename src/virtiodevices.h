@@ -2,6 +2,7 @@
 #pragma once
 
 #include <string>
+#include <vector>
 #include <pthread.h>
 
 extern "C" {
@@ -13,31 +14,44 @@ class VirtioDevices {
  private:
   BlockDevice *block_device;
   CharacterDevice *console;
+  std::vector<CharacterDevice *> console_ports; // indexed by port number
+  std::vector<uint8_t> console_buf;
   EthernetDevice *ethernet_device;
+  VsockDevice *vsock_device = 0;
   PhysMemoryMap *mem_map;
   VIRTIOBusDef *virtio_bus;
   VIRTIODevice *virtio_console = 0;
   VIRTIODevice *virtio_block = 0;
   VIRTIODevice *virtio_net = 0;
   VIRTIODevice *virtio_entropy = 0;
+  VIRTIODevice *virtio_vsock = 0;
+  std::vector<VIRTIODevice *> vhost_user_devices;
   IRQSignal *irq;
   int irq_num;
-  const char *tun_ifname;
+  const char *net_backend;
   int stop_pipe[2];
   pthread_t io_thread;
 
   void process_io();
+  void forward_console_input(int port, CharacterDevice *cs);
   static void *process_io_thread(void *opaque);
 
  public:
-  VirtioDevices(int first_irq_num = 0, const char *tun_ifname = 0);
+  VirtioDevices(int first_irq_num = 0, const char *net_backend = 0);
   ~VirtioDevices();
+  PhysMemoryMap *get_mem_map() { return mem_map; }
   PhysMemoryRange *get_phys_mem_range(uint64_t paddr);
   uint8_t *phys_mem_get_ram_ptr(uint64_t paddr, BOOL is_rw);
   void add_virtio_block_device(std::string filename);
   void add_virtio_console_device();
+  bool add_virtio_console_port(std::string spec);
+  bool add_virtio_vsock_device(std::string uds_path, uint64_t guest_cid);
+  bool add_vhost_user_device(std::string spec);
   void set_virtio_stdin_fd(int fd);
   void set_virtio_dma_fd(int fd);
+  void set_virtio_xdma(XDMATransport *xdma);
+  void set_virtio_dram(uint8_t *ptr, uint64_t base, uint64_t size,
+                       int fd = -1, uint64_t fd_offset = 0);
   bool has_virtio_console_device();
   void start();
   void stop();
@@ -0,0 +1,584 @@
+/*
+ * virtio-vsock backend mapping guest stream sockets to host unix sockets
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "cutils.h"
+#include "list.h"
+#include "virtio.h"
+#include "temu.h"
+
+/*
+ * Host side follows the Firecracker conventions:
+ *
+ * - a guest connect() to host port P connects to the unix socket
+ *   "<uds_path>_P";
+ * - a host client connects to "<uds_path>", sends "CONNECT <port>\n" and
+ *   gets "OK <local port>\n" back once the guest has accepted.
+ */
+
+#define VSOCK_BUF_ALLOC (256 * 1024)
+#define VSOCK_RX_BUF_SIZE (64 * 1024)
+#define VSOCK_CTRL_QUEUE_SIZE 64 /* initial size, and backlog stopping the guest */
+#define VSOCK_FIRST_LOCAL_PORT (1U << 30)
+#define VSOCK_LINE_MAX 32
+
+typedef enum {
+    VSOCK_CONN_HOST_HANDSHAKE, /* waiting for "CONNECT <port>\n" */
+    VSOCK_CONN_CONNECTING,     /* REQUEST sent to the guest */
+    VSOCK_CONN_CONNECTED,
+} VsockConnStateEnum;
+
+typedef struct {
+    struct list_head link;
+    int fd;
+    VsockConnStateEnum state;
+    uint32_t local_port;
+    uint32_t peer_port;
+    /* guest receive credit */
+    uint32_t peer_buf_alloc;
+    uint32_t peer_fwd_cnt;
+    uint32_t tx_cnt;
+    /* bytes of guest data delivered to the host socket */
+    uint32_t fwd_cnt;
+    uint32_t last_fwd_cnt_sent;
+    /* guest data not yet accepted by the host socket */
+    uint8_t *pending;
+    int pending_len;
+    BOOL host_eof;
+    uint32_t peer_shutdown;
+    char line[VSOCK_LINE_MAX];
+    int line_len;
+} VsockConn;
+
+typedef struct {
+    char *uds_path;
+    int listen_fd;
+    int event_fd;
+    pthread_mutex_t mutex;
+    struct list_head conn_list;
+    uint32_t next_local_port;
+    VsockPacketHeader *ctrl_queue;
+    int ctrl_size; /* power of two */
+    int ctrl_head;
+    int ctrl_count;
+    BOOL tx_stopped; /* guest packets wait for the backlog to drain */
+    uint8_t *rx_buf;
+} VsockState;
+
+static VsockConn *vsock_find_conn(VsockState *s, uint32_t local_port,
+                                  uint32_t peer_port)
+{
+    struct list_head *el;
+    VsockConn *c;
+
+    list_for_each(el, &s->conn_list) {
+        c = list_entry(el, VsockConn, link);
+        if (c->state != VSOCK_CONN_HOST_HANDSHAKE &&
+            c->local_port == local_port && c->peer_port == peer_port)
+            return c;
+    }
+    return NULL;
+}
+
+static void vsock_free_conn(VsockConn *c)
+{
+    list_del(&c->link);
+    close(c->fd);
+    free(c->pending);
+    free(c);
+}
+
+static void vsock_init_header(VsockDevice *vs, VsockPacketHeader *h,
+                              VsockConn *c, int op)
+{
+    memset(h, 0, sizeof(*h));
+    h->src_cid = VSOCK_HOST_CID;
+    h->dst_cid = vs->guest_cid;
+    h->src_port = c->local_port;
+    h->dst_port = c->peer_port;
+    h->type = VSOCK_TYPE_STREAM;
+    h->op = op;
+    h->buf_alloc = VSOCK_BUF_ALLOC;
+    h->fwd_cnt = c->fwd_cnt;
+    c->last_fwd_cnt_sent = c->fwd_cnt;
+}
+
+/* Control packets are generated on the queue thread but only the I/O
+   thread writes to the guest, so they are queued and the I/O thread
+   woken through event_fd. A lost RST, SHUTDOWN or CREDIT_UPDATE would
+   hang the connection: the queue grows instead, and the guest packets
+   are held back while it is long (see vsock_can_write_packet()). */
+static void vsock_queue_ctrl(VsockState *s, const VsockPacketHeader *h)
+{
+    VsockPacketHeader *q;
+    uint64_t one = 1;
+    int i;
+
+    if (s->ctrl_count == s->ctrl_size) {
+        q = malloc(sizeof(*q) * s->ctrl_size * 2);
+        for(i = 0; i < s->ctrl_count; i++)
+            q[i] = s->ctrl_queue[(s->ctrl_head + i) & (s->ctrl_size - 1)];
+        free(s->ctrl_queue);
+        s->ctrl_queue = q;
+        s->ctrl_size *= 2;
+        s->ctrl_head = 0;
+    }
+    s->ctrl_queue[(s->ctrl_head + s->ctrl_count) & (s->ctrl_size - 1)] = *h;
+    s->ctrl_count++;
+    if (write(s->event_fd, &one, sizeof(one)) < 0) {
+        /* counter saturated: a wakeup is already pending */
+    }
+}
+
+static void vsock_queue_conn_ctrl(VsockDevice *vs, VsockConn *c, int op,
+                                  uint32_t flags)
+{
+    VsockPacketHeader h;
+
+    vsock_init_header(vs, &h, c, op);
+    h.flags = flags;
+    vsock_queue_ctrl(vs->opaque, &h);
+}
+
+static void vsock_send_rst(VsockDevice *vs, const VsockPacketHeader *req)
+{
+    VsockPacketHeader h;
+
+    memset(&h, 0, sizeof(h));
+    h.src_cid = VSOCK_HOST_CID;
+    h.dst_cid = vs->guest_cid;
+    h.src_port = req->dst_port;
+    h.dst_port = req->src_port;
+    h.type = VSOCK_TYPE_STREAM;
+    h.op = VSOCK_OP_RST;
+    vsock_queue_ctrl(vs->opaque, &h);
+}
+
+static uint32_t vsock_peer_credit(VsockConn *c)
+{
+    return c->peer_buf_alloc - (c->tx_cnt - c->peer_fwd_cnt);
+}
+
+/* Write as much pending guest data as the socket takes. Return -1 if the
+   host end is gone. */
+static int vsock_flush_pending(VsockDevice *vs, VsockConn *c)
+{
+    int ret;
+
+    while (c->pending_len > 0) {
+        ret = send(c->fd, c->pending, c->pending_len, MSG_NOSIGNAL);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            return -1;
+        }
+        memmove(c->pending, c->pending + ret, c->pending_len - ret);
+        c->pending_len -= ret;
+        c->fwd_cnt += ret;
+    }
+    /* let the guest know once a useful amount of credit is free again */
+    if ((uint32_t)(c->fwd_cnt - c->last_fwd_cnt_sent) >= VSOCK_BUF_ALLOC / 4)
+        vsock_queue_conn_ctrl(vs, c, VSOCK_OP_CREDIT_UPDATE, 0);
+    return 0;
+}
+
+/* Tear the connection down once both directions are finished. Return
+   TRUE if the connection was freed. */
+static BOOL vsock_check_shutdown(VsockDevice *vs, VsockConn *c)
+{
+    if ((c->peer_shutdown & VSOCK_SHUTDOWN_SEND) && c->pending_len == 0)
+        shutdown(c->fd, SHUT_WR);
+    if (c->peer_shutdown == (VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND) &&
+        c->pending_len == 0) {
+        vsock_queue_conn_ctrl(vs, c, VSOCK_OP_RST, 0);
+        vsock_free_conn(c);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+static void vsock_reset_conn(VsockDevice *vs, VsockConn *c)
+{
+    vsock_queue_conn_ctrl(vs, c, VSOCK_OP_RST, 0);
+    vsock_free_conn(c);
+}
+
+static void vsock_guest_connect(VsockDevice *vs, const VsockPacketHeader *h)
+{
+    VsockState *s = vs->opaque;
+    struct sockaddr_un addr;
+    VsockConn *c;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    snprintf(addr.sun_path, sizeof(addr.sun_path), "%s_%u",
+             s->uds_path, h->dst_port);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        if (fd >= 0)
+            close(fd);
+        vsock_send_rst(vs, h);
+        return;
+    }
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+
+    c = mallocz(sizeof(*c));
+    c->fd = fd;
+    c->state = VSOCK_CONN_CONNECTED;
+    c->local_port = h->dst_port;
+    c->peer_port = h->src_port;
+    c->peer_buf_alloc = h->buf_alloc;
+    c->peer_fwd_cnt = h->fwd_cnt;
+    c->pending = malloc(VSOCK_BUF_ALLOC);
+    list_add_tail(&c->link, &s->conn_list);
+    vsock_queue_conn_ctrl(vs, c, VSOCK_OP_RESPONSE, 0);
+}
+
+/* packet from the guest (queue thread) */
+static void vsock_write_packet(VsockDevice *vs, const VsockPacketHeader *h,
+                               const uint8_t *buf)
+{
+    VsockState *s = vs->opaque;
+    VsockConn *c;
+    char line[VSOCK_LINE_MAX];
+    int ret, len;
+
+    pthread_mutex_lock(&s->mutex);
+    if (h->dst_cid != VSOCK_HOST_CID || h->type != VSOCK_TYPE_STREAM) {
+        if (h->op != VSOCK_OP_RST)
+            vsock_send_rst(vs, h);
+        goto done;
+    }
+    c = vsock_find_conn(s, h->dst_port, h->src_port);
+    if (!c) {
+        if (h->op == VSOCK_OP_REQUEST)
+            vsock_guest_connect(vs, h);
+        else if (h->op != VSOCK_OP_RST)
+            vsock_send_rst(vs, h);
+        goto done;
+    }
+    c->peer_buf_alloc = h->buf_alloc;
+    c->peer_fwd_cnt = h->fwd_cnt;
+
+    switch (h->op) {
+    case VSOCK_OP_RESPONSE:
+        if (c->state != VSOCK_CONN_CONNECTING) {
+            vsock_reset_conn(vs, c);
+            break;
+        }
+        c->state = VSOCK_CONN_CONNECTED;
+        c->pending = malloc(VSOCK_BUF_ALLOC);
+        len = snprintf(line, sizeof(line), "OK %u\n", c->local_port);
+        if (send(c->fd, line, len, MSG_NOSIGNAL) != len)
+            vsock_reset_conn(vs, c);
+        break;
+    case VSOCK_OP_RW:
+        if (c->state != VSOCK_CONN_CONNECTED ||
+            c->pending_len + h->len > VSOCK_BUF_ALLOC) {
+            /* the guest ignored our credit */
+            vsock_reset_conn(vs, c);
+            break;
+        }
+        len = h->len;
+        if (c->pending_len == 0) {
+            /* fast path: straight into the socket */
+            while (len > 0) {
+                ret = send(c->fd, buf, len, MSG_NOSIGNAL);
+                if (ret < 0) {
+                    if (errno == EINTR)
+                        continue;
+                    break;
+                }
+                buf += ret;
+                len -= ret;
+                c->fwd_cnt += ret;
+            }
+        }
+        memcpy(c->pending + c->pending_len, buf, len);
+        c->pending_len += len;
+        if (vsock_flush_pending(vs, c) < 0)
+            vsock_reset_conn(vs, c);
+        break;
+    case VSOCK_OP_CREDIT_REQUEST:
+        vsock_queue_conn_ctrl(vs, c, VSOCK_OP_CREDIT_UPDATE, 0);
+        break;
+    case VSOCK_OP_CREDIT_UPDATE:
+        break;
+    case VSOCK_OP_SHUTDOWN:
+        c->peer_shutdown |= h->flags & (VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND);
+        vsock_check_shutdown(vs, c);
+        break;
+    case VSOCK_OP_RST:
+        vsock_free_conn(c);
+        break;
+    default:
+        vsock_reset_conn(vs, c);
+        break;
+    }
+ done:
+    pthread_mutex_unlock(&s->mutex);
+}
+
+/* queue thread */
+static BOOL vsock_can_write_packet(VsockDevice *vs)
+{
+    VsockState *s = vs->opaque;
+    BOOL ret;
+
+    pthread_mutex_lock(&s->mutex);
+    ret = s->ctrl_count < VSOCK_CTRL_QUEUE_SIZE;
+    if (!ret)
+        s->tx_stopped = TRUE;
+    pthread_mutex_unlock(&s->mutex);
+    return ret;
+}
+
+/* Send the queued control packets, ahead of any new data so that a
+   RESPONSE or a CREDIT_UPDATE precedes the data of its connection */
+static void vsock_send_ctrl(VsockDevice *vs)
+{
+    VsockState *s = vs->opaque;
+
+    while (s->ctrl_count > 0 && vs->device_can_write_packet(vs)) {
+        vs->device_write_packet(vs, &s->ctrl_queue[s->ctrl_head], NULL);
+        s->ctrl_head = (s->ctrl_head + 1) & (s->ctrl_size - 1);
+        s->ctrl_count--;
+    }
+    if (s->tx_stopped && s->ctrl_count < VSOCK_CTRL_QUEUE_SIZE) {
+        s->tx_stopped = FALSE;
+        vs->device_resume(vs);
+    }
+}
+
+static void vsock_select_fill(VsockDevice *vs, int *pfd_max,
+                              fd_set *rfds, fd_set *wfds, fd_set *efds,
+                              int *pdelay)
+{
+    VsockState *s = vs->opaque;
+    BOOL can_write = vs->device_can_write_packet(vs);
+    struct list_head *el;
+    VsockConn *c;
+
+    pthread_mutex_lock(&s->mutex);
+    FD_SET(s->event_fd, rfds);
+    *pfd_max = max_int(*pfd_max, s->event_fd);
+    if (s->listen_fd >= 0) {
+        FD_SET(s->listen_fd, rfds);
+        *pfd_max = max_int(*pfd_max, s->listen_fd);
+    }
+    list_for_each(el, &s->conn_list) {
+        c = list_entry(el, VsockConn, link);
+        if (c->state == VSOCK_CONN_HOST_HANDSHAKE ||
+            (c->state == VSOCK_CONN_CONNECTED && can_write && !c->host_eof &&
+             vsock_peer_credit(c) > 0)) {
+            FD_SET(c->fd, rfds);
+            *pfd_max = max_int(*pfd_max, c->fd);
+        }
+        if (c->pending_len > 0) {
+            FD_SET(c->fd, wfds);
+            *pfd_max = max_int(*pfd_max, c->fd);
+        }
+    }
+    pthread_mutex_unlock(&s->mutex);
+}
+
+static void vsock_host_accept(VsockDevice *vs)
+{
+    VsockState *s = vs->opaque;
+    VsockConn *c;
+    int fd;
+
+    fd = accept4(s->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+        return;
+    c = mallocz(sizeof(*c));
+    c->fd = fd;
+    c->state = VSOCK_CONN_HOST_HANDSHAKE;
+    list_add_tail(&c->link, &s->conn_list);
+}
+
+/* Read the "CONNECT <port>\n" line a byte at a time so that no stream data
+   following it is consumed. */
+static void vsock_host_handshake(VsockDevice *vs, VsockConn *c)
+{
+    VsockState *s = vs->opaque;
+    unsigned int port;
+    char ch;
+    int ret;
+
+    for (;;) {
+        ret = read(c->fd, &ch, 1);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            return;
+        if (ret <= 0) {
+            vsock_free_conn(c);
+            return;
+        }
+        if (ch == '\n')
+            break;
+        if (c->line_len == VSOCK_LINE_MAX - 1) {
+            vsock_free_conn(c);
+            return;
+        }
+        c->line[c->line_len++] = ch;
+    }
+    c->line[c->line_len] = '\0';
+    if (sscanf(c->line, "CONNECT %u", &port) != 1) {
+        fprintf(stderr, "vsock: bad handshake '%s'\r\n", c->line);
+        vsock_free_conn(c);
+        return;
+    }
+    c->peer_port = port;
+    do {
+        c->local_port = s->next_local_port++;
+        if (s->next_local_port == 0)
+            s->next_local_port = VSOCK_FIRST_LOCAL_PORT;
+    } while (vsock_find_conn(s, c->local_port, c->peer_port));
+    c->state = VSOCK_CONN_CONNECTING;
+    vsock_queue_conn_ctrl(vs, c, VSOCK_OP_REQUEST, 0);
+}
+
+/* Move host socket data to the guest, within its credit and the size of
+   the receive buffers it posted. */
+static void vsock_host_read(VsockDevice *vs, VsockConn *c)
+{
+    VsockState *s = vs->opaque;
+    VsockPacketHeader h;
+    int len, ret;
+
+    /* the control packets go first */
+    while (s->ctrl_count == 0 && vs->device_can_write_packet(vs)) {
+        len = min_int(vs->device_get_write_len(vs), VSOCK_RX_BUF_SIZE);
+        len = min_int(len, vsock_peer_credit(c));
+        if (len <= 0)
+            return;
+        ret = read(c->fd, s->rx_buf, len);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return;
+            vsock_reset_conn(vs, c);
+            return;
+        }
+        if (ret == 0) {
+            c->host_eof = TRUE;
+            vsock_queue_conn_ctrl(vs, c, VSOCK_OP_SHUTDOWN,
+                                  VSOCK_SHUTDOWN_RCV | VSOCK_SHUTDOWN_SEND);
+            return;
+        }
+        vsock_init_header(vs, &h, c, VSOCK_OP_RW);
+        h.len = ret;
+        vs->device_write_packet(vs, &h, s->rx_buf);
+        c->tx_cnt += ret;
+        if (ret < len)
+            return;
+    }
+}
+
+static void vsock_select_poll(VsockDevice *vs,
+                              fd_set *rfds, fd_set *wfds, fd_set *efds,
+                              int select_ret)
+{
+    VsockState *s = vs->opaque;
+    struct list_head *el, *el1;
+    VsockConn *c;
+    uint64_t val;
+
+    pthread_mutex_lock(&s->mutex);
+    if (select_ret > 0) {
+        if (FD_ISSET(s->event_fd, rfds)) {
+            if (read(s->event_fd, &val, sizeof(val)) < 0) {
+                /* spurious wakeup */
+            }
+        }
+        if (s->listen_fd >= 0 && FD_ISSET(s->listen_fd, rfds))
+            vsock_host_accept(vs);
+
+        vsock_send_ctrl(vs);
+        list_for_each_safe(el, el1, &s->conn_list) {
+            c = list_entry(el, VsockConn, link);
+            if (FD_ISSET(c->fd, wfds)) {
+                if (vsock_flush_pending(vs, c) < 0) {
+                    vsock_reset_conn(vs, c);
+                    continue;
+                }
+                if (c->peer_shutdown && vsock_check_shutdown(vs, c))
+                    continue;
+            }
+            if (!FD_ISSET(c->fd, rfds))
+                continue;
+            if (c->state == VSOCK_CONN_HOST_HANDSHAKE)
+                vsock_host_handshake(vs, c);
+            else if (c->state == VSOCK_CONN_CONNECTED)
+                vsock_host_read(vs, c);
+        }
+    }
+
+    /* those queued by the connections above */
+    vsock_send_ctrl(vs);
+    pthread_mutex_unlock(&s->mutex);
+}
+
+VsockDevice *vsock_unix_open(const char *uds_path, uint64_t guest_cid)
+{
+    struct sockaddr_un addr;
+    VsockDevice *vs;
+    VsockState *s;
+    int fd;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (strlen(uds_path) + 12 >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "Error: vsock socket path too long: %s\n", uds_path);
+        return NULL;
+    }
+    pstrcpy(addr.sun_path, sizeof(addr.sun_path), uds_path);
+    unlink(uds_path);
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(fd, 16) < 0) {
+        fprintf(stderr, "Error: could not listen on %s: %s\n", uds_path,
+                strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return NULL;
+    }
+
+    s = mallocz(sizeof(*s));
+    s->uds_path = strdup(uds_path);
+    s->listen_fd = fd;
+    s->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    pthread_mutex_init(&s->mutex, NULL);
+    init_list_head(&s->conn_list);
+    s->next_local_port = VSOCK_FIRST_LOCAL_PORT;
+    s->rx_buf = malloc(VSOCK_RX_BUF_SIZE);
+    s->ctrl_size = VSOCK_CTRL_QUEUE_SIZE;
+    s->ctrl_queue = malloc(sizeof(*s->ctrl_queue) * s->ctrl_size);
+
+    vs = mallocz(sizeof(*vs));
+    vs->guest_cid = guest_cid;
+    vs->opaque = s;
+    vs->write_packet = vsock_write_packet;
+    vs->can_write_packet = vsock_can_write_packet;
+    vs->select_fill = vsock_select_fill;
+    vs->select_poll = vsock_select_poll;
+    return vs;
+}
@@ -0,0 +1,403 @@
+/*
+ * Ethernet switch between the guests of several processes on one host
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "cutils.h"
+#include "metrics.h"
+#include "virtio.h"
+#include "temu.h"
+
+/*
+ * The switch is a POSIX shared memory object holding one packet ring for
+ * each ordered pair of ports, so that every ring has a single producer
+ * (the sending port) and a single consumer (the receiving port) and needs
+ * no lock. A process takes the first free port when it opens the switch.
+ * A port is owned through a write lock on its byte of the shared memory
+ * object, taken with F_OFD_SETLK: the kernel drops it when the owner dies,
+ * whatever PID namespace it ran in, and two opens of the switch in one
+ * process still exclude each other.
+ *
+ * Each port learns the source addresses of the frames it receives and
+ * sends unicast frames to the port that owns the destination, everything
+ * else to all the other ports. A receiving port sleeping in select() is
+ * woken with a datagram on its unix socket; it is only sent once per
+ * sleep, however many frames are queued meanwhile, and the frames are
+ * then drained in batches, the consumer index being published once per
+ * batch.
+ */
+
+#define VSWITCH_MAGIC 0x32485753 /* "SWH2", bump with the layout */
+#define VSWITCH_MAX_PORTS 8
+#define VSWITCH_RING_SIZE 128 /* frames, power of two */
+#define VSWITCH_SLOT_SIZE 2048
+#define VSWITCH_MAX_FRAME (VSWITCH_SLOT_SIZE - 4)
+#define VSWITCH_BATCH 32
+#define VSWITCH_MAC_TABLE_SIZE 256 /* direct mapped, power of two */
+
+typedef struct {
+    uint32_t len;
+    uint8_t data[VSWITCH_MAX_FRAME];
+} VSwitchSlot;
+
+typedef struct {
+    uint32_t head __attribute__((aligned(64))); /* written by the sender */
+    uint32_t tail __attribute__((aligned(64))); /* written by the receiver */
+    VSwitchSlot slots[VSWITCH_RING_SIZE] __attribute__((aligned(64)));
+} VSwitchRing;
+
+typedef struct {
+    uint32_t pid; /* owner in its PID namespace, 0 if never claimed */
+    uint32_t rx_waiting; /* the owner waits for a datagram */
+} __attribute__((aligned(64))) VSwitchPort;
+
+typedef struct {
+    uint32_t magic;
+    VSwitchPort ports[VSWITCH_MAX_PORTS];
+    VSwitchRing rings[VSWITCH_MAX_PORTS][VSWITCH_MAX_PORTS]; /* [from][to] */
+} VSwitchShared;
+
+typedef struct {
+    char *name;
+    VSwitchShared *shared;
+    int shm_fd; /* holds the lock of our port */
+    int port;
+    int rx_fd; /* bound to our doorbell address */
+    int tx_fd; /* rings the other ports */
+    BOOL select_filled;
+    /* mac address (48 bits) | (port + 1) << 48, written by the receive
+       path and read by the send path without lock */
+    uint64_t mac_table[VSWITCH_MAC_TABLE_SIZE];
+    Metric *tx_dropped_metric;
+    Metric *flood_metric;
+} VSwitchState;
+
+static void vswitch_doorbell_addr(VSwitchState *s, int port,
+                                  struct sockaddr_un *addr, socklen_t *plen)
+{
+    int len;
+
+    /* abstract socket: nothing to clean up when the process dies */
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    len = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1,
+                   "fmem-vswitch%s.%d", s->name, port);
+    *plen = offsetof(struct sockaddr_un, sun_path) + 1 +
+        min_int(len, sizeof(addr->sun_path) - 2);
+}
+
+static uint64_t vswitch_get_mac(const uint8_t *mac)
+{
+    return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+        ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+        (mac[4] << 8) | mac[5];
+}
+
+static unsigned int vswitch_mac_hash(uint64_t mac)
+{
+    return (mac ^ (mac >> 16) ^ (mac >> 32)) & (VSWITCH_MAC_TABLE_SIZE - 1);
+}
+
+static void vswitch_learn(VSwitchState *s, const uint8_t *mac, int port)
+{
+    uint64_t m = vswitch_get_mac(mac);
+    uint64_t e = m | ((uint64_t)(port + 1) << 48);
+    uint64_t *pe = &s->mac_table[vswitch_mac_hash(m)];
+
+    if (mac[0] & 1)
+        return;
+    if (__atomic_load_n(pe, __ATOMIC_RELAXED) != e)
+        __atomic_store_n(pe, e, __ATOMIC_RELAXED);
+}
+
+/* return the port owning 'mac' or -1 if unknown */
+static int vswitch_lookup(VSwitchState *s, const uint8_t *mac)
+{
+    uint64_t m = vswitch_get_mac(mac);
+    uint64_t e = __atomic_load_n(&s->mac_table[vswitch_mac_hash(m)],
+                                 __ATOMIC_RELAXED);
+
+    if ((e & 0xffffffffffffULL) != m || !(e >> 48))
+        return -1;
+    return (e >> 48) - 1;
+}
+
+static void vswitch_send(VSwitchState *s, int port, const uint8_t *buf,
+                         int len)
+{
+    VSwitchShared *sh = s->shared;
+    VSwitchRing *r = &sh->rings[s->port][port];
+    VSwitchPort *p = &sh->ports[port];
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    VSwitchSlot *slot;
+    uint32_t head, tail;
+
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (head - tail >= VSWITCH_RING_SIZE) {
+        metric_inc(s->tx_dropped_metric);
+        return;
+    }
+    slot = &r->slots[head & (VSWITCH_RING_SIZE - 1)];
+    slot->len = len;
+    memcpy(slot->data, buf, len);
+    __atomic_store_n(&r->head, head + 1, __ATOMIC_RELEASE);
+
+    /* pairs with the fence in vswitch_select_fill() */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&p->rx_waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&p->rx_waiting, 0, __ATOMIC_RELAXED)) {
+        vswitch_doorbell_addr(s, port, &addr, &addr_len);
+        sendto(s->tx_fd, "", 1, MSG_DONTWAIT, (struct sockaddr *)&addr,
+               addr_len);
+    }
+}
+
+static void vswitch_write_packet(EthernetDevice *net,
+                                 const uint8_t *buf, int len)
+{
+    VSwitchState *s = net->opaque;
+    VSwitchShared *sh = s->shared;
+    int port;
+
+    if (len < 14 || len > VSWITCH_MAX_FRAME) {
+        metric_inc(s->tx_dropped_metric);
+        return;
+    }
+    if (!(buf[0] & 1)) {
+        port = vswitch_lookup(s, buf);
+        if (port >= 0 && port != s->port &&
+            __atomic_load_n(&sh->ports[port].pid, __ATOMIC_RELAXED)) {
+            vswitch_send(s, port, buf, len);
+            return;
+        }
+    }
+    metric_inc(s->flood_metric);
+    for(port = 0; port < VSWITCH_MAX_PORTS; port++) {
+        if (port != s->port &&
+            __atomic_load_n(&sh->ports[port].pid, __ATOMIC_RELAXED))
+            vswitch_send(s, port, buf, len);
+    }
+}
+
+static BOOL vswitch_rx_pending(VSwitchState *s)
+{
+    VSwitchRing *r;
+    int port;
+
+    for(port = 0; port < VSWITCH_MAX_PORTS; port++) {
+        r = &s->shared->rings[port][s->port];
+        if (__atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail)
+            return TRUE;
+    }
+    return FALSE;
+}
+
+static void vswitch_select_fill(EthernetDevice *net, int *pfd_max,
+                                fd_set *rfds, fd_set *wfds, fd_set *efds,
+                                int *pdelay)
+{
+    VSwitchState *s = net->opaque;
+    VSwitchPort *p = &s->shared->ports[s->port];
+
+    s->select_filled = net->device_can_write_packet(net);
+    if (s->select_filled) {
+        FD_SET(s->rx_fd, rfds);
+        *pfd_max = max_int(*pfd_max, s->rx_fd);
+        __atomic_store_n(&p->rx_waiting, 1, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        /* queued before the senders could see rx_waiting */
+        if (vswitch_rx_pending(s))
+            *pdelay = 0;
+    }
+}
+
+static void vswitch_select_poll(EthernetDevice *net,
+                                fd_set *rfds, fd_set *wfds, fd_set *efds,
+                                int select_ret)
+{
+    VSwitchState *s = net->opaque;
+    VSwitchShared *sh = s->shared;
+    VSwitchRing *r;
+    VSwitchSlot *slot;
+    uint32_t head, tail;
+    uint8_t dummy[16];
+    int port, n;
+
+    __atomic_store_n(&sh->ports[s->port].rx_waiting, 0, __ATOMIC_RELAXED);
+    if (select_ret > 0 && FD_ISSET(s->rx_fd, rfds)) {
+        while (recv(s->rx_fd, dummy, sizeof(dummy), MSG_DONTWAIT) > 0)
+            continue;
+    }
+    if (!s->select_filled)
+        return;
+
+    for(port = 0; port < VSWITCH_MAX_PORTS; port++) {
+        if (port == s->port)
+            continue;
+        r = &sh->rings[port][s->port];
+        tail = r->tail;
+        head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        for(n = 0; tail != head && n < VSWITCH_BATCH; n++) {
+            if (!net->device_can_write_packet(net))
+                break;
+            slot = &r->slots[tail & (VSWITCH_RING_SIZE - 1)];
+            if (slot->len >= 14 && slot->len <= VSWITCH_MAX_FRAME) {
+                vswitch_learn(s, slot->data + 6, port);
+                net->device_write_packet(net, slot->data, slot->len);
+            }
+            tail++;
+        }
+        __atomic_store_n(&r->tail, tail, __ATOMIC_RELEASE);
+    }
+}
+
+/* return 0 if we own 'port', -1 if it is in use or on error */
+static int vswitch_lock_port(VSwitchState *s, int port)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(fl));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = port;
+    fl.l_len = 1;
+    if (fcntl(s->shm_fd, F_OFD_SETLK, &fl) < 0) {
+        if (errno != EAGAIN && errno != EACCES)
+            fprintf(stderr, "Error: could not lock switch %s port %d: %s\n",
+                    s->name, port, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+static int vswitch_claim_port(VSwitchState *s)
+{
+    VSwitchShared *sh = s->shared;
+    int port, i;
+
+    for(port = 0; port < VSWITCH_MAX_PORTS; port++) {
+        if (vswitch_lock_port(s, port) < 0)
+            continue;
+        __atomic_store_n(&sh->ports[port].pid, getpid(), __ATOMIC_RELEASE);
+        /* drop what was sent to a previous owner */
+        for(i = 0; i < VSWITCH_MAX_PORTS; i++) {
+            VSwitchRing *r = &sh->rings[i][port];
+            __atomic_store_n(&r->tail, __atomic_load_n(&r->head, __ATOMIC_ACQUIRE),
+                             __ATOMIC_RELEASE);
+        }
+        sh->ports[port].rx_waiting = 0;
+        return port;
+    }
+    return -1;
+}
+
+/* 'name' is the name of the shared memory object, e.g. "/fmem-vswitch" */
+EthernetDevice *vswitch_open(const char *name)
+{
+    struct sockaddr_un addr;
+    socklen_t addr_len;
+    EthernetDevice *net;
+    VSwitchState *s;
+    uint32_t magic;
+    void *p;
+    int fd;
+
+    fd = shm_open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+        fprintf(stderr, "Error: could not open switch %s: %s\n", name,
+                strerror(errno));
+        return NULL;
+    }
+    /* the sparse zero filled object is an empty switch */
+    if (ftruncate(fd, sizeof(VSwitchShared)) < 0) {
+        fprintf(stderr, "Error: could not size switch %s: %s\n", name,
+                strerror(errno));
+        close(fd);
+        return NULL;
+    }
+    p = mmap(NULL, sizeof(VSwitchShared), PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+    if (p == MAP_FAILED) {
+        fprintf(stderr, "Error: could not map switch %s: %s\n", name,
+                strerror(errno));
+        close(fd);
+        return NULL;
+    }
+
+    s = mallocz(sizeof(*s));
+    s->name = strdup(name);
+    s->shared = p;
+    s->shm_fd = fd;
+    s->rx_fd = -1;
+    s->tx_fd = -1;
+    magic = 0;
+    if (!__atomic_compare_exchange_n(&s->shared->magic, &magic, VSWITCH_MAGIC,
+                                     FALSE, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) &&
+        magic != VSWITCH_MAGIC) {
+        fprintf(stderr, "Error: %s is not a switch of this version\n", name);
+        goto fail;
+    }
+    s->port = vswitch_claim_port(s);
+    if (s->port < 0) {
+        fprintf(stderr, "Error: all the %d ports of switch %s are in use\n",
+                VSWITCH_MAX_PORTS, name);
+        goto fail;
+    }
+    vswitch_doorbell_addr(s, s->port, &addr, &addr_len);
+    s->rx_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    s->tx_fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->rx_fd < 0 || s->tx_fd < 0 ||
+        bind(s->rx_fd, (struct sockaddr *)&addr, addr_len) < 0) {
+        fprintf(stderr, "Error: could not bind switch %s port %d: %s\n", name,
+                s->port, strerror(errno));
+        /* closing shm_fd gives the port back */
+        __atomic_store_n(&s->shared->ports[s->port].pid, 0, __ATOMIC_RELEASE);
+        goto fail;
+    }
+    s->tx_dropped_metric =
+        metric_new(METRIC_COUNTER, "vswitch_dropped_frames_total",
+                   "Frames dropped because the receiving port was full",
+                   "port=\"%d\"", s->port);
+    s->flood_metric =
+        metric_new(METRIC_COUNTER, "vswitch_flooded_frames_total",
+                   "Broadcast and unknown destination frames sent to all ports",
+                   "port=\"%d\"", s->port);
+
+    net = mallocz(sizeof(*net));
+    /* locally administered address unique on the switch */
+    net->mac_addr[0] = 0x02;
+    net->mac_addr[1] = 0x00;
+    net->mac_addr[2] = 0x00;
+    net->mac_addr[3] = 0x00;
+    net->mac_addr[4] = 0x01;
+    net->mac_addr[5] = 0x01 + s->port;
+    net->opaque = s;
+    net->write_packet = vswitch_write_packet;
+    net->select_fill = vswitch_select_fill;
+    net->select_poll = vswitch_select_poll;
+    fprintf(stderr, "switch %s: port %d\n", name, s->port);
+    return net;
+ fail:
+    if (s->rx_fd >= 0)
+        close(s->rx_fd);
+    if (s->tx_fd >= 0)
+        close(s->tx_fd);
+    munmap(s->shared, sizeof(VSwitchShared));
+    close(s->shm_fd);
+    free(s->name);
+    free(s);
+    return NULL;
+}
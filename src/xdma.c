@@ -0,0 +1,120 @@
+/*
+ * XDMA streaming transport for bulk guest memory access
+ *
+ * The Xilinx XDMA driver exposes each DMA channel as a character device
+ * where pread()/pwrite() at offset N moves data to or from card address
+ * N. The driver splits large transfers into scatter-gather descriptors
+ * itself, so one system call covers a whole buffer.
+ */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <inttypes.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "cutils.h"
+#include "xdma.h"
+
+struct XDMATransport {
+    int h2c_fd;
+    int c2h_fd;
+    uint64_t offset;
+};
+
+XDMATransport *xdma_open(const char *h2c_path, const char *c2h_path,
+                         uint64_t offset)
+{
+    XDMATransport *x;
+    int h2c_fd, c2h_fd;
+
+    h2c_fd = open(h2c_path, O_WRONLY | O_CLOEXEC);
+    if (h2c_fd < 0) {
+        fprintf(stderr, "ERROR: Failed to open XDMA H2C device %s: %s\r\n",
+                h2c_path, strerror(errno));
+        return NULL;
+    }
+    c2h_fd = open(c2h_path, O_RDONLY | O_CLOEXEC);
+    if (c2h_fd < 0) {
+        fprintf(stderr, "ERROR: Failed to open XDMA C2H device %s: %s\r\n",
+                c2h_path, strerror(errno));
+        close(h2c_fd);
+        return NULL;
+    }
+    x = mallocz(sizeof(*x));
+    x->h2c_fd = h2c_fd;
+    x->c2h_fd = c2h_fd;
+    x->offset = offset;
+    return x;
+}
+
+XDMATransport *xdma_open_default(void)
+{
+    const char *h2c_path = getenv("RISCV_XDMA_H2C_DEV");
+    const char *c2h_path = getenv("RISCV_XDMA_C2H_DEV");
+    const char *offset = getenv("RISCV_XDMA_OFFSET");
+
+    if (!h2c_path)
+        h2c_path = "/dev/xdma0_h2c_0";
+    if (!c2h_path)
+        c2h_path = "/dev/xdma0_c2h_0";
+    return xdma_open(h2c_path, c2h_path,
+                     offset ? strtoull(offset, NULL, 0) : 0);
+}
+
+void xdma_close(XDMATransport *x)
+{
+    if (!x)
+        return;
+    close(x->h2c_fd);
+    close(x->c2h_fd);
+    free(x);
+}
+
+int xdma_read(XDMATransport *x, uint64_t addr, uint8_t *buf, size_t len)
+{
+    ssize_t ret;
+
+    addr += x->offset;
+    while (len > 0) {
+        ret = pread(x->c2h_fd, buf, len, addr);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: XDMA read at %" PRIx64 " failed: %s\r\n",
+                    addr, strerror(errno));
+            return -1;
+        }
+        if (ret == 0) {
+            fprintf(stderr, "ERROR: XDMA read at %" PRIx64 " past end\r\n", addr);
+            return -1;
+        }
+        buf += ret;
+        addr += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+int xdma_write(XDMATransport *x, uint64_t addr, const uint8_t *buf,
+               size_t len)
+{
+    ssize_t ret;
+
+    addr += x->offset;
+    while (len > 0) {
+        ret = pwrite(x->h2c_fd, buf, len, addr);
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "ERROR: XDMA write at %" PRIx64 " failed: %s\r\n",
+                    addr, strerror(errno));
+            return -1;
+        }
+        buf += ret;
+        addr += ret;
+        len -= ret;
+    }
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+ * XDMA streaming transport for bulk guest memory access
+ */
+#ifndef XDMA_H
+#define XDMA_H
+
+/* Transfers shorter than this stay on the fmem path, where a single
+   ioctl is cheaper than setting up a DMA descriptor. */
+#define XDMA_MIN_TRANSFER 64
+
+typedef struct XDMATransport XDMATransport;
+
+/* h2c_path/c2h_path are the XDMA host-to-card and card-to-host character
+   devices (or regular files standing in for them). 'offset' is added to
+   every address before it is used as the file position. */
+XDMATransport *xdma_open(const char *h2c_path, const char *c2h_path,
+                         uint64_t offset);
+/* Open the devices named by RISCV_XDMA_H2C_DEV, RISCV_XDMA_C2H_DEV and
+   RISCV_XDMA_OFFSET, defaulting to /dev/xdma0_h2c_0 and /dev/xdma0_c2h_0 */
+XDMATransport *xdma_open_default(void);
+void xdma_close(XDMATransport *x);
+/* return 0 if OK, -1 on error */
+int xdma_read(XDMATransport *x, uint64_t addr, uint8_t *buf, size_t len);
+int xdma_write(XDMATransport *x, uint64_t addr, const uint8_t *buf,
+               size_t len);
+
+#endif /* XDMA_H */